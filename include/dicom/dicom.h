@@ -162,6 +162,8 @@ typedef enum _DcmErrorCode {
     DCM_ERROR_CODE_IO = 4,
     /** Missing frame */
     DCM_ERROR_CODE_MISSING_FRAME = 5,
+    /** Memory limit exceeded */
+    DCM_ERROR_CODE_MEMORY_LIMIT = 6,
 } DcmErrorCode;
 
 /**
@@ -697,6 +699,9 @@ bool dcm_element_is_multivalued(const DcmElement *element);
 /**
  * Clone (i.e., create a deep copy of) a Data Element.
  *
+ * Sequence values are locked, so the clone of a Sequence Data Element
+ * shares the Sequence rather than copying it.
+ *
  * :param error: Pointer to error object
  * :param element: Pointer to Data Element
  *
@@ -1011,6 +1016,11 @@ DcmDataSet *dcm_dataset_create(DcmError **error);
 /**
  * Clone (i.e., create a deep copy of) a Data Set.
  *
+ * Locked Data Sets can't change, so a clone of a locked Data Set shares its
+ * Data Elements and takes no time. The clone only copies the list of Data
+ * Elements when you first insert or remove one. The Data Set you cloned
+ * from can be destroyed at any time.
+ *
  * :param error: Pointer to error object
  * :param dataset: Pointer to Data Set
  *
@@ -1079,6 +1089,8 @@ DcmElement *dcm_dataset_get_clone(DcmError **error,
 /**
  * Iterate over Data Elements in a Data Set.
  *
+ * Data Elements are visited in ascending tag order.
+ *
  * The user function should return true to continue looping, or false to
  * terminate the loop early.
  *
@@ -1109,6 +1121,60 @@ bool dcm_dataset_foreach(const DcmDataSet *dataset,
 DCM_EXTERN
 DcmElement *dcm_dataset_contains(const DcmDataSet *dataset, uint32_t tag);
 
+/**
+ * The type of a value to fetch with :c:func:`dcm_dataset_get_many()`.
+ */
+typedef enum _DcmValueType {
+    /** Integer value, written to an int64_t */
+    DCM_VALUE_TYPE_INTEGER,
+
+    /** Floating point value, written to a double */
+    DCM_VALUE_TYPE_DECIMAL,
+
+    /** String value, written to a const char * */
+    DCM_VALUE_TYPE_STRING,
+} DcmValueType;
+
+/**
+ * A value to fetch with :c:func:`dcm_dataset_get_many()`.
+ */
+typedef struct _DcmValueSpec {
+    /** Attribute Tag of the Data Element */
+    uint32_t tag;
+
+    /** Type of the value */
+    DcmValueType type;
+
+    /** If true, a missing Data Element is not an error */
+    bool optional;
+
+    /** Where to write the first value of the Data Element */
+    void *value;
+} DcmValueSpec;
+
+/**
+ * Fetch the first value of several Data Elements from a Data Set.
+ *
+ * If the specs are in ascending tag order, this is a single pass over the
+ * Data Set. Optional Data Elements which are not present are skipped, and
+ * their destination is left unchanged, so it can hold a default. Any other
+ * missing Data Element, or a value of the wrong type, is an error.
+ *
+ * String values are owned by the Data Set.
+ *
+ * :param error: Pointer to error object
+ * :param dataset: Pointer to Data Set
+ * :param specs: Array of values to fetch
+ * :param n_specs: Number of items in the array
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_dataset_get_many(DcmError **error,
+                          const DcmDataSet *dataset,
+                          const DcmValueSpec *specs,
+                          uint32_t n_specs);
+
 /**
  * Count the number of Data Elements in a Data Set.
  *
@@ -1168,6 +1234,56 @@ bool dcm_dataset_is_locked(const DcmDataSet *dataset);
 DCM_EXTERN
 void dcm_dataset_print(const DcmDataSet *dataset, int indentation);
 
+/**
+ * Memory usage, see :c:func:`dcm_dataset_get_memory_usage()` and
+ * :c:func:`dcm_filehandle_get_memory_usage()`.
+ *
+ * All sizes are in bytes.
+ */
+typedef struct _DcmMemoryUsage {
+    /** Data Sets, Data Elements, and the tables which index them */
+    uint64_t elements;
+
+    /** Data Element values */
+    uint64_t values;
+
+    /** Hash tables used to share repeated values */
+    uint64_t hash;
+
+    /** Sequences, and the raw bytes of Sequence items not yet parsed */
+    uint64_t sequences;
+
+    /** Table of Frame offsets */
+    uint64_t offset_table;
+
+    /** Index of Frame positions, focal planes and optical paths */
+    uint64_t frame_index;
+
+    /** Allocated in blocks, but not yet used */
+    uint64_t unused;
+
+    /** Sum of all the above */
+    uint64_t total;
+} DcmMemoryUsage;
+
+/**
+ * Get the memory used by a Data Set.
+ *
+ * This counts the Data Set, its Data Elements and their values, and any
+ * nested Sequences. Data Sets read from a File are allocated as a single
+ * tree, so for these, and for any Data Set inside them, this is the memory
+ * used by the whole tree.
+ *
+ * Memory shared with the Data Set this was cloned from, and values borrowed
+ * from external memory, are not counted.
+ *
+ * :param dataset: Pointer to Data Set
+ * :param usage: Return memory usage here
+ */
+DCM_EXTERN
+void dcm_dataset_get_memory_usage(const DcmDataSet *dataset,
+                                  DcmMemoryUsage *usage);
+
 /**
  * Destroy a Data Set.
  *
@@ -1176,6 +1292,83 @@ void dcm_dataset_print(const DcmDataSet *dataset, int indentation);
 DCM_EXTERN
 void dcm_dataset_destroy(DcmDataSet *dataset);
 
+/**
+ * Serialize a locked Data Set to a snapshot.
+ *
+ * A snapshot is a compact binary image of the whole Data Set tree, and
+ * :c:func:`dcm_dataset_deserialize()` can load it much more quickly than
+ * the original file can be parsed. Snapshots are versioned, and use the
+ * byte order of the machine that wrote them, so they are for caching, not
+ * for interchange.
+ *
+ * Free the snapshot with :c:func:`dcm_free()`.
+ *
+ * :param error: Pointer to error object
+ * :param dataset: Pointer to Data Set
+ * :param snapshot: Pointer to return location for the snapshot
+ * :param length: Pointer to return location for the snapshot length
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_dataset_serialize(DcmError **error,
+                           const DcmDataSet *dataset,
+                           char **snapshot,
+                           uint64_t *length);
+
+/**
+ * Load a Data Set from a snapshot made by
+ * :c:func:`dcm_dataset_serialize()`.
+ *
+ * The snapshot must be aligned to 8 bytes. It is copied, so it can be freed
+ * as soon as this returns. The Data Set is locked.
+ *
+ * The return result must be destroyed with :c:func:`dcm_dataset_destroy()`.
+ *
+ * :param error: Pointer to error object
+ * :param snapshot: Pointer to the snapshot
+ * :param length: Length of the snapshot in bytes
+ *
+ * :return: Pointer to Data Set
+ */
+DCM_EXTERN
+DcmDataSet *dcm_dataset_deserialize(DcmError **error,
+                                    const char *snapshot,
+                                    uint64_t length);
+
+/**
+ * A function to release a snapshot, see
+ * :c:func:`dcm_dataset_deserialize_external()`.
+ */
+typedef void (*DcmDataSetReleaseFn)(void *client);
+
+/**
+ * Load a Data Set from a snapshot owned by someone else.
+ *
+ * This is like :c:func:`dcm_dataset_deserialize()`, but values in the
+ * Data Set point into the snapshot, so nothing is copied. The snapshot can
+ * be a memory mapped file. When the Data Set has been destroyed, release is
+ * called with client, if release is not NULL. Until then, the snapshot must
+ * remain valid and unchanged.
+ *
+ * If loading fails, release is not called.
+ *
+ * :param error: Pointer to error object
+ * :param snapshot: Pointer to the snapshot
+ * :param length: Length of the snapshot in bytes
+ * :param release: Function to call when the snapshot is no longer used,
+ *                 or NULL
+ * :param client: Argument for release
+ *
+ * :return: Pointer to Data Set
+ */
+DCM_EXTERN
+DcmDataSet *dcm_dataset_deserialize_external(DcmError **error,
+                                             const char *snapshot,
+                                             uint64_t length,
+                                             DcmDataSetReleaseFn release,
+                                             void *client);
+
 
 /**
  * Sequence
@@ -1298,6 +1491,102 @@ DCM_EXTERN
 void dcm_sequence_destroy(DcmSequence *seq);
 
 
+/**
+ * Query
+ *
+ * A compiled path to Data Elements in a nested Data Set.
+ */
+typedef struct _DcmQuery DcmQuery;
+
+/**
+ * Called for each Data Element a Query matches.
+ *
+ * :param element: Pointer to the matching Data Element
+ * :param client: Client data
+ *
+ * :return: true to continue, false to stop
+ */
+typedef bool (*DcmQueryFn)(const DcmElement *element, void *client);
+
+/**
+ * Compile a path into a Query.
+ *
+ * A path is a list of steps separated by ``.``, for example
+ * ``SharedFunctionalGroupsSequence[0].PixelMeasuresSequence[0].PixelSpacing``.
+ * Each step names an Attribute by keyword, as ``(gggg,eeee)``, as
+ * ``ggggeeee`` in hex, or as ``*`` to match every Data Element. Every step
+ * but the last is a Sequence, and is followed by the index of an item, from
+ * 0, or by ``[*]`` to match every item.
+ *
+ * Queries are never changed once compiled, so they can be reused for any
+ * number of Data Sets, and shared between threads.
+ *
+ * :param error: Pointer to error object
+ * :param path: Path to compile
+ *
+ * :return: Pointer to Query
+ */
+DCM_EXTERN
+DcmQuery *dcm_query_create(DcmError **error, const char *path);
+
+/**
+ * Get the path a Query was compiled from.
+ *
+ * :param query: Pointer to Query
+ *
+ * :return: Path
+ */
+DCM_EXTERN
+const char *dcm_query_get_path(const DcmQuery *query);
+
+/**
+ * Call a function for every Data Element in a Data Set which matches a
+ * Query, in tag and item order.
+ *
+ * Data Elements which do not exist, items which are out of range, and
+ * steps through Data Elements which are not Sequences match nothing, and
+ * are not errors.
+ *
+ * :param error: Pointer to error object
+ * :param query: Pointer to Query
+ * :param dataset: Pointer to Data Set
+ * :param fn: Function to call for each match
+ * :param client: Client data passed to fn
+ *
+ * :return: true on success, even if fn stopped the search
+ */
+DCM_EXTERN
+bool dcm_query_foreach(DcmError **error,
+                       const DcmQuery *query,
+                       const DcmDataSet *dataset,
+                       DcmQueryFn fn,
+                       void *client);
+
+/**
+ * Get the first Data Element in a Data Set which matches a Query.
+ *
+ * The Data Element is owned by the Data Set.
+ *
+ * :param error: Pointer to error object
+ * :param query: Pointer to Query
+ * :param dataset: Pointer to Data Set
+ *
+ * :return: Pointer to Data Element, or NULL if nothing matches
+ */
+DCM_EXTERN
+const DcmElement *dcm_query_get(DcmError **error,
+                                const DcmQuery *query,
+                                const DcmDataSet *dataset);
+
+/**
+ * Destroy a Query.
+ *
+ * :param query: Pointer to Query
+ */
+DCM_EXTERN
+void dcm_query_destroy(DcmQuery *query);
+
+
 /**
  * Frame Item of Pixel Data Element
  *
@@ -1347,6 +1636,86 @@ DcmFrame *dcm_frame_create(DcmError **error,
                            const char *photometric_interpretation,
                            const char *transfer_syntax_uid);
 
+/**
+ * A function to release memory wrapped by a Frame, see
+ * :c:func:`dcm_frame_create_external()`.
+ */
+typedef void (*DcmFrameReleaseFn)(void *client);
+
+/**
+ * Create a Frame which wraps memory owned by someone else.
+ *
+ * This is like :c:func:`dcm_frame_create()`, but the pixel data is not
+ * copied or freed. It can be part of a memory mapped file, a slab from a
+ * pool, or a block in a cache. When the last reference to the Frame is
+ * dropped, release is called with client, if release is not NULL. Until
+ * then, data must remain valid.
+ *
+ * If creation fails, release is not called.
+ *
+ * :param error: Pointer to error object
+ * :param number: Number of the Frame within the Pixel Data Element
+ * :param data: Pixel data of the Frame
+ * :param length: Size of the Frame (number of bytes)
+ * :param rows: Number of rows in pixel matrix
+ * :param columns: Number of columns in pixel matrix
+ * :param samples_per_pixel: Number of samples per pixel
+ * :param bits_allocated: Number of bits allocated per pixel
+ * :param bits_stored: Number of bits stored per pixel
+ * :param pixel_representation: Representation of pixels
+ *                              (unsigned integers or 2's complement)
+ * :param planar_configuration: Configuration of samples
+ *                              (color-by-plane or color-by-pixel)
+ * :param photometric_interpretation: Interpretation of pixels
+ *                                    (monochrome, RGB, etc.)
+ * :param transfer_syntax_uid: UID of transfer syntax in which data is encoded
+ * :param release: Function to call when the Frame is freed, or NULL
+ * :param client: Argument for release
+ *
+ * :return: Frame Item
+ */
+DCM_EXTERN
+DcmFrame *dcm_frame_create_external(DcmError **error,
+                                    uint32_t number,
+                                    const char *data,
+                                    uint32_t length,
+                                    uint16_t rows,
+                                    uint16_t columns,
+                                    uint16_t samples_per_pixel,
+                                    uint16_t bits_allocated,
+                                    uint16_t bits_stored,
+                                    uint16_t pixel_representation,
+                                    uint16_t planar_configuration,
+                                    const char *photometric_interpretation,
+                                    const char *transfer_syntax_uid,
+                                    DcmFrameReleaseFn release,
+                                    void *client);
+
+/**
+ * Add a reference to a Frame.
+ *
+ * Frames are reference counted, so one Frame can be handed to several
+ * consumers without copying the pixel data. Each reference must be dropped
+ * with :c:func:`dcm_frame_unref()`. Reference counts are atomic, so
+ * references can be added and dropped from any thread.
+ *
+ * :param frame: Frame
+ *
+ * :return: frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_frame_ref(DcmFrame *frame);
+
+/**
+ * Drop a reference to a Frame.
+ *
+ * The Frame is freed when the last reference is dropped.
+ *
+ * :param frame: Frame
+ */
+DCM_EXTERN
+void dcm_frame_unref(DcmFrame *frame);
+
 /**
  * Get number of a Frame Item within the Pixel Data Element.
  *
@@ -1480,6 +1849,10 @@ const char *dcm_frame_get_value(const DcmFrame *frame);
 /**
  * Destroy a Frame.
  *
+ * This is the same as :c:func:`dcm_frame_unref()`. Frames returned from a
+ * filehandle with a frame cache may be shared with the cache, and are only
+ * freed when the cache has also finished with them.
+ *
  * :param frame: Frame
  */
 DCM_EXTERN
@@ -1556,6 +1929,41 @@ DCM_EXTERN
 DcmIO *dcm_io_create_from_memory(DcmError **error, const char *buffer,
                                  int64_t length);
 
+/**
+ * A function to release memory wrapped by an IO object, see
+ * :c:func:`dcm_io_create_from_memory_external()`.
+ */
+typedef void (*DcmIOReleaseFn)(void *client);
+
+/**
+ * Open an area of memory owned by someone else for IO.
+ *
+ * This is like :c:func:`dcm_io_create_from_memory()`, but the IO object
+ * keeps a reference to the memory, for example a memory mapped file. Large
+ * binary and numeric values in metadata read from it then point into the
+ * memory rather than being copied, and hold a reference too.
+ *
+ * When the IO object and all data sets read from it have been destroyed,
+ * release is called with client, if release is not NULL. Until then, the
+ * memory must remain valid and unchanged.
+ *
+ * If creation fails, release is not called.
+ *
+ * :param error: Error structure pointer
+ * :param buffer: Pointer to memory area
+ * :param length: Length of memory area in bytes
+ * :param release: Function to call when the memory is no longer used, or NULL
+ * :param client: Argument for release
+ *
+ * :return: IO object
+ */
+DCM_EXTERN
+DcmIO *dcm_io_create_from_memory_external(DcmError **error,
+                                          const char *buffer,
+                                          int64_t length,
+                                          DcmIOReleaseFn release,
+                                          void *client);
+
 /**
  * Close an IO object.
  *
@@ -1706,6 +2114,80 @@ DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
                                          DcmFilehandle *filehandle,
                                          const uint32_t *stop_tags);
 
+/**
+ * Set lazy parsing of Sequences.
+ *
+ * When this is on, metadata reads copy the bytes of each Sequence item, but
+ * don't parse them. An item is parsed the first time it is fetched with
+ * :c:func:`dcm_sequence_get()` or :c:func:`dcm_sequence_foreach()`, so a
+ * read of the whole of a file with a large PerFrameFunctionalGroupsSequence
+ * costs little more than :c:func:`dcm_filehandle_get_metadata_subset()`.
+ *
+ * Errors in an item are reported when the item is first fetched, rather
+ * than by the metadata read. Items can be fetched from several threads at
+ * once.
+ *
+ * Lazy parsing is off by default. Call this before reading metadata.
+ *
+ * :param filehandle: File
+ * :param lazy: true to parse Sequence items on first use
+ */
+DCM_EXTERN
+void dcm_filehandle_set_lazy_sequences(DcmFilehandle *filehandle, bool lazy);
+
+/**
+ * Set interning of string values.
+ *
+ * When this is on, metadata reads store each distinct short string value
+ * once, and elements with the same value share it. This saves memory for
+ * files with large functional group sequences, where the same UIDs and code
+ * strings are repeated for every frame.
+ *
+ * Interning is off by default. Call this before reading metadata.
+ *
+ * :param filehandle: File
+ * :param intern: true to share repeated string values
+ */
+DCM_EXTERN
+void dcm_filehandle_set_intern_strings(DcmFilehandle *filehandle,
+                                       bool intern);
+
+/**
+ * Get the memory used by a File.
+ *
+ * This counts the metadata the Filehandle holds, the table of Frame
+ * offsets, and the index of Frame positions. Metadata returned by
+ * :c:func:`dcm_filehandle_read_metadata()` belongs to the caller and is not
+ * counted, nor are Frames held by a Frame cache.
+ *
+ * :param filehandle: File
+ * :param usage: Return memory usage here
+ */
+DCM_EXTERN
+void dcm_filehandle_get_memory_usage(DcmFilehandle *filehandle,
+                                     DcmMemoryUsage *usage);
+
+/**
+ * Set a limit on the memory used by a File.
+ *
+ * Reads which would take the memory counted by
+ * :c:func:`dcm_filehandle_get_memory_usage()` over this limit fail with
+ * :c:enum:`DCM_ERROR_CODE_MEMORY_LIMIT`, rather than allocating whatever
+ * sizes a damaged or hostile file asks for. The limit applies to each read
+ * of metadata, to Sequence items parsed later, and to the tables built for
+ * reading Frames. Batched Frame reads also check the item length of the
+ * final Frame against it, since nothing else in the file bounds it.
+ *
+ * There is no limit by default. Call this before reading metadata. Pass
+ * zero to remove the limit.
+ *
+ * :param filehandle: File
+ * :param limit: Maximum number of bytes
+ */
+DCM_EXTERN
+void dcm_filehandle_set_memory_limit(DcmFilehandle *filehandle,
+                                     uint64_t limit);
+
 /**
  * Get a fast subset of metadata from a File.
  *
@@ -1777,29 +2259,759 @@ DcmFrame *dcm_filehandle_read_frame(DcmError **error,
                                     uint32_t frame_number);
 
 /**
- * Read the frame at a position in a File.
+ * Attributes of a frame read with :c:func:`dcm_filehandle_read_frame_into()`
+ * or decoded with :c:func:`dcm_frame_decode_into()`.
  *
- * Read a frame from a File at a specified (column, row), numbered from zero.
- * This takes account of any frame positioning given in
- * PerFrameFunctionalGroupSequence.
+ * The strings are owned by the Filehandle and are valid for its lifetime.
+ */
+typedef struct _DcmFrameInfo {
+    /** One-based frame number */
+    uint32_t number;
+
+    /** Length of the frame value in bytes. For encapsulated pixel data
+     * this is the length of the compressed Frame Item value. For native
+     * pixel data it is rows * columns * samples_per_pixel *
+     * bits_allocated / 8 */
+    uint32_t length;
+
+    /** Height of the frame in pixels */
+    uint16_t rows;
+
+    /** Width of the frame in pixels */
+    uint16_t columns;
+
+    /** Samples per pixel, for example 1 for MONOCHROME2 or 3 for RGB */
+    uint16_t samples_per_pixel;
+
+    /** Bits allocated for each sample, usually 8 or 16 */
+    uint16_t bits_allocated;
+
+    /** Bits of each sample which hold the value */
+    uint16_t bits_stored;
+
+    /** Zero-based index of the most significant bit of each value */
+    uint16_t high_bit;
+
+    /** 0 for unsigned samples, 1 for two's complement signed samples */
+    uint16_t pixel_representation;
+
+    /** 0 for samples interleaved by pixel, 1 for one plane per sample */
+    uint16_t planar_configuration;
+
+    /** Photometric Interpretation, for example "RGB" */
+    const char *photometric_interpretation;
+
+    /** Transfer Syntax UID of the frame value, so for native pixel data this
+     * is the Transfer Syntax of the file */
+    const char *transfer_syntax_uid;
+} DcmFrameInfo;
+
+/**
+ * Read an individual Frame from a File into a buffer.
  *
- * If the frame is missing, perhaps because this is a sparse file, this
- * function returns NULL and sets the error
- * :c:enum:`DCM_ERROR_CODE_MISSING_FRAME`. Applications can detect
- * this and render a background image.
+ * This is like :c:func:`dcm_filehandle_read_frame()`, but the pixel data is
+ * written to a buffer you supply and the frame attributes are returned in
+ * info, so no memory is allocated.
+ *
+ * If buffer is NULL, only info is filled in. Use info->length to find the
+ * size of buffer you need. It is an error if buffer_length is less than the
+ * frame length.
  *
  * :param error: Pointer to error object
  * :param filehandle: File
- * :param column: Column number, from 0
- * :param row: Row number, from 0
+ * :param frame_number: One-based frame number
+ * :param buffer: Memory area to write the frame to, or NULL
+ * :param buffer_length: Size of buffer in bytes
+ * :param info: Return frame attributes here
  *
- * :return: Frame
+ * :return: true on success
  */
 DCM_EXTERN
-DcmFrame *dcm_filehandle_read_frame_position(DcmError **error,
-                                             DcmFilehandle *filehandle,
-                                             uint32_t column,
-                                             uint32_t row);
+bool dcm_filehandle_read_frame_into(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t frame_number,
+                                    char *buffer,
+                                    uint32_t buffer_length,
+                                    DcmFrameInfo *info);
+
+/**
+ * Read a set of Frames from a File.
+ *
+ * This is equivalent to calling :c:func:`dcm_filehandle_read_frame()` for
+ * each frame number, but frames are fetched in file order and frames which
+ * are close together in the file are fetched with a single large read. This
+ * can be much faster, especially on network filesystems. Frames from the
+ * same read are not copied out, but share its buffer, which is freed with
+ * the last of them.
+ *
+ * The frames are returned in the same order as the frame numbers. On error,
+ * no frames are returned and every entry in frames is set to NULL.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param frame_numbers: Array of one-based frame numbers
+ * :param n_frames: Number of frame numbers
+ * :param frames: Array to return the n_frames Frames in
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_read_frames(DcmError **error,
+                                DcmFilehandle *filehandle,
+                                const uint32_t *frame_numbers,
+                                uint32_t n_frames,
+                                DcmFrame **frames);
+
+/**
+ * Codecs
+ *
+ * Frames are decoded to native pixels by a codec for their transfer syntax.
+ * libdicom has codecs for the native transfer syntaxes and for RLE Lossless,
+ * and applications can register codecs for other transfer syntaxes, for
+ * example JPEG or JPEG 2000.
+ */
+
+/**
+ * The maximum number of codecs that can be registered.
+ */
+#define DCM_MAX_CODECS (32)
+
+/**
+ * Decode a Frame into a buffer.
+ *
+ * info is filled in with the attributes of the decoded frame before the
+ * decoder is called: little-endian, color-by-pixel, with the Explicit VR
+ * Little Endian transfer syntax. buffer is info->length bytes. Decoders
+ * which change the color space, for example from YBR_FULL_422 to RGB,
+ * should set info->photometric_interpretation to a string which is valid
+ * for the lifetime of the codec.
+ *
+ * Decoders can be called from several threads at once.
+ *
+ * :param error: Pointer to error object
+ * :param client: The client pointer the codec was registered with
+ * :param frame: Frame to decode
+ * :param buffer: Memory area to write the decoded pixels to
+ * :param length: Size of buffer in bytes
+ * :param info: Attributes of the decoded frame
+ *
+ * :return: true on success
+ */
+typedef bool (*DcmDecodeFn)(DcmError **error,
+                            void *client,
+                            const DcmFrame *frame,
+                            char *buffer,
+                            uint32_t length,
+                            DcmFrameInfo *info);
+
+/**
+ * A codec for a transfer syntax.
+ */
+typedef struct _DcmCodec {
+    /** The transfer syntax this codec decodes */
+    const char *transfer_syntax_uid;
+
+    /** Decode function */
+    DcmDecodeFn decode;
+
+    /** Passed to decode */
+    void *client;
+} DcmCodec;
+
+/**
+ * Register a codec.
+ *
+ * The codec is copied, but the transfer syntax string is not, and must be
+ * valid for the lifetime of the program. Codecs registered later take
+ * priority over codecs registered earlier, and over the codecs built into
+ * libdicom.
+ *
+ * This function is not thread-safe. Register codecs during startup, before
+ * any frames are decoded.
+ *
+ * :param error: Pointer to error object
+ * :param codec: Codec to register
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_codec_register(DcmError **error, const DcmCodec *codec);
+
+/**
+ * Test if a transfer syntax can be decoded.
+ *
+ * :param transfer_syntax_uid: Transfer syntax UID
+ *
+ * :return: true if there is a codec for this transfer syntax
+ */
+DCM_EXTERN
+bool dcm_codec_is_supported(const char *transfer_syntax_uid);
+
+/**
+ * Decode a Frame to native pixels.
+ *
+ * Frames are decoded to little-endian, color-by-pixel pixels with the
+ * Explicit VR Little Endian transfer syntax. Frames which are already in
+ * this form are returned unchanged, with a new reference. It is an error if
+ * there is no codec for the transfer syntax of the frame.
+ *
+ * The result must be freed with :c:func:`dcm_frame_unref()`.
+ *
+ * :param error: Pointer to error object
+ * :param frame: Frame
+ *
+ * :return: Decoded Frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_frame_decode(DcmError **error, DcmFrame *frame);
+
+/**
+ * Decode a Frame to native pixels, with several threads.
+ *
+ * As :c:func:`dcm_frame_decode()`, but RLE segments (one for each byte of
+ * each sample) are decoded in parallel on up to n_threads threads. This is
+ * useful for large color or 16-bit frames.
+ *
+ * :param error: Pointer to error object
+ * :param frame: Frame
+ * :param n_threads: Maximum number of threads to use, including the caller
+ *
+ * :return: Decoded Frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_frame_decode_ex(DcmError **error,
+                              DcmFrame *frame,
+                              uint32_t n_threads);
+
+/**
+ * Decode a Frame into a buffer.
+ *
+ * This is like :c:func:`dcm_frame_decode()`, but the pixels are written to a
+ * buffer you supply and the attributes of the decoded frame are returned in
+ * info, so no memory is allocated.
+ *
+ * If buffer is NULL, only info is filled in. Use info->length to find the
+ * size of buffer you need.
+ *
+ * :param error: Pointer to error object
+ * :param frame: Frame
+ * :param buffer: Memory area to write the decoded pixels to, or NULL
+ * :param buffer_length: Size of buffer in bytes
+ * :param info: Return decoded frame attributes here
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_frame_decode_into(DcmError **error,
+                           const DcmFrame *frame,
+                           char *buffer,
+                           uint32_t buffer_length,
+                           DcmFrameInfo *info);
+
+/**
+ * Read and decode an individual Frame from a File.
+ *
+ * This is :c:func:`dcm_filehandle_read_frame()` followed by
+ * :c:func:`dcm_frame_decode()`.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param frame_number: One-based frame number
+ *
+ * :return: Decoded Frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_filehandle_read_frame_decoded(DcmError **error,
+                                            DcmFilehandle *filehandle,
+                                            uint32_t frame_number);
+
+/**
+ * Read and decode a set of Frames from a File.
+ *
+ * The encoded Frames are fetched together, as
+ * :c:func:`dcm_filehandle_read_frames()` does, so nearby Frames share large
+ * reads. Each Frame is queued for decoding as soon as the read it is part of
+ * completes, so decoding overlaps with fetching the rest. Decoding runs on a
+ * pool of worker threads shared by the whole library, using up to n_threads
+ * threads at once, including the caller. If there are fewer Frames than
+ * threads, the spare threads are shared out between the Frames, see
+ * :c:func:`dcm_frame_decode_ex()`.
+ *
+ * The frames are returned in the same order as the frame numbers. On error,
+ * no frames are returned and every entry in frames is set to NULL.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param frame_numbers: Array of one-based frame numbers
+ * :param n_frames: Number of frame numbers
+ * :param n_threads: Maximum number of threads to use, including the caller
+ * :param frames: Array to return the n_frames decoded Frames in
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_read_frames_decoded(DcmError **error,
+                                        DcmFilehandle *filehandle,
+                                        const uint32_t *frame_numbers,
+                                        uint32_t n_frames,
+                                        uint32_t n_threads,
+                                        DcmFrame **frames);
+
+/**
+ * Pixel formats for :c:func:`dcm_frame_convert()`.
+ */
+typedef enum _DcmPixelFormat {
+    /** One byte per pixel, MONOCHROME2 */
+    DCM_PIXEL_FORMAT_GREY8,
+
+    /** Three bytes per pixel, RGB, color-by-pixel */
+    DCM_PIXEL_FORMAT_RGB8,
+} DcmPixelFormat;
+
+/**
+ * Convert a Frame to 8-bit pixels for display.
+ *
+ * The frame is decoded with :c:func:`dcm_frame_decode()`, then converted to
+ * the requested pixel format. MONOCHROME1, MONOCHROME2, RGB and YBR_FULL
+ * frames with 8 or 16 bits allocated are supported. Samples are scaled from
+ * their full stored range to 8 bits, and MONOCHROME1 is inverted. Color
+ * frames converted to greyscale use the Rec. 601 luma.
+ *
+ * Frames which are already in the requested format are returned unchanged,
+ * with a new reference. The result must be freed with
+ * :c:func:`dcm_frame_unref()`.
+ *
+ * :param error: Pointer to error object
+ * :param frame: Frame
+ * :param format: Pixel format of the result
+ *
+ * :return: Converted Frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_frame_convert(DcmError **error,
+                            DcmFrame *frame,
+                            DcmPixelFormat format);
+
+/**
+ * Convert a Frame to 8-bit pixels for display, with a window.
+ *
+ * As :c:func:`dcm_frame_convert()`, but samples are mapped to 8 bits with
+ * the linear VOI LUT function given by window_center and window_width, see
+ * WindowCenter and WindowWidth. If window_width is zero or less, the full
+ * stored range is used.
+ *
+ * :param error: Pointer to error object
+ * :param frame: Frame
+ * :param format: Pixel format of the result
+ * :param window_center: Window center
+ * :param window_width: Window width
+ *
+ * :return: Converted Frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_frame_convert_ex(DcmError **error,
+                               DcmFrame *frame,
+                               DcmPixelFormat format,
+                               double window_center,
+                               double window_width);
+
+/**
+ * Read the frame at a position in a File.
+ *
+ * Read a frame from a File at a specified (column, row), numbered from zero.
+ * This takes account of any frame positioning given in
+ * PerFrameFunctionalGroupSequence.
+ *
+ * If the frame is missing, perhaps because this is a sparse file, this
+ * function returns NULL and sets the error
+ * :c:enum:`DCM_ERROR_CODE_MISSING_FRAME`. Applications can detect
+ * this and render a background image.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param column: Column number, from 0
+ * :param row: Row number, from 0
+ *
+ * :return: Frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_filehandle_read_frame_position(DcmError **error,
+                                             DcmFilehandle *filehandle,
+                                             uint32_t column,
+                                             uint32_t row);
+
+/**
+ * Read the frame at a position in a File, including focal plane and optical
+ * path.
+ *
+ * Read a frame from a File at a specified (column, row, focal plane,
+ * optical path), all numbered from zero. Focal planes are numbered in order
+ * of increasing Z offset, and optical paths in the order they appear in
+ * OpticalPathSequence.
+ *
+ * For TILED_FULL images, the frame is found by calculation, with no per
+ * frame metadata, and focal planes and optical paths are numbered in the
+ * order their frames appear in the file.
+ *
+ * :c:func:`dcm_filehandle_read_frame_position()` is equivalent to calling
+ * this function with focal plane and optical path zero.
+ *
+ * If the frame is missing, this function returns NULL and sets the error
+ * :c:enum:`DCM_ERROR_CODE_MISSING_FRAME`.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param column: Column number, from 0
+ * :param row: Row number, from 0
+ * :param focal_plane: Focal plane number, from 0
+ * :param optical_path: Optical path number, from 0
+ *
+ * :return: Frame
+ */
+DCM_EXTERN
+DcmFrame *dcm_filehandle_read_frame_position_ex(DcmError **error,
+                                                DcmFilehandle *filehandle,
+                                                uint32_t column,
+                                                uint32_t row,
+                                                uint32_t focal_plane,
+                                                uint32_t optical_path);
+
+/**
+ * Read a rectangle of pixels from a File.
+ *
+ * All frames which overlap the region are fetched in a single pass over the
+ * file, and the overlapping parts are copied to the caller's buffer. The
+ * region is measured in pixels from the top-left of the tile grid.
+ *
+ * Each line of the region is written stride bytes after the previous one.
+ * Parts of the region with no frame, perhaps because this is a sparse file,
+ * are filled with the background byte.
+ *
+ * Only native (uncompressed) pixel data with a planar configuration of zero
+ * and a whole number of bytes per sample is supported.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param left: Left edge of region, in pixels
+ * :param top: Top edge of region, in pixels
+ * :param width: Width of region, in pixels
+ * :param height: Height of region, in pixels
+ * :param focal_plane: Focal plane number, from 0
+ * :param optical_path: Optical path number, from 0
+ * :param buffer: Memory area to write pixels to
+ * :param stride: Distance in bytes between lines in buffer
+ * :param background: Byte value to fill missing frames with
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_read_region(DcmError **error,
+                                DcmFilehandle *filehandle,
+                                uint32_t left,
+                                uint32_t top,
+                                uint32_t width,
+                                uint32_t height,
+                                uint32_t focal_plane,
+                                uint32_t optical_path,
+                                char *buffer,
+                                uint32_t stride,
+                                uint8_t background);
+
+/**
+ * Get the number of focal planes in a File.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ *
+ * :return: Number of focal planes, or 0 on error
+ */
+DCM_EXTERN
+uint32_t dcm_filehandle_get_num_focal_planes(DcmError **error,
+                                             DcmFilehandle *filehandle);
+
+/**
+ * Get the number of optical paths in a File.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ *
+ * :return: Number of optical paths, or 0 on error
+ */
+DCM_EXTERN
+uint32_t dcm_filehandle_get_num_optical_paths(DcmError **error,
+                                              DcmFilehandle *filehandle);
+
+/**
+ * Get the Z offset of a focal plane, in millimetres.
+ *
+ * This fails if the File does not give Z offsets for frames.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param focal_plane: Focal plane number, from 0
+ * :param z: Pointer to return the Z offset to
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_get_focal_plane_z(DcmError **error,
+                                      DcmFilehandle *filehandle,
+                                      uint32_t focal_plane,
+                                      double *z);
+
+/**
+ * Get the identifier of an optical path.
+ *
+ * The return result must not be destroyed.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param optical_path: Optical path number, from 0
+ *
+ * :return: Value of OpticalPathIdentifier for this optical path
+ */
+DCM_EXTERN
+const char *dcm_filehandle_get_optical_path_identifier(DcmError **error,
+                                                       DcmFilehandle *filehandle,
+                                                       uint32_t optical_path);
+
+/**
+ * A cache of frames, shared by one or more Filehandles.
+ */
+typedef struct _DcmFrameCache DcmFrameCache;
+
+/**
+ * Frame cache statistics, see :c:func:`dcm_frame_cache_get_stats()`.
+ */
+typedef struct _DcmFrameCacheStats {
+    /** Number of reads satisfied from the cache */
+    uint64_t hits;
+
+    /** Number of reads which had to go to the file */
+    uint64_t misses;
+
+    /** Number of frames dropped to stay inside the budget */
+    uint64_t evictions;
+
+    /** Number of bytes of pixel data in the cache */
+    uint64_t bytes;
+
+    /** Number of frames in the cache */
+    uint32_t frames;
+} DcmFrameCacheStats;
+
+/**
+ * Create a Frame cache.
+ *
+ * The cache holds frames read by any Filehandle it is attached to, up to a
+ * budget of bytes of pixel data. Frames that are read only once, for example
+ * by a bulk export, can't push out frames that are read repeatedly.
+ *
+ * The cache is safe to share between threads.
+ *
+ * :param error: Pointer to error object
+ * :param budget: Maximum number of bytes of pixel data to hold
+ *
+ * :return: Frame cache
+ */
+DCM_EXTERN
+DcmFrameCache *dcm_frame_cache_create(DcmError **error, uint64_t budget);
+
+/**
+ * Destroy a Frame cache.
+ *
+ * Filehandles using the cache keep it alive until they are destroyed, so you
+ * can call this as soon as you have attached the cache.
+ *
+ * :param cache: Frame cache
+ */
+DCM_EXTERN
+void dcm_frame_cache_destroy(DcmFrameCache *cache);
+
+/**
+ * Get Frame cache statistics.
+ *
+ * :param cache: Frame cache
+ * :param stats: Return statistics here
+ */
+DCM_EXTERN
+void dcm_frame_cache_get_stats(DcmFrameCache *cache,
+                               DcmFrameCacheStats *stats);
+
+/**
+ * Attach a Frame cache to a Filehandle.
+ *
+ * Frames returned by :c:func:`dcm_filehandle_read_frame()` and
+ * :c:func:`dcm_filehandle_read_frames()` are then shared with the cache,
+ * rather than copied out of it. :c:func:`dcm_filehandle_read_frame_into()`
+ * will copy frames from the cache, but will not add to it.
+ *
+ * Call this before sharing the Filehandle between threads. Pass NULL to
+ * detach any cache.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param cache: Frame cache, or NULL
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_set_frame_cache(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    DcmFrameCache *cache);
+
+/**
+ * The largest number of prefetch threads a Filehandle can have.
+ */
+#define DCM_MAX_PREFETCH_THREADS 64
+
+/**
+ * Start or stop background prefetch for a Filehandle.
+ *
+ * When prefetch is on, each call to
+ * :c:func:`dcm_filehandle_read_frame_position()` or
+ * :c:func:`dcm_filehandle_read_frame_position_ex()` queues the tiles which
+ * are likely to be read next. If the previous read shows the direction of a
+ * pan, these are the tiles ahead, otherwise they are the ring of tiles around
+ * the one read. A pool of n_threads threads reads the queued tiles into the
+ * Frame cache, if there is one, or into the operating system's page cache.
+ *
+ * Only the most recent read is used for prediction, and each read replaces
+ * any queued tiles.
+ *
+ * Call this before sharing the Filehandle between threads. Pass zero to stop
+ * prefetch.
+ *
+ * :param error: Pointer to error object
+ * :param filehandle: File
+ * :param n_threads: Number of prefetch threads, or zero
+ *
+ * :return: true on success
+ */
+DCM_EXTERN
+bool dcm_filehandle_set_prefetch(DcmError **error,
+                                 DcmFilehandle *filehandle,
+                                 uint32_t n_threads);
+
+/**
+ * Filehandle pool
+ */
+typedef struct _DcmFilehandlePool DcmFilehandlePool;
+
+/**
+ * Filehandle pool statistics, see :c:func:`dcm_filehandle_pool_get_stats()`.
+ */
+typedef struct _DcmFilehandlePoolStats {
+    /** Number of acquires which found the file already open */
+    uint64_t hits;
+
+    /** Number of acquires which had to open and parse the file */
+    uint64_t opens;
+
+    /** Number of acquires which reopened a closed file, reusing the
+     * parsed state */
+    uint64_t reopens;
+
+    /** Number of files closed to stay inside the open file limit */
+    uint64_t closes;
+
+    /** Number of Filehandles destroyed to stay inside the budget */
+    uint64_t evictions;
+
+    /** Bytes of parsed state held by the pool, see
+     * :c:func:`dcm_filehandle_get_memory_usage()` */
+    uint64_t bytes;
+
+    /** Number of Filehandles in the pool */
+    uint32_t handles;
+
+    /** Number of Filehandles with an open file */
+    uint32_t open_handles;
+} DcmFilehandlePoolStats;
+
+/**
+ * Create a Filehandle pool.
+ *
+ * A pool shares Filehandles for many files between many requests. At most
+ * max_open files are kept open, and the least recently used idle files are
+ * closed beyond that. A closed Filehandle keeps its parsed state, such as
+ * the metadata, offset table and frame index, so acquiring it again only
+ * needs to reopen the file. If the parsed state goes over budget bytes, the
+ * least recently used idle Filehandles are destroyed.
+ *
+ * Files in the pool must not change while the pool is using them.
+ *
+ * The pool is safe to share between threads.
+ *
+ * :param error: Pointer to error object
+ * :param max_open: Maximum number of idle open files
+ * :param budget: Maximum number of bytes of parsed state to keep
+ *
+ * :return: Filehandle pool
+ */
+DCM_EXTERN
+DcmFilehandlePool *dcm_filehandle_pool_create(DcmError **error,
+                                              uint32_t max_open,
+                                              uint64_t budget);
+
+/**
+ * Destroy a Filehandle pool, and all the Filehandles in it.
+ *
+ * All Filehandles must have been released.
+ *
+ * :param pool: Filehandle pool
+ */
+DCM_EXTERN
+void dcm_filehandle_pool_destroy(DcmFilehandlePool *pool);
+
+/**
+ * Get a Filehandle for a file from a pool.
+ *
+ * The Filehandle is ready to read frames, see
+ * :c:func:`dcm_filehandle_prepare_read_frame()`. It stays open until you
+ * pass it to :c:func:`dcm_filehandle_pool_release()`. Several threads can
+ * acquire the same file at once and will share one Filehandle. Don't call
+ * :c:func:`dcm_filehandle_destroy()` on it.
+ *
+ * Files can be closed while they are idle in the pool. Any prefetch set
+ * with :c:func:`dcm_filehandle_set_prefetch()` stops while the file is
+ * closed, and starts again when it is reopened. A Frame cache stays
+ * attached.
+ *
+ * Because in-use Filehandles are never closed, the number of open files can
+ * go over the limit while many are acquired.
+ *
+ * :param error: Pointer to error object
+ * :param pool: Filehandle pool
+ * :param path: Path of the file to open
+ *
+ * :return: Filehandle
+ */
+DCM_EXTERN
+DcmFilehandle *dcm_filehandle_pool_acquire(DcmError **error,
+                                           DcmFilehandlePool *pool,
+                                           const char *path);
+
+/**
+ * Give a Filehandle back to the pool it was acquired from.
+ *
+ * :param pool: Filehandle pool
+ * :param filehandle: Filehandle returned by
+ *                    :c:func:`dcm_filehandle_pool_acquire()`
+ */
+DCM_EXTERN
+void dcm_filehandle_pool_release(DcmFilehandlePool *pool,
+                                 DcmFilehandle *filehandle);
+
+/**
+ * Get Filehandle pool statistics.
+ *
+ * :param pool: Filehandle pool
+ * :param stats: Return statistics here
+ */
+DCM_EXTERN
+void dcm_filehandle_pool_get_stats(DcmFilehandlePool *pool,
+                                   DcmFilehandlePoolStats *stats);
 
 /**
  * Scan a file and print the entire structure to stdout.
@@ -0,0 +1,490 @@
+/*
+ * Arena allocation for parsed data sets.
+ *
+ * A data set tree parsed from a file is made of many small objects which
+ * all live and die together. Rather than calling malloc for each one, we
+ * carve them out of large chunks, and free the whole tree by freeing the
+ * chunks.
+ *
+ * Objects in an arena tree are never freed individually. This is safe
+ * since parsed data sets are locked, so nothing can be removed from them.
+ *
+ * Parsed trees repeat the same short strings many times, so an arena can
+ * also intern values. Each distinct value is stored once, and is found
+ * again with a hash table keyed by the string. Interned values are shared,
+ * so they must never be changed.
+ *
+ * Element values can also point into the external memory the tree was
+ * parsed from. The arena then holds a ref to that mapping.
+ *
+ * Each allocation says what it is for, so we can report how the memory is
+ * used. An arena can have a limit, and allocations which would go over it
+ * fail with DCM_ERROR_CODE_MEMORY_LIMIT.
+ *
+ * Arenas are refcounted, since a tree can be split, for example by stealing
+ * an item from a sequence. Allocation is not thread-safe, so only one
+ * thread can build an arena tree at once. Lazy sequences parse items into a
+ * finished tree, and they hold the arena lock while they do it.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+// all allocations are aligned to this
+#define ARENA_ALIGN (16)
+
+// chunks start small, so tiny trees stay small, and double up to a limit
+#define ARENA_MIN_CHUNK (4 * 1024)
+#define ARENA_MAX_CHUNK (1024 * 1024)
+
+// the intern table starts with this many slots, and doubles when half full
+#define ARENA_MIN_INTERN (256)
+
+#define ARENA_ROUND(SIZE) \
+    (((SIZE) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+};
+
+// allocations start after the chunk header
+#define ARENA_CHUNK_HEADER ARENA_ROUND(sizeof(struct ArenaChunk))
+#define ARENA_CHUNK_DATA(CHUNK) ((char *) (CHUNK) + ARENA_CHUNK_HEADER)
+
+struct InternEntry {
+    const char *key;
+    void *value;
+    uint32_t hash;
+    int kind;
+};
+
+
+struct _DcmArena {
+    int32_t refcount;
+
+    // the chunk we are filling is at the head
+    struct ArenaChunk *chunks;
+    size_t chunk_size;
+
+    // the most recent allocation from the head chunk, so it can grow in place
+    void *last;
+
+    // held while a lazy sequence parses an item
+    DcmMutex *lock;
+
+    // the intern table is NULL until the first value is interned ... it is
+    // malloced, since it is replaced as it grows
+    bool intern;
+    struct InternEntry *interned;
+    uint32_t n_interned;
+    uint32_t intern_capacity;
+
+    // element values point into this
+    DcmMapping *mapping;
+
+    // bytes of chunks, including headers, and the bytes in them given out
+    // for each use
+    uint64_t allocated;
+    uint64_t used[DCM_ARENA_N_USES];
+
+    // chunks and the intern table must fit in this
+    uint64_t limit;
+};
+
+
+DcmArena *dcm_arena_create(DcmError **error)
+{
+    DcmArena *arena = DCM_NEW(error, DcmArena);
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->lock = dcm_mutex_create(error);
+    if (arena->lock == NULL) {
+        free(arena);
+        return NULL;
+    }
+
+    arena->refcount = 1;
+    arena->chunk_size = ARENA_MIN_CHUNK;
+    arena->limit = UINT64_MAX;
+
+    return arena;
+}
+
+
+DcmArena *dcm_arena_ref(DcmArena *arena)
+{
+    dcm_atomic_add(&arena->refcount, 1);
+
+    return arena;
+}
+
+
+void dcm_arena_unref(DcmArena *arena)
+{
+    if (arena && dcm_atomic_add(&arena->refcount, -1) == 0) {
+        struct ArenaChunk *chunk = arena->chunks;
+        while (chunk) {
+            struct ArenaChunk *next = chunk->next;
+
+            free(chunk);
+            chunk = next;
+        }
+
+        dcm_mutex_destroy(arena->lock);
+        dcm_mapping_unref(arena->mapping);
+        free(arena->interned);
+        free(arena);
+    }
+}
+
+
+static uint64_t arena_get_intern_size(const DcmArena *arena)
+{
+    return (uint64_t) arena->intern_capacity * sizeof(struct InternEntry);
+}
+
+
+/* Check that size more bytes of chunks or intern table fit in the limit.
+ */
+bool dcm_arena_reserve(DcmError **error,
+                       const DcmArena *arena,
+                       uint64_t size)
+{
+    uint64_t total = arena->allocated + arena_get_intern_size(arena);
+
+    if (total > arena->limit || size > arena->limit - total) {
+        dcm_error_set(error, DCM_ERROR_CODE_MEMORY_LIMIT,
+                      "Memory limit exceeded",
+                      "Allocating %" PRIu64 " bytes would exceed the "
+                      "limit of %" PRIu64 " bytes",
+                      size, arena->limit);
+        return false;
+    }
+
+    return true;
+}
+
+
+static struct ArenaChunk *chunk_create(DcmError **error,
+                                       DcmArena *arena,
+                                       size_t size)
+{
+    if (!dcm_arena_reserve(error, arena, ARENA_CHUNK_HEADER + size)) {
+        return NULL;
+    }
+
+    struct ArenaChunk *chunk = malloc(ARENA_CHUNK_HEADER + size);
+    if (chunk == NULL) {
+        dcm_error_set(error, DCM_ERROR_CODE_NOMEM,
+                      "Out of memory",
+                      "Failed to allocate %zd bytes",
+                      ARENA_CHUNK_HEADER + size);
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    arena->allocated += ARENA_CHUNK_HEADER + size;
+
+    return chunk;
+}
+
+
+/* Allocate zeroed memory, like calloc.
+ */
+void *dcm_arena_alloc(DcmError **error,
+                      DcmArena *arena,
+                      DcmArenaUse use,
+                      size_t size)
+{
+    // zero-sized values must still give a non-NULL pointer
+    size = ARENA_ROUND(MAX(size, 1));
+
+    struct ArenaChunk *chunk = arena->chunks;
+    if (chunk && chunk->size - chunk->used >= size) {
+        void *result = ARENA_CHUNK_DATA(chunk) + chunk->used;
+        chunk->used += size;
+        arena->used[use] += size;
+        arena->last = result;
+        memset(result, 0, size);
+
+        return result;
+    }
+
+    // large values get a chunk of their own behind the head, so we can keep
+    // filling the head chunk
+    if (chunk && size > arena->chunk_size / 4) {
+        struct ArenaChunk *large = chunk_create(error, arena, size);
+        if (large == NULL) {
+            return NULL;
+        }
+        large->used = size;
+        large->next = chunk->next;
+        chunk->next = large;
+        arena->used[use] += size;
+        memset(ARENA_CHUNK_DATA(large), 0, size);
+
+        return ARENA_CHUNK_DATA(large);
+    }
+
+    size_t chunk_size = MAX(arena->chunk_size, size);
+    chunk = chunk_create(error, arena, chunk_size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->used = size;
+    arena->used[use] += size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->chunk_size = MIN(arena->chunk_size * 2, ARENA_MAX_CHUNK);
+    arena->last = ARENA_CHUNK_DATA(chunk);
+    memset(arena->last, 0, size);
+
+    return arena->last;
+}
+
+
+void *dcm_arena_realloc(DcmError **error,
+                        DcmArena *arena,
+                        DcmArenaUse use,
+                        void *pointer,
+                        size_t old_size,
+                        size_t size)
+{
+    if (pointer && size <= old_size) {
+        return pointer;
+    }
+
+    // the last allocation can often just grow
+    struct ArenaChunk *chunk = arena->chunks;
+    if (pointer && pointer == arena->last) {
+        size_t start = (size_t) ((char *) pointer - ARENA_CHUNK_DATA(chunk));
+
+        if (chunk->size - start >= ARENA_ROUND(size)) {
+            chunk->used = start + ARENA_ROUND(size);
+            arena->used[use] += ARENA_ROUND(size) -
+                ARENA_ROUND(MAX(old_size, 1));
+            return pointer;
+        }
+    }
+
+    void *result = dcm_arena_alloc(error, arena, use, size);
+    if (result == NULL) {
+        return NULL;
+    }
+    if (pointer) {
+        memcpy(result, pointer, old_size);
+
+        // the old block is now wasted
+        arena->used[use] -= ARENA_ROUND(MAX(old_size, 1));
+    }
+
+    return result;
+}
+
+
+char *dcm_arena_strdup(DcmError **error, DcmArena *arena, const char *str)
+{
+    if (str == NULL) {
+        return NULL;
+    }
+
+    size_t length = strlen(str);
+    char *new_str = dcm_arena_alloc(error,
+                                    arena,
+                                    DCM_ARENA_USE_VALUES,
+                                    length + 1);
+    if (new_str == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_str, str, length + 1);
+
+    return new_str;
+}
+
+
+void dcm_arena_lock(DcmArena *arena)
+{
+    dcm_mutex_lock(arena->lock);
+}
+
+
+void dcm_arena_unlock(DcmArena *arena)
+{
+    dcm_mutex_unlock(arena->lock);
+}
+
+
+/* Keep a mapping alive for as long as the arena. An arena can only hold
+ * one, so this is false if it already holds a different mapping.
+ */
+bool dcm_arena_hold_mapping(DcmArena *arena, DcmMapping *mapping)
+{
+    if (arena->mapping == NULL) {
+        arena->mapping = dcm_mapping_ref(mapping);
+    }
+
+    return arena->mapping == mapping;
+}
+
+
+void dcm_arena_set_limit(DcmArena *arena, uint64_t limit)
+{
+    arena->limit = limit;
+}
+
+
+/* Add the memory held by an arena to a usage report.
+ */
+void dcm_arena_add_memory_usage(DcmArena *arena, DcmMemoryUsage *usage)
+{
+    // lazy sequences can be allocating in another thread
+    dcm_arena_lock(arena);
+
+    uint64_t used = 0;
+    for (int i = 0; i < DCM_ARENA_N_USES; i++) {
+        used += arena->used[i];
+    }
+
+    usage->elements += arena->used[DCM_ARENA_USE_ELEMENTS];
+    usage->values += arena->used[DCM_ARENA_USE_VALUES];
+    usage->sequences += arena->used[DCM_ARENA_USE_SEQUENCES];
+    usage->hash += arena_get_intern_size(arena);
+    usage->unused += arena->allocated - used;
+
+    dcm_arena_unlock(arena);
+}
+
+
+void dcm_arena_set_intern(DcmArena *arena, bool intern)
+{
+    arena->intern = intern;
+}
+
+
+bool dcm_arena_get_intern(const DcmArena *arena)
+{
+    return arena->intern;
+}
+
+
+// FNV-1a
+static uint32_t intern_hash(const char *key, int kind)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t) kind;
+
+    for (const unsigned char *p = (const unsigned char *) key; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static struct InternEntry *intern_find(const DcmArena *arena,
+                                       uint32_t hash,
+                                       int kind,
+                                       const char *key)
+{
+    uint32_t mask = arena->intern_capacity - 1;
+
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        struct InternEntry *entry = &arena->interned[i];
+
+        if (entry->key == NULL ||
+            (entry->hash == hash &&
+             entry->kind == kind &&
+             strcmp(entry->key, key) == 0)) {
+            return entry;
+        }
+    }
+}
+
+
+/* Find the value interned for a key, or NULL.
+ */
+void *dcm_arena_intern_lookup(const DcmArena *arena,
+                              int kind,
+                              const char *key)
+{
+    if (arena->interned == NULL) {
+        return NULL;
+    }
+
+    uint32_t hash = intern_hash(key, kind);
+
+    return intern_find(arena, hash, kind, key)->value;
+}
+
+
+static bool intern_grow(DcmError **error, DcmArena *arena)
+{
+    uint32_t capacity = MAX(ARENA_MIN_INTERN, arena->intern_capacity * 2);
+    if (!dcm_arena_reserve(error,
+                           arena,
+                           (uint64_t) (capacity - arena->intern_capacity) *
+                               sizeof(struct InternEntry))) {
+        return false;
+    }
+
+    struct InternEntry *old = arena->interned;
+    uint32_t old_capacity = arena->intern_capacity;
+
+    arena->interned = DCM_NEW_ARRAY(error, capacity, struct InternEntry);
+    if (arena->interned == NULL) {
+        arena->interned = old;
+        return false;
+    }
+    arena->intern_capacity = capacity;
+
+    for (uint32_t i = 0; i < old_capacity; i++) {
+        if (old[i].key) {
+            *intern_find(arena, old[i].hash, old[i].kind, old[i].key) =
+                old[i];
+        }
+    }
+    free(old);
+
+    return true;
+}
+
+
+/* Intern a value. The key and the value must be allocated from the arena,
+ * and the key must not already be interned.
+ */
+bool dcm_arena_intern_add(DcmError **error,
+                          DcmArena *arena,
+                          int kind,
+                          const char *key,
+                          void *value)
+{
+    if (arena->n_interned + 1 > arena->intern_capacity / 2 &&
+        !intern_grow(error, arena)) {
+        return false;
+    }
+
+    uint32_t hash = intern_hash(key, kind);
+    struct InternEntry *entry = intern_find(arena, hash, kind, key);
+    entry->key = key;
+    entry->value = value;
+    entry->hash = hash;
+    entry->kind = kind;
+    arena->n_interned += 1;
+
+    return true;
+}
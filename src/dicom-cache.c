@@ -0,0 +1,423 @@
+/*
+ * A cache of frames read from filehandles.
+ *
+ * We use the 2Q scheme (Johnson and Shasha, 1994). Frames we have seen once
+ * go into a FIFO, a1in. If they are evicted from there, we remember their
+ * key (but not their pixels) in a1out. Frames which are requested again
+ * while in a1out are promoted to an LRU queue, am. A long scan of frames
+ * which are only read once can therefore only flush a1in, and the frames in
+ * am, the working set, survive.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uthash.h"
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+/* The fraction of the budget we allow a1in to use.
+ */
+#define A1IN_FRACTION (4)
+
+/* The number of bytes of frames we remember in a1out, as a fraction of the
+ * budget.
+ */
+#define A1OUT_FRACTION (2)
+
+typedef enum _DcmCacheQueue {
+    DCM_CACHE_QUEUE_A1IN,
+    DCM_CACHE_QUEUE_A1OUT,
+    DCM_CACHE_QUEUE_AM,
+    DCM_CACHE_QUEUE_N,
+} DcmCacheQueue;
+
+struct CacheKey {
+    const DcmFilehandle *filehandle;
+    uint32_t frame_number;
+};
+
+struct CacheOwner;
+
+struct CacheEntry {
+    struct CacheKey key;
+
+    // NULL for entries in a1out
+    DcmFrame *frame;
+    uint32_t length;
+
+    DcmCacheQueue queue;
+    struct CacheEntry *prev;
+    struct CacheEntry *next;
+
+    // all the entries for this filehandle
+    struct CacheOwner *owner;
+    struct CacheEntry *owner_prev;
+    struct CacheEntry *owner_next;
+
+    UT_hash_handle hh;
+};
+
+/* The entries for one filehandle, so we can drop them without a walk over
+ * the whole cache.
+ */
+struct CacheOwner {
+    const DcmFilehandle *filehandle;
+    struct CacheEntry *entries;
+
+    UT_hash_handle hh;
+};
+
+/* A doubly-linked list, most recent at the head.
+ */
+struct CacheList {
+    struct CacheEntry *head;
+    struct CacheEntry *tail;
+    uint64_t bytes;
+};
+
+struct _DcmFrameCache {
+    DcmMutex *lock;
+
+    // one for the creator, plus one for each filehandle using the cache
+    int32_t refcount;
+
+    uint64_t budget;
+    struct CacheEntry *entries;
+    struct CacheOwner *owners;
+    struct CacheList queues[DCM_CACHE_QUEUE_N];
+
+    DcmFrameCacheStats stats;
+};
+
+
+static void list_remove(struct CacheList *list, struct CacheEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+
+    entry->prev = NULL;
+    entry->next = NULL;
+    list->bytes -= entry->length;
+}
+
+
+static void list_push(struct CacheList *list, struct CacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = list->head;
+    if (list->head) {
+        list->head->prev = entry;
+    } else {
+        list->tail = entry;
+    }
+
+    list->head = entry;
+    list->bytes += entry->length;
+}
+
+
+static void cache_move(DcmFrameCache *cache,
+                       struct CacheEntry *entry,
+                       DcmCacheQueue queue)
+{
+    list_remove(&cache->queues[entry->queue], entry);
+    entry->queue = queue;
+    list_push(&cache->queues[queue], entry);
+}
+
+
+static void owner_remove(DcmFrameCache *cache, struct CacheEntry *entry)
+{
+    struct CacheOwner *owner = entry->owner;
+
+    if (entry->owner_prev) {
+        entry->owner_prev->owner_next = entry->owner_next;
+    } else {
+        owner->entries = entry->owner_next;
+    }
+    if (entry->owner_next) {
+        entry->owner_next->owner_prev = entry->owner_prev;
+    }
+
+    if (owner->entries == NULL) {
+        HASH_DEL(cache->owners, owner);
+        free(owner);
+    }
+}
+
+
+static bool owner_add(DcmFrameCache *cache, struct CacheEntry *entry)
+{
+    const DcmFilehandle *filehandle = entry->key.filehandle;
+    struct CacheOwner *owner;
+
+    HASH_FIND(hh, cache->owners, &filehandle, sizeof(filehandle), owner);
+    if (owner == NULL) {
+        owner = DCM_NEW(NULL, struct CacheOwner);
+        if (owner == NULL) {
+            return false;
+        }
+        owner->filehandle = filehandle;
+        HASH_ADD(hh, cache->owners, filehandle, sizeof(filehandle), owner);
+    }
+
+    entry->owner = owner;
+    entry->owner_prev = NULL;
+    entry->owner_next = owner->entries;
+    if (owner->entries) {
+        owner->entries->owner_prev = entry;
+    }
+    owner->entries = entry;
+
+    return true;
+}
+
+
+static void cache_remove(DcmFrameCache *cache, struct CacheEntry *entry)
+{
+    HASH_DEL(cache->entries, entry);
+    owner_remove(cache, entry);
+    list_remove(&cache->queues[entry->queue], entry);
+    if (entry->frame) {
+        cache->stats.bytes -= entry->length;
+        cache->stats.frames -= 1;
+        dcm_frame_destroy(entry->frame);
+    }
+    free(entry);
+}
+
+
+/* Shrink the cache back inside the budget.
+ */
+static void cache_trim(DcmFrameCache *cache)
+{
+    struct CacheList *a1in = &cache->queues[DCM_CACHE_QUEUE_A1IN];
+    struct CacheList *a1out = &cache->queues[DCM_CACHE_QUEUE_A1OUT];
+    struct CacheList *am = &cache->queues[DCM_CACHE_QUEUE_AM];
+
+    while (cache->stats.bytes > cache->budget) {
+        if (a1in->tail &&
+            (a1in->bytes > cache->budget / A1IN_FRACTION || am->tail == NULL)) {
+            // drop the pixels, but remember we've seen this frame
+            struct CacheEntry *entry = a1in->tail;
+            cache_move(cache, entry, DCM_CACHE_QUEUE_A1OUT);
+            cache->stats.bytes -= entry->length;
+            cache->stats.frames -= 1;
+            dcm_frame_destroy(entry->frame);
+            entry->frame = NULL;
+        } else {
+            cache_remove(cache, am->tail);
+        }
+
+        cache->stats.evictions += 1;
+    }
+
+    while (a1out->bytes > cache->budget / A1OUT_FRACTION) {
+        cache_remove(cache, a1out->tail);
+    }
+}
+
+
+DcmFrameCache *dcm_frame_cache_create(DcmError **error, uint64_t budget)
+{
+    DcmFrameCache *cache = DCM_NEW(error, DcmFrameCache);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->lock = dcm_mutex_create(error);
+    if (cache->lock == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    cache->refcount = 1;
+    cache->budget = budget;
+
+    return cache;
+}
+
+
+DcmFrameCache *dcm_frame_cache_ref(DcmFrameCache *cache)
+{
+    dcm_atomic_add(&cache->refcount, 1);
+
+    return cache;
+}
+
+
+void dcm_frame_cache_destroy(DcmFrameCache *cache)
+{
+    if (cache && dcm_atomic_add(&cache->refcount, -1) == 0) {
+        struct CacheEntry *entry;
+        struct CacheEntry *tmp;
+
+        HASH_ITER(hh, cache->entries, entry, tmp) {
+            cache_remove(cache, entry);
+        }
+
+        dcm_mutex_destroy(cache->lock);
+        free(cache);
+    }
+}
+
+
+void dcm_frame_cache_get_stats(DcmFrameCache *cache,
+                               DcmFrameCacheStats *stats)
+{
+    dcm_mutex_lock(cache->lock);
+    *stats = cache->stats;
+    dcm_mutex_unlock(cache->lock);
+}
+
+
+DcmFrame *dcm_frame_cache_get(DcmFrameCache *cache,
+                              const DcmFilehandle *filehandle,
+                              uint32_t frame_number)
+{
+    struct CacheKey key;
+    struct CacheEntry *entry;
+    DcmFrame *frame = NULL;
+
+    // the key is hashed as bytes, so any padding must be zero
+    memset(&key, 0, sizeof(key));
+    key.filehandle = filehandle;
+    key.frame_number = frame_number;
+
+    dcm_mutex_lock(cache->lock);
+
+    HASH_FIND(hh, cache->entries, &key, sizeof(key), entry);
+    if (entry && entry->frame) {
+        // frames in a1in stay where they are, since a burst of reads of one
+        // frame shouldn't promote it
+        if (entry->queue == DCM_CACHE_QUEUE_AM) {
+            cache_move(cache, entry, DCM_CACHE_QUEUE_AM);
+        }
+        frame = dcm_frame_ref(entry->frame);
+        cache->stats.hits += 1;
+    } else {
+        cache->stats.misses += 1;
+    }
+
+    dcm_mutex_unlock(cache->lock);
+
+    return frame;
+}
+
+
+/* Test for a frame without counting a hit or a miss, or changing the
+ * queues.
+ */
+bool dcm_frame_cache_contains(DcmFrameCache *cache,
+                              const DcmFilehandle *filehandle,
+                              uint32_t frame_number)
+{
+    struct CacheKey key;
+    struct CacheEntry *entry;
+
+    memset(&key, 0, sizeof(key));
+    key.filehandle = filehandle;
+    key.frame_number = frame_number;
+
+    dcm_mutex_lock(cache->lock);
+    HASH_FIND(hh, cache->entries, &key, sizeof(key), entry);
+    bool result = entry && entry->frame;
+    dcm_mutex_unlock(cache->lock);
+
+    return result;
+}
+
+
+void dcm_frame_cache_put(DcmFrameCache *cache,
+                         const DcmFilehandle *filehandle,
+                         DcmFrame *frame)
+{
+    struct CacheKey key;
+    struct CacheEntry *entry;
+    uint32_t length = dcm_frame_get_length(frame);
+
+    // too large to ever fit
+    if (length > cache->budget) {
+        return;
+    }
+
+    memset(&key, 0, sizeof(key));
+    key.filehandle = filehandle;
+    key.frame_number = dcm_frame_get_number(frame);
+
+    dcm_mutex_lock(cache->lock);
+
+    HASH_FIND(hh, cache->entries, &key, sizeof(key), entry);
+    if (entry && entry->frame) {
+        // another thread got there first
+        dcm_mutex_unlock(cache->lock);
+        return;
+    }
+
+    if (entry) {
+        // seen recently, so this frame is part of the working set
+        list_remove(&cache->queues[entry->queue], entry);
+        entry->queue = DCM_CACHE_QUEUE_AM;
+    } else {
+        entry = DCM_NEW(NULL, struct CacheEntry);
+        if (entry == NULL) {
+            dcm_mutex_unlock(cache->lock);
+            return;
+        }
+        entry->key = key;
+        if (!owner_add(cache, entry)) {
+            free(entry);
+            dcm_mutex_unlock(cache->lock);
+            return;
+        }
+        entry->queue = DCM_CACHE_QUEUE_A1IN;
+        HASH_ADD(hh, cache->entries, key, sizeof(key), entry);
+    }
+
+    entry->frame = dcm_frame_ref(frame);
+    entry->length = length;
+    list_push(&cache->queues[entry->queue], entry);
+    cache->stats.bytes += length;
+    cache->stats.frames += 1;
+
+    cache_trim(cache);
+
+    dcm_mutex_unlock(cache->lock);
+}
+
+
+/* Remove all frames from a filehandle, for example when it closes.
+ */
+void dcm_frame_cache_remove_filehandle(DcmFrameCache *cache,
+                                       const DcmFilehandle *filehandle)
+{
+    struct CacheOwner *owner;
+
+    dcm_mutex_lock(cache->lock);
+
+    // the owner is freed along with its last entry
+    HASH_FIND(hh, cache->owners, &filehandle, sizeof(filehandle), owner);
+    struct CacheEntry *entry = owner ? owner->entries : NULL;
+    while (entry) {
+        struct CacheEntry *next = entry->owner_next;
+
+        cache_remove(cache, entry);
+        entry = next;
+    }
+
+    dcm_mutex_unlock(cache->lock);
+}
@@ -0,0 +1,332 @@
+/*
+ * Frame decoding, and the registry of codecs.
+ *
+ * Applications can register decoders for any transfer syntax. We search
+ * these first, most recent first, so a registered codec can replace one of
+ * the built-in decoders.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+/* The transfer syntax of decoded frames.
+ */
+#define DECODED_TRANSFER_SYNTAX "1.2.840.10008.1.2.1"
+
+typedef bool (*DcmBuiltinDecodeFn)(DcmError **error,
+                                   const DcmFrame *frame,
+                                   char *buffer,
+                                   DcmFrameInfo *info,
+                                   uint32_t n_threads);
+
+struct BuiltinCodec {
+    const char *transfer_syntax_uid;
+    DcmBuiltinDecodeFn decode;
+};
+
+static DcmCodec codecs[DCM_MAX_CODECS];
+static int n_codecs = 0;
+
+
+/* The number of bytes of native pixels in a frame.
+ */
+static bool get_decoded_length(DcmError **error,
+                               const DcmFrame *frame,
+                               uint32_t *length)
+{
+    uint16_t bits_allocated = dcm_frame_get_bits_allocated(frame);
+    if (bits_allocated % 8 != 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Decoding Frame failed",
+                      "Bits allocated must be a multiple of 8");
+        return false;
+    }
+
+    uint64_t decoded_length = (uint64_t) dcm_frame_get_rows(frame) *
+        dcm_frame_get_columns(frame) *
+        dcm_frame_get_samples_per_pixel(frame) *
+        (bits_allocated / 8);
+    if (decoded_length == 0 || decoded_length > 0xffffffff) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Decoding Frame failed",
+                      "Bad Frame size");
+        return false;
+    }
+
+    *length = (uint32_t) decoded_length;
+
+    return true;
+}
+
+
+/* Native pixels can be big-endian or color-by-plane, and we need
+ * little-endian, color-by-pixel.
+ */
+static bool decode_native(DcmError **error,
+                          const DcmFrame *frame,
+                          char *buffer,
+                          DcmFrameInfo *info,
+                          uint32_t n_threads)
+{
+    const char *data = dcm_frame_get_value(frame);
+    uint32_t n_pixels = (uint32_t) info->rows * info->columns;
+    uint32_t samples_per_pixel = info->samples_per_pixel;
+    uint32_t bytes_per_sample = info->bits_allocated / 8;
+    bool big_endian = strcmp(dcm_frame_get_transfer_syntax_uid(frame),
+                             "1.2.840.10008.1.2.2") == 0;
+    bool planar = dcm_frame_get_planar_configuration(frame) == 1;
+
+    USED(n_threads);
+
+    if (dcm_frame_get_length(frame) < info->length) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Decoding Frame failed",
+                      "Frame is %u bytes, but should be %u bytes",
+                      dcm_frame_get_length(frame), info->length);
+        return false;
+    }
+
+    if (!big_endian && !planar) {
+        memcpy(buffer, data, info->length);
+        return true;
+    }
+
+    for (uint32_t sample = 0; sample < samples_per_pixel; sample++) {
+        for (uint32_t pixel = 0; pixel < n_pixels; pixel++) {
+            uint32_t from = planar ?
+                sample * n_pixels + pixel :
+                pixel * samples_per_pixel + sample;
+            uint32_t to = pixel * samples_per_pixel + sample;
+            const char *in = data + (uint64_t) from * bytes_per_sample;
+            char *out = buffer + (uint64_t) to * bytes_per_sample;
+
+            for (uint32_t byte = 0; byte < bytes_per_sample; byte++) {
+                out[byte] = big_endian ?
+                    in[bytes_per_sample - 1 - byte] : in[byte];
+            }
+        }
+    }
+
+    return true;
+}
+
+
+static bool decode_rle(DcmError **error,
+                       const DcmFrame *frame,
+                       char *buffer,
+                       DcmFrameInfo *info,
+                       uint32_t n_threads)
+{
+    return dcm_rle_decode(error,
+                          dcm_frame_get_value(frame),
+                          dcm_frame_get_length(frame),
+                          buffer,
+                          (uint32_t) info->rows * info->columns,
+                          info->samples_per_pixel,
+                          info->bits_allocated / 8,
+                          n_threads);
+}
+
+
+static const struct BuiltinCodec builtin_codecs[] = {
+    {"1.2.840.10008.1.2", decode_native},
+    {"1.2.840.10008.1.2.1", decode_native},
+    {"1.2.840.10008.1.2.1.99", decode_native},
+    {"1.2.840.10008.1.2.2", decode_native},
+    {"1.2.840.10008.1.2.5", decode_rle},
+};
+
+
+bool dcm_codec_register(DcmError **error, const DcmCodec *codec)
+{
+    if (codec->transfer_syntax_uid == NULL || codec->decode == NULL) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Registering codec failed",
+                      "Codec must have a transfer syntax and a decoder");
+        return false;
+    }
+
+    if (n_codecs == DCM_MAX_CODECS) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Registering codec failed",
+                      "Too many codecs, the limit is %d", DCM_MAX_CODECS);
+        return false;
+    }
+
+    codecs[n_codecs++] = *codec;
+
+    return true;
+}
+
+
+static const DcmCodec *find_codec(const char *transfer_syntax_uid)
+{
+    for (int i = n_codecs - 1; i >= 0; i--) {
+        if (strcmp(codecs[i].transfer_syntax_uid, transfer_syntax_uid) == 0) {
+            return &codecs[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static const struct BuiltinCodec *find_builtin_codec(const char *uid)
+{
+    int n = sizeof(builtin_codecs) / sizeof(builtin_codecs[0]);
+
+    for (int i = 0; i < n; i++) {
+        if (strcmp(builtin_codecs[i].transfer_syntax_uid, uid) == 0) {
+            return &builtin_codecs[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+bool dcm_codec_is_supported(const char *transfer_syntax_uid)
+{
+    return find_codec(transfer_syntax_uid) != NULL ||
+        find_builtin_codec(transfer_syntax_uid) != NULL;
+}
+
+
+static bool decode_into(DcmError **error,
+                        const DcmFrame *frame,
+                        char *buffer,
+                        uint32_t buffer_length,
+                        DcmFrameInfo *info,
+                        uint32_t n_threads)
+{
+    const char *transfer_syntax_uid = dcm_frame_get_transfer_syntax_uid(frame);
+
+    // the decoded frame, the codec can change the photometric interpretation
+    info->number = dcm_frame_get_number(frame);
+    info->rows = dcm_frame_get_rows(frame);
+    info->columns = dcm_frame_get_columns(frame);
+    info->samples_per_pixel = dcm_frame_get_samples_per_pixel(frame);
+    info->bits_allocated = dcm_frame_get_bits_allocated(frame);
+    info->bits_stored = dcm_frame_get_bits_stored(frame);
+    info->high_bit = dcm_frame_get_high_bit(frame);
+    info->pixel_representation = dcm_frame_get_pixel_representation(frame);
+    info->planar_configuration = 0;
+    info->photometric_interpretation =
+        dcm_frame_get_photometric_interpretation(frame);
+    info->transfer_syntax_uid = DECODED_TRANSFER_SYNTAX;
+    if (!get_decoded_length(error, frame, &info->length)) {
+        return false;
+    }
+
+    if (buffer == NULL) {
+        return true;
+    }
+
+    if (buffer_length < info->length) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Decoding Frame failed",
+                      "Buffer is %u bytes, but decoded Frame is %u bytes",
+                      buffer_length, info->length);
+        return false;
+    }
+
+    const DcmCodec *codec = find_codec(transfer_syntax_uid);
+    if (codec) {
+        return codec->decode(error,
+                             codec->client,
+                             frame,
+                             buffer,
+                             info->length,
+                             info);
+    }
+
+    const struct BuiltinCodec *builtin =
+        find_builtin_codec(transfer_syntax_uid);
+    if (builtin) {
+        return builtin->decode(error, frame, buffer, info, n_threads);
+    }
+
+    dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                  "Decoding Frame failed",
+                  "No codec for Transfer Syntax '%s'",
+                  transfer_syntax_uid);
+
+    return false;
+}
+
+
+bool dcm_frame_decode_into(DcmError **error,
+                           const DcmFrame *frame,
+                           char *buffer,
+                           uint32_t buffer_length,
+                           DcmFrameInfo *info)
+{
+    return decode_into(error, frame, buffer, buffer_length, info, 1);
+}
+
+
+DcmFrame *dcm_frame_decode_ex(DcmError **error,
+                              DcmFrame *frame,
+                              uint32_t n_threads)
+{
+    // frames which are already little-endian, color-by-pixel native need no
+    // work
+    if (find_codec(dcm_frame_get_transfer_syntax_uid(frame)) == NULL &&
+        dcm_frame_get_planar_configuration(frame) == 0 &&
+        (strcmp(dcm_frame_get_transfer_syntax_uid(frame),
+                "1.2.840.10008.1.2") == 0 ||
+         strcmp(dcm_frame_get_transfer_syntax_uid(frame),
+                "1.2.840.10008.1.2.1") == 0 ||
+         strcmp(dcm_frame_get_transfer_syntax_uid(frame),
+                "1.2.840.10008.1.2.1.99") == 0)) {
+        return dcm_frame_ref(frame);
+    }
+
+    DcmFrameInfo info;
+    if (!decode_into(error, frame, NULL, 0, &info, n_threads)) {
+        return NULL;
+    }
+
+    char *pixels = DCM_MALLOC(error, info.length);
+    if (pixels == NULL) {
+        return NULL;
+    }
+
+    if (!decode_into(error, frame, pixels, info.length, &info, n_threads)) {
+        free(pixels);
+        return NULL;
+    }
+
+    DcmFrame *decoded = dcm_frame_create(error,
+                                         info.number,
+                                         pixels,
+                                         info.length,
+                                         info.rows,
+                                         info.columns,
+                                         info.samples_per_pixel,
+                                         info.bits_allocated,
+                                         info.bits_stored,
+                                         info.pixel_representation,
+                                         info.planar_configuration,
+                                         info.photometric_interpretation,
+                                         info.transfer_syntax_uid);
+    if (decoded == NULL) {
+        free(pixels);
+        return NULL;
+    }
+
+    return decoded;
+}
+
+
+DcmFrame *dcm_frame_decode(DcmError **error, DcmFrame *frame)
+{
+    return dcm_frame_decode_ex(error, frame, 1);
+}
@@ -0,0 +1,799 @@
+/*
+ * Convert native frames to 8-bit greyscale or RGB for display.
+ *
+ * The two expensive steps, windowing 16-bit samples and YBR_FULL to RGB,
+ * have SIMD versions. On x86 with GCC or clang we build SSE4.1 and AVX2
+ * kernels and pick one at runtime, and on aarch64 we use NEON. The SIMD
+ * kernels use the same arithmetic as the scalar ones, so every path gives
+ * the same pixels.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_X86_SIMD
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON) && \
+    defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define USE_NEON
+#include <arm_neon.h>
+#endif
+
+/* YCbCr to RGB, see PS3.3 C.7.6.3.1.2. We work in 16-bit fixed point with
+ * two fraction bits, and the coefficients are Q15, with the integer part of
+ * 1.402 and 1.772 added separately. This is exactly what the SSE pmulhrsw
+ * and NEON sqrdmulh instructions compute.
+ */
+#define YBR_SHIFT (2)
+#define CR_TO_R (13173)     // 1.402 - 1
+#define CB_TO_G (11277)     // 0.344136
+#define CR_TO_G (23401)     // 0.714136
+#define CB_TO_B (25297)     // 1.772 - 1
+
+struct ConvertKernels {
+    void (*window16)(const char *in, uint8_t *out, uint32_t n,
+                     bool is_signed, uint16_t bits_stored,
+                     float scale, float offset);
+    void (*ybr_to_rgb)(const uint8_t *in, uint8_t *out, uint32_t n_pixels);
+};
+
+
+static uint8_t clamp_byte(int32_t value)
+{
+    return (uint8_t) (value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+
+static int32_t mulhrs(int32_t a, int32_t b)
+{
+    return (a * b + (1 << 14)) >> 15;
+}
+
+
+/* Map little-endian 16-bit samples through a linear window. Bits above
+ * bits_stored are masked off, or replaced by the sign bit.
+ */
+static void window16_scalar(const char *in,
+                            uint8_t *out,
+                            uint32_t n,
+                            bool is_signed,
+                            uint16_t bits_stored,
+                            float scale,
+                            float offset)
+{
+    const uint8_t *bytes = (const uint8_t *) in;
+    uint32_t shift = 32 - bits_stored;
+    uint32_t mask = (1u << bits_stored) - 1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t raw = (uint32_t) bytes[2 * i] |
+            (uint32_t) bytes[2 * i + 1] << 8;
+        int32_t value = is_signed ?
+            (int32_t) (raw << shift) >> shift :
+            (int32_t) (raw & mask);
+        float y = (float) value * scale + offset;
+
+        y = y < 0.0f ? 0.0f : y;
+        y = y > 255.0f ? 255.0f : y;
+        out[i] = (uint8_t) (y + 0.5f);
+    }
+}
+
+
+static void ybr_to_rgb_scalar(const uint8_t *in,
+                              uint8_t *out,
+                              uint32_t n_pixels)
+{
+    const int32_t round = 1 << (YBR_SHIFT - 1);
+
+    for (uint32_t i = 0; i < n_pixels; i++) {
+        int32_t y = (int32_t) in[3 * i] << YBR_SHIFT;
+        int32_t cb = ((int32_t) in[3 * i + 1] - 128) * (1 << YBR_SHIFT);
+        int32_t cr = ((int32_t) in[3 * i + 2] - 128) * (1 << YBR_SHIFT);
+        int32_t r = y + cr + mulhrs(cr, CR_TO_R);
+        int32_t g = y - mulhrs(cb, CB_TO_G) - mulhrs(cr, CR_TO_G);
+        int32_t b = y + cb + mulhrs(cb, CB_TO_B);
+
+        out[3 * i] = clamp_byte((r + round) >> YBR_SHIFT);
+        out[3 * i + 1] = clamp_byte((g + round) >> YBR_SHIFT);
+        out[3 * i + 2] = clamp_byte((b + round) >> YBR_SHIFT);
+    }
+}
+
+
+static const struct ConvertKernels kernels_scalar = {
+    window16_scalar,
+    ybr_to_rgb_scalar,
+};
+
+
+#ifdef USE_X86_SIMD
+/* pshufb masks to split 16 RGB pixels into three planes, and to join them
+ * again.
+ */
+static const int8_t split_masks[3][3][16] = {
+    {
+        {0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13},
+    },
+    {
+        {1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14},
+    },
+    {
+        {2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+        {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15},
+    },
+};
+
+static const int8_t join_masks[3][3][16] = {
+    {
+        {0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5},
+        {-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1},
+        {-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1},
+    },
+    {
+        {-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1},
+        {5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10},
+        {-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1},
+    },
+    {
+        {-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1},
+        {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1},
+        {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15},
+    },
+};
+
+
+__attribute__((target("sse4.1")))
+static __m128i load_mask(const int8_t *mask)
+{
+    return _mm_loadu_si128((const __m128i *) mask);
+}
+
+
+__attribute__((target("sse4.1")))
+static __m128i split_plane(__m128i a, __m128i b, __m128i c, int plane)
+{
+    return _mm_or_si128(
+        _mm_or_si128(_mm_shuffle_epi8(a, load_mask(split_masks[plane][0])),
+                     _mm_shuffle_epi8(b, load_mask(split_masks[plane][1]))),
+        _mm_shuffle_epi8(c, load_mask(split_masks[plane][2])));
+}
+
+
+__attribute__((target("sse4.1")))
+static __m128i join_chunk(__m128i r, __m128i g, __m128i b, int chunk)
+{
+    return _mm_or_si128(
+        _mm_or_si128(_mm_shuffle_epi8(r, load_mask(join_masks[chunk][0])),
+                     _mm_shuffle_epi8(g, load_mask(join_masks[chunk][1]))),
+        _mm_shuffle_epi8(b, load_mask(join_masks[chunk][2])));
+}
+
+
+/* Eight pixels of YBR as 16-bit lanes to 16-bit RGB, not yet shifted down.
+ */
+__attribute__((target("sse4.1")))
+static void ybr_to_rgb_8_sse41(__m128i y, __m128i cb, __m128i cr,
+                               __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i offset = _mm_set1_epi16(128);
+
+    y = _mm_slli_epi16(y, YBR_SHIFT);
+    cb = _mm_slli_epi16(_mm_sub_epi16(cb, offset), YBR_SHIFT);
+    cr = _mm_slli_epi16(_mm_sub_epi16(cr, offset), YBR_SHIFT);
+
+    *r = _mm_add_epi16(_mm_add_epi16(y, cr),
+                       _mm_mulhrs_epi16(cr, _mm_set1_epi16(CR_TO_R)));
+    *g = _mm_sub_epi16(_mm_sub_epi16(y,
+                                     _mm_mulhrs_epi16(cb,
+                                                      _mm_set1_epi16(CB_TO_G))),
+                       _mm_mulhrs_epi16(cr, _mm_set1_epi16(CR_TO_G)));
+    *b = _mm_add_epi16(_mm_add_epi16(y, cb),
+                       _mm_mulhrs_epi16(cb, _mm_set1_epi16(CB_TO_B)));
+}
+
+
+/* Round, shift down and saturate two sets of eight 16-bit lanes to bytes.
+ */
+__attribute__((target("sse4.1")))
+static __m128i narrow_sse41(__m128i low, __m128i high)
+{
+    const __m128i round = _mm_set1_epi16(1 << (YBR_SHIFT - 1));
+
+    low = _mm_srai_epi16(_mm_add_epi16(low, round), YBR_SHIFT);
+    high = _mm_srai_epi16(_mm_add_epi16(high, round), YBR_SHIFT);
+
+    return _mm_packus_epi16(low, high);
+}
+
+
+__attribute__((target("sse4.1")))
+static void ybr_to_rgb_sse41(const uint8_t *in,
+                             uint8_t *out,
+                             uint32_t n_pixels)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+
+    for (; i + 16 <= n_pixels; i += 16) {
+        const __m128i *chunks = (const __m128i *) (in + 3 * i);
+        __m128i a = _mm_loadu_si128(chunks);
+        __m128i b = _mm_loadu_si128(chunks + 1);
+        __m128i c = _mm_loadu_si128(chunks + 2);
+        __m128i y = split_plane(a, b, c, 0);
+        __m128i cb = split_plane(a, b, c, 1);
+        __m128i cr = split_plane(a, b, c, 2);
+        __m128i r[2];
+        __m128i g[2];
+        __m128i bl[2];
+
+        ybr_to_rgb_8_sse41(_mm_unpacklo_epi8(y, zero),
+                           _mm_unpacklo_epi8(cb, zero),
+                           _mm_unpacklo_epi8(cr, zero),
+                           &r[0], &g[0], &bl[0]);
+        ybr_to_rgb_8_sse41(_mm_unpackhi_epi8(y, zero),
+                           _mm_unpackhi_epi8(cb, zero),
+                           _mm_unpackhi_epi8(cr, zero),
+                           &r[1], &g[1], &bl[1]);
+
+        __m128i red = narrow_sse41(r[0], r[1]);
+        __m128i green = narrow_sse41(g[0], g[1]);
+        __m128i blue = narrow_sse41(bl[0], bl[1]);
+
+        __m128i *result = (__m128i *) (out + 3 * i);
+        _mm_storeu_si128(result, join_chunk(red, green, blue, 0));
+        _mm_storeu_si128(result + 1, join_chunk(red, green, blue, 1));
+        _mm_storeu_si128(result + 2, join_chunk(red, green, blue, 2));
+    }
+
+    ybr_to_rgb_scalar(in + 3 * i, out + 3 * i, n_pixels - i);
+}
+
+
+__attribute__((target("sse4.1")))
+static __m128i window4_sse41(__m128i value, __m128 scale, __m128 offset)
+{
+    __m128 y = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(value), scale), offset);
+
+    y = _mm_max_ps(y, _mm_setzero_ps());
+    y = _mm_min_ps(y, _mm_set1_ps(255.0f));
+
+    return _mm_cvttps_epi32(_mm_add_ps(y, _mm_set1_ps(0.5f)));
+}
+
+
+__attribute__((target("sse4.1")))
+static void window16_sse41(const char *in,
+                           uint8_t *out,
+                           uint32_t n,
+                           bool is_signed,
+                           uint16_t bits_stored,
+                           float scale,
+                           float offset)
+{
+    const __m128 scale4 = _mm_set1_ps(scale);
+    const __m128 offset4 = _mm_set1_ps(offset);
+    const __m128i mask = _mm_set1_epi16((short) ((1u << bits_stored) - 1));
+    const __m128i shift = _mm_cvtsi32_si128(16 - bits_stored);
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + 2 * i));
+        __m128i low;
+        __m128i high;
+
+        if (is_signed) {
+            v = _mm_sra_epi16(_mm_sll_epi16(v, shift), shift);
+            low = _mm_cvtepi16_epi32(v);
+            high = _mm_cvtepi16_epi32(_mm_srli_si128(v, 8));
+        } else {
+            v = _mm_and_si128(v, mask);
+            low = _mm_cvtepu16_epi32(v);
+            high = _mm_cvtepu16_epi32(_mm_srli_si128(v, 8));
+        }
+
+        __m128i result = _mm_packs_epi32(window4_sse41(low, scale4, offset4),
+                                         window4_sse41(high, scale4, offset4));
+        _mm_storel_epi64((__m128i *) (out + i),
+                         _mm_packus_epi16(result, result));
+    }
+
+    window16_scalar(in + 2 * i, out + i, n - i,
+                    is_signed, bits_stored, scale, offset);
+}
+
+
+__attribute__((target("avx2")))
+static __m256i window8_avx2(__m256i value, __m256 scale, __m256 offset)
+{
+    __m256 y = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(value), scale),
+                             offset);
+
+    y = _mm256_max_ps(y, _mm256_setzero_ps());
+    y = _mm256_min_ps(y, _mm256_set1_ps(255.0f));
+
+    return _mm256_cvttps_epi32(_mm256_add_ps(y, _mm256_set1_ps(0.5f)));
+}
+
+
+__attribute__((target("avx2")))
+static void window16_avx2(const char *in,
+                          uint8_t *out,
+                          uint32_t n,
+                          bool is_signed,
+                          uint16_t bits_stored,
+                          float scale,
+                          float offset)
+{
+    const __m256 scale8 = _mm256_set1_ps(scale);
+    const __m256 offset8 = _mm256_set1_ps(offset);
+    const __m256i mask = _mm256_set1_epi16((short) ((1u << bits_stored) - 1));
+    const __m128i shift = _mm_cvtsi32_si128(16 - bits_stored);
+    uint32_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in + 2 * i));
+        __m256i low;
+        __m256i high;
+
+        if (is_signed) {
+            v = _mm256_sra_epi16(_mm256_sll_epi16(v, shift), shift);
+            low = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(v));
+            high = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1));
+        } else {
+            v = _mm256_and_si256(v, mask);
+            low = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v));
+            high = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1));
+        }
+
+        // packs works within 128-bit lanes, so put the lanes back in order
+        __m256i words = _mm256_packs_epi32(window8_avx2(low, scale8, offset8),
+                                           window8_avx2(high,
+                                                        scale8,
+                                                        offset8));
+        words = _mm256_permute4x64_epi64(words, 0xd8);
+        __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words),
+                                         _mm256_extracti128_si256(words, 1));
+        _mm_storeu_si128((__m128i *) (out + i), bytes);
+    }
+
+    window16_scalar(in + 2 * i, out + i, n - i,
+                    is_signed, bits_stored, scale, offset);
+}
+
+
+static const struct ConvertKernels kernels_sse41 = {
+    window16_sse41,
+    ybr_to_rgb_sse41,
+};
+
+// pshufb can't cross 128-bit lanes, so AVX2 is no help splitting planes
+static const struct ConvertKernels kernels_avx2 = {
+    window16_avx2,
+    ybr_to_rgb_sse41,
+};
+#endif
+
+
+#ifdef USE_NEON
+static void ybr_to_rgb_neon(const uint8_t *in,
+                            uint8_t *out,
+                            uint32_t n_pixels)
+{
+    const int16x8_t offset = vdupq_n_s16(128);
+    uint32_t i = 0;
+
+    for (; i + 8 <= n_pixels; i += 8) {
+        uint8x8x3_t ybr = vld3_u8(in + 3 * i);
+        int16x8_t y = vreinterpretq_s16_u16(vmovl_u8(ybr.val[0]));
+        int16x8_t cb = vreinterpretq_s16_u16(vmovl_u8(ybr.val[1]));
+        int16x8_t cr = vreinterpretq_s16_u16(vmovl_u8(ybr.val[2]));
+
+        y = vshlq_n_s16(y, YBR_SHIFT);
+        cb = vshlq_n_s16(vsubq_s16(cb, offset), YBR_SHIFT);
+        cr = vshlq_n_s16(vsubq_s16(cr, offset), YBR_SHIFT);
+
+        int16x8_t r = vaddq_s16(vaddq_s16(y, cr),
+                                vqrdmulhq_n_s16(cr, CR_TO_R));
+        int16x8_t g = vsubq_s16(vsubq_s16(y, vqrdmulhq_n_s16(cb, CB_TO_G)),
+                                vqrdmulhq_n_s16(cr, CR_TO_G));
+        int16x8_t b = vaddq_s16(vaddq_s16(y, cb),
+                                vqrdmulhq_n_s16(cb, CB_TO_B));
+
+        uint8x8x3_t rgb;
+        rgb.val[0] = vqrshrun_n_s16(r, YBR_SHIFT);
+        rgb.val[1] = vqrshrun_n_s16(g, YBR_SHIFT);
+        rgb.val[2] = vqrshrun_n_s16(b, YBR_SHIFT);
+        vst3_u8(out + 3 * i, rgb);
+    }
+
+    ybr_to_rgb_scalar(in + 3 * i, out + 3 * i, n_pixels - i);
+}
+
+
+static uint32x4_t window4_neon(float32x4_t value,
+                               float32x4_t scale,
+                               float32x4_t offset)
+{
+    float32x4_t y = vaddq_f32(vmulq_f32(value, scale), offset);
+
+    y = vmaxq_f32(y, vdupq_n_f32(0.0f));
+    y = vminq_f32(y, vdupq_n_f32(255.0f));
+
+    return vcvtq_u32_f32(vaddq_f32(y, vdupq_n_f32(0.5f)));
+}
+
+
+static void window16_neon(const char *in,
+                          uint8_t *out,
+                          uint32_t n,
+                          bool is_signed,
+                          uint16_t bits_stored,
+                          float scale,
+                          float offset)
+{
+    const float32x4_t scale4 = vdupq_n_f32(scale);
+    const float32x4_t offset4 = vdupq_n_f32(offset);
+    const uint16x8_t mask = vdupq_n_u16((uint16_t) ((1u << bits_stored) - 1));
+    const int16x8_t left = vdupq_n_s16((int16_t) (16 - bits_stored));
+    const int16x8_t right = vdupq_n_s16((int16_t) (bits_stored - 16));
+    uint32_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vld1q_u16((const uint16_t *) (in + 2 * i));
+        float32x4_t low;
+        float32x4_t high;
+
+        if (is_signed) {
+            int16x8_t s = vshlq_s16(vshlq_s16(vreinterpretq_s16_u16(v), left),
+                                    right);
+            low = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+            high = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+        } else {
+            v = vandq_u16(v, mask);
+            low = vcvtq_f32_u32(vmovl_u16(vget_low_u16(v)));
+            high = vcvtq_f32_u32(vmovl_u16(vget_high_u16(v)));
+        }
+
+        uint16x8_t words = vcombine_u16(
+            vmovn_u32(window4_neon(low, scale4, offset4)),
+            vmovn_u32(window4_neon(high, scale4, offset4)));
+        vst1_u8(out + i, vmovn_u16(words));
+    }
+
+    window16_scalar(in + 2 * i, out + i, n - i,
+                    is_signed, bits_stored, scale, offset);
+}
+
+
+static const struct ConvertKernels kernels_neon = {
+    window16_neon,
+    ybr_to_rgb_neon,
+};
+#endif
+
+
+static const struct ConvertKernels *get_kernels(void)
+{
+#ifdef USE_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return &kernels_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return &kernels_sse41;
+    }
+#endif
+#ifdef USE_NEON
+    return &kernels_neon;
+#endif
+
+    return &kernels_scalar;
+}
+
+
+static void lut8(const uint8_t *in,
+                 uint8_t *out,
+                 uint32_t n,
+                 const uint8_t *lut)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        out[i] = lut[in[i]];
+    }
+}
+
+
+/* Rec. 601 luma.
+ */
+static void rgb_to_grey(const uint8_t *in, uint8_t *out, uint32_t n_pixels)
+{
+    for (uint32_t i = 0; i < n_pixels; i++) {
+        uint32_t r = in[3 * i];
+        uint32_t g = in[3 * i + 1];
+        uint32_t b = in[3 * i + 2];
+
+        out[i] = (uint8_t) ((77 * r + 150 * g + 29 * b + 128) >> 8);
+    }
+}
+
+
+static void grey_to_rgb(const uint8_t *in, uint8_t *out, uint32_t n_pixels)
+{
+    for (uint32_t i = 0; i < n_pixels; i++) {
+        out[3 * i] = in[i];
+        out[3 * i + 1] = in[i];
+        out[3 * i + 2] = in[i];
+    }
+}
+
+
+static void first_sample(const uint8_t *in, uint8_t *out, uint32_t n_pixels)
+{
+    for (uint32_t i = 0; i < n_pixels; i++) {
+        out[i] = in[3 * i];
+    }
+}
+
+
+
+/* Find the scale and offset for the linear VOI LUT function, see PS3.3
+ * C.11.2.1.2. MONOCHROME1 is inverted.
+ */
+static void get_window(const DcmFrame *frame,
+                       double center,
+                       double width,
+                       float *scale,
+                       float *offset)
+{
+    if (width <= 0) {
+        // the full range of stored values
+        uint16_t bits_stored = dcm_frame_get_bits_stored(frame);
+        double low = dcm_frame_get_pixel_representation(frame) ?
+            -(double) (1 << (bits_stored - 1)) : 0.0;
+        width = (double) (1u << bits_stored);
+        center = low + width / 2;
+    }
+
+    double range = MAX(width - 1, 1.0);
+    double a = 255.0 / range;
+    double b = ((center - 0.5) / -range + 0.5) * 255.0;
+
+    if (strcmp(dcm_frame_get_photometric_interpretation(frame),
+               "MONOCHROME1") == 0) {
+        a = -a;
+        b = 255.0 - b;
+    }
+
+    *scale = (float) a;
+    *offset = (float) b;
+}
+
+
+static void build_lut8(const DcmFrame *frame,
+                       float scale,
+                       float offset,
+                       uint8_t *lut)
+{
+    bool is_signed = dcm_frame_get_pixel_representation(frame) == 1;
+
+    for (int i = 0; i < 256; i++) {
+        int value = is_signed ? (int8_t) i : i;
+        float y = (float) value * scale + offset;
+
+        y = y < 0.0f ? 0.0f : y > 255.0f ? 255.0f : y;
+        lut[i] = (uint8_t) (y + 0.5f);
+    }
+}
+
+
+static bool is_monochrome(const char *photometric_interpretation)
+{
+    return strcmp(photometric_interpretation, "MONOCHROME1") == 0 ||
+        strcmp(photometric_interpretation, "MONOCHROME2") == 0;
+}
+
+
+/* Convert a decoded frame. */
+static DcmFrame *convert(DcmError **error,
+                         DcmFrame *frame,
+                         DcmPixelFormat format,
+                         double window_center,
+                         double window_width)
+{
+    const struct ConvertKernels *kernels = get_kernels();
+    const char *photometric = dcm_frame_get_photometric_interpretation(frame);
+    uint16_t samples_per_pixel = dcm_frame_get_samples_per_pixel(frame);
+    uint16_t bits_allocated = dcm_frame_get_bits_allocated(frame);
+    uint32_t n_pixels = (uint32_t) dcm_frame_get_rows(frame) *
+        dcm_frame_get_columns(frame);
+    bool mono = is_monochrome(photometric);
+    bool ybr = strcmp(photometric, "YBR_FULL") == 0;
+
+    if (!(mono && samples_per_pixel == 1) &&
+        !((ybr || strcmp(photometric, "RGB") == 0) &&
+          samples_per_pixel == 3)) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Converting Frame failed",
+                      "Photometric Interpretation '%s' with %u samples "
+                      "per pixel is not supported",
+                      photometric, samples_per_pixel);
+        return NULL;
+    }
+
+    if (bits_allocated != 8 && bits_allocated != 16) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Converting Frame failed",
+                      "Bits allocated must be 8 or 16");
+        return NULL;
+    }
+
+    if (dcm_frame_get_bits_stored(frame) == 0 ||
+        dcm_frame_get_bits_stored(frame) > bits_allocated) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Converting Frame failed",
+                      "Bad number of bits stored");
+        return NULL;
+    }
+
+    uint16_t out_samples = format == DCM_PIXEL_FORMAT_RGB8 ? 3 : 1;
+
+    // frame lengths are 32 bits, so larger frames can't exist
+    uint64_t in_length = (uint64_t) n_pixels * samples_per_pixel *
+        (bits_allocated / 8);
+    uint64_t out_length = (uint64_t) n_pixels * out_samples;
+    if (in_length > UINT32_MAX || out_length > UINT32_MAX) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Converting Frame failed",
+                      "Frame is too large");
+        return NULL;
+    }
+    uint32_t n_samples = n_pixels * samples_per_pixel;
+    uint32_t length = (uint32_t) out_length;
+
+    if (dcm_frame_get_length(frame) < in_length) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Converting Frame failed",
+                      "Frame is too short");
+        return NULL;
+    }
+
+    bool needs_window = bits_allocated == 16 ||
+        window_width > 0 ||
+        strcmp(photometric, "MONOCHROME1") == 0 ||
+        dcm_frame_get_pixel_representation(frame) == 1;
+
+    // already in the requested format
+    if (!needs_window &&
+        ((format == DCM_PIXEL_FORMAT_GREY8 && mono) ||
+         (format == DCM_PIXEL_FORMAT_RGB8 && !mono && !ybr))) {
+        return dcm_frame_ref(frame);
+    }
+
+    // first get 8-bit samples, with the window applied
+    const uint8_t *samples = (const uint8_t *) dcm_frame_get_value(frame);
+    uint8_t *windowed = NULL;
+    if (needs_window) {
+        float scale;
+        float offset;
+        get_window(frame, window_center, window_width, &scale, &offset);
+
+        windowed = DCM_MALLOC(error, n_samples);
+        if (windowed == NULL) {
+            return NULL;
+        }
+
+        if (bits_allocated == 16) {
+            kernels->window16(dcm_frame_get_value(frame),
+                              windowed,
+                              n_samples,
+                              dcm_frame_get_pixel_representation(frame) == 1,
+                              dcm_frame_get_bits_stored(frame),
+                              scale,
+                              offset);
+        } else {
+            uint8_t lut[256];
+            build_lut8(frame, scale, offset, lut);
+            lut8(samples, windowed, n_samples, lut);
+        }
+
+        samples = windowed;
+    }
+
+    uint8_t *pixels = DCM_MALLOC(error, length);
+    if (pixels == NULL) {
+        free(windowed);
+        return NULL;
+    }
+
+    if (format == DCM_PIXEL_FORMAT_RGB8) {
+        if (mono) {
+            grey_to_rgb(samples, pixels, n_pixels);
+        } else if (ybr) {
+            kernels->ybr_to_rgb(samples, pixels, n_pixels);
+        } else {
+            memcpy(pixels, samples, length);
+        }
+    } else {
+        if (mono) {
+            memcpy(pixels, samples, length);
+        } else if (ybr) {
+            // Y is the luma
+            first_sample(samples, pixels, n_pixels);
+        } else {
+            rgb_to_grey(samples, pixels, n_pixels);
+        }
+    }
+
+    free(windowed);
+
+    DcmFrame *converted = dcm_frame_create(error,
+                                           dcm_frame_get_number(frame),
+                                           (char *) pixels,
+                                           length,
+                                           dcm_frame_get_rows(frame),
+                                           dcm_frame_get_columns(frame),
+                                           out_samples,
+                                           8,
+                                           8,
+                                           0,
+                                           0,
+                                           out_samples == 3 ?
+                                               "RGB" : "MONOCHROME2",
+                                           "1.2.840.10008.1.2.1");
+    if (converted == NULL) {
+        free(pixels);
+        return NULL;
+    }
+
+    return converted;
+}
+
+
+DcmFrame *dcm_frame_convert_ex(DcmError **error,
+                               DcmFrame *frame,
+                               DcmPixelFormat format,
+                               double window_center,
+                               double window_width)
+{
+    if (format != DCM_PIXEL_FORMAT_GREY8 && format != DCM_PIXEL_FORMAT_RGB8) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Converting Frame failed",
+                      "Unknown pixel format %d", (int) format);
+        return NULL;
+    }
+
+    // get little-endian, color-by-pixel native samples
+    DcmFrame *decoded = dcm_frame_decode(error, frame);
+    if (decoded == NULL) {
+        return NULL;
+    }
+
+    DcmFrame *converted = convert(error,
+                                  decoded,
+                                  format,
+                                  window_center,
+                                  window_width);
+    dcm_frame_unref(decoded);
+
+    return converted;
+}
+
+
+DcmFrame *dcm_frame_convert(DcmError **error,
+                            DcmFrame *frame,
+                            DcmPixelFormat format)
+{
+    return dcm_frame_convert_ex(error, frame, format, 0.0, 0.0);
+}
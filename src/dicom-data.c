@@ -19,9 +19,6 @@
 #include <string.h>
 #include <inttypes.h>
 
-#include "utarray.h"
-#include "uthash.h"
-
 #include <dicom/dicom.h>
 #include "pdicom.h"
 
@@ -33,6 +30,9 @@ struct _DcmElement {
     uint32_t vm;
     bool assigned;
 
+    // the size of a binary value, length is padded to even
+    uint32_t binary_length;
+
     // Store values for multiplicity 1 (the most common case)
     // inside the element to reduce malloc/frees during build
     union {
@@ -78,23 +78,79 @@ struct _DcmElement {
     char **value_pointer_array;
     DcmSequence *sequence_pointer;
 
-    UT_hash_handle hh;
+    // clones share a locked sequence, and hold a ref to it
+    DcmSequence *shared_sequence;
+
+    // set for elements parsed from a file, the value is in the arena too
+    DcmArena *arena;
 };
 
 
 struct _DcmSequence {
-    UT_array *items;
+    DcmDataSet **items;
+    uint32_t n_items;
+    uint32_t capacity;
+    DcmArena *arena;
     bool is_locked;
+
+    // sequences not in an arena can be shared by element clones
+    int32_t refcount;
+
+    // lazy sequences keep the raw bytes of each item, and only parse an item
+    // the first time it is used ... is_parsed is set atomically once
+    // items[i] is valid
+    bool is_lazy;
+    bool implicit;
+    const char *value;
+    const uint32_t *item_offsets;
+    int32_t *is_parsed;
+};
+
+
+/* Data Sets keep their elements sorted by tag, so lookup is a binary search
+ * and iteration is in tag order. We keep a copy of the tag next to each
+ * element pointer so the search only touches this array.
+ */
+struct DataSetEntry {
+    uint32_t tag;
+
+    // the element belongs to the data set we were cloned from
+    bool is_shared;
+
+    DcmElement *element;
 };
 
 
 struct _DcmDataSet {
-    DcmElement *elements;
+    struct DataSetEntry *entries;
+    uint32_t n_entries;
+    uint32_t capacity;
     bool is_locked;
+
+    // set for data sets parsed from a file ... the root of an arena tree
+    // holds a ref to the arena
+    DcmArena *arena;
+    bool owns_arena;
+
+    // data sets not in an arena can be shared by clones
+    int32_t refcount;
+
+    // clones of locked data sets hold a ref to the data set they were
+    // cloned from, and use its entries until they are changed
+    DcmDataSet *shared;
+    bool borrows_entries;
 };
 
 
 struct _DcmFrame {
+    // frames can be shared, for example with a frame cache
+    int32_t refcount;
+
+    // set for frames which wrap memory we don't own
+    bool external;
+    DcmFrameReleaseFn release;
+    void *release_client;
+
     uint32_t number;
     const char *data;
     uint32_t length;
@@ -111,63 +167,169 @@ struct _DcmFrame {
 };
 
 
-struct SequenceItem {
-    DcmDataSet *dataset;
-};
+/* Objects in an arena are kept alive by a ref to the arena, others by
+ * their own refcount.
+ */
+static DcmSequence *sequence_retain(DcmSequence *seq)
+{
+    if (seq->arena) {
+        dcm_arena_ref(seq->arena);
+    } else {
+        dcm_atomic_add(&seq->refcount, 1);
+    }
+
+    return seq;
+}
 
 
-static struct SequenceItem *create_sequence_item(DcmError **error,
-                                                 DcmDataSet *dataset)
+static void sequence_release(DcmSequence *seq)
 {
-    struct SequenceItem *seq_item = DCM_NEW(error, struct SequenceItem);
-    if (seq_item == NULL) {
-        return NULL;
+    if (seq->arena) {
+        dcm_arena_unref(seq->arena);
+    } else {
+        dcm_sequence_destroy(seq);
+    }
+}
+
+
+static DcmDataSet *dataset_retain(DcmDataSet *dataset)
+{
+    if (dataset->arena) {
+        dcm_arena_ref(dataset->arena);
+    } else {
+        dcm_atomic_add(&dataset->refcount, 1);
+    }
+
+    return dataset;
+}
+
+
+static void dataset_release(DcmDataSet *dataset)
+{
+    if (dataset->arena) {
+        dcm_arena_unref(dataset->arena);
+    } else {
+        dcm_dataset_destroy(dataset);
+    }
+}
+
+
+/* Elements in an arena allocate their values from the arena.
+ */
+static void *element_alloc(DcmError **error, DcmElement *element, size_t size)
+{
+    if (element->arena) {
+        return dcm_arena_alloc(error,
+                               element->arena,
+                               DCM_ARENA_USE_VALUES,
+                               size);
     }
-    seq_item->dataset = dataset;
-    dcm_dataset_lock(seq_item->dataset);
-    return seq_item;
+
+    return DCM_MALLOC(error, size);
 }
 
 
-static void copy_sequence_item_icd(void *_dst_item, const void *_src_item)
+/* Arenas can intern short strings, since they often repeat. We key
+ * single strings and packed multi-valued strings separately.
+ */
+#define INTERN_MAX_LENGTH (128)
+#define INTERN_STRING (0)
+#define INTERN_STRING_MULTI (1)
+
+
+static bool element_can_intern(const DcmElement *element, const char *str)
 {
-    struct SequenceItem *dst_seq_item = (struct SequenceItem *) _dst_item;
-    struct SequenceItem *src_seq_item = (struct SequenceItem *) _src_item;
-    dst_seq_item->dataset = src_seq_item->dataset;
-    dcm_dataset_lock(dst_seq_item->dataset);
+    if (element->arena == NULL ||
+        !dcm_arena_get_intern(element->arena) ||
+        strlen(str) > INTERN_MAX_LENGTH) {
+        return false;
+    }
+
+    // codes, names and UIDs repeat, but numbers, dates and times are
+    // usually different for each frame, and interning them would cost more
+    // than it saves
+    switch (element->vr) {
+        case DCM_VR_AE:
+        case DCM_VR_AS:
+        case DCM_VR_CS:
+        case DCM_VR_LO:
+        case DCM_VR_PN:
+        case DCM_VR_SH:
+        case DCM_VR_UI:
+            return true;
+
+        default:
+            return false;
+    }
 }
 
 
-static void destroy_sequence_item_icd(void *_item)
+static char *element_strdup(DcmError **error,
+                            DcmElement *element,
+                            const char *str)
 {
-    if (_item) {
-        struct SequenceItem *seq_item = (struct SequenceItem *) _item;
-        if (seq_item) {
-            if (seq_item->dataset) {
-                dcm_dataset_destroy(seq_item->dataset);
-                seq_item->dataset = NULL;
+    if (element_can_intern(element, str)) {
+        char *value = dcm_arena_intern_lookup(element->arena,
+                                              INTERN_STRING,
+                                              str);
+        if (value == NULL) {
+            value = dcm_arena_strdup(error, element->arena, str);
+            if (value == NULL ||
+                !dcm_arena_intern_add(error,
+                                      element->arena,
+                                      INTERN_STRING,
+                                      value,
+                                      value)) {
+                return NULL;
             }
-            // utarray frees the memory of the item itself
         }
+
+        return value;
     }
-}
 
+    if (element->arena) {
+        return dcm_arena_strdup(error, element->arena, str);
+    }
 
-static UT_icd sequence_item_icd = {
-    sizeof(struct SequenceItem),
-    NULL,
-    copy_sequence_item_icd,
-    destroy_sequence_item_icd
-};
+    return dcm_strdup(error, str);
+}
 
 
-static int compare_tags(const void *a, const void *b)
+/* Multi-valued strings are a single block: the array of pointers, then
+ * the strings themselves.
+ */
+static char **element_pack_strings(DcmError **error,
+                                   DcmElement *element,
+                                   char **values,
+                                   uint32_t vm)
 {
-   return ( *(uint32_t*)a - *(uint32_t*)b );
+    size_t size = vm * sizeof(char *);
+    for (uint32_t i = 0; i < vm; i++) {
+        size += strlen(values[i]) + 1;
+    }
+
+    char **block = element_alloc(error, element, size);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    char *p = (char *) (block + vm);
+    for (uint32_t i = 0; i < vm; i++) {
+        size_t length = strlen(values[i]) + 1;
+
+        memcpy(p, values[i], length);
+        block[i] = p;
+        p += length;
+    }
+
+    return block;
 }
 
 
-DcmElement *dcm_element_create(DcmError **error, uint32_t tag, DcmVR vr)
+static DcmElement *element_create(DcmError **error,
+                                  DcmArena *arena,
+                                  uint32_t tag,
+                                  DcmVR vr)
 {
     if (!dcm_is_valid_vr_for_tag(vr, tag)) {
         dcm_error_set(error, DCM_ERROR_CODE_INVALID,
@@ -178,24 +340,52 @@ DcmElement *dcm_element_create(DcmError **error, uint32_t tag, DcmVR vr)
         return NULL;
     }
 
-    DcmElement *element = DCM_NEW(error, DcmElement);
+    DcmElement *element = arena ?
+        dcm_arena_alloc(error,
+                        arena,
+                        DCM_ARENA_USE_ELEMENTS,
+                        sizeof(DcmElement)) :
+        DCM_NEW(error, DcmElement);
     if (element == NULL) {
         return NULL;
     }
     element->tag = tag;
     element->vr = vr;
+    element->arena = arena;
 
     return element;
 }
 
 
+DcmElement *dcm_element_create(DcmError **error, uint32_t tag, DcmVR vr)
+{
+    return element_create(error, NULL, tag, vr);
+}
+
+
+DcmElement *dcm_element_create_in_arena(DcmError **error,
+                                        DcmArena *arena,
+                                        uint32_t tag,
+                                        DcmVR vr)
+{
+    return element_create(error, arena, tag, vr);
+}
+
+
 void dcm_element_destroy(DcmElement *element)
 {
     if (element) {
         dcm_log_debug("Destroy Data Element '%08x'.", element->tag);
+        // freed with the arena
+        if (element->arena) {
+            return;
+        }
         if(element->sequence_pointer) {
             dcm_sequence_destroy(element->sequence_pointer);
         }
+        if(element->shared_sequence) {
+            sequence_release(element->shared_sequence);
+        }
         if(element->value_pointer) {
             free(element->value_pointer);
         }
@@ -249,6 +439,12 @@ uint32_t dcm_element_get_length(const DcmElement *element)
 }
 
 
+uint32_t dcm_element_get_binary_length(const DcmElement *element)
+{
+    return element->binary_length;
+}
+
+
 // check, set, get string value representations
 
 static bool element_check_index(DcmError **error,
@@ -423,29 +619,15 @@ static void element_set_length(DcmElement *element, uint32_t length)
 }
 
 
-bool dcm_element_set_value_string_multi(DcmError **error,
-                                        DcmElement *element,
-                                        char **values,
-                                        uint32_t vm,
-                                        bool steal)
+/* Set a string value we already own, with no copy.
+ */
+static bool element_assign_strings(DcmError **error,
+                                   DcmElement *element,
+                                   char **values,
+                                   uint32_t vm)
 {
-    if (!element_check_not_assigned(error, element) ||
-        !element_check_string(error, element)) {
-        return false;
-    }
-
     if (vm == 1) {
-        if (steal) {
-            element->value.single.str = values[0];
-        } else {
-            char *value_copy = dcm_strdup(error, values[0]);
-            if (value_copy == NULL) {
-                return false;
-            }
-
-            element->value.single.str = value_copy;
-            element->value_pointer = value_copy;
-        }
+        element->value.single.str = values[0];
     } else {
         DcmVRClass vr_class = dcm_dict_vr_class(element->vr);
         if (vr_class != DCM_VR_CLASS_STRING_MULTI) {
@@ -457,23 +639,7 @@ bool dcm_element_set_value_string_multi(DcmError **error,
             return false;
         }
 
-        if (steal) {
-            element->value.multi.str = values;
-        } else {
-            char **values_copy = DCM_NEW_ARRAY(error, vm, char *);
-            if (values_copy == NULL) {
-                return false;
-            }
-            element->value.multi.str = values_copy;
-            element->value_pointer_array = values_copy;
-
-            for (uint32_t i = 0; i < vm; i++) {
-                values_copy[i] = dcm_strdup(error, values[i]);
-                if (values_copy[i] == NULL) {
-                    return false;
-                }
-            }
-        }
+        element->value.multi.str = values;
     }
 
     element->vm = vm;
@@ -488,49 +654,108 @@ bool dcm_element_set_value_string_multi(DcmError **error,
     }
     element_set_length(element, length);
 
-    if (!dcm_element_validate(error, element)) {
+    return dcm_element_validate(error, element);
+}
+
+
+bool dcm_element_set_value_string_multi(DcmError **error,
+                                        DcmElement *element,
+                                        char **values,
+                                        uint32_t vm,
+                                        bool steal)
+{
+    if (!element_check_not_assigned(error, element) ||
+        !element_check_string(error, element)) {
         return false;
     }
 
     if (steal) {
+        if (!element_assign_strings(error, element, values, vm)) {
+            return false;
+        }
+
         element->value_pointer_array = values;
+
+        return true;
     }
 
-    return true;
+    if (vm == 1) {
+        char *value_copy = element_strdup(error, element, values[0]);
+        if (value_copy == NULL) {
+            return false;
+        }
+        element->value_pointer = value_copy;
+
+        return element_assign_strings(error, element, &value_copy, 1);
+    }
+
+    char **values_copy = element_pack_strings(error, element, values, vm);
+    if (values_copy == NULL) {
+        return false;
+    }
+    element->value_pointer = values_copy;
+
+    return element_assign_strings(error, element, values_copy, vm);
 }
 
 
+/* Split a multi-valued string into a packed block, see
+ * element_pack_strings().
+ */
 static char **dcm_parse_character_string(DcmError **error,
-                                         char *string, uint32_t *vm)
+                                         DcmElement *element,
+                                         const char *string,
+                                         uint32_t *vm)
 {
-    int n_segments = 1;
+    uint32_t n_segments = 1;
     for (int i = 0; string[i]; i++) {
         if (string[i] == '\\') {
             n_segments += 1;
         }
     }
 
-    char **parts = DCM_NEW_ARRAY(error, n_segments, char *);
+    bool intern = element_can_intern(element, string);
+    if (intern) {
+        char **parts = dcm_arena_intern_lookup(element->arena,
+                                               INTERN_STRING_MULTI,
+                                               string);
+        if (parts) {
+            *vm = n_segments;
+            return parts;
+        }
+    }
+
+    size_t length = strlen(string);
+    char **parts = element_alloc(error,
+                                 element,
+                                 n_segments * sizeof(char *) + length + 1);
     if (parts == NULL) {
         return NULL;
     }
 
-    char *p = string;
-    for (int segment = 0; segment < n_segments; segment++) {
-        int i;
-        for (i = 0; p[i] && p[i] != '\\'; i++)
-            ;
+    char *p = (char *) (parts + n_segments);
+    memcpy(p, string, length + 1);
+    for (uint32_t segment = 0; segment < n_segments; segment++) {
+        parts[segment] = p;
 
-        parts[segment] = DCM_MALLOC(error, i + 1);
-        if (parts[segment] == NULL) {
-            dcm_free_string_array(parts, n_segments);
-            return NULL;
+        p = strchr(p, '\\');
+        if (p) {
+            *p++ = '\0';
         }
+    }
 
-        strncpy(parts[segment], p, i);
-        parts[segment][i] = '\0';
-
-        p += i + 1;
+    if (intern) {
+        // single values can use the copy in the block as the key
+        char *key = n_segments == 1 ?
+            parts[0] : dcm_arena_strdup(error, element->arena, string);
+        if (key == NULL ||
+            !dcm_arena_intern_add(error,
+                                  element->arena,
+                                  INTERN_STRING_MULTI,
+                                  key,
+                                  parts)) {
+            return NULL;
+        }
     }
 
     *vm = n_segments;
@@ -552,35 +777,42 @@ bool dcm_element_set_value_string(DcmError **error,
     DcmVRClass vr_class = dcm_dict_vr_class(element->vr);
     if (vr_class == DCM_VR_CLASS_STRING_MULTI) {
         uint32_t vm;
-        char **values = dcm_parse_character_string(error, value, &vm);
+        char **values = dcm_parse_character_string(error,
+                                                   element, value, &vm);
         if (values == NULL) {
             return false;
         }
 
-        if (!dcm_element_set_value_string_multi(error,
-                                                element, values, vm, true)) {
-            dcm_free_string_array(values, vm);
+        // the block has a copy of the string, so we don't need value
+        element->value_pointer = values;
+        if (!element_assign_strings(error, element, values, vm)) {
             return false;
         }
-    } else {
-        if (steal) {
-            element->value.single.str = value;
-        } else {
-            char *value_copy = dcm_strdup(error, value);
-            if (value_copy == NULL) {
-                return false;
-            }
 
-            element->value.single.str = value_copy;
-            element->value_pointer = value_copy;
+        if (steal) {
+            free(value);
         }
 
-        element->vm = 1;
-        element_set_length(element, (uint32_t) strlen(value));
+        return true;
+    }
 
-        if (!dcm_element_validate(error, element)) {
+    if (steal) {
+        element->value.single.str = value;
+    } else {
+        char *value_copy = element_strdup(error, element, value);
+        if (value_copy == NULL) {
             return false;
         }
+
+        element->value.single.str = value_copy;
+        element->value_pointer = value_copy;
+    }
+
+    element->vm = 1;
+    element_set_length(element, (uint32_t) strlen(value));
+
+    if (!dcm_element_validate(error, element)) {
+        return false;
     }
 
     if (steal) {
@@ -728,7 +960,7 @@ bool dcm_element_set_value_numeric_multi(DcmError **error,
         if (steal) {
             element->value.multi.sl = (int32_t *)value;
         } else {
-            char *value_copy = DCM_NEW_ARRAY(error, size_in_bytes, char);
+            char *value_copy = element_alloc(error, element, size_in_bytes);
             if (value_copy == NULL) {
                 return false;
             }
@@ -755,6 +987,18 @@ bool dcm_element_set_value_numeric_multi(DcmError **error,
 }
 
 
+/* The stored values of a numeric element, as an array of the VR type.
+ */
+const void *dcm_element_get_value_numeric(const DcmElement *element)
+{
+    if (element->vm == 1) {
+        return &element->value.single;
+    }
+
+    return element->value.multi.sl;
+}
+
+
 // the float values
 
 // use a VR to marshall a double pointer into a float
@@ -891,7 +1135,7 @@ bool dcm_element_set_value_binary(DcmError **error,
     if (steal) {
         element->value.single.bytes = value;
     } else {
-        void *value_copy = DCM_NEW_ARRAY(error, length, char);
+        void *value_copy = element_alloc(error, element, length);
         if (value_copy == NULL) {
             return false;
         }
@@ -903,6 +1147,7 @@ bool dcm_element_set_value_binary(DcmError **error,
     }
 
     element->vm = 1;
+    element->binary_length = length;
     element_set_length(element, length);
 
     if (!dcm_element_validate(error, element)) {
@@ -977,6 +1222,27 @@ bool dcm_element_set_value(DcmError **error,
     return true;
 }
 
+/* Set a value which points into a mapping. Only elements in an arena can
+ * borrow, since the arena holds the mapping. Otherwise, copy.
+ */
+bool dcm_element_set_value_borrowed(DcmError **error,
+                                    DcmElement *element,
+                                    const char *value,
+                                    uint32_t length,
+                                    DcmMapping *mapping)
+{
+    bool borrow = element->arena &&
+        dcm_arena_hold_mapping(element->arena, mapping);
+
+    // arena elements never free their value, so steal just sets the pointer
+    return dcm_element_set_value(error,
+                                 element,
+                                 (char *) value,
+                                 length,
+                                 borrow);
+}
+
+
 // Sequence Data Element
 
 static bool element_check_sequence(DcmError **error,
@@ -1022,15 +1288,18 @@ bool dcm_element_set_value_sequence(DcmError **error,
 
     uint32_t seq_count = dcm_sequence_count(value);
     uint32_t length = 0;
-    for (uint32_t i = 0; i < seq_count; i++) {
-        DcmDataSet *item = dcm_sequence_get(error, value, i);
-        if (item == NULL) {
-            return false;
-        }
-        for (DcmElement *element = item->elements;
-            element;
-            element = element->hh.next) {
-            length += element->length;
+    if (value->is_lazy) {
+        // we must not parse the items just to find the length
+        length = value->item_offsets[seq_count];
+    } else {
+        for (uint32_t i = 0; i < seq_count; i++) {
+            DcmDataSet *item = dcm_sequence_get(error, value, i);
+            if (item == NULL) {
+                return false;
+            }
+            for (uint32_t j = 0; j < item->n_entries; j++) {
+                length += item->entries[j].element->length;
+            }
         }
     }
     element_set_length(element, length);
@@ -1050,7 +1319,6 @@ bool dcm_element_set_value_sequence(DcmError **error,
 
 DcmElement *dcm_element_clone(DcmError **error, const DcmElement *element)
 {
-    uint32_t i;
     DcmSequence *from_seq;
 
     dcm_log_debug("Clone Data Element '%08x'.", element->tag);
@@ -1064,38 +1332,15 @@ DcmElement *dcm_element_clone(DcmError **error, const DcmElement *element)
     DcmVRClass vr_class = dcm_dict_vr_class(element->vr);
     switch (vr_class) {
         case DCM_VR_CLASS_SEQUENCE:
+            // this locks the sequence, so the clone can share it
             if (!dcm_element_get_value_sequence(error, element, &from_seq)) {
                 dcm_element_destroy(clone);
                 return NULL;
             }
 
-            // Copy each data set in sequence
-            uint32_t count = dcm_sequence_count(from_seq);
-            DcmSequence *seq = dcm_sequence_create(error);
-
-            for (i = 0; i < count; i++) {
-                DcmDataSet *item = dcm_sequence_get(error, from_seq, i);
-                if (item == NULL) {
-                    dcm_sequence_destroy(seq);
-                    dcm_element_destroy(clone);
-                    return NULL;
-                }
-
-                DcmDataSet *cloned_item = dcm_dataset_clone(error, item);
-                if (cloned_item == NULL) {
-                    dcm_sequence_destroy(seq);
-                    dcm_element_destroy(clone);
-                    return NULL;
-                }
-
-                dcm_sequence_append(error, seq, cloned_item);
-            }
-
-            if (!dcm_element_set_value_sequence(error, clone, seq)) {
-                dcm_sequence_destroy(seq);
-                dcm_element_destroy(clone);
-                return NULL;
-            }
+            clone->value.single.sq = sequence_retain(from_seq);
+            clone->shared_sequence = from_seq;
+            clone->vm = 1;
 
             break;
 
@@ -1112,23 +1357,16 @@ DcmElement *dcm_element_clone(DcmError **error, const DcmElement *element)
                 clone->value_pointer = clone->value.single.str;
                 clone->vm = 1;
             } else if (element->vm > 1 && element->value.multi.str) {
-                clone->value.multi.str = DCM_NEW_ARRAY(error,
-                                                       element->vm, char *);
+                clone->value.multi.str = element_pack_strings(error,
+                                                              clone,
+                                                              element->
+                                                              value.multi.str,
+                                                              element->vm);
                 if (clone->value.multi.str == NULL) {
                     dcm_element_destroy(clone);
                     return NULL;
                 }
-                clone->value_pointer_array = clone->value.multi.str;
-
-                for (i = 0; i < element->vm; i++) {
-                    clone->value.multi.str[i] = dcm_strdup(error,
-                                                           element->
-                                                           value.multi.str[i]);
-                    if (clone->value.multi.str[i] == NULL) {
-                        dcm_element_destroy(clone);
-                        return NULL;
-                    }
-                }
+                clone->value_pointer = clone->value.multi.str;
                 clone->vm = element->vm;
             }
 
@@ -1136,15 +1374,17 @@ DcmElement *dcm_element_clone(DcmError **error, const DcmElement *element)
 
         case DCM_VR_CLASS_BINARY:
             if (element->value.single.bytes) {
-                clone->value.single.bytes = DCM_MALLOC(error, element->length);
+                clone->value.single.bytes =
+                    DCM_MALLOC(error, element->binary_length);
                 if (clone->value.single.bytes == NULL) {
                     dcm_element_destroy(clone);
                     return NULL;
                 }
                 memcpy(clone->value.single.bytes,
                        element->value.single.bytes,
-                       element->length);
+                       element->binary_length);
                 clone->value_pointer = clone->value.single.bytes;
+                clone->binary_length = element->binary_length;
                 clone->vm = 1;
             }
             break;
@@ -1368,8 +1608,22 @@ DcmDataSet *dcm_dataset_create(DcmError **error)
     if (dataset == NULL) {
         return NULL;
     }
-    dataset->elements = NULL;
     dataset->is_locked = false;
+    dataset->refcount = 1;
+    return dataset;
+}
+
+
+DcmDataSet *dcm_dataset_create_in_arena(DcmError **error, DcmArena *arena)
+{
+    DcmDataSet *dataset = dcm_arena_alloc(error,
+                                          arena,
+                                          DCM_ARENA_USE_ELEMENTS,
+                                          sizeof(DcmDataSet));
+    if (dataset == NULL) {
+        return NULL;
+    }
+    dataset->arena = arena;
     return dataset;
 }
 
@@ -1382,10 +1636,23 @@ DcmDataSet *dcm_dataset_clone(DcmError **error, const DcmDataSet *dataset)
         return NULL;
     }
 
-    DcmElement *element;
-    DcmElement *cloned_element;
-    for(element = dataset->elements; element; element = element->hh.next) {
-        cloned_element = dcm_element_clone(error, element);
+    // locked data sets can't change, so the clone can share the entries
+    // until it is changed
+    if (dataset->is_locked || dataset->borrows_entries) {
+        DcmDataSet *shared = dataset->borrows_entries ?
+            dataset->shared : (DcmDataSet *) dataset;
+
+        cloned_dataset->shared = dataset_retain(shared);
+        cloned_dataset->entries = shared->entries;
+        cloned_dataset->n_entries = shared->n_entries;
+        cloned_dataset->borrows_entries = true;
+
+        return cloned_dataset;
+    }
+
+    for (uint32_t i = 0; i < dataset->n_entries; i++) {
+        DcmElement *element = dataset->entries[i].element;
+        DcmElement *cloned_element = dcm_element_clone(error, element);
         if (cloned_element == NULL) {
             dcm_dataset_destroy(cloned_dataset);
             return NULL;
@@ -1413,45 +1680,154 @@ static bool dataset_check_not_locked(DcmError **error, DcmDataSet *dataset)
 }
 
 
-DcmElement *dcm_dataset_contains(const DcmDataSet *dataset, uint32_t tag)
+/* Before the first change to a clone, we must copy the entries. The
+ * elements still belong to the shared data set.
+ */
+static bool dataset_copy_entries(DcmError **error, DcmDataSet *dataset)
 {
-    DcmElement *element;
-    HASH_FIND_INT(dataset->elements, &tag, element);
-
-    return element;
-}
-
+    if (!dataset->borrows_entries) {
+        return true;
+    }
 
-bool dcm_dataset_insert(DcmError **error,
-                        DcmDataSet *dataset, DcmElement *element)
-{
-    if (!element_check_assigned(error, element) ||
-        !dataset_check_not_locked(error, dataset)) {
+    uint32_t capacity = MAX(4, dataset->n_entries);
+    struct DataSetEntry *entries = DCM_NEW_ARRAY(error,
+                                                 capacity,
+                                                 struct DataSetEntry);
+    if (entries == NULL) {
         return false;
     }
 
-    DcmElement *matched_element = dcm_dataset_contains(dataset, element->tag);
-    if (matched_element) {
-        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
-                      "Element already exists",
-                      "Inserting Data Element '%08x' into Data Set failed",
-                      element->tag);
-        return false;
+    for (uint32_t i = 0; i < dataset->n_entries; i++) {
+        entries[i] = dataset->entries[i];
+        entries[i].is_shared = true;
     }
 
-    HASH_ADD_INT(dataset->elements, tag, element);
+    dataset->entries = entries;
+    dataset->capacity = capacity;
+    dataset->borrows_entries = false;
 
     return true;
 }
 
 
-DcmElement *dcm_dataset_get(DcmError **error,
-                            const DcmDataSet *dataset, uint32_t tag)
+/* The index of the first entry from low on with a tag not less than tag.
+ */
+static uint32_t dataset_search_from(const DcmDataSet *dataset,
+                                    uint32_t low,
+                                    uint32_t tag)
 {
-    dcm_log_debug("Get Data Element '%08x' from Data Set.", tag);
+    uint32_t high = dataset->n_entries;
 
-    DcmElement *element = dcm_dataset_contains(dataset, tag);
-    if (element == NULL) {
+    // parse appends in tag order, so check the end first
+    if (high > 0 && dataset->entries[high - 1].tag < tag) {
+        return high;
+    }
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+
+        if (dataset->entries[middle].tag < tag) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+
+static uint32_t dataset_search(const DcmDataSet *dataset, uint32_t tag)
+{
+    return dataset_search_from(dataset, 0, tag);
+}
+
+
+DcmElement *dcm_dataset_contains(const DcmDataSet *dataset, uint32_t tag)
+{
+    uint32_t index = dataset_search(dataset, tag);
+    if (index < dataset->n_entries && dataset->entries[index].tag == tag) {
+        return dataset->entries[index].element;
+    }
+
+    return NULL;
+}
+
+
+static bool dataset_grow(DcmError **error, DcmDataSet *dataset)
+{
+    uint32_t capacity = MAX(4, dataset->capacity * 2);
+    size_t size = capacity * sizeof(struct DataSetEntry);
+    struct DataSetEntry *entries;
+
+    if (dataset->arena) {
+        entries = dcm_arena_realloc(error,
+                                    dataset->arena,
+                                    DCM_ARENA_USE_ELEMENTS,
+                                    dataset->entries,
+                                    dataset->capacity *
+                                    sizeof(struct DataSetEntry),
+                                    size);
+    } else {
+        entries = dcm_realloc(error, dataset->entries, size);
+    }
+    if (entries == NULL) {
+        return false;
+    }
+
+    dataset->entries = entries;
+    dataset->capacity = capacity;
+
+    return true;
+}
+
+
+bool dcm_dataset_insert(DcmError **error,
+                        DcmDataSet *dataset, DcmElement *element)
+{
+    if (!element_check_assigned(error, element) ||
+        !dataset_check_not_locked(error, dataset)) {
+        return false;
+    }
+
+    uint32_t index = dataset_search(dataset, element->tag);
+    if (index < dataset->n_entries &&
+        dataset->entries[index].tag == element->tag) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Element already exists",
+                      "Inserting Data Element '%08x' into Data Set failed",
+                      element->tag);
+        return false;
+    }
+
+    if (!dataset_copy_entries(error, dataset)) {
+        return false;
+    }
+
+    if (dataset->n_entries == dataset->capacity &&
+        !dataset_grow(error, dataset)) {
+        return false;
+    }
+
+    memmove(&dataset->entries[index + 1],
+            &dataset->entries[index],
+            (dataset->n_entries - index) * sizeof(struct DataSetEntry));
+    dataset->entries[index].tag = element->tag;
+    dataset->entries[index].is_shared = false;
+    dataset->entries[index].element = element;
+    dataset->n_entries += 1;
+
+    return true;
+}
+
+
+DcmElement *dcm_dataset_get(DcmError **error,
+                            const DcmDataSet *dataset, uint32_t tag)
+{
+    dcm_log_debug("Get Data Element '%08x' from Data Set.", tag);
+
+    DcmElement *element = dcm_dataset_contains(dataset, tag);
+    if (element == NULL) {
         dcm_error_set(error, DCM_ERROR_CODE_INVALID,
                       "Could not find Data Element",
                       "Getting Data Element '%08x' from Data Set failed",
@@ -1462,6 +1838,79 @@ DcmElement *dcm_dataset_get(DcmError **error,
 }
 
 
+bool dcm_dataset_get_many(DcmError **error,
+                          const DcmDataSet *dataset,
+                          const DcmValueSpec *specs,
+                          uint32_t n_specs)
+{
+    uint32_t index = 0;
+
+    for (uint32_t i = 0; i < n_specs; i++) {
+        const DcmValueSpec *spec = &specs[i];
+
+        // specs in tag order carry on from the last match, so a sorted list
+        // is a single pass over the data set
+        if (i > 0 && spec->tag < specs[i - 1].tag) {
+            index = 0;
+        }
+        index = dataset_search_from(dataset, index, spec->tag);
+
+        if (index >= dataset->n_entries ||
+            dataset->entries[index].tag != spec->tag) {
+            if (spec->optional) {
+                continue;
+            }
+
+            dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                          "Could not find Data Element",
+                          "Getting Data Element '%08x' from Data Set failed",
+                          spec->tag);
+            return false;
+        }
+
+        const DcmElement *element = dataset->entries[index].element;
+        bool ok;
+        switch (spec->type) {
+            case DCM_VALUE_TYPE_INTEGER:
+                ok = dcm_element_get_value_integer(error,
+                                                   element,
+                                                   0,
+                                                   (int64_t *) spec->value);
+                break;
+
+            case DCM_VALUE_TYPE_DECIMAL:
+                ok = dcm_element_get_value_decimal(error,
+                                                   element,
+                                                   0,
+                                                   (double *) spec->value);
+                break;
+
+            case DCM_VALUE_TYPE_STRING:
+                ok = dcm_element_get_value_string(error,
+                                                  element,
+                                                  0,
+                                                  (const char **)
+                                                      spec->value);
+                break;
+
+            default:
+                dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                              "Bad value type",
+                              "Unknown value type %d for Data Element "
+                              "'%08x'",
+                              (int) spec->type, spec->tag);
+                ok = false;
+                break;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
 DcmElement *dcm_dataset_get_clone(DcmError **error,
                                   const DcmDataSet *dataset, uint32_t tag)
 {
@@ -1483,12 +1932,20 @@ bool dcm_dataset_remove(DcmError **error, DcmDataSet *dataset, uint32_t tag)
     }
 
     DcmElement *matched_element = dcm_dataset_get(error, dataset, tag);
-    if (matched_element == NULL) {
+    if (matched_element == NULL ||
+        !dataset_copy_entries(error, dataset)) {
         return false;
     }
 
-    HASH_DEL(dataset->elements, matched_element);
-    dcm_element_destroy(matched_element);
+    uint32_t index = dataset_search(dataset, tag);
+    bool is_shared = dataset->entries[index].is_shared;
+    memmove(&dataset->entries[index],
+            &dataset->entries[index + 1],
+            (dataset->n_entries - index - 1) * sizeof(struct DataSetEntry));
+    dataset->n_entries -= 1;
+    if (!is_shared) {
+        dcm_element_destroy(matched_element);
+    }
 
     return true;
 }
@@ -1498,10 +1955,8 @@ bool dcm_dataset_foreach(const DcmDataSet *dataset,
                          bool (*fn)(const DcmElement *element, void *client),
                          void *client)
 {
-    DcmElement *element;
-
-    for(element = dataset->elements; element; element = element->hh.next) {
-        if (!fn(element, client)) {
+    for (uint32_t i = 0; i < dataset->n_entries; i++) {
+        if (!fn(dataset->entries[i].element, client)) {
             return false;
         }
     }
@@ -1512,55 +1967,162 @@ bool dcm_dataset_foreach(const DcmDataSet *dataset,
 
 uint32_t dcm_dataset_count(const DcmDataSet *dataset)
 {
-    uint32_t num_users = HASH_COUNT(dataset->elements);
-    return num_users;
+    return dataset->n_entries;
 }
 
 
 void dcm_dataset_copy_tags(const DcmDataSet *dataset,
                            uint32_t *tags, uint32_t n)
 {
-    uint32_t i;
-    DcmElement *element;
+    // already sorted
+    for (uint32_t i = 0; i < n && i < dataset->n_entries; i++) {
+        tags[i] = dataset->entries[i].tag;
+    }
+}
+
+
+void dcm_dataset_print(const DcmDataSet *dataset, int indentation)
+{
+    for (uint32_t i = 0; i < dataset->n_entries; i++) {
+        dcm_element_print(dataset->entries[i].element, indentation);
+    }
+}
+
+
+static void dataset_add_memory_usage(const DcmDataSet *dataset,
+                                     DcmMemoryUsage *usage);
+
 
-    for(i = 0, element = dataset->elements;
-        element && i < n;
-        element = element->hh.next, i++) {
-        tags[i] = element->tag;
+/* Just the characters, callers add any array of pointers.
+ */
+static uint64_t element_get_strings_size(char *const *values, uint32_t vm)
+{
+    uint64_t size = 0;
+
+    for (uint32_t i = 0; i < vm; i++) {
+        size += strlen(values[i]) + 1;
     }
 
-    qsort(tags, n, sizeof(uint32_t), compare_tags);
+    return size;
 }
 
 
-void dcm_dataset_print(const DcmDataSet *dataset, int indentation)
+static void element_add_memory_usage(const DcmElement *element,
+                                     DcmMemoryUsage *usage)
 {
-    uint32_t i;
-    DcmElement *element;
+    usage->elements += sizeof(DcmElement);
+
+    if (element->sequence_pointer) {
+        const DcmSequence *seq = element->sequence_pointer;
+
+        usage->sequences += sizeof(DcmSequence) +
+            seq->capacity * sizeof(DcmDataSet *);
+        for (uint32_t i = 0; i < seq->n_items; i++) {
+            dataset_add_memory_usage(seq->items[i], usage);
+        }
+    }
 
-    uint32_t n = dcm_dataset_count(dataset);
-    uint32_t *tags = DCM_NEW_ARRAY(NULL, n, uint32_t);
-    if (tags == NULL) {
+    // only values we will free are ours
+    if (element->value_pointer_array) {
+        usage->values += (uint64_t) element->vm * sizeof(char *) +
+            element_get_strings_size(element->value_pointer_array,
+                                     element->vm);
+    } else if (element->value_pointer) {
+        switch (dcm_dict_vr_class(element->vr)) {
+            case DCM_VR_CLASS_STRING_SINGLE:
+            case DCM_VR_CLASS_STRING_MULTI:
+                // multiple values are packed into one block with their
+                // array of pointers
+                usage->values += element->vm == 1 ?
+                    element_get_strings_size(&element->value.single.str, 1) :
+                    (uint64_t) element->vm * sizeof(char *) +
+                    element_get_strings_size(element->value.multi.str,
+                                             element->vm);
+                break;
+
+            case DCM_VR_CLASS_NUMERIC_DECIMAL:
+            case DCM_VR_CLASS_NUMERIC_INTEGER:
+                usage->values += (uint64_t) element->vm *
+                    dcm_dict_vr_size(element->vr);
+                break;
+
+            default:
+                usage->values += element->length;
+                break;
+        }
+    }
+}
+
+
+/* Data sets in an arena tree don't count themselves, the root of the tree
+ * counts the arena.
+ */
+static void dataset_add_memory_usage(const DcmDataSet *dataset,
+                                     DcmMemoryUsage *usage)
+{
+    if (dataset->arena) {
+        if (dataset->owns_arena) {
+            dcm_arena_add_memory_usage(dataset->arena, usage);
+        }
         return;
     }
-    dcm_dataset_copy_tags(dataset, tags, n);
 
-    for(i = 0; i < n; i++) {
-        element = dcm_dataset_get(NULL, dataset, tags[i]);
-        if (element == NULL) {
-            dcm_log_warning("Missing tag.");
-            free(tags);
-            return;
+    usage->elements += sizeof(DcmDataSet);
+    if (dataset->borrows_entries) {
+        return;
+    }
+
+    usage->elements += dataset->capacity * sizeof(struct DataSetEntry);
+    for (uint32_t i = 0; i < dataset->n_entries; i++) {
+        if (!dataset->entries[i].is_shared) {
+            element_add_memory_usage(dataset->entries[i].element, usage);
         }
-        dcm_element_print(element, indentation);
     }
+}
+
 
-    free(tags);
+void dcm_dataset_add_memory_usage(const DcmDataSet *dataset,
+                                  DcmMemoryUsage *usage)
+{
+    // any data set in an arena tree reports the whole tree
+    if (dataset->arena) {
+        dcm_arena_add_memory_usage(dataset->arena, usage);
+    } else {
+        dataset_add_memory_usage(dataset, usage);
+    }
+}
+
+
+void dcm_dataset_get_memory_usage(const DcmDataSet *dataset,
+                                  DcmMemoryUsage *usage)
+{
+    memset(usage, 0, sizeof(DcmMemoryUsage));
+    dcm_dataset_add_memory_usage(dataset, usage);
+    dcm_memory_usage_set_total(usage);
 }
 
 
 void dcm_dataset_lock(DcmDataSet *dataset)
 {
+    // several threads can read a locked data set, so only write if we must
+    if (dataset->is_locked) {
+        return;
+    }
+
+    // locked data sets can't grow, so we can drop any spare capacity
+    if (dataset->arena == NULL &&
+        !dataset->borrows_entries &&
+        dataset->n_entries > 0 &&
+        dataset->n_entries < dataset->capacity) {
+        struct DataSetEntry *entries =
+            realloc(dataset->entries,
+                    dataset->n_entries * sizeof(struct DataSetEntry));
+        if (entries) {
+            dataset->entries = entries;
+            dataset->capacity = dataset->n_entries;
+        }
+    }
+
     dataset->is_locked = true;
 }
 
@@ -1573,15 +2135,32 @@ bool dcm_dataset_is_locked(const DcmDataSet *dataset)
 
 void dcm_dataset_destroy(DcmDataSet *dataset)
 {
-    DcmElement *element, *tmp;
-
     if (dataset) {
-        HASH_ITER(hh, dataset->elements, element, tmp) {
-            HASH_DEL(dataset->elements, element);
-            dcm_element_destroy(element);
+        // the whole tree is freed with the arena
+        if (dataset->arena) {
+            if (dataset->owns_arena) {
+                dcm_arena_unref(dataset->arena);
+            }
+            return;
+        }
+
+        // clones can hold refs to this data set
+        if (dcm_atomic_add(&dataset->refcount, -1) > 0) {
+            return;
+        }
+
+        if (!dataset->borrows_entries) {
+            for (uint32_t i = 0; i < dataset->n_entries; i++) {
+                if (!dataset->entries[i].is_shared) {
+                    dcm_element_destroy(dataset->entries[i].element);
+                }
+            }
+            free(dataset->entries);
+        }
+        if (dataset->shared) {
+            dataset_release(dataset->shared);
         }
         free(dataset);
-        dataset = NULL;
     }
 }
 
@@ -1594,23 +2173,251 @@ DcmSequence *dcm_sequence_create(DcmError **error)
     if (seq == NULL) {
         return NULL;
     }
+    seq->refcount = 1;
 
-    UT_array *items;
-    utarray_new(items, &sequence_item_icd);
-    if (items == NULL) {
-        dcm_error_set(error, DCM_ERROR_CODE_NOMEM,
-                      "Out of memory",
-                      "Creation of Sequence failed");
-        free(seq);
+    return seq;
+}
+
+
+DcmSequence *dcm_sequence_create_in_arena(DcmError **error, DcmArena *arena)
+{
+    DcmSequence *seq = dcm_arena_alloc(error,
+                                       arena,
+                                       DCM_ARENA_USE_SEQUENCES,
+                                       sizeof(DcmSequence));
+    if (seq == NULL) {
         return NULL;
     }
-    seq->items = items;
-    seq->is_locked = false;
+    seq->arena = arena;
+
+    return seq;
+}
+
+
+static DcmSequence *sequence_create_lazy(DcmError **error,
+                                         DcmArena *arena,
+                                         bool implicit,
+                                         const char *value,
+                                         uint32_t length,
+                                         const uint32_t *item_offsets,
+                                         uint32_t n_items)
+{
+    DcmSequence *seq = dcm_sequence_create_in_arena(error, arena);
+    if (seq == NULL) {
+        return NULL;
+    }
+
+    seq->items = dcm_arena_alloc(error,
+                                 arena,
+                                 DCM_ARENA_USE_SEQUENCES,
+                                 n_items * sizeof(DcmDataSet *));
+    seq->is_parsed = dcm_arena_alloc(error,
+                                     arena,
+                                     DCM_ARENA_USE_SEQUENCES,
+                                     n_items * sizeof(int32_t));
+    char *seq_value = dcm_arena_alloc(error,
+                                      arena,
+                                      DCM_ARENA_USE_SEQUENCES,
+                                      length);
+    uint32_t *seq_item_offsets = dcm_arena_alloc(error,
+                                                 arena,
+                                                 DCM_ARENA_USE_SEQUENCES,
+                                                 (n_items + 1) *
+                                                 sizeof(uint32_t));
+    if (seq->items == NULL ||
+        seq->is_parsed == NULL ||
+        seq_value == NULL ||
+        seq_item_offsets == NULL) {
+        return NULL;
+    }
+    if (length > 0) {
+        memcpy(seq_value, value, length);
+    }
+    memcpy(seq_item_offsets, item_offsets, (n_items + 1) * sizeof(uint32_t));
+
+    seq->n_items = n_items;
+    seq->capacity = n_items;
+    seq->is_lazy = true;
+    seq->implicit = implicit;
+    seq->value = seq_value;
+    seq->item_offsets = seq_item_offsets;
+
+    // the items are fixed by the file
+    seq->is_locked = true;
 
     return seq;
 }
 
 
+/* Add a sequence element to a data set in an arena, with items which are
+ * only parsed when they are first used.
+ */
+bool dcm_dataset_insert_lazy_sequence(DcmError **error,
+                                      DcmDataSet *dataset,
+                                      uint32_t tag,
+                                      DcmVR vr,
+                                      bool implicit,
+                                      const char *value,
+                                      uint32_t length,
+                                      const uint32_t *item_offsets,
+                                      uint32_t n_items)
+{
+    DcmSequence *seq = sequence_create_lazy(error,
+                                            dataset->arena,
+                                            implicit,
+                                            value,
+                                            length,
+                                            item_offsets,
+                                            n_items);
+    if (seq == NULL) {
+        return false;
+    }
+
+    DcmElement *element = dcm_element_create_in_arena(error,
+                                                      dataset->arena,
+                                                      tag,
+                                                      vr);
+    if (element == NULL ||
+        !dcm_element_set_value_sequence(error, element, seq) ||
+        !dcm_dataset_insert(error, dataset, element)) {
+        return false;
+    }
+
+    return true;
+}
+
+
+struct LazyParse {
+    DcmArena *arena;
+    bool implicit;
+    DcmDataSet *dataset;
+};
+
+
+static bool lazy_dataset_begin(DcmError **error, void *client)
+{
+    struct LazyParse *lazy = (struct LazyParse *) client;
+
+    lazy->dataset = dcm_dataset_create_in_arena(error, lazy->arena);
+
+    return lazy->dataset != NULL;
+}
+
+
+static bool lazy_element_create(DcmError **error,
+                                void *client,
+                                uint32_t tag,
+                                DcmVR vr,
+                                char *value,
+                                uint32_t length)
+{
+    struct LazyParse *lazy = (struct LazyParse *) client;
+
+    DcmElement *element = dcm_element_create_in_arena(error,
+                                                      lazy->arena,
+                                                      tag,
+                                                      vr);
+    if (element == NULL ||
+        !dcm_element_set_value(error, element, value, length, false) ||
+        !dcm_dataset_insert(error, lazy->dataset, element)) {
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool lazy_sequence_raw(DcmError **error,
+                              void *client,
+                              uint32_t tag,
+                              DcmVR vr,
+                              const char *value,
+                              uint32_t length,
+                              const uint32_t *item_offsets,
+                              uint32_t n_items)
+{
+    struct LazyParse *lazy = (struct LazyParse *) client;
+
+    return dcm_dataset_insert_lazy_sequence(error,
+                                            lazy->dataset,
+                                            tag,
+                                            vr,
+                                            lazy->implicit,
+                                            value,
+                                            length,
+                                            item_offsets,
+                                            n_items);
+}
+
+
+/* Parse an item of a lazy sequence. Any sequences inside the item are lazy
+ * too. Call with the arena lock held.
+ */
+static DcmDataSet *sequence_parse_item(DcmError **error,
+                                       const DcmSequence *seq,
+                                       uint32_t index)
+{
+    static const DcmParse parse = {
+        .dataset_begin = lazy_dataset_begin,
+        .element_create = lazy_element_create,
+        .sequence_raw = lazy_sequence_raw,
+    };
+
+    uint32_t start = seq->item_offsets[index];
+    uint32_t end = seq->item_offsets[index + 1];
+    DcmIO *io = dcm_io_create_from_memory(error,
+                                          seq->value + start,
+                                          end - start);
+    if (io == NULL) {
+        return NULL;
+    }
+
+    struct LazyParse lazy = {
+        .arena = seq->arena,
+        .implicit = seq->implicit,
+    };
+    bool result = dcm_parse_dataset(error, io, seq->implicit, &parse, &lazy);
+    dcm_io_close(io);
+    if (!result) {
+        return NULL;
+    }
+
+    return lazy.dataset;
+}
+
+
+/* Get an item, parsing it if this is the first use. Several threads can
+ * touch an item for the first time together, and arena allocation is not
+ * thread-safe, so we parse with the arena lock held.
+ */
+static DcmDataSet *sequence_get_item(DcmError **error,
+                                     const DcmSequence *seq,
+                                     uint32_t index)
+{
+    if (!seq->is_lazy || dcm_atomic_get(&seq->is_parsed[index])) {
+        return seq->items[index];
+    }
+
+    dcm_arena_lock(seq->arena);
+
+    if (!dcm_atomic_get(&seq->is_parsed[index])) {
+        DcmDataSet *item = sequence_parse_item(error, seq, index);
+        if (item == NULL) {
+            dcm_arena_unlock(seq->arena);
+            return NULL;
+        }
+
+        dcm_dataset_lock(item);
+        seq->items[index] = item;
+        dcm_atomic_set(&seq->is_parsed[index], 1);
+    }
+
+    dcm_arena_unlock(seq->arena);
+
+    return seq->items[index];
+}
+
+
 static bool sequence_check_not_locked(DcmError **error, DcmSequence *seq)
 {
     if (seq->is_locked) {
@@ -1623,95 +2430,118 @@ static bool sequence_check_not_locked(DcmError **error, DcmSequence *seq)
 }
 
 
-bool dcm_sequence_append(DcmError **error, DcmSequence *seq, DcmDataSet *item)
+static bool sequence_grow(DcmError **error, DcmSequence *seq)
 {
-    if (!sequence_check_not_locked(error, seq)) {
+    uint32_t capacity = MAX(4, seq->capacity * 2);
+    size_t size = capacity * sizeof(DcmDataSet *);
+    DcmDataSet **items;
+
+    if (seq->arena) {
+        items = dcm_arena_realloc(error,
+                                  seq->arena,
+                                  DCM_ARENA_USE_SEQUENCES,
+                                  seq->items,
+                                  seq->capacity * sizeof(DcmDataSet *),
+                                  size);
+    } else {
+        items = dcm_realloc(error, seq->items, size);
+    }
+    if (items == NULL) {
         return false;
     }
 
-    dcm_log_debug("Append item to Sequence.");
-
-    /**
-     * The SequenceItem is just a thin wrapper around a DcmDataSet object as a
-     * handle for utarray. Under the hood, utarray frees the memory of the
-     * DcmDataSet object when the array item gets destroyed. However, utarray
-     * does not free the memory of the item handle. Therefore, we need to free
-     * the memory of the item handle after the item was added to the array.
-     */
-    struct SequenceItem *seq_item = create_sequence_item(error, item);
-    utarray_push_back(seq->items, seq_item);
-    free(seq_item);
+    seq->items = items;
+    seq->capacity = capacity;
 
     return true;
 }
 
 
-static struct SequenceItem *sequence_get_index(const DcmSequence *seq,
-                                               uint32_t index)
+bool dcm_sequence_append(DcmError **error, DcmSequence *seq, DcmDataSet *item)
 {
-    return (struct SequenceItem*)utarray_eltptr(seq->items, index);
+    if (!sequence_check_not_locked(error, seq)) {
+        return false;
+    }
+
+    dcm_log_debug("Append item to Sequence.");
+
+    if (seq->n_items == seq->capacity && !sequence_grow(error, seq)) {
+        return false;
+    }
+
+    dcm_dataset_lock(item);
+    seq->items[seq->n_items++] = item;
+
+    return true;
 }
 
 
-static struct SequenceItem *sequence_check_index(DcmError **error,
-                                                 const DcmSequence *seq,
-                                                 uint32_t index)
+static DcmDataSet *sequence_check_index(DcmError **error,
+                                        const DcmSequence *seq,
+                                        uint32_t index)
 {
-    uint32_t length = utarray_len(seq->items);
-    if (index >= length) {
+    if (index >= seq->n_items) {
         dcm_error_set(error, DCM_ERROR_CODE_INVALID,
                       "Item of Sequence invalid",
                       "Index %i exceeds length of sequence %i",
-                      index, length);
+                      index, seq->n_items);
         return NULL;
     }
 
-    struct SequenceItem *seq_item = sequence_get_index(seq, index);
-    if (seq_item == NULL) {
-        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
-                      "Item of Sequence invalid",
-                      "Getting item #%i of Sequence failed", index);
-        return NULL;
-    }
-    if (seq_item->dataset == NULL) {
-        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
-                      "Item of Sequence invalid",
-                      "Getting item #%i of Sequence failed", index);
-        return NULL;
+    return sequence_get_item(error, seq, index);
+}
+
+
+/* Take an item out of a sequence, the caller now owns it. Items from an
+ * arena keep the arena alive. Lazy sequences must have parsed every item,
+ * since the raw bytes are found by index.
+ */
+static DcmDataSet *sequence_take(DcmSequence *seq, uint32_t index)
+{
+    DcmDataSet *item = seq->items[index];
+
+    memmove(&seq->items[index],
+            &seq->items[index + 1],
+            (seq->n_items - index - 1) * sizeof(DcmDataSet *));
+    seq->n_items -= 1;
+
+    if (item->arena && !item->owns_arena) {
+        item->owns_arena = true;
+        dcm_arena_ref(item->arena);
     }
 
-    return seq_item;
+    return item;
 }
 
 
 DcmDataSet *dcm_sequence_get(DcmError **error,
                              const DcmSequence *seq, uint32_t index)
 {
-    struct SequenceItem *seq_item = sequence_check_index(error, seq, index);
-    if (seq_item == NULL) {
+    DcmDataSet *item = sequence_check_index(error, seq, index);
+    if (item == NULL) {
         return NULL;
     }
 
-    dcm_dataset_lock(seq_item->dataset);
+    dcm_dataset_lock(item);
 
-    return seq_item->dataset;
+    return item;
 }
 
 
 DcmDataSet *dcm_sequence_steal(DcmError **error,
                                const DcmSequence *seq, uint32_t index)
 {
-    struct SequenceItem *seq_item = sequence_check_index(error, seq, index);
-    if (seq_item == NULL) {
+    if (sequence_check_index(error, seq, index) == NULL) {
         return NULL;
     }
 
-    DcmDataSet *result = seq_item->dataset;
-    seq_item->dataset = NULL;
-    // this will free the SequenceItem
-    utarray_erase(seq->items, index, 1);
+    for (uint32_t i = 0; i < seq->n_items; i++) {
+        if (sequence_get_item(error, seq, i) == NULL) {
+            return NULL;
+        }
+    }
 
-    return result;
+    return sequence_take((DcmSequence *) seq, index);
 }
 
 
@@ -1721,10 +2551,15 @@ bool dcm_sequence_foreach(const DcmSequence *seq,
                                      void *client),
                           void *client)
 {
-    uint32_t length = utarray_len(seq->items);
-    for (uint32_t index = 0; index < length; index++) {
-        struct SequenceItem *seq_item = sequence_get_index(seq, index);
-        DcmDataSet *dataset = seq_item->dataset;
+    for (uint32_t index = 0; index < seq->n_items; index++) {
+        DcmError *error = NULL;
+        DcmDataSet *dataset = sequence_get_item(&error, seq, index);
+        if (dataset == NULL) {
+            dcm_log_warning("Unable to parse item #%u of Sequence - %s",
+                            index, dcm_error_get_message(error));
+            dcm_error_clear(&error);
+            return false;
+        }
 
         dcm_dataset_lock(dataset);
 
@@ -1746,7 +2581,7 @@ bool dcm_sequence_remove(DcmError **error, DcmSequence *seq, uint32_t index)
 
     dcm_log_debug("Remove item #%i from Sequence.", index);
 
-    utarray_erase(seq->items, index, 1);
+    dcm_dataset_destroy(sequence_take(seq, index));
 
     return true;
 }
@@ -1754,14 +2589,15 @@ bool dcm_sequence_remove(DcmError **error, DcmSequence *seq, uint32_t index)
 
 uint32_t dcm_sequence_count(const DcmSequence *seq)
 {
-    uint32_t length = utarray_len(seq->items);
-    return length;
+    return seq->n_items;
 }
 
 
 void dcm_sequence_lock(DcmSequence *seq)
 {
-    seq->is_locked = true;
+    if (!seq->is_locked) {
+        seq->is_locked = true;
+    }
 }
 
 
@@ -1773,30 +2609,37 @@ bool dcm_sequence_is_locked(const DcmSequence *seq)
 
 void dcm_sequence_destroy(DcmSequence *seq)
 {
-    if (seq) {
-        utarray_free(seq->items);
-        seq->items = NULL;
+    // sequences in an arena are freed with the arena, and clones can hold
+    // refs to other sequences
+    if (seq &&
+        seq->arena == NULL &&
+        dcm_atomic_add(&seq->refcount, -1) == 0) {
+        for (uint32_t i = 0; i < seq->n_items; i++) {
+            dcm_dataset_destroy(seq->items[i]);
+        }
+        free(seq->items);
         free(seq);
-        seq = NULL;
     }
 }
 
 
 // Frames
 
-DcmFrame *dcm_frame_create(DcmError **error,
-                           uint32_t number,
-                           const char *data,
-                           uint32_t length,
-                           uint16_t rows,
-                           uint16_t columns,
-                           uint16_t samples_per_pixel,
-                           uint16_t bits_allocated,
-                           uint16_t bits_stored,
-                           uint16_t pixel_representation,
-                           uint16_t planar_configuration,
-                           const char *photometric_interpretation,
-                           const char *transfer_syntax_uid)
+DcmFrame *dcm_frame_create_external(DcmError **error,
+                                    uint32_t number,
+                                    const char *data,
+                                    uint32_t length,
+                                    uint16_t rows,
+                                    uint16_t columns,
+                                    uint16_t samples_per_pixel,
+                                    uint16_t bits_allocated,
+                                    uint16_t bits_stored,
+                                    uint16_t pixel_representation,
+                                    uint16_t planar_configuration,
+                                    const char *photometric_interpretation,
+                                    const char *transfer_syntax_uid,
+                                    DcmFrameReleaseFn release,
+                                    void *client)
 {
     if (data == NULL || length == 0) {
         dcm_error_set(error, DCM_ERROR_CODE_INVALID,
@@ -1837,6 +2680,8 @@ DcmFrame *dcm_frame_create(DcmError **error,
     if (frame == NULL) {
         return NULL;
     }
+    frame->refcount = 1;
+    frame->external = true;
 
     frame->photometric_interpretation = dcm_strdup(error,
                                                    photometric_interpretation);
@@ -1862,6 +2707,48 @@ DcmFrame *dcm_frame_create(DcmError **error,
     frame->high_bit = bits_stored - 1;
     frame->pixel_representation = pixel_representation;
     frame->planar_configuration = planar_configuration;
+    frame->release = release;
+    frame->release_client = client;
+
+    return frame;
+}
+
+
+DcmFrame *dcm_frame_create(DcmError **error,
+                           uint32_t number,
+                           const char *data,
+                           uint32_t length,
+                           uint16_t rows,
+                           uint16_t columns,
+                           uint16_t samples_per_pixel,
+                           uint16_t bits_allocated,
+                           uint16_t bits_stored,
+                           uint16_t pixel_representation,
+                           uint16_t planar_configuration,
+                           const char *photometric_interpretation,
+                           const char *transfer_syntax_uid)
+{
+    DcmFrame *frame = dcm_frame_create_external(error,
+                                                number,
+                                                data,
+                                                length,
+                                                rows,
+                                                columns,
+                                                samples_per_pixel,
+                                                bits_allocated,
+                                                bits_stored,
+                                                pixel_representation,
+                                                planar_configuration,
+                                                photometric_interpretation,
+                                                transfer_syntax_uid,
+                                                NULL,
+                                                NULL);
+    if (frame == NULL) {
+        return NULL;
+    }
+
+    // we own data, and must free it
+    frame->external = false;
 
     return frame;
 }
@@ -1947,10 +2834,23 @@ const char *dcm_frame_get_value(const DcmFrame *frame)
 }
 
 
-void dcm_frame_destroy(DcmFrame *frame)
+DcmFrame *dcm_frame_ref(DcmFrame *frame)
 {
-    if (frame) {
-        if (frame->data) {
+    dcm_atomic_add(&frame->refcount, 1);
+
+    return frame;
+}
+
+
+void dcm_frame_unref(DcmFrame *frame)
+{
+    // drop our reference, and only free on the last one
+    if (frame && dcm_atomic_add(&frame->refcount, -1) == 0) {
+        if (frame->external) {
+            if (frame->release) {
+                frame->release(frame->release_client);
+            }
+        } else if (frame->data) {
             free((char*)frame->data);
         }
         if (frame->photometric_interpretation) {
@@ -1965,6 +2865,12 @@ void dcm_frame_destroy(DcmFrame *frame)
 }
 
 
+void dcm_frame_destroy(DcmFrame *frame)
+{
+    dcm_frame_unref(frame);
+}
+
+
 bool dcm_is_encapsulated_transfer_syntax(const char *transfer_syntax_uid)
 {
     return
@@ -13,9 +13,11 @@
 #endif
 
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "utarray.h"
 
@@ -63,17 +65,28 @@ struct _DcmFilehandle {
     uint32_t tiles_down;
     uint32_t num_tiles;
 
-    // zero-indexed and of length num_tiles
+    // sparse files can have several focal planes and optical paths, each
+    // with a complete grid of tiles
+    uint32_t num_focal_planes;
+    uint32_t num_optical_paths;
+
+    // the Z offset of each focal plane in increasing order, or NULL
+    double *focal_plane_z;
+
+    // identifiers in optical path order, if known
+    char **optical_path_identifiers;
+    uint32_t num_optical_path_identifiers;
+
+    // the optical path for frames which don't give one
+    uint32_t shared_optical_path;
+
+    // zero-indexed and of length num_tiles * num_focal_planes *
+    // num_optical_paths, with focal plane varying fastest
     uint32_t *frame_index;
 
     // the last top level tag the scanner saw
     uint32_t last_tag;
 
-    // used to count frames as we scan per frame functional group sequence
-    uint32_t frame_number;
-    int32_t column_position;
-    int32_t row_position;
-
     // indent for file print
     int indent;
 
@@ -84,11 +97,40 @@ struct _DcmFilehandle {
     UT_array *dataset_stack;
     UT_array *sequence_stack;
 
+    // the tree we are parsing is allocated from this
+    DcmArena *arena;
+
+    // parse sequence items on first use
+    bool lazy_sequences;
+
+    // share repeated string values in the parsed tree
+    bool intern_strings;
+
+    // the most memory we can hold, or 0 for no limit
+    uint64_t memory_limit;
+
     // skip to tags during parse
     uint32_t *skip_to_tags;
 
     // set if we see an ext offset table
     bool have_extended_offset_table;
+
+    // held while we parse metadata, or use the IO read point
+    DcmMutex *lock;
+
+    // frames we've read, or NULL
+    DcmFrameCache *cache;
+
+    // background reads of the tiles near the last position, or NULL
+    DcmPrefetch *prefetch;
+
+    // the thread count from set_prefetch, so we can restart prefetch on
+    // reopen_io
+    uint32_t prefetch_threads;
+
+    // set once prepare_read_frame has succeeded ... after this, frame
+    // reads only use immutable state and positional reads
+    int32_t prepared;
 };
 
 
@@ -99,14 +141,21 @@ DcmFilehandle *dcm_filehandle_create(DcmError **error, DcmIO *io)
         return NULL;
     }
 
+    filehandle->lock = dcm_mutex_create(error);
+    if (filehandle->lock == NULL) {
+        free(filehandle);
+        return NULL;
+    }
+
     filehandle->io = io;
     filehandle->offset = 0;
     filehandle->transfer_syntax_uid = NULL;
     filehandle->pixel_data_offset = 0;
     filehandle->last_tag = 0xffffffff;
-    filehandle->frame_number = 0;
     filehandle->layout = DCM_LAYOUT_FULL;
     filehandle->frame_index = NULL;
+    filehandle->num_focal_planes = 1;
+    filehandle->num_optical_paths = 1;
     utarray_new(filehandle->index_stack, &ut_int_icd);
     utarray_new(filehandle->dataset_stack, &ut_ptr_icd);
     utarray_new(filehandle->sequence_stack, &ut_ptr_icd);
@@ -167,12 +216,19 @@ static void dcm_filehandle_clear(DcmFilehandle *filehandle)
     }
 
     utarray_clear(filehandle->sequence_stack);
+
+    // the dataset we parsed holds its own ref
+    dcm_arena_unref(filehandle->arena);
+    filehandle->arena = NULL;
 }
 
 
 void dcm_filehandle_destroy(DcmFilehandle *filehandle)
 {
     if (filehandle) {
+        // the prefetch workers use the filehandle, so stop them first
+        dcm_prefetch_destroy(filehandle->prefetch);
+
         dcm_filehandle_clear(filehandle);
 
         if (filehandle->transfer_syntax_uid) {
@@ -183,16 +239,34 @@ void dcm_filehandle_destroy(DcmFilehandle *filehandle)
             free(filehandle->frame_index);
         }
 
+        if (filehandle->focal_plane_z) {
+            free(filehandle->focal_plane_z);
+        }
+
+        if (filehandle->optical_path_identifiers) {
+            dcm_free_string_array(filehandle->optical_path_identifiers,
+                                  filehandle->num_optical_path_identifiers);
+        }
+
         if (filehandle->offset_table) {
             free(filehandle->offset_table);
         }
 
-        dcm_io_close(filehandle->io);
+        if (filehandle->io) {
+            dcm_io_close(filehandle->io);
+        }
 
         utarray_free(filehandle->index_stack);
         utarray_free(filehandle->dataset_stack);
         utarray_free(filehandle->sequence_stack);
 
+        dcm_mutex_destroy(filehandle->lock);
+
+        if (filehandle->cache) {
+            dcm_frame_cache_remove_filehandle(filehandle->cache, filehandle);
+            dcm_frame_cache_destroy(filehandle->cache);
+        }
+
         if (filehandle->meta) {
             dcm_dataset_destroy(filehandle->meta);
         }
@@ -206,6 +280,100 @@ void dcm_filehandle_destroy(DcmFilehandle *filehandle)
 }
 
 
+static void filehandle_add_memory_usage(const DcmFilehandle *filehandle,
+                                        DcmMemoryUsage *usage)
+{
+    if (filehandle->file_meta) {
+        dcm_dataset_add_memory_usage(filehandle->file_meta, usage);
+    }
+    if (filehandle->meta) {
+        dcm_dataset_add_memory_usage(filehandle->meta, usage);
+    }
+
+    if (filehandle->offset_table) {
+        usage->offset_table += filehandle->num_frames * sizeof(int64_t);
+    }
+
+    if (filehandle->frame_index) {
+        usage->frame_index += (uint64_t) filehandle->num_tiles *
+            filehandle->num_focal_planes *
+            filehandle->num_optical_paths *
+            sizeof(uint32_t);
+    }
+    if (filehandle->focal_plane_z) {
+        usage->frame_index += filehandle->num_frames * sizeof(double);
+    }
+    for (uint32_t i = 0; i < filehandle->num_optical_path_identifiers; i++) {
+        usage->frame_index += sizeof(char *) +
+            strlen(filehandle->optical_path_identifiers[i]) + 1;
+    }
+}
+
+
+/* The number of bytes we can still allocate.
+ */
+static uint64_t filehandle_get_headroom(const DcmFilehandle *filehandle)
+{
+    if (filehandle->memory_limit == 0) {
+        return UINT64_MAX;
+    }
+
+    DcmMemoryUsage usage = { 0 };
+    filehandle_add_memory_usage(filehandle, &usage);
+    dcm_memory_usage_set_total(&usage);
+    if (usage.total >= filehandle->memory_limit) {
+        return 0;
+    }
+
+    return filehandle->memory_limit - usage.total;
+}
+
+
+static bool filehandle_reserve(DcmError **error,
+                               const DcmFilehandle *filehandle,
+                               uint64_t size)
+{
+    if (size > filehandle_get_headroom(filehandle)) {
+        dcm_error_set(error, DCM_ERROR_CODE_MEMORY_LIMIT,
+                      "Memory limit exceeded",
+                      "Allocating %" PRIu64 " bytes would exceed the "
+                      "limit of %" PRIu64 " bytes",
+                      size, filehandle->memory_limit);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Parse into a new arena, limited to the memory we have left.
+ */
+static bool filehandle_create_arena(DcmError **error,
+                                    DcmFilehandle *filehandle)
+{
+    filehandle->arena = dcm_arena_create(error);
+    if (filehandle->arena == NULL) {
+        return false;
+    }
+    dcm_arena_set_limit(filehandle->arena,
+                        filehandle_get_headroom(filehandle));
+
+    return true;
+}
+
+
+static bool parse_reserve(DcmError **error, void *client, uint64_t size)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    if (filehandle->arena) {
+        return dcm_arena_reserve(error, filehandle->arena, size);
+    }
+
+    return filehandle_reserve(error, filehandle, size);
+}
+
+
 static int64_t dcm_read(DcmError **error, DcmFilehandle *filehandle,
     char *buffer, int64_t length, int64_t *position)
 {
@@ -357,9 +525,9 @@ static bool get_tiles(DcmError **error,
     width = frame_width;
     (void) get_tag_int(NULL, metadata, "TotalPixelMatrixColumns", &width);
 
-    // TotalPixelMatrixColumns is optional and defaults to Columns, ie. one
-    // frame across
-    height = frame_width;
+    // TotalPixelMatrixRows is optional and defaults to Rows, ie. one
+    // frame down
+    height = frame_height;
     (void) get_tag_int(NULL, metadata, "TotalPixelMatrixRows", &height);
 
     *tiles_across = (uint32_t) width / frame_width + !!(width % frame_width);
@@ -374,7 +542,8 @@ static bool parse_meta_dataset_begin(DcmError **error,
 {
     DcmFilehandle *filehandle = (DcmFilehandle *) client;
 
-    DcmDataSet *dataset = dcm_dataset_create(error);
+    DcmDataSet *dataset = dcm_dataset_create_in_arena(error,
+                                                      filehandle->arena);
     if (dataset == NULL) {
         return false;
     }
@@ -417,7 +586,8 @@ static bool parse_meta_sequence_begin(DcmError **error,
 
     DcmFilehandle *filehandle = (DcmFilehandle *) client;
 
-    DcmSequence *sequence = dcm_sequence_create(error);
+    DcmSequence *sequence = dcm_sequence_create_in_arena(error,
+                                                         filehandle->arena);
     if (sequence == NULL) {
         return false;
     }
@@ -438,7 +608,10 @@ static bool parse_meta_sequence_end(DcmError **error,
 
     DcmFilehandle *filehandle = (DcmFilehandle *) client;
 
-    DcmElement *element = dcm_element_create(error, tag, vr);
+    DcmElement *element = dcm_element_create_in_arena(error,
+                                                      filehandle->arena,
+                                                      tag,
+                                                      vr);
     if (element == NULL) {
         return false;
     }
@@ -472,7 +645,10 @@ static bool parse_meta_element_create(DcmError **error,
 {
     DcmFilehandle *filehandle = (DcmFilehandle *) client;
 
-    DcmElement *element = dcm_element_create(error, tag, vr);
+    DcmElement *element = dcm_element_create_in_arena(error,
+                                                      filehandle->arena,
+                                                      tag,
+                                                      vr);
     if (element == NULL) {
         return false;
     }
@@ -489,6 +665,66 @@ static bool parse_meta_element_create(DcmError **error,
 }
 
 
+static bool parse_meta_element_borrow(DcmError **error,
+                                      void *client,
+                                      uint32_t tag,
+                                      DcmVR vr,
+                                      const char *value,
+                                      uint32_t length,
+                                      DcmMapping *mapping)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    DcmElement *element = dcm_element_create_in_arena(error,
+                                                      filehandle->arena,
+                                                      tag,
+                                                      vr);
+    if (element == NULL) {
+        return false;
+    }
+
+    DcmDataSet *dataset = *((DcmDataSet **)
+            utarray_back(filehandle->dataset_stack));
+    if (!dcm_element_set_value_borrowed(error,
+                                        element,
+                                        value,
+                                        length,
+                                        mapping) ||
+        !dcm_dataset_insert(error, dataset, element)) {
+        dcm_element_destroy(element);
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool parse_meta_sequence_raw(DcmError **error,
+                                    void *client,
+                                    uint32_t tag,
+                                    DcmVR vr,
+                                    const char *value,
+                                    uint32_t length,
+                                    const uint32_t *item_offsets,
+                                    uint32_t n_items)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    DcmDataSet *dataset = *((DcmDataSet **)
+            utarray_back(filehandle->dataset_stack));
+
+    return dcm_dataset_insert_lazy_sequence(error,
+                                            dataset,
+                                            tag,
+                                            vr,
+                                            filehandle->implicit,
+                                            value,
+                                            length,
+                                            item_offsets,
+                                            n_items);
+}
+
+
 static bool parse_preamble(DcmError **error,
                            DcmFilehandle *filehandle,
                            int64_t *position)
@@ -527,6 +763,7 @@ static DcmDataSet *dcm_filehandle_read_file_meta(DcmError **error,
         .sequence_end = parse_meta_sequence_end,
         .element_create = parse_meta_element_create,
         .stop = NULL,
+        .reserve = parse_reserve,
     };
 
     // skip File Preamble
@@ -536,7 +773,11 @@ static DcmDataSet *dcm_filehandle_read_file_meta(DcmError **error,
     }
 
     dcm_filehandle_clear(filehandle);
-    DcmSequence *sequence = dcm_sequence_create(error);
+    if (!filehandle_create_arena(error, filehandle)) {
+        return NULL;
+    }
+    DcmSequence *sequence = dcm_sequence_create_in_arena(error,
+                                                         filehandle->arena);
     if (sequence == NULL) {
         return NULL;
     }
@@ -571,7 +812,8 @@ static DcmDataSet *dcm_filehandle_read_file_meta(DcmError **error,
         return NULL;
     }
 
-    // steal file_meta to stop it being destroyed
+    // steal file_meta to stop it being destroyed ... it takes a ref to the
+    // arena
     (void) dcm_sequence_steal(NULL, sequence, 0);
     dcm_filehandle_clear(filehandle);
 
@@ -579,8 +821,8 @@ static DcmDataSet *dcm_filehandle_read_file_meta(DcmError **error,
 }
 
 
-const DcmDataSet *dcm_filehandle_get_file_meta(DcmError **error,
-                                               DcmFilehandle *filehandle)
+static const DcmDataSet *get_file_meta(DcmError **error,
+                                       DcmFilehandle *filehandle)
 {
     if (filehandle->file_meta == NULL) {
         DcmDataSet *file_meta =
@@ -621,6 +863,23 @@ const DcmDataSet *dcm_filehandle_get_file_meta(DcmError **error,
             filehandle->implicit = true;
         }
 
+        // the rest of the file is a deflate stream, so read through an
+        // inflater from here on
+        if (strcmp(filehandle->transfer_syntax_uid,
+                   "1.2.840.10008.1.2.1.99") == 0) {
+            DcmIO *io = dcm_io_create_deflate(error,
+                                              filehandle->io,
+                                              filehandle->offset);
+            if (io == NULL) {
+                // keep the plain IO, so a retry fails the same way
+                free(filehandle->transfer_syntax_uid);
+                filehandle->transfer_syntax_uid = NULL;
+                dcm_dataset_destroy(file_meta);
+                return NULL;
+            }
+            filehandle->io = io;
+        }
+
         filehandle->desc.transfer_syntax_uid = filehandle->transfer_syntax_uid;
 
         filehandle->file_meta = file_meta;
@@ -635,6 +894,17 @@ const DcmDataSet *dcm_filehandle_get_file_meta(DcmError **error,
 }
 
 
+const DcmDataSet *dcm_filehandle_get_file_meta(DcmError **error,
+                                               DcmFilehandle *filehandle)
+{
+    dcm_mutex_lock(filehandle->lock);
+    const DcmDataSet *file_meta = get_file_meta(error, filehandle);
+    dcm_mutex_unlock(filehandle->lock);
+
+    return file_meta;
+}
+
+
 const char *dcm_filehandle_get_transfer_syntax_uid(const DcmFilehandle *filehandle)
 {
     return filehandle->transfer_syntax_uid;
@@ -667,73 +937,50 @@ static bool set_pixel_description(DcmError **error,
                                   const DcmDataSet *metadata,
                                   struct PixelDescription *desc)
 {
-    DcmElement *element;
-    int64_t value;
-    const char *string;
-
-    element = dcm_dataset_get(error, metadata, 0x00280010);
-    if (element == NULL ||
-        !dcm_element_get_value_integer(error, element, 0, &value)) {
-        return false;
-    }
-    desc->rows = (uint16_t) value;
-
-    element = dcm_dataset_get(error, metadata, 0x00280011);
-    if (element == NULL ||
-        !dcm_element_get_value_integer(error, element, 0, &value)) {
-        return false;
-    }
-    desc->columns = (uint16_t) value;
-
-    element = dcm_dataset_get(error, metadata, 0x00280002);
-    if (element == NULL ||
-        !dcm_element_get_value_integer(error, element, 0, &value)) {
-        return false;
-    }
-    desc->samples_per_pixel = (uint16_t) value;
-
-    element = dcm_dataset_get(error, metadata, 0x00280100);
-    if (element == NULL ||
-        !dcm_element_get_value_integer(error, element, 0, &value)) {
-        return false;
-    }
-    desc->bits_allocated = (uint16_t) value;
-
-    element = dcm_dataset_get(error, metadata, 0x00280101);
-    if (element == NULL ||
-        !dcm_element_get_value_integer(error, element, 0, &value)) {
-        return false;
-    }
-    desc->bits_stored = (uint16_t) value;
-
-    element = dcm_dataset_get(error, metadata, 0x00280103);
-    if (element == NULL ||
-        !dcm_element_get_value_integer(error, element, 0, &value)) {
-        return false;
-    }
-    desc->pixel_representation = (uint16_t) value;
-
-    element = dcm_dataset_get(error, metadata, 0x00280006);
-    if (element == NULL ||
-        !dcm_element_get_value_integer(error, element, 0, &value)) {
+    int64_t samples_per_pixel;
+    int64_t planar_configuration;
+    int64_t rows;
+    int64_t columns;
+    int64_t bits_allocated;
+    int64_t bits_stored;
+    int64_t pixel_representation;
+    const char *photometric_interpretation;
+
+    // in tag order, so this is one pass over the data set
+    const DcmValueSpec specs[] = {
+        {0x00280002, DCM_VALUE_TYPE_INTEGER, false, &samples_per_pixel},
+        {0x00280004, DCM_VALUE_TYPE_STRING, false,
+            &photometric_interpretation},
+        {0x00280006, DCM_VALUE_TYPE_INTEGER, false, &planar_configuration},
+        {0x00280010, DCM_VALUE_TYPE_INTEGER, false, &rows},
+        {0x00280011, DCM_VALUE_TYPE_INTEGER, false, &columns},
+        {0x00280100, DCM_VALUE_TYPE_INTEGER, false, &bits_allocated},
+        {0x00280101, DCM_VALUE_TYPE_INTEGER, false, &bits_stored},
+        {0x00280103, DCM_VALUE_TYPE_INTEGER, false, &pixel_representation},
+    };
+    if (!dcm_dataset_get_many(error,
+                              metadata,
+                              specs,
+                              sizeof(specs) / sizeof(specs[0]))) {
         return false;
     }
-    desc->planar_configuration = (uint16_t) value;
 
-    element = dcm_dataset_get(error, metadata, 0x00280004);
-    if (element == NULL ||
-        !dcm_element_get_value_string(error, element, 0, &string)) {
-        return false;
-    }
-    desc->photometric_interpretation = string;
+    desc->rows = (uint16_t) rows;
+    desc->columns = (uint16_t) columns;
+    desc->samples_per_pixel = (uint16_t) samples_per_pixel;
+    desc->bits_allocated = (uint16_t) bits_allocated;
+    desc->bits_stored = (uint16_t) bits_stored;
+    desc->pixel_representation = (uint16_t) pixel_representation;
+    desc->planar_configuration = (uint16_t) planar_configuration;
+    desc->photometric_interpretation = photometric_interpretation;
 
     return true;
 }
 
 
-DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
-                                         DcmFilehandle *filehandle,
-                                         const uint32_t *stop_tags)
+static DcmDataSet *read_metadata(DcmError **error,
+                                 DcmFilehandle *filehandle,
+                                 const uint32_t *stop_tags)
 {
     // by default, we don't stop anywhere (except pixeldata)
     static const uint32_t default_stop_tags[] = {
@@ -752,13 +999,24 @@ DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
         .sequence_end = parse_meta_sequence_end,
         .element_create = parse_meta_element_create,
         .stop = parse_meta_stop,
+        .element_borrow = parse_meta_element_borrow,
+        .reserve = parse_reserve,
+    };
+
+    static DcmParse lazy_parse = {
+        .dataset_begin = parse_meta_dataset_begin,
+        .dataset_end = parse_meta_dataset_end,
+        .element_create = parse_meta_element_create,
+        .stop = parse_meta_stop,
+        .sequence_raw = parse_meta_sequence_raw,
+        .element_borrow = parse_meta_element_borrow,
+        .reserve = parse_reserve,
     };
 
     // only get the file_meta if it's not there ... we don't want to rewind
     // filehandle every time
     if (filehandle->file_meta == NULL) {
-        const DcmDataSet *file_meta = dcm_filehandle_get_file_meta(error,
-                                                                   filehandle);
+        const DcmDataSet *file_meta = get_file_meta(error, filehandle);
         if (file_meta == NULL) {
             return NULL;
         }
@@ -766,7 +1024,12 @@ DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
 
     dcm_filehandle_clear(filehandle);
     filehandle->stop_tags = stop_tags == NULL ? default_stop_tags : stop_tags;
-    DcmSequence *sequence = dcm_sequence_create(error);
+    if (!filehandle_create_arena(error, filehandle)) {
+        return NULL;
+    }
+    dcm_arena_set_intern(filehandle->arena, filehandle->intern_strings);
+    DcmSequence *sequence = dcm_sequence_create_in_arena(error,
+                                                         filehandle->arena);
     if (sequence == NULL) {
         return NULL;
     }
@@ -775,7 +1038,7 @@ DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
     if (!dcm_parse_dataset(error,
                            filehandle->io,
                            filehandle->implicit,
-                           &parse,
+                           filehandle->lazy_sequences ? &lazy_parse : &parse,
                            filehandle)) {
         return NULL;
     }
@@ -800,7 +1063,7 @@ DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
         return NULL;
     }
 
-    // steal meta to stop it being destroyed
+    // steal meta to stop it being destroyed ... it takes a ref to the arena
     (void) dcm_sequence_steal(NULL, sequence, 0);
     dcm_filehandle_clear(filehandle);
 
@@ -808,8 +1071,52 @@ DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
 }
 
 
-const DcmDataSet *dcm_filehandle_get_metadata_subset(DcmError **error,
-                                                     DcmFilehandle *filehandle)
+DcmDataSet *dcm_filehandle_read_metadata(DcmError **error,
+                                         DcmFilehandle *filehandle,
+                                         const uint32_t *stop_tags)
+{
+    dcm_mutex_lock(filehandle->lock);
+    DcmDataSet *meta = read_metadata(error, filehandle, stop_tags);
+    dcm_mutex_unlock(filehandle->lock);
+
+    return meta;
+}
+
+
+void dcm_filehandle_set_lazy_sequences(DcmFilehandle *filehandle, bool lazy)
+{
+    filehandle->lazy_sequences = lazy;
+}
+
+
+void dcm_filehandle_set_intern_strings(DcmFilehandle *filehandle, bool intern)
+{
+    filehandle->intern_strings = intern;
+}
+
+
+void dcm_filehandle_get_memory_usage(DcmFilehandle *filehandle,
+                                     DcmMemoryUsage *usage)
+{
+    memset(usage, 0, sizeof(DcmMemoryUsage));
+
+    dcm_mutex_lock(filehandle->lock);
+    filehandle_add_memory_usage(filehandle, usage);
+    dcm_mutex_unlock(filehandle->lock);
+
+    dcm_memory_usage_set_total(usage);
+}
+
+
+void dcm_filehandle_set_memory_limit(DcmFilehandle *filehandle,
+                                     uint64_t limit)
+{
+    filehandle->memory_limit = limit;
+}
+
+
+static const DcmDataSet *get_metadata_subset(DcmError **error,
+                                             DcmFilehandle *filehandle)
 {
     // we stop on any of the tags that start a huge group that
     // would take a long time to parse
@@ -824,15 +1131,12 @@ const DcmDataSet *dcm_filehandle_get_metadata_subset(DcmError **error,
 
     if (filehandle->meta == NULL) {
         // always rewind the filehandle
-        const DcmDataSet *file_meta = dcm_filehandle_get_file_meta(error,
-                                                                   filehandle);
+        const DcmDataSet *file_meta = get_file_meta(error, filehandle);
         if (file_meta == NULL) {
             return NULL;
         }
 
-        DcmDataSet *meta = dcm_filehandle_read_metadata(error,
-                                                        filehandle,
-                                                        stop_tags);
+        DcmDataSet *meta = read_metadata(error, filehandle, stop_tags);
         if (meta == NULL) {
             return NULL;
         }
@@ -886,159 +1190,380 @@ const DcmDataSet *dcm_filehandle_get_metadata_subset(DcmError **error,
 }
 
 
-static bool parse_frame_index_sequence_begin(DcmError **error,
-                                             void *client,
-                                             uint32_t tag,
-                                             DcmVR vr,
-                                             uint32_t length)
+const DcmDataSet *dcm_filehandle_get_metadata_subset(DcmError **error,
+                                                     DcmFilehandle *filehandle)
 {
-    USED(error);
-    USED(vr);
-    USED(length);
+    dcm_mutex_lock(filehandle->lock);
+    const DcmDataSet *meta = get_metadata_subset(error, filehandle);
+    dcm_mutex_unlock(filehandle->lock);
 
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    return meta;
+}
 
-    if (tag == TAG_PLANE_POSITION_SLIDE_SEQUENCE) {
-        filehandle->column_position = -1;
-        filehandle->row_position = -1;
-    }
 
-    return true;
+static int compare_double(const void *a, const void *b)
+{
+    double x = *((const double *) a);
+    double y = *((const double *) b);
+
+    return x < y ? -1 : x > y ? 1 : 0;
 }
 
 
-static bool parse_frame_index_sequence_end(DcmError **error,
-                                           void *client,
-                                           uint32_t tag,
-                                           DcmVR vr,
-                                           uint32_t length)
+/* Each distinct Z offset is a focal plane, numbered from the lowest Z.
+ */
+static bool set_focal_planes(DcmError **error,
+                             DcmFilehandle *filehandle,
+                             const struct FramePosition *positions)
 {
-    USED(vr);
-    USED(length);
+    if (!filehandle_reserve(error,
+                            filehandle,
+                            (uint64_t) filehandle->num_frames *
+                                sizeof(double))) {
+        return false;
+    }
 
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    double *z = DCM_NEW_ARRAY(error, filehandle->num_frames, double);
+    if (z == NULL) {
+        return false;
+    }
 
-    // have we seen a valid pair of tile positions
-    if (tag == TAG_PLANE_POSITION_SLIDE_SEQUENCE &&
-        filehandle->column_position != -1 &&
-        filehandle->row_position != -1) {
-        // we don't support fractional tile positioning ... they must be
-        // exactly aligned on tile boundaries
-        if ((filehandle->column_position - 1) % filehandle->frame_width != 0 ||
-            (filehandle->row_position - 1) % filehandle->frame_height != 0) {
-            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                          "Reading PerFrameFunctionalGroupsSequence failed",
-                          "Unsupported frame alignment.");
-            return false;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < filehandle->num_frames; i++) {
+        if (positions[i].have_z) {
+            z[n++] = positions[i].z;
         }
+    }
 
-        // map the position of the tile to the frame number
-        int col = (filehandle->column_position - 1) / filehandle->frame_width;
-        int row = (filehandle->row_position - 1) / filehandle->frame_height;
-        uint32_t index = col + row * filehandle->tiles_across;
-        if (index < filehandle->num_tiles) {
-            filehandle->frame_index[index] = filehandle->frame_number;
+    if (n == 0) {
+        free(z);
+        return true;
+    }
 
-            // we have something meaningful in per frame functional group
-            // sequence, so we must display in SPARSE mode
-            filehandle->layout = DCM_LAYOUT_SPARSE;
+    qsort(z, n, sizeof(double), compare_double);
+    uint32_t n_unique = 1;
+    for (uint32_t i = 1; i < n; i++) {
+        if (z[i] != z[n_unique - 1]) {
+            z[n_unique++] = z[i];
         }
-
-        // end of TAG_PLANE_POSITION_SLIDE_SEQUENCE, so we're on to the next
-        // frame
-        filehandle->frame_number += 1;
     }
 
+    filehandle->focal_plane_z = z;
+    filehandle->num_focal_planes = n_unique;
+
     return true;
 }
 
 
-static bool parse_frame_index_element_create(DcmError **error,
-                                             void *client,
-                                             uint32_t tag,
-                                             DcmVR vr,
-                                             char *value,
-                                             uint32_t length)
+static uint32_t find_focal_plane(const DcmFilehandle *filehandle,
+                                 const struct FramePosition *position)
 {
-    USED(error);
-
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    if (filehandle->focal_plane_z == NULL || !position->have_z) {
+        return 0;
+    }
 
-    switch (tag) {
-    case TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX:
-        if (vr == DCM_VR_SL && length == 4) {
-            int32_t *sl = (int32_t *) value;
+    const double *z = bsearch(&position->z,
+                              filehandle->focal_plane_z,
+                              filehandle->num_focal_planes,
+                              sizeof(double),
+                              compare_double);
 
-            filehandle->column_position = sl[0];
-        }
-        break;
+    return (uint32_t) (z - filehandle->focal_plane_z);
+}
 
-    case TAG_ROW_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX:
-        if (vr == DCM_VR_SL && length == 4) {
-            int32_t *sl = (int32_t *) value;
 
-            filehandle->row_position = sl[0];
+static int64_t find_optical_path(const DcmFilehandle *filehandle,
+                                 const char *identifier)
+{
+    for (uint32_t i = 0; i < filehandle->num_optical_path_identifiers; i++) {
+        if (strcmp(filehandle->optical_path_identifiers[i], identifier) == 0) {
+            return i;
         }
-        break;
-
-    default:
-        break;
     }
 
-    return true;
+    return -1;
 }
 
 
-static bool parse_frame_index_stop(void *client,
-                                   uint32_t tag,
-                                   DcmVR vr,
-                                   uint32_t length)
+static bool add_optical_path(DcmError **error,
+                             DcmFilehandle *filehandle,
+                             const char *identifier)
 {
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    if (find_optical_path(filehandle, identifier) >= 0) {
+        return true;
+    }
 
-    USED(vr);
-    USED(length);
+    uint32_t n = filehandle->num_optical_path_identifiers;
+    char **identifiers = dcm_realloc(error,
+                                     filehandle->optical_path_identifiers,
+                                     (n + 1) * sizeof(char *));
+    if (identifiers == NULL) {
+        return false;
+    }
+    filehandle->optical_path_identifiers = identifiers;
 
-    filehandle->last_tag = tag;
+    identifiers[n] = dcm_strdup(error, identifier);
+    if (identifiers[n] == NULL) {
+        return false;
+    }
+    filehandle->num_optical_path_identifiers += 1;
 
-    return tag != TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE;
+    return true;
 }
 
 
-static bool read_frame_index(DcmError **error,
-                             DcmFilehandle *filehandle)
+static const char *get_optical_path_identifier(const DcmDataSet *dataset)
 {
-    static DcmParse parse = {
-        .sequence_begin = parse_frame_index_sequence_begin,
-        .sequence_end = parse_frame_index_sequence_end,
-        .element_create = parse_frame_index_element_create,
-        .stop = parse_frame_index_stop,
-    };
+    DcmElement *element = dcm_dataset_contains(dataset,
+                                               TAG_OPTICAL_PATH_IDENTIFIER);
+    const char *identifier;
+    if (element == NULL ||
+        !dcm_element_get_value_string(NULL, element, 0, &identifier)) {
+        return NULL;
+    }
 
-    dcm_log_debug("Reading per frame functional group sequence.");
+    return identifier;
+}
+
+
+/* Get the first item of a sequence element in a dataset, or NULL.
+ */
+static DcmDataSet *get_first_item(const DcmDataSet *dataset, uint32_t tag)
+{
+    DcmElement *element = dcm_dataset_contains(dataset, tag);
+    DcmSequence *sequence;
+    if (element == NULL ||
+        !dcm_element_get_value_sequence(NULL, element, &sequence) ||
+        dcm_sequence_count(sequence) == 0) {
+        return NULL;
+    }
+
+    return dcm_sequence_get(NULL, sequence, 0);
+}
+
+
+/* Optical paths are numbered in the order they appear in
+ * OpticalPathSequence, followed by any extra paths that only appear in
+ * PerFrameFunctionalGroupsSequence. positions can be NULL if there is no
+ * PerFrameFunctionalGroupsSequence.
+ */
+static bool set_optical_paths(DcmError **error,
+                              DcmFilehandle *filehandle,
+                              const struct FramePosition *positions)
+{
+    DcmElement *element = dcm_dataset_contains(filehandle->meta,
+                                               TAG_OPTICAL_PATH_SEQUENCE);
+    DcmSequence *sequence;
+    if (element != NULL &&
+        dcm_element_get_value_sequence(NULL, element, &sequence)) {
+        for (uint32_t i = 0; i < dcm_sequence_count(sequence); i++) {
+            DcmDataSet *item = dcm_sequence_get(NULL, sequence, i);
+            const char *identifier = get_optical_path_identifier(item);
+            if (identifier != NULL &&
+                !add_optical_path(error, filehandle, identifier)) {
+                return false;
+            }
+        }
+    }
+
+    // a single optical path is often given in the shared functional groups
+    DcmDataSet *shared = get_first_item(filehandle->meta,
+                                        TAG_SHARED_FUNCTIONAL_GROUP_SEQUENCE);
+    DcmDataSet *item = shared == NULL ? NULL :
+        get_first_item(shared, TAG_OPTICAL_PATH_IDENTIFICATION_SEQUENCE);
+    const char *shared_identifier = item == NULL ? NULL :
+        get_optical_path_identifier(item);
+    filehandle->shared_optical_path = 0;
+    if (shared_identifier != NULL) {
+        if (!add_optical_path(error, filehandle, shared_identifier)) {
+            return false;
+        }
+        filehandle->shared_optical_path =
+            (uint32_t) find_optical_path(filehandle, shared_identifier);
+    }
+
+    for (uint32_t i = 0; positions && i < filehandle->num_frames; i++) {
+        const char *identifier = positions[i].optical_path_identifier;
+        if (identifier[0] != '\0' &&
+            !add_optical_path(error, filehandle, identifier)) {
+            return false;
+        }
+    }
+
+    filehandle->num_optical_paths =
+        MAX(1, filehandle->num_optical_path_identifiers);
+
+    return true;
+}
+
+
+static bool read_frame_index(DcmError **error,
+                             DcmFilehandle *filehandle)
+{
+    dcm_log_debug("Reading per frame functional group sequence.");
+
+    if (!filehandle_reserve(error,
+                            filehandle,
+                            (uint64_t) filehandle->num_frames *
+                                sizeof(struct FramePosition))) {
+        return false;
+    }
+
+    struct FramePosition *positions = DCM_NEW_ARRAY(error,
+                                                    filehandle->num_frames,
+                                                    struct FramePosition);
+    if (positions == NULL) {
+        return false;
+    }
+
+    if (!dcm_parse_frame_positions(error,
+                                   filehandle->io,
+                                   filehandle->implicit,
+                                   positions,
+                                   filehandle->num_frames) ||
+        !set_focal_planes(error, filehandle, positions) ||
+        !set_optical_paths(error, filehandle, positions)) {
+        free(positions);
+        return false;
+    }
+
+    // one grid of tiles for each focal plane and optical path
+    uint64_t num_planes = (uint64_t) filehandle->num_focal_planes *
+        filehandle->num_optical_paths;
+    uint64_t index_length = num_planes * filehandle->num_tiles;
+    if (index_length > 0xffffffff) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Reading PerFrameFunctionalGroupsSequence failed",
+                      "Too many tiles.");
+        free(positions);
+        return false;
+    }
 
-    filehandle->frame_index = DCM_NEW_ARRAY(error,
-                                            filehandle->num_tiles,
-                                            uint32_t);
+    if (!filehandle_reserve(error,
+                            filehandle,
+                            index_length * sizeof(uint32_t))) {
+        free(positions);
+        return false;
+    }
+
+    filehandle->frame_index = DCM_NEW_ARRAY(error, index_length, uint32_t);
     if (filehandle->frame_index == NULL) {
+        free(positions);
         return false;
     }
 
     // we may not have all frames ... set to missing initially
-    for (uint32_t i = 0; i < filehandle->num_tiles; i++) {
+    for (uint64_t i = 0; i < index_length; i++) {
         filehandle->frame_index[i] = 0xffffffff;
     }
 
-    // parse just the per-frame stuff
-    filehandle->frame_number = 0;
-    if (!dcm_parse_dataset(error,
-                           filehandle->io,
-                           filehandle->implicit,
-                           &parse,
-                           filehandle)) {
+    for (uint32_t i = 0; i < filehandle->num_frames; i++) {
+        const struct FramePosition *position = &positions[i];
+
+        // have we seen a valid pair of tile positions
+        if (!position->have_column ||
+            !position->have_row ||
+            position->column < 1 ||
+            position->row < 1) {
+            continue;
+        }
+
+        // we don't support fractional tile positioning ... they must be
+        // exactly aligned on tile boundaries
+        uint32_t column = (uint32_t) position->column - 1;
+        uint32_t row = (uint32_t) position->row - 1;
+        if (column % filehandle->frame_width != 0 ||
+            row % filehandle->frame_height != 0) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Reading PerFrameFunctionalGroupsSequence failed",
+                          "Unsupported frame alignment.");
+            free(positions);
+            return false;
+        }
+
+        column /= filehandle->frame_width;
+        row /= filehandle->frame_height;
+        if (column >= filehandle->tiles_across ||
+            row >= filehandle->tiles_down) {
+            continue;
+        }
+
+        uint32_t focal_plane = find_focal_plane(filehandle, position);
+        uint32_t optical_path = position->optical_path_identifier[0] == '\0' ?
+            filehandle->shared_optical_path :
+            (uint32_t) find_optical_path(filehandle,
+                                         position->optical_path_identifier);
+
+        // map the position of the tile to the frame number ... if several
+        // frames claim the same position, the first wins
+        uint32_t plane = focal_plane +
+            optical_path * filehandle->num_focal_planes;
+        uint32_t index = column +
+            row * filehandle->tiles_across +
+            plane * filehandle->num_tiles;
+        if (filehandle->frame_index[index] == 0xffffffff) {
+            filehandle->frame_index[index] = i;
+        }
+
+        // we have something meaningful in per frame functional group
+        // sequence, so we must display in SPARSE mode
+        filehandle->layout = DCM_LAYOUT_SPARSE;
+    }
+
+    free(positions);
+
+    return true;
+}
+
+
+/* TILED_FULL frames are in a fixed order: across each row of tiles, then
+ * down the rows, then through the focal planes, then through the optical
+ * paths, so we can compute the frame for any position and don't need an
+ * index.
+ */
+static bool set_full_layout(DcmError **error,
+                            DcmFilehandle *filehandle)
+{
+    int64_t num_focal_planes = 1;
+    int64_t num_optical_paths = 1;
+    (void) get_tag_int(NULL, filehandle->meta,
+                       "TotalPixelMatrixFocalPlanes", &num_focal_planes);
+    (void) get_tag_int(NULL, filehandle->meta,
+                       "NumberOfOpticalPaths", &num_optical_paths);
+
+    // the identifiers, if there's an OpticalPathSequence
+    if (filehandle->optical_path_identifiers == NULL &&
+        !set_optical_paths(error, filehandle, NULL)) {
         return false;
     }
 
+    if (num_focal_planes < 1 ||
+        num_optical_paths < 1 ||
+        (uint64_t) filehandle->num_tiles *
+            num_focal_planes *
+            num_optical_paths > filehandle->num_frames) {
+        dcm_log_warning("TILED_FULL image has %u frames, but "
+                        "%"PRId64" focal planes and "
+                        "%"PRId64" optical paths of %u tiles -- "
+                        "only using the first plane",
+                        filehandle->num_frames,
+                        num_focal_planes,
+                        num_optical_paths,
+                        filehandle->num_tiles);
+        num_focal_planes = 1;
+        num_optical_paths = 1;
+    }
+
+    // any Z values we found don't describe these planes
+    if (filehandle->focal_plane_z &&
+        filehandle->num_focal_planes != num_focal_planes) {
+        free(filehandle->focal_plane_z);
+        filehandle->focal_plane_z = NULL;
+    }
+
+    filehandle->num_focal_planes = (uint32_t) num_focal_planes;
+    filehandle->num_optical_paths = (uint32_t) num_optical_paths;
+
     return true;
 }
 
@@ -1086,280 +1611,1525 @@ static bool read_skip_to(DcmError **error,
 }
 
 
-static bool parse_extended_offsets_element_create(DcmError **error,
-                                                  void *client,
-                                                  uint32_t tag,
-                                                  DcmVR vr,
-                                                  char *value,
-                                                  uint32_t length)
+static bool parse_extended_offsets_element_create(DcmError **error,
+                                                  void *client,
+                                                  uint32_t tag,
+                                                  DcmVR vr,
+                                                  char *value,
+                                                  uint32_t length)
+{
+    USED(error);
+    USED(vr);
+
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    int64_t expected_size = filehandle->num_frames * sizeof(int64_t);
+
+    if (tag == TAG_EXTENDED_OFFSET_TABLE && length == expected_size) {
+        memcpy(filehandle->offset_table, value, length);
+        filehandle->have_extended_offset_table = true;
+
+        // the size of the pixeldata header, plus the size of the empty frame
+        // 0 (the BOT)
+        filehandle->first_frame_offset = 20;
+    }
+
+    return true;
+}
+
+
+static bool parse_extended_offsets_stop(void *client,
+                                        uint32_t tag,
+                                        DcmVR vr,
+                                        uint32_t length)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    USED(vr);
+    USED(length);
+
+    filehandle->last_tag = tag;
+
+    return tag != TAG_EXTENDED_OFFSET_TABLE;
+}
+
+
+static bool
+read_extended_offsets(DcmError **error,
+                      DcmFilehandle *filehandle)
+{
+    static DcmParse parse = {
+        .element_create = parse_extended_offsets_element_create,
+        .stop = parse_extended_offsets_stop,
+        .reserve = parse_reserve,
+    };
+
+    if (!dcm_parse_dataset(error,
+                           filehandle->io,
+                           filehandle->implicit,
+                           &parse,
+                           filehandle)) {
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool prepare_read_frame(DcmError **error,
+                               DcmFilehandle *filehandle)
+{
+    if (filehandle->offset_table == NULL) {
+        // move to the first of our stop tags
+        if (get_metadata_subset(error, filehandle) == NULL) {
+            return false;
+        }
+
+        if (!filehandle_reserve(error,
+                                filehandle,
+                                (uint64_t) filehandle->num_frames *
+                                    sizeof(int64_t))) {
+            return false;
+        }
+
+        filehandle->offset_table = DCM_NEW_ARRAY(error,
+                                                 filehandle->num_frames,
+                                                 int64_t);
+        if (filehandle->offset_table == NULL) {
+            return false;
+        }
+
+        if (filehandle->layout == DCM_LAYOUT_UNKNOWN) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Reading PixelData failed",
+                          "Unsupported DimensionOrganisationType.");
+            return false;
+        }
+
+        // skip ahead to per frame functional group, if present, and read it
+        uint32_t skip_to_per_frame[] = {
+            TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE,
+            TAG_EXTENDED_OFFSET_TABLE,
+            TAG_PIXEL_DATA,
+            TAG_FLOAT_PIXEL_DATA,
+            TAG_DOUBLE_PIXEL_DATA,
+            0
+        };
+        if (!read_skip_to(error, filehandle, skip_to_per_frame)) {
+            return false;
+        }
+        if (filehandle->last_tag == TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE &&
+            !read_frame_index(error, filehandle)) {
+            return false;
+        }
+        if (filehandle->layout == DCM_LAYOUT_FULL &&
+            !set_full_layout(error, filehandle)) {
+            return false;
+        }
+
+        // skip ahead to extended offset table, if present
+        uint32_t skip_to_offset[] = {
+            TAG_EXTENDED_OFFSET_TABLE,
+            TAG_PIXEL_DATA,
+            TAG_FLOAT_PIXEL_DATA,
+            TAG_DOUBLE_PIXEL_DATA,
+            0
+        };
+        if (!read_skip_to(error, filehandle, skip_to_offset)) {
+            return false;
+        }
+        if (filehandle->last_tag == TAG_EXTENDED_OFFSET_TABLE &&
+            !read_extended_offsets(error, filehandle)) {
+            return false;
+        }
+
+        // skip to pixel data
+        uint32_t skip_to_pixel_data[] = {
+            TAG_PIXEL_DATA,
+            TAG_FLOAT_PIXEL_DATA,
+            TAG_DOUBLE_PIXEL_DATA,
+            0
+        };
+        if (!read_skip_to(error, filehandle, skip_to_pixel_data)) {
+            return false;
+        }
+        if (filehandle->last_tag != TAG_PIXEL_DATA &&
+            filehandle->last_tag != TAG_FLOAT_PIXEL_DATA &&
+            filehandle->last_tag != TAG_DOUBLE_PIXEL_DATA) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Reading PixelData failed",
+                          "Could not determine offset of Pixel Data Element.");
+            return false;
+        }
+
+        if (!dcm_offset(error, filehandle, &filehandle->pixel_data_offset)) {
+            return false;
+        }
+
+        // if there was no ext offset table, we must read the basic one, or
+        // create it
+        if (!filehandle->have_extended_offset_table) {
+            const char *syntax =
+                dcm_filehandle_get_transfer_syntax_uid(filehandle);
+            if (dcm_is_encapsulated_transfer_syntax(syntax)) {
+                // read the bot if available, otherwise parse pixeldata to find
+                // offsets
+                if (!dcm_parse_pixeldata_offsets(error,
+                                                 filehandle->io,
+                                                 filehandle->implicit,
+                                                 &filehandle->first_frame_offset,
+                                                 filehandle->offset_table,
+                                                 filehandle->num_frames)) {
+                    return false;
+                }
+            } else {
+                int64_t frame_length =
+                    dcm_native_frame_length(&filehandle->desc);
+                for (uint32_t i = 0; i < filehandle->num_frames; i++) {
+                    filehandle->offset_table[i] = i * frame_length;
+                }
+
+                // the size of the pixeldata element header
+                filehandle->first_frame_offset = filehandle->implicit ? 8 : 12;
+            }
+        }
+    }
+
+    return true;
+}
+
+
+bool dcm_filehandle_prepare_read_frame(DcmError **error,
+                                       DcmFilehandle *filehandle)
+{
+    // after the first successful call, this is just an atomic read
+    if (dcm_atomic_get(&filehandle->prepared)) {
+        return true;
+    }
+
+    dcm_mutex_lock(filehandle->lock);
+    bool result = filehandle->prepared ||
+        prepare_read_frame(error, filehandle);
+    if (result) {
+        dcm_atomic_set(&filehandle->prepared, 1);
+    }
+    dcm_mutex_unlock(filehandle->lock);
+
+    return result;
+}
+
+
+/* Make a frame from data read from the file. This takes ownership of data,
+ * even on failure.
+ */
+static DcmFrame *create_frame(DcmError **error,
+                              const DcmFilehandle *filehandle,
+                              uint32_t frame_number,
+                              char *data,
+                              uint32_t length)
+{
+    DcmFrame *frame = dcm_frame_create(error,
+                                       frame_number,
+                                       data,
+                                       length,
+                                       filehandle->desc.rows,
+                                       filehandle->desc.columns,
+                                       filehandle->desc.samples_per_pixel,
+                                       filehandle->desc.bits_allocated,
+                                       filehandle->desc.bits_stored,
+                                       filehandle->desc.pixel_representation,
+                                       filehandle->desc.planar_configuration,
+                                       filehandle->desc.photometric_interpretation,
+                                       filehandle->desc.transfer_syntax_uid);
+    if (frame == NULL) {
+        free(data);
+        return NULL;
+    }
+
+    return frame;
+}
+
+
+/* Read length bytes at offset without using the IO read point, so frame
+ * reads can run in parallel with each other. IO objects which can't do this
+ * fall back to a seek and read under the filehandle lock.
+ */
+static bool read_at(DcmError **error,
+                    DcmFilehandle *filehandle,
+                    int64_t offset,
+                    char *buffer,
+                    int64_t length)
+{
+    if (!dcm_io_can_read_at(filehandle->io)) {
+        int64_t position = 0;
+
+        dcm_mutex_lock(filehandle->lock);
+        bool result = dcm_seekset(error, filehandle, offset) &&
+            dcm_require(error, filehandle, buffer, length, &position);
+        dcm_mutex_unlock(filehandle->lock);
+
+        return result;
+    }
+
+    while (length > 0) {
+        int64_t bytes_read = dcm_io_read_at(error,
+                                            filehandle->io,
+                                            offset,
+                                            buffer,
+                                            length);
+        if (bytes_read < 0) {
+            return false;
+        } else if (bytes_read == 0) {
+            dcm_error_set(error, DCM_ERROR_CODE_IO,
+                "End of filehandle",
+                "Needed %zd bytes beyond end of filehandle", length);
+            return false;
+        }
+
+        offset += bytes_read;
+        buffer += bytes_read;
+        length -= bytes_read;
+    }
+
+    return true;
+}
+
+
+/* Check a frame number, and find the file offset and length of the frame
+ * data.
+ */
+static bool find_frame(DcmError **error,
+                       DcmFilehandle *filehandle,
+                       uint32_t frame_number,
+                       int64_t *offset,
+                       uint32_t *length)
+{
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return false;
+    }
+
+    if (frame_number == 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Reading Frame Item failed",
+                      "Frame Number must be non-zero");
+        return false;
+    }
+    if (frame_number > filehandle->num_frames) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Reading Frame Item failed",
+                      "Frame Number must be less than %u",
+                      filehandle->num_frames);
+        return false;
+    }
+
+    // we are zero-based from here on
+    uint32_t i = frame_number - 1;
+
+    *offset = filehandle->pixel_data_offset +
+              filehandle->first_frame_offset +
+              filehandle->offset_table[i];
+
+    if (dcm_is_encapsulated_transfer_syntax(filehandle->transfer_syntax_uid)) {
+        char header[8];
+        if (!read_at(error, filehandle, *offset, header, sizeof(header)) ||
+            !dcm_parse_frame_item(error, header, length)) {
+            return false;
+        }
+        *offset += sizeof(header);
+    } else {
+        int64_t frame_length = dcm_native_frame_length(&filehandle->desc);
+        if (frame_length > 0xffffffff) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Reading Frame Item failed",
+                          "Frame too large");
+            return false;
+        }
+        *length = (uint32_t) frame_length;
+    }
+
+    return true;
+}
+
+
+/* Read a frame from the file, and add it to the cache, if any.
+ */
+static DcmFrame *read_frame(DcmError **error,
+                            DcmFilehandle *filehandle,
+                            uint32_t frame_number)
+{
+    int64_t offset;
+    uint32_t length;
+    if (!find_frame(error, filehandle, frame_number, &offset, &length)) {
+        return NULL;
+    }
+
+    char *frame_data = DCM_MALLOC(error, length);
+    if (frame_data == NULL) {
+        return NULL;
+    }
+    if (!read_at(error, filehandle, offset, frame_data, length)) {
+        free(frame_data);
+        return NULL;
+    }
+
+    DcmFrame *frame = create_frame(error,
+                                   filehandle,
+                                   frame_number,
+                                   frame_data,
+                                   length);
+    if (frame && filehandle->cache) {
+        dcm_frame_cache_put(filehandle->cache, filehandle, frame);
+    }
+
+    return frame;
+}
+
+
+DcmFrame *dcm_filehandle_read_frame(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t frame_number)
+{
+    dcm_log_debug("Read frame number #%u.", frame_number);
+
+    if (filehandle->cache) {
+        DcmFrame *frame = dcm_frame_cache_get(filehandle->cache,
+                                              filehandle,
+                                              frame_number);
+        if (frame) {
+            return frame;
+        }
+    }
+
+    return read_frame(error, filehandle, frame_number);
+}
+
+
+bool dcm_filehandle_read_frame_into(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    uint32_t frame_number,
+                                    char *buffer,
+                                    uint32_t buffer_length,
+                                    DcmFrameInfo *info)
+{
+    dcm_log_debug("Read frame number #%u into buffer.", frame_number);
+
+    DcmFrame *frame = NULL;
+    if (filehandle->cache) {
+        frame = dcm_frame_cache_get(filehandle->cache,
+                                    filehandle,
+                                    frame_number);
+    }
+
+    int64_t offset = 0;
+    uint32_t length;
+    if (frame) {
+        length = dcm_frame_get_length(frame);
+    } else if (!find_frame(error, filehandle, frame_number, &offset, &length)) {
+        return false;
+    }
+
+    const struct PixelDescription *desc = &filehandle->desc;
+    info->number = frame_number;
+    info->length = length;
+    info->rows = desc->rows;
+    info->columns = desc->columns;
+    info->samples_per_pixel = desc->samples_per_pixel;
+    info->bits_allocated = desc->bits_allocated;
+    info->bits_stored = desc->bits_stored;
+    info->high_bit = desc->high_bit;
+    info->pixel_representation = desc->pixel_representation;
+    info->planar_configuration = desc->planar_configuration;
+    info->photometric_interpretation = desc->photometric_interpretation;
+    info->transfer_syntax_uid = desc->transfer_syntax_uid;
+
+    // just asking for the size
+    if (buffer == NULL) {
+        dcm_frame_destroy(frame);
+        return true;
+    }
+
+    if (length > buffer_length) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Reading Frame Item failed",
+                      "Frame %u needs %u bytes, but buffer has only %u",
+                      frame_number,
+                      length,
+                      buffer_length);
+        dcm_frame_destroy(frame);
+        return false;
+    }
+
+    if (frame) {
+        memcpy(buffer, dcm_frame_get_value(frame), length);
+        dcm_frame_destroy(frame);
+        return true;
+    }
+
+    return read_at(error, filehandle, offset, buffer, length);
+}
+
+
+/* Frames with a gap smaller than this between them are fetched with a single
+ * read.
+ */
+#define READ_COALESCE_DISTANCE (1024 * 1024)
+
+/* And never read more than this in one go.
+ */
+#define READ_MAX_SPAN (64 * 1024 * 1024)
+
+
+/* A frame we need for a batched read.
+ */
+struct FrameRequest {
+    // offset of frame from the start of the offset table
+    int64_t offset;
+
+    // zero-based frame number
+    uint32_t index;
+
+    // position in the caller's list of frames
+    uint32_t position;
+};
+
+
+/* The buffer for one coalesced read. Frames made from the run point into
+ * it and hold a reference, so the last one to go frees it.
+ */
+struct ReadRun {
+    int32_t refcount;
+    char *data;
+};
+
+
+typedef bool (*DcmFrameRequestFn)(DcmError **error,
+                                  void *client,
+                                  const struct FrameRequest *request,
+                                  struct ReadRun *run,
+                                  const char *data,
+                                  uint32_t length);
+
+
+static struct ReadRun *read_run_ref(struct ReadRun *run)
+{
+    dcm_atomic_add(&run->refcount, 1);
+
+    return run;
+}
+
+
+static void read_run_unref(void *client)
+{
+    struct ReadRun *run = (struct ReadRun *) client;
+
+    if (dcm_atomic_add(&run->refcount, -1) == 0) {
+        free(run->data);
+        free(run);
+    }
+}
+
+
+static int compare_frame_request(const void *a, const void *b)
+{
+    const struct FrameRequest *x = (const struct FrameRequest *) a;
+    const struct FrameRequest *y = (const struct FrameRequest *) b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset ? 1 : 0;
+}
+
+
+/* Where a frame ends, relative to the start of the offset table. Frame items
+ * are packed one after the other, so an encapsulated frame ends where the
+ * next one starts. For the last frame we only know about the item header.
+ */
+static int64_t frame_request_end(const DcmFilehandle *filehandle,
+                                 const struct FrameRequest *request,
+                                 bool encapsulated,
+                                 int64_t native_length)
+{
+    if (!encapsulated) {
+        return request->offset + native_length;
+    } else if (request->index + 1 < filehandle->num_frames) {
+        return MAX(request->offset + 8,
+                   filehandle->offset_table[request->index + 1]);
+    } else {
+        return request->offset + 8;
+    }
+}
+
+
+/* Fetch a set of frames. Requests are sorted by file offset, and frames which
+ * are near each other are fetched with a single large read and then split
+ * apart again. fn is called once for each request, in file order.
+ */
+static bool read_coalesced(DcmError **error,
+                           DcmFilehandle *filehandle,
+                           struct FrameRequest *requests,
+                           uint32_t n_requests,
+                           DcmFrameRequestFn fn,
+                           void *client)
+{
+    bool encapsulated =
+        dcm_is_encapsulated_transfer_syntax(filehandle->transfer_syntax_uid);
+    int64_t native_length = dcm_native_frame_length(&filehandle->desc);
+
+    qsort(requests, n_requests, sizeof(struct FrameRequest),
+          compare_frame_request);
+
+    uint32_t i = 0;
+    while (i < n_requests) {
+        uint32_t j = i + 1;
+        while (j < n_requests &&
+               requests[j].offset -
+                   frame_request_end(filehandle,
+                                     &requests[j - 1],
+                                     encapsulated,
+                                     native_length) <=
+                   READ_COALESCE_DISTANCE &&
+               frame_request_end(filehandle,
+                                 &requests[j],
+                                 encapsulated,
+                                 native_length) -
+                   requests[i].offset <= READ_MAX_SPAN) {
+            j++;
+        }
+
+        // read from the first frame in the run to the end of the last one ...
+        // for encapsulated frames we only know where the last one ends once
+        // we've seen its item header
+        int64_t start = requests[i].offset;
+        int64_t end = requests[j - 1].offset +
+            (encapsulated ? 8 : native_length);
+        int64_t base = filehandle->pixel_data_offset +
+            filehandle->first_frame_offset;
+        struct ReadRun *run = DCM_NEW(error, struct ReadRun);
+        if (run == NULL) {
+            return false;
+        }
+        run->refcount = 1;
+        run->data = DCM_MALLOC(error, end - start);
+        if (run->data == NULL ||
+            !read_at(error, filehandle, base + start, run->data, end - start)) {
+            read_run_unref(run);
+            return false;
+        }
+
+        if (encapsulated) {
+            const struct FrameRequest *last = &requests[j - 1];
+            uint32_t length;
+            if (!dcm_parse_frame_item(error,
+                                      run->data + end - start - 8,
+                                      &length)) {
+                read_run_unref(run);
+                return false;
+            }
+
+            // the item can't run into the next frame ... the last frame in
+            // the file has no next frame, so the length is all we have
+            int64_t next = last->index + 1 < filehandle->num_frames ?
+                filehandle->offset_table[last->index + 1] : 0;
+            bool is_final = next <= last->offset;
+            if (!is_final && (int64_t) length > next - end) {
+                dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                              "Reading Frame Item failed",
+                              "Frame Item length is invalid");
+                read_run_unref(run);
+                return false;
+            }
+
+            // if the final frame would take the run past the span limit,
+            // leave it for a read of its own ... the frames before it end
+            // where its header starts, so we already have them
+            if (is_final &&
+                j - i > 1 &&
+                end - start + (int64_t) length > READ_MAX_SPAN) {
+                j -= 1;
+            } else {
+                // and don't let a damaged length ask for more than we may
+                // use
+                if (is_final &&
+                    !filehandle_reserve(error, filehandle, length)) {
+                    read_run_unref(run);
+                    return false;
+                }
+
+                char *new_data = dcm_realloc(error,
+                                             run->data,
+                                             end - start + (int64_t) length);
+                if (new_data == NULL) {
+                    read_run_unref(run);
+                    return false;
+                }
+                run->data = new_data;
+
+                if (!read_at(error,
+                             filehandle,
+                             base + end,
+                             run->data + end - start,
+                             length)) {
+                    read_run_unref(run);
+                    return false;
+                }
+                end += length;
+            }
+        }
+
+        for (uint32_t k = i; k < j; k++) {
+            const char *data = run->data + requests[k].offset - start;
+            uint32_t length = (uint32_t) native_length;
+
+            if (encapsulated) {
+                if (!dcm_parse_frame_item(error, data, &length)) {
+                    read_run_unref(run);
+                    return false;
+                }
+                data += 8;
+
+                if (requests[k].offset + 8 + (int64_t) length > end) {
+                    dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                                  "Reading Frame Item failed",
+                                  "Frame Item length is invalid");
+                    read_run_unref(run);
+                    return false;
+                }
+            }
+
+            if (!fn(error, client, &requests[k], run, data, length)) {
+                read_run_unref(run);
+                return false;
+            }
+        }
+
+        read_run_unref(run);
+        i = j;
+    }
+
+    return true;
+}
+
+
+/* Called as each frame of a batched read arrives, with its position in the
+ * caller's list.
+ */
+typedef void (*DcmFrameReadyFn)(void *client, uint32_t position);
+
+
+struct FramesRead {
+    DcmFilehandle *filehandle;
+    DcmFrame **frames;
+    DcmFrameReadyFn ready;
+    void *client;
+};
+
+
+static bool read_frames_request(DcmError **error,
+                                void *client,
+                                const struct FrameRequest *request,
+                                struct ReadRun *run,
+                                const char *data,
+                                uint32_t length)
+{
+    struct FramesRead *read = (struct FramesRead *) client;
+    DcmFilehandle *filehandle = read->filehandle;
+    const struct PixelDescription *desc = &filehandle->desc;
+
+    // the frame is a slice of the run, and keeps it alive
+    DcmFrame *frame = dcm_frame_create_external(error,
+                                                request->index + 1,
+                                                data,
+                                                length,
+                                                desc->rows,
+                                                desc->columns,
+                                                desc->samples_per_pixel,
+                                                desc->bits_allocated,
+                                                desc->bits_stored,
+                                                desc->pixel_representation,
+                                                desc->planar_configuration,
+                                                desc->photometric_interpretation,
+                                                desc->transfer_syntax_uid,
+                                                read_run_unref,
+                                                read_run_ref(run));
+    if (frame == NULL) {
+        read_run_unref(run);
+        return false;
+    }
+    if (filehandle->cache) {
+        dcm_frame_cache_put(filehandle->cache, filehandle, frame);
+    }
+    read->frames[request->position] = frame;
+    if (read->ready) {
+        read->ready(read->client, request->position);
+    }
+
+    return true;
+}
+
+
+/* Fetch a set of frames, calling ready (if set) as each one arrives. On
+ * error, frames may be partly filled, and the caller must free them.
+ */
+static bool read_frames(DcmError **error,
+                        DcmFilehandle *filehandle,
+                        const uint32_t *frame_numbers,
+                        uint32_t n_frames,
+                        DcmFrame **frames,
+                        DcmFrameReadyFn ready,
+                        void *client)
+{
+    for (uint32_t i = 0; i < n_frames; i++) {
+        frames[i] = NULL;
+    }
+
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return false;
+    }
+
+    struct FrameRequest *requests = DCM_NEW_ARRAY(error,
+                                                  MAX(n_frames, 1),
+                                                  struct FrameRequest);
+    if (requests == NULL) {
+        return false;
+    }
+
+    // check every frame number before we start anything
+    for (uint32_t i = 0; i < n_frames; i++) {
+        if (frame_numbers[i] == 0 ||
+            frame_numbers[i] > filehandle->num_frames) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Reading Frame Item failed",
+                          "Frame Number must be between 1 and %u",
+                          filehandle->num_frames);
+            free(requests);
+            return false;
+        }
+    }
+
+    uint32_t n_requests = 0;
+    for (uint32_t i = 0; i < n_frames; i++) {
+        if (filehandle->cache) {
+            frames[i] = dcm_frame_cache_get(filehandle->cache,
+                                            filehandle,
+                                            frame_numbers[i]);
+            if (frames[i]) {
+                if (ready) {
+                    ready(client, i);
+                }
+                continue;
+            }
+        }
+
+        requests[n_requests].index = frame_numbers[i] - 1;
+        requests[n_requests].offset =
+            filehandle->offset_table[requests[n_requests].index];
+        requests[n_requests].position = i;
+        n_requests += 1;
+    }
+
+    struct FramesRead read = {
+        .filehandle = filehandle,
+        .frames = frames,
+        .ready = ready,
+        .client = client,
+    };
+    bool result = read_coalesced(error,
+                                 filehandle,
+                                 requests,
+                                 n_requests,
+                                 read_frames_request,
+                                 &read);
+
+    free(requests);
+
+    return result;
+}
+
+
+bool dcm_filehandle_read_frames(DcmError **error,
+                                DcmFilehandle *filehandle,
+                                const uint32_t *frame_numbers,
+                                uint32_t n_frames,
+                                DcmFrame **frames)
+{
+    dcm_log_debug("Read %u frames.", n_frames);
+
+    if (!read_frames(error,
+                     filehandle,
+                     frame_numbers,
+                     n_frames,
+                     frames,
+                     NULL,
+                     NULL)) {
+        for (uint32_t i = 0; i < n_frames; i++) {
+            dcm_frame_destroy(frames[i]);
+            frames[i] = NULL;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+
+DcmFrame *dcm_filehandle_read_frame_decoded(DcmError **error,
+                                            DcmFilehandle *filehandle,
+                                            uint32_t frame_number)
+{
+    DcmFrame *frame = dcm_filehandle_read_frame(error,
+                                                filehandle,
+                                                frame_number);
+    if (frame == NULL) {
+        return NULL;
+    }
+
+    DcmFrame *decoded = dcm_frame_decode(error, frame);
+    dcm_frame_unref(frame);
+
+    return decoded;
+}
+
+
+struct DecodeBatch {
+    DcmFrame **frames;
+
+    // threads for each frame, for decoders which can split a frame
+    uint32_t n_threads;
+
+    DcmTaskGroup *group;
+
+    // one task per frame
+    struct DecodeTask *tasks;
+
+    // counts failed tasks, the first to fail keeps its error
+    int32_t failed;
+    DcmError *error;
+};
+
+
+struct DecodeTask {
+    struct DecodeBatch *batch;
+    uint32_t position;
+};
+
+
+/* Replace a frame with its decoded form.
+ */
+static void decode_task_main(void *client)
+{
+    struct DecodeTask *task = (struct DecodeTask *) client;
+    struct DecodeBatch *batch = task->batch;
+    DcmFrame **frame = &batch->frames[task->position];
+
+    if (dcm_atomic_get(&batch->failed)) {
+        return;
+    }
+
+    DcmError *error = NULL;
+    DcmFrame *decoded = dcm_frame_decode_ex(&error, *frame, batch->n_threads);
+    if (decoded == NULL) {
+        if (dcm_atomic_add(&batch->failed, 1) == 1) {
+            batch->error = error;
+        } else {
+            dcm_error_clear(&error);
+        }
+        return;
+    }
+    dcm_frame_unref(*frame);
+    *frame = decoded;
+}
+
+
+/* Start decoding a frame as soon as it has been read.
+ */
+static void decode_batch_ready(void *client, uint32_t position)
+{
+    struct DecodeBatch *batch = (struct DecodeBatch *) client;
+    struct DecodeTask *task = &batch->tasks[position];
+
+    task->batch = batch;
+    task->position = position;
+    dcm_task_group_add(batch->group, decode_task_main, task);
+}
+
+
+bool dcm_filehandle_read_frames_decoded(DcmError **error,
+                                        DcmFilehandle *filehandle,
+                                        const uint32_t *frame_numbers,
+                                        uint32_t n_frames,
+                                        uint32_t n_threads,
+                                        DcmFrame **frames)
+{
+    dcm_log_debug("Read and decode %u frames.", n_frames);
+
+    for (uint32_t i = 0; i < n_frames; i++) {
+        frames[i] = NULL;
+    }
+
+    if (n_frames > INT32_MAX) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Reading Frames failed",
+                      "Too many frames requested");
+        return false;
+    }
+
+    // spare threads go to the decoder when there are few frames
+    struct DecodeBatch batch = {
+        .frames = frames,
+        .n_threads = MAX(1, n_threads / MAX(1, n_frames)),
+    };
+    batch.tasks = DCM_NEW_ARRAY(error, MAX(1, n_frames), struct DecodeTask);
+    if (batch.tasks == NULL) {
+        return false;
+    }
+    batch.group = dcm_task_group_create(error, n_threads);
+    if (batch.group == NULL) {
+        free(batch.tasks);
+        return false;
+    }
+
+    // frames are decoded on the shared pool as each read completes, while we
+    // go on to fetch the next run
+    bool result = read_frames(error,
+                              filehandle,
+                              frame_numbers,
+                              n_frames,
+                              frames,
+                              decode_batch_ready,
+                              &batch);
+    dcm_task_group_wait(batch.group);
+    dcm_task_group_destroy(batch.group);
+    free(batch.tasks);
+
+    if (result && dcm_atomic_get(&batch.failed)) {
+        if (error && *error == NULL) {
+            *error = batch.error;
+            batch.error = NULL;
+        }
+        result = false;
+    }
+    dcm_error_clear(&batch.error);
+
+    if (!result) {
+        for (uint32_t i = 0; i < n_frames; i++) {
+            dcm_frame_unref(frames[i]);
+            frames[i] = NULL;
+        }
+    }
+
+    return result;
+}
+
+
+bool dcm_filehandle_set_frame_cache(DcmError **error,
+                                    DcmFilehandle *filehandle,
+                                    DcmFrameCache *cache)
+{
+    USED(error);
+
+    if (filehandle->cache) {
+        dcm_frame_cache_remove_filehandle(filehandle->cache, filehandle);
+        dcm_frame_cache_destroy(filehandle->cache);
+        filehandle->cache = NULL;
+    }
+
+    if (cache) {
+        filehandle->cache = dcm_frame_cache_ref(cache);
+    }
+
+    return true;
+}
+
+
+/* Find the zero-based frame number at a position, or 0xffffffff if there's
+ * no frame there. The position must be in range.
+ */
+static uint32_t lookup_frame(const DcmFilehandle *filehandle,
+                             uint32_t column,
+                             uint32_t row,
+                             uint32_t focal_plane,
+                             uint32_t optical_path)
+{
+    // both layouts put one grid of tiles for each focal plane and optical
+    // path, with focal plane varying fastest
+    uint32_t plane = focal_plane + optical_path * filehandle->num_focal_planes;
+    uint32_t index = column +
+        row * filehandle->tiles_across +
+        plane * filehandle->num_tiles;
+
+    if (filehandle->layout == DCM_LAYOUT_SPARSE) {
+        if (filehandle->frame_index == NULL) {
+            return 0xffffffff;
+        }
+
+        index = filehandle->frame_index[index];
+    }
+
+    return index;
+}
+
+
+DcmFrame *dcm_filehandle_read_frame_position(DcmError **error,
+                                             DcmFilehandle *filehandle,
+                                             uint32_t column,
+                                             uint32_t row)
+{
+    return dcm_filehandle_read_frame_position_ex(error,
+                                                 filehandle,
+                                                 column,
+                                                 row,
+                                                 0,
+                                                 0);
+}
+
+
+DcmFrame *dcm_filehandle_read_frame_position_ex(DcmError **error,
+                                                DcmFilehandle *filehandle,
+                                                uint32_t column,
+                                                uint32_t row,
+                                                uint32_t focal_plane,
+                                                uint32_t optical_path)
+{
+    dcm_log_debug("Read frame position (%u, %u, %u, %u)",
+                  column, row, focal_plane, optical_path);
+
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return NULL;
+    }
+
+    if (column >= filehandle->tiles_across ||
+        row >= filehandle->tiles_down) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Reading Frame position failed",
+                      "Column and row must be less than %u, %u",
+                      filehandle->tiles_across,
+                      filehandle->tiles_down);
+        return NULL;
+    }
+    if (focal_plane >= filehandle->num_focal_planes ||
+        optical_path >= filehandle->num_optical_paths) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Reading Frame position failed",
+                      "Focal plane and optical path must be less than %u, %u",
+                      filehandle->num_focal_planes,
+                      filehandle->num_optical_paths);
+        return NULL;
+    }
+
+    uint32_t index = lookup_frame(filehandle,
+                                  column, row, focal_plane, optical_path);
+    if (index == 0xffffffff) {
+        dcm_error_set(error, DCM_ERROR_CODE_MISSING_FRAME,
+                      "No frame",
+                      "No Frame at position (%u, %u, %u, %u)",
+                      column, row, focal_plane, optical_path);
+        return NULL;
+    }
+
+    // start the neighbours loading while we read this frame
+    if (filehandle->prefetch) {
+        dcm_prefetch_position(filehandle->prefetch,
+                              column, row, focal_plane, optical_path);
+    }
+
+    // read_frame() numbers from 1
+    return dcm_filehandle_read_frame(error, filehandle, index + 1);
+}
+
+
+/* Called from the prefetch workers.
+ */
+static void prefetch_tile(void *client,
+                          uint32_t column,
+                          uint32_t row,
+                          uint32_t focal_plane,
+                          uint32_t optical_path)
+{
+    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+
+    uint32_t index = lookup_frame(filehandle,
+                                  column, row, focal_plane, optical_path);
+    if (index == 0xffffffff ||
+        (filehandle->cache &&
+         dcm_frame_cache_contains(filehandle->cache, filehandle, index + 1))) {
+        return;
+    }
+
+    // with no frame cache, this still warms the OS page cache
+    dcm_frame_destroy(read_frame(NULL, filehandle, index + 1));
+}
+
+
+bool dcm_filehandle_set_prefetch(DcmError **error,
+                                 DcmFilehandle *filehandle,
+                                 uint32_t n_threads)
+{
+    if (n_threads > DCM_MAX_PREFETCH_THREADS) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Unable to set prefetch",
+                      "At most %d prefetch threads are allowed",
+                      DCM_MAX_PREFETCH_THREADS);
+        return false;
+    }
+
+    dcm_prefetch_destroy(filehandle->prefetch);
+    filehandle->prefetch = NULL;
+    filehandle->prefetch_threads = 0;
+
+    if (n_threads > 0) {
+        if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+            return false;
+        }
+
+        filehandle->prefetch = dcm_prefetch_create(error,
+                                                   n_threads,
+                                                   filehandle->tiles_across,
+                                                   filehandle->tiles_down,
+                                                   prefetch_tile,
+                                                   filehandle);
+        if (filehandle->prefetch == NULL) {
+            return false;
+        }
+        filehandle->prefetch_threads = n_threads;
+    }
+
+    return true;
+}
+
+
+/* Close the IO of a prepared filehandle, but keep everything we've parsed,
+ * so the filehandle pool can give fds back. Any prefetch is stopped, since
+ * the workers would need the IO, and restarted by reopen_io.
+ */
+void dcm_filehandle_close_io(DcmFilehandle *filehandle)
 {
-    USED(error);
-    USED(vr);
+    dcm_prefetch_destroy(filehandle->prefetch);
+    filehandle->prefetch = NULL;
 
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
-    int64_t expected_size = filehandle->num_frames * sizeof(int64_t);
+    dcm_mutex_lock(filehandle->lock);
+    dcm_io_close(filehandle->io);
+    filehandle->io = NULL;
+    dcm_mutex_unlock(filehandle->lock);
+}
 
-    if (tag == TAG_EXTENDED_OFFSET_TABLE && length == expected_size) {
-        memcpy(filehandle->offset_table, value, length);
-        filehandle->have_extended_offset_table = true;
 
-        // the size of the pixeldata header, plus the size of the empty frame
-        // 0 (the BOT)
-        filehandle->first_frame_offset = 20;
+/* Give a filehandle closed with dcm_filehandle_close_io() a new IO on the
+ * same file, and restart any prefetch. The filehandle owns io, even on
+ * failure.
+ */
+bool dcm_filehandle_reopen_io(DcmError **error,
+                              DcmFilehandle *filehandle,
+                              DcmIO *io)
+{
+    if (strcmp(filehandle->transfer_syntax_uid,
+               "1.2.840.10008.1.2.1.99") == 0) {
+        DcmIO *deflate = dcm_io_create_deflate(error, io, filehandle->offset);
+        if (deflate == NULL) {
+            dcm_io_close(io);
+            return false;
+        }
+        io = deflate;
+    }
+
+    dcm_mutex_lock(filehandle->lock);
+    filehandle->io = io;
+    dcm_mutex_unlock(filehandle->lock);
+
+    // prefetch is only a hint, so the reopen still works if we can't
+    // restart it
+    if (filehandle->prefetch_threads > 0 && filehandle->prefetch == NULL) {
+        filehandle->prefetch = dcm_prefetch_create(NULL,
+                                                   filehandle->prefetch_threads,
+                                                   filehandle->tiles_across,
+                                                   filehandle->tiles_down,
+                                                   prefetch_tile,
+                                                   filehandle);
+        if (filehandle->prefetch == NULL) {
+            dcm_log_warning("Unable to restart prefetch");
+        }
     }
 
     return true;
 }
 
 
-static bool parse_extended_offsets_stop(void *client,
-                                        uint32_t tag,
-                                        DcmVR vr,
-                                        uint32_t length)
+uint32_t dcm_filehandle_get_num_focal_planes(DcmError **error,
+                                             DcmFilehandle *filehandle)
 {
-    DcmFilehandle *filehandle = (DcmFilehandle *) client;
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return 0;
+    }
 
-    USED(vr);
-    USED(length);
+    return filehandle->num_focal_planes;
+}
 
-    filehandle->last_tag = tag;
 
-    return tag != TAG_EXTENDED_OFFSET_TABLE;
+uint32_t dcm_filehandle_get_num_optical_paths(DcmError **error,
+                                              DcmFilehandle *filehandle)
+{
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return 0;
+    }
+
+    return filehandle->num_optical_paths;
 }
 
 
-static bool
-read_extended_offsets(DcmError **error,
-                      DcmFilehandle *filehandle)
+bool dcm_filehandle_get_focal_plane_z(DcmError **error,
+                                      DcmFilehandle *filehandle,
+                                      uint32_t focal_plane,
+                                      double *z)
 {
-    static DcmParse parse = {
-        .element_create = parse_extended_offsets_element_create,
-        .stop = parse_extended_offsets_stop,
-    };
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return false;
+    }
 
-    if (!dcm_parse_dataset(error,
-                           filehandle->io,
-                           filehandle->implicit,
-                           &parse,
-                           filehandle)) {
+    if (filehandle->focal_plane_z == NULL ||
+        focal_plane >= filehandle->num_focal_planes) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Focal plane not found",
+                      "No Z offset for focal plane %u", focal_plane);
         return false;
     }
 
+    *z = filehandle->focal_plane_z[focal_plane];
+
     return true;
 }
 
 
-bool dcm_filehandle_prepare_read_frame(DcmError **error,
-                                       DcmFilehandle *filehandle)
+const char *dcm_filehandle_get_optical_path_identifier(DcmError **error,
+                                                       DcmFilehandle *filehandle,
+                                                       uint32_t optical_path)
 {
-    if (filehandle->offset_table == NULL) {
-        // move to the first of our stop tags
-        if (dcm_filehandle_get_metadata_subset(error, filehandle) == NULL) {
-            return false;
-        }
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        return NULL;
+    }
 
-        filehandle->offset_table = DCM_NEW_ARRAY(error,
-                                                 filehandle->num_frames,
-                                                 int64_t);
-        if (filehandle->offset_table == NULL) {
-            return false;
-        }
+    if (optical_path >= filehandle->num_optical_path_identifiers) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Optical path not found",
+                      "No identifier for optical path %u", optical_path);
+        return NULL;
+    }
 
-        if (filehandle->layout == DCM_LAYOUT_UNKNOWN) {
-            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                          "Reading PixelData failed",
-                          "Unsupported DimensionOrganisationType.");
-            return false;
-        }
+    return filehandle->optical_path_identifiers[optical_path];
+}
 
-        // skip ahead to per frame functional group, if present, and read it
-        uint32_t skip_to_per_frame[] = {
-            TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE,
-            TAG_EXTENDED_OFFSET_TABLE,
-            TAG_PIXEL_DATA,
-            TAG_FLOAT_PIXEL_DATA,
-            TAG_DOUBLE_PIXEL_DATA,
-            0
-        };
-        if (!read_skip_to(error, filehandle, skip_to_per_frame)) {
-            return false;
-        }
-        if (filehandle->last_tag == TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE &&
-            !read_frame_index(error, filehandle)) {
-            return false;
-        }
 
-        // skip ahead to extended offset table, if present
-        uint32_t skip_to_offset[] = {
-            TAG_EXTENDED_OFFSET_TABLE,
-            TAG_PIXEL_DATA,
-            TAG_FLOAT_PIXEL_DATA,
-            TAG_DOUBLE_PIXEL_DATA,
-            0
-        };
-        if (!read_skip_to(error, filehandle, skip_to_offset)) {
-            return false;
-        }
-        if (filehandle->last_tag == TAG_EXTENDED_OFFSET_TABLE &&
-            !read_extended_offsets(error, filehandle)) {
-            return false;
-        }
+/* A tile we need for a region read.
+ */
+struct RegionTile {
+    uint32_t column;
+    uint32_t row;
+};
 
-        // skip to pixel data
-        uint32_t skip_to_pixel_data[] = {
-            TAG_PIXEL_DATA,
-            TAG_FLOAT_PIXEL_DATA,
-            TAG_DOUBLE_PIXEL_DATA,
-            0
-        };
-        if (!read_skip_to(error, filehandle, skip_to_pixel_data)) {
-            return false;
-        }
-        if (filehandle->last_tag != TAG_PIXEL_DATA &&
-            filehandle->last_tag != TAG_FLOAT_PIXEL_DATA &&
-            filehandle->last_tag != TAG_DOUBLE_PIXEL_DATA) {
-            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                          "Reading PixelData failed",
-                          "Could not determine offset of Pixel Data Element.");
-            return false;
-        }
 
-        if (!dcm_offset(error, filehandle, &filehandle->pixel_data_offset)) {
-            return false;
-        }
+/* The region we are reading.
+ */
+struct Region {
+    const DcmFilehandle *filehandle;
+    const struct RegionTile *tiles;
+    uint32_t left;
+    uint32_t top;
+    uint32_t width;
+    uint32_t height;
+    char *buffer;
+    uint32_t stride;
+    uint8_t background;
+};
 
-        // if there was no ext offset table, we must read the basic one, or
-        // create it
-        if (!filehandle->have_extended_offset_table) {
-            const char *syntax =
-                dcm_filehandle_get_transfer_syntax_uid(filehandle);
-            if (dcm_is_encapsulated_transfer_syntax(syntax)) {
-                // read the bot if available, otherwise parse pixeldata to find
-                // offsets
-                if (!dcm_parse_pixeldata_offsets(error,
-                                                 filehandle->io,
-                                                 filehandle->implicit,
-                                                 &filehandle->first_frame_offset,
-                                                 filehandle->offset_table,
-                                                 filehandle->num_frames)) {
-                    return false;
-                }
-            } else {
-                for (uint32_t i = 0; i < filehandle->num_frames; i++) {
-                    filehandle->offset_table[i] = i *
-                                                  filehandle->desc.rows *
-                                                  filehandle->desc.columns *
-                                                  filehandle->desc.samples_per_pixel;
-                }
 
-                filehandle->first_frame_offset = 12;
-            }
-        }
-    } else {
-        // always position at pixel_data
-        if (!dcm_seekset(error, filehandle, filehandle->pixel_data_offset)) {
-            return false;
+/* Copy the part of a tile that overlaps a region, or fill that part with the
+ * background if frame is NULL.
+ */
+static void blit_tile(const struct Region *region,
+                      const struct RegionTile *tile,
+                      const char *frame)
+{
+    const DcmFilehandle *filehandle = region->filehandle;
+    const struct PixelDescription *desc = &filehandle->desc;
+    uint32_t pixel_size = desc->samples_per_pixel * desc->bits_allocated / 8;
+    uint32_t tile_stride = filehandle->frame_width * pixel_size;
+
+    uint32_t tile_left = tile->column * filehandle->frame_width;
+    uint32_t tile_top = tile->row * filehandle->frame_height;
+    uint32_t x0 = MAX(region->left, tile_left);
+    uint32_t y0 = MAX(region->top, tile_top);
+    uint32_t x1 = MIN(region->left + region->width,
+                      tile_left + filehandle->frame_width);
+    uint32_t y1 = MIN(region->top + region->height,
+                      tile_top + filehandle->frame_height);
+    size_t row_length = (size_t) (x1 - x0) * pixel_size;
+
+    for (uint32_t y = y0; y < y1; y++) {
+        char *to = region->buffer +
+            (size_t) (y - region->top) * region->stride +
+            (size_t) (x0 - region->left) * pixel_size;
+
+        if (frame == NULL) {
+            memset(to, region->background, row_length);
+        } else {
+            const char *from = frame +
+                (size_t) (y - tile_top) * tile_stride +
+                (size_t) (x0 - tile_left) * pixel_size;
+
+            memcpy(to, from, row_length);
         }
     }
+}
+
+
+static bool read_region_request(DcmError **error,
+                                void *client,
+                                const struct FrameRequest *request,
+                                struct ReadRun *run,
+                                const char *data,
+                                uint32_t length)
+{
+    const struct Region *region = (const struct Region *) client;
+
+    USED(error);
+    USED(run);
+    USED(length);
+
+    blit_tile(region, &region->tiles[request->position], data);
 
     return true;
 }
 
 
-DcmFrame *dcm_filehandle_read_frame(DcmError **error,
-                                    DcmFilehandle *filehandle,
-                                    uint32_t frame_number)
+bool dcm_filehandle_read_region(DcmError **error,
+                                DcmFilehandle *filehandle,
+                                uint32_t left,
+                                uint32_t top,
+                                uint32_t width,
+                                uint32_t height,
+                                uint32_t focal_plane,
+                                uint32_t optical_path,
+                                char *buffer,
+                                uint32_t stride,
+                                uint8_t background)
 {
-    dcm_log_debug("Read frame number #%u.", frame_number);
+    dcm_log_debug("Read region (%u, %u, %u, %u)", left, top, width, height);
 
     if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
-        return NULL;
+        return false;
     }
 
-    if (frame_number == 0) {
-        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                      "Reading Frame Item failed",
-                      "Frame Number must be non-zero");
-        return NULL;
-    }
-    if (frame_number > filehandle->num_frames) {
-        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                      "Reading Frame Item failed",
-                      "Frame Number must be less than %u",
-                      filehandle->num_frames);
-        return NULL;
+    const struct PixelDescription *desc = &filehandle->desc;
+    if (dcm_is_encapsulated_transfer_syntax(filehandle->transfer_syntax_uid) ||
+        desc->planar_configuration != 0 ||
+        desc->bits_allocated % 8 != 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Reading region failed",
+                      "Only native pixel data with interleaved samples "
+                      "is supported");
+        return false;
     }
 
-    // we are zero-based from here on
-    uint32_t i = frame_number - 1;
-
-    ssize_t total_frame_offset = filehandle->pixel_data_offset +
-                                 filehandle->first_frame_offset +
-                                 filehandle->offset_table[i];
-    if (!dcm_seekset(error, filehandle, total_frame_offset)) {
-        return NULL;
+    uint64_t image_width = (uint64_t) filehandle->tiles_across *
+        filehandle->frame_width;
+    uint64_t image_height = (uint64_t) filehandle->tiles_down *
+        filehandle->frame_height;
+    if (width == 0 ||
+        height == 0 ||
+        (uint64_t) left + width > image_width ||
+        (uint64_t) top + height > image_height) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Reading region failed",
+                      "Region must be within the %"PRIu64" x %"PRIu64
+                      " image",
+                      image_width, image_height);
+        return false;
+    }
+    if (focal_plane >= filehandle->num_focal_planes ||
+        optical_path >= filehandle->num_optical_paths) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Reading region failed",
+                      "Focal plane and optical path must be less than %u, %u",
+                      filehandle->num_focal_planes,
+                      filehandle->num_optical_paths);
+        return false;
     }
 
-    uint32_t length;
-    char *frame_data = dcm_parse_frame(error,
-                                       filehandle->io,
-                                       filehandle->implicit,
-                                       &filehandle->desc,
-                                       &length);
-    if (frame_data == NULL) {
-        return NULL;
+    uint32_t pixel_size = desc->samples_per_pixel * desc->bits_allocated / 8;
+    if ((uint64_t) width * pixel_size > stride) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Reading region failed",
+                      "Stride too small for region width");
+        return false;
     }
 
-    return dcm_frame_create(error,
-                            frame_number,
-                            frame_data,
-                            length,
-                            filehandle->desc.rows,
-                            filehandle->desc.columns,
-                            filehandle->desc.samples_per_pixel,
-                            filehandle->desc.bits_allocated,
-                            filehandle->desc.bits_stored,
-                            filehandle->desc.pixel_representation,
-                            filehandle->desc.planar_configuration,
-                            filehandle->desc.photometric_interpretation,
-                            filehandle->desc.transfer_syntax_uid);
-}
+    uint32_t first_column = left / filehandle->frame_width;
+    uint32_t last_column = (left + width - 1) / filehandle->frame_width;
+    uint32_t first_row = top / filehandle->frame_height;
+    uint32_t last_row = (top + height - 1) / filehandle->frame_height;
+    uint32_t n_tiles = (last_column - first_column + 1) *
+        (last_row - first_row + 1);
 
+    struct RegionTile *tiles = DCM_NEW_ARRAY(error,
+                                             n_tiles,
+                                             struct RegionTile);
+    if (tiles == NULL) {
+        return false;
+    }
+    struct FrameRequest *requests = DCM_NEW_ARRAY(error,
+                                                  n_tiles,
+                                                  struct FrameRequest);
+    if (requests == NULL) {
+        free(tiles);
+        return false;
+    }
 
-DcmFrame *dcm_filehandle_read_frame_position(DcmError **error,
-                                             DcmFilehandle *filehandle,
-                                             uint32_t column,
-                                             uint32_t row)
-{
-    dcm_log_debug("Read frame position (%u, %u)", column, row);
+    struct Region region = {
+        .filehandle = filehandle,
+        .tiles = tiles,
+        .left = left,
+        .top = top,
+        .width = width,
+        .height = height,
+        .buffer = buffer,
+        .stride = stride,
+        .background = background,
+    };
 
-    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
-        return NULL;
+    // find the frames we need, and paint missing tiles with the background
+    uint32_t n_requests = 0;
+    for (uint32_t row = first_row; row <= last_row; row++) {
+        for (uint32_t column = first_column; column <= last_column; column++) {
+            struct RegionTile tile = {
+                .column = column,
+                .row = row,
+            };
+            uint32_t index = lookup_frame(filehandle,
+                                          column, row,
+                                          focal_plane, optical_path);
+            if (index == 0xffffffff) {
+                blit_tile(&region, &tile, NULL);
+            } else {
+                tiles[n_requests] = tile;
+                requests[n_requests].offset = filehandle->offset_table[index];
+                requests[n_requests].index = index;
+                requests[n_requests].position = n_requests;
+                n_requests += 1;
+            }
+        }
     }
 
-    if (column >= filehandle->tiles_across ||
-        row >= filehandle->tiles_down) {
-        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                      "Reading Frame position failed",
-                      "Column and row must be less than %u, %u",
-                      filehandle->tiles_across,
-                      filehandle->tiles_down);
-        return NULL;
+    // fetch in file order, so we make a single pass over the pixel data
+    if (!read_coalesced(error,
+                        filehandle,
+                        requests,
+                        n_requests,
+                        read_region_request,
+                        &region)) {
+        free(requests);
+        free(tiles);
+        return false;
     }
 
-    uint32_t index = column + row * filehandle->tiles_across;
-    if (filehandle->layout == DCM_LAYOUT_SPARSE) {
-        index = filehandle->frame_index[index];
-        if (index == 0xffffffff) {
-            dcm_error_set(error, DCM_ERROR_CODE_MISSING_FRAME,
-                          "No frame",
-                          "No Frame at position (%u, %u)", column, row);
-            return NULL;
-        }
-    }
+    free(requests);
+    free(tiles);
 
-    // read_frame() numbers from 1
-    return dcm_filehandle_read_frame(error, filehandle, index + 1);
+    return true;
 }
 
 
@@ -1577,8 +3347,8 @@ static bool print_pixeldata_create(DcmError **error,
     return true;
 }
 
-bool dcm_filehandle_print(DcmError **error,
-                          DcmFilehandle *filehandle)
+static bool print_filehandle(DcmError **error,
+                             DcmFilehandle *filehandle)
 {
     static DcmParse parse = {
         .dataset_begin = print_dataset_begin,
@@ -1624,3 +3394,14 @@ bool dcm_filehandle_print(DcmError **error,
 
     return true;
 }
+
+
+bool dcm_filehandle_print(DcmError **error,
+                          DcmFilehandle *filehandle)
+{
+    dcm_mutex_lock(filehandle->lock);
+    bool result = print_filehandle(error, filehandle);
+    dcm_mutex_unlock(filehandle->lock);
+
+    return result;
+}
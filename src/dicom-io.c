@@ -15,6 +15,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -29,6 +30,9 @@
 #include <io.h>
 #endif /*HAVE_IO_H*/
 #include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /*HAVE_ZLIB*/
 
 #include <dicom/dicom.h>
 #include "pdicom.h"
@@ -46,6 +50,9 @@ typedef struct _DcmIOFile {
     char input_buffer[BUFFER_SIZE];
     int64_t bytes_in_buffer;
     int64_t read_point;
+
+    // file offset of the start of input_buffer
+    int64_t buffer_offset;
 } DcmIOFile;
 
 
@@ -152,6 +159,7 @@ static int64_t refill(DcmError **error, DcmIOFile *file)
         return bytes_read;
     }
 
+    file->buffer_offset += file->bytes_in_buffer;
     file->read_point = 0;
     file->bytes_in_buffer = bytes_read;
 
@@ -202,9 +210,25 @@ static int64_t dcm_io_seek_file(DcmError **error, DcmIO *io,
 {
     DcmIOFile *file = (DcmIOFile *) io;
 
+    /* The parser makes many short seeks, often back to the start of the
+     * element it just peeked at. If the target is in the buffer, we can
+     * just move the read point.
+     */
+    if (whence == SEEK_SET || whence == SEEK_CUR) {
+        int64_t target = whence == SEEK_SET ?
+            offset : file->buffer_offset + file->read_point + offset;
+
+        if (target >= file->buffer_offset &&
+            target <= file->buffer_offset + file->bytes_in_buffer) {
+            file->read_point = target - file->buffer_offset;
+            return target;
+        }
+    }
+
     /* We've read ahead by some number of buffered bytes, so first undo that,
      * then do the seek from the true position.
      */
+    int64_t position = file->buffer_offset + file->read_point;
     int64_t new_offset;
 
     int64_t bytes_ahead = file->bytes_in_buffer - file->read_point;
@@ -238,6 +262,7 @@ static int64_t dcm_io_seek_file(DcmError **error, DcmIO *io,
      */
     file->bytes_in_buffer = 0;
     file->read_point = 0;
+    file->buffer_offset = new_offset >= 0 ? new_offset : position;
 
     return new_offset;
 }
@@ -257,16 +282,97 @@ DcmIO *dcm_io_create(DcmError **error,
 }
 
 
+static DcmIOMethods file_methods = {
+    dcm_io_open_file,
+    dcm_io_close_file,
+    dcm_io_read_file,
+    dcm_io_seek_file,
+};
+
+
 DcmIO *dcm_io_create_from_file(DcmError **error, const char *filename)
 {
-    static DcmIOMethods methods = {
-        dcm_io_open_file,
-        dcm_io_close_file,
-        dcm_io_read_file,
-        dcm_io_seek_file,
-    };
+    return dcm_io_create(error, &file_methods, (void *) filename);
+}
+
+
+#ifdef HAVE_PREAD
+/* Read at an offset without touching the file pointer or the input buffer,
+ * so this is safe to call from several threads at once.
+ */
+static int64_t read_file_at(DcmError **error, DcmIOFile *file,
+    int64_t offset, char *buffer, int64_t length)
+{
+    int64_t bytes_read;
+
+    do {
+        bytes_read = pread(file->fd, buffer, length, offset);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read < 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_IO,
+            "Unable to read from file",
+            "Unable to read %s - %s", file->filename, strerror(errno));
+    }
 
-    return dcm_io_create(error, &methods, (void *) filename);
+    return bytes_read;
+}
+#endif /*HAVE_PREAD*/
+
+
+/* Memory owned by someone else, for example a memory mapped file. The IO
+ * object holds a ref, and so does each arena with element values which
+ * point into the memory, so it is only released when they are all gone.
+ */
+struct _DcmMapping {
+    int32_t refcount;
+    DcmIOReleaseFn release;
+    void *client;
+};
+
+
+DcmMapping *dcm_mapping_create(DcmError **error,
+                               DcmIOReleaseFn release,
+                               void *client)
+{
+    DcmMapping *mapping = DCM_NEW(error, DcmMapping);
+    if (mapping == NULL) {
+        return NULL;
+    }
+    mapping->refcount = 1;
+    mapping->release = release;
+    mapping->client = client;
+
+    return mapping;
+}
+
+
+/* Drop a ref, and make sure release is never called. For when creating the
+ * object that owns the mapping fails.
+ */
+void dcm_mapping_cancel(DcmMapping *mapping)
+{
+    mapping->release = NULL;
+    dcm_mapping_unref(mapping);
+}
+
+
+DcmMapping *dcm_mapping_ref(DcmMapping *mapping)
+{
+    dcm_atomic_add(&mapping->refcount, 1);
+
+    return mapping;
+}
+
+
+void dcm_mapping_unref(DcmMapping *mapping)
+{
+    if (mapping && dcm_atomic_add(&mapping->refcount, -1) == 0) {
+        if (mapping->release) {
+            mapping->release(mapping->client);
+        }
+        free(mapping);
+    }
 }
 
 
@@ -277,6 +383,9 @@ typedef struct _DcmIOMemory {
     const char *buffer;
     int64_t length;
     int64_t read_point;
+
+    // NULL unless the memory is external
+    DcmMapping *mapping;
 } DcmIOMemory;
 
 
@@ -284,6 +393,7 @@ static void dcm_io_close_memory(DcmIO *io)
 {
     DcmIOMemory *memory = (DcmIOMemory *) io;
 
+    dcm_mapping_unref(memory->mapping);
     free(memory);
 }
 
@@ -298,6 +408,7 @@ static DcmIO *dcm_io_open_memory(DcmError **error, void *client)
     }
     memory->buffer = params->buffer;
     memory->length = params->length;
+    memory->mapping = params->mapping;
 
     return (DcmIO *) memory;
 }
@@ -355,25 +466,56 @@ static int64_t dcm_io_seek_memory(DcmError **error, DcmIO *io,
 }
 
 
+static DcmIOMethods memory_methods = {
+    dcm_io_open_memory,
+    dcm_io_close_memory,
+    dcm_io_read_memory,
+    dcm_io_seek_memory,
+};
+
+
 DcmIO *dcm_io_create_from_memory(DcmError **error,
                                  const char *buffer,
                                  int64_t length)
 {
-    static DcmIOMethods methods = {
-        dcm_io_open_memory,
-        dcm_io_close_memory,
-        dcm_io_read_memory,
-        dcm_io_seek_memory,
+    DcmIOMemory memory = {
+        &memory_methods,
+        buffer,
+        length,
+        0,
+        NULL
     };
 
+    return dcm_io_create(error, &memory_methods, &memory);
+}
+
+
+DcmIO *dcm_io_create_from_memory_external(DcmError **error,
+                                          const char *buffer,
+                                          int64_t length,
+                                          DcmIOReleaseFn release,
+                                          void *client)
+{
+    DcmMapping *mapping = dcm_mapping_create(error, release, client);
+    if (mapping == NULL) {
+        return NULL;
+    }
+
     DcmIOMemory memory = {
-        &methods,
+        &memory_methods,
         buffer,
         length,
-        0
+        0,
+        mapping
     };
 
-    return dcm_io_create(error, &methods, &memory);
+    DcmIO *io = dcm_io_create(error, &memory_methods, &memory);
+    if (io == NULL) {
+        dcm_mapping_cancel(mapping);
+        return NULL;
+    }
+
+    return io;
 }
 
 
@@ -400,3 +542,519 @@ int64_t dcm_io_seek(DcmError **error,
     return io->methods->seek(error, io, offset, whence);
 }
 
+
+
+bool dcm_io_can_read_at(const DcmIO *io)
+{
+#ifdef HAVE_PREAD
+    if (io->methods == &file_methods) {
+        return true;
+    }
+#endif /*HAVE_PREAD*/
+
+    return io->methods == &memory_methods;
+}
+
+
+/* The next length bytes of an IO object with external memory, without
+ * moving the read point, or NULL. The pointer stays valid while you hold a
+ * ref to the mapping.
+ */
+const char *dcm_io_peek(DcmIO *io, int64_t length, DcmMapping **mapping)
+{
+    if (io->methods == &memory_methods) {
+        DcmIOMemory *memory = (DcmIOMemory *) io;
+
+        if (memory->mapping &&
+            memory->length - memory->read_point >= length) {
+            *mapping = memory->mapping;
+            return memory->buffer + memory->read_point;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Read without moving the read point. Only for IO objects where
+ * dcm_io_can_read_at() is true.
+ */
+int64_t dcm_io_read_at(DcmError **error,
+                       DcmIO *io,
+                       int64_t offset,
+                       char *buffer,
+                       int64_t length)
+{
+#ifdef HAVE_PREAD
+    if (io->methods == &file_methods) {
+        return read_file_at(error, (DcmIOFile *) io, offset, buffer, length);
+    }
+#endif /*HAVE_PREAD*/
+
+    if (io->methods == &memory_methods) {
+        DcmIOMemory *memory = (DcmIOMemory *) io;
+        int64_t start = MAX(0, MIN(offset, memory->length));
+        int64_t bytes_to_copy = MIN(memory->length - start, length);
+
+        memcpy(buffer, memory->buffer + start, bytes_to_copy);
+
+        return bytes_to_copy;
+    }
+
+    dcm_error_set(error, DCM_ERROR_CODE_IO,
+        "Unable to read from IO",
+        "IO object does not support positional reads");
+
+    return -1;
+}
+
+
+#ifdef HAVE_ZLIB
+/* Deflated Explicit VR Little Endian files are a normal file meta header
+ * followed by a raw deflate stream.
+ *
+ * We inflate on demand into a ring buffer holding the most recent 32kb of
+ * output, so short backward seeks are cheap. As we go, we record a
+ * checkpoint at the first deflate block boundary after every
+ * DEFLATE_CHECKPOINT_SPAN bytes of output. A checkpoint holds the
+ * position in the compressed stream and the 32kb of output before it, which
+ * is enough to restart inflate there, so a long seek only needs to inflate
+ * from the nearest checkpoint, not from the start.
+ *
+ * This is the scheme used by zran.c in the zlib distribution.
+ */
+
+/* Largest deflate back reference, and the size of our ring buffer.
+ */
+#define DEFLATE_WINDOW (32768)
+
+/* Distance in output bytes between checkpoints.
+ */
+#define DEFLATE_CHECKPOINT_SPAN (1024 * 1024)
+
+struct DeflateCheckpoint {
+    // offset in the inflated stream
+    int64_t position;
+
+    // offset of the next compressed byte in the underlying IO, and the
+    // number of bits of the previous byte still to be used
+    int64_t input_offset;
+    int bits;
+
+    // the output just before position
+    unsigned char *dictionary;
+    uint32_t dictionary_length;
+};
+
+typedef struct _DcmIODeflate {
+    DcmIOMethods *methods;
+
+    // private fields
+    DcmIO *io;
+    int64_t start;
+
+    z_stream stream;
+    bool stream_end;
+    unsigned char input_buffer[BUFFER_SIZE];
+    // offset in io just after the last byte in input_buffer
+    int64_t input_offset;
+    // set if we've moved the read point of io
+    bool io_moved;
+
+    // the most recent output, ending at position
+    unsigned char ring[DEFLATE_WINDOW];
+    uint32_t ring_fill;
+    int64_t position;
+
+    // where the next read comes from
+    int64_t read_point;
+
+    struct DeflateCheckpoint *checkpoints;
+    uint32_t n_checkpoints;
+} DcmIODeflate;
+
+struct DeflateParams {
+    DcmIO *io;
+    int64_t start;
+};
+
+
+static void dcm_io_close_deflate(DcmIO *io)
+{
+    DcmIODeflate *deflate = (DcmIODeflate *) io;
+
+    (void) inflateEnd(&deflate->stream);
+    for (uint32_t i = 0; i < deflate->n_checkpoints; i++) {
+        free(deflate->checkpoints[i].dictionary);
+    }
+    free(deflate->checkpoints);
+    dcm_io_close(deflate->io);
+    free(deflate);
+}
+
+
+static DcmIO *dcm_io_open_deflate(DcmError **error, void *client)
+{
+    struct DeflateParams *params = (struct DeflateParams *) client;
+
+    DcmIODeflate *deflate = DCM_NEW(error, DcmIODeflate);
+    if (deflate == NULL) {
+        return NULL;
+    }
+    deflate->io = params->io;
+    deflate->start = params->start;
+    deflate->input_offset = params->start;
+    deflate->position = params->start;
+    deflate->read_point = params->start;
+    deflate->io_moved = true;
+
+    // a negative window size means raw deflate, with no zlib header
+    if (inflateInit2(&deflate->stream, -15) != Z_OK) {
+        dcm_error_set(error, DCM_ERROR_CODE_NOMEM,
+                      "Unable to open deflate stream",
+                      "inflateInit2() failed");
+        free(deflate);
+        return NULL;
+    }
+
+    // we can always restart from the beginning
+    deflate->checkpoints = DCM_NEW(error, struct DeflateCheckpoint);
+    if (deflate->checkpoints == NULL) {
+        (void) inflateEnd(&deflate->stream);
+        free(deflate);
+        return NULL;
+    }
+    deflate->checkpoints[0].position = params->start;
+    deflate->checkpoints[0].input_offset = params->start;
+    deflate->n_checkpoints = 1;
+
+    return (DcmIO *) deflate;
+}
+
+
+/* Copy the last length bytes of output into buffer, oldest first.
+ */
+static void ring_copy_out(const DcmIODeflate *deflate,
+                          unsigned char *buffer,
+                          uint32_t length)
+{
+    uint32_t head = (uint32_t) ((deflate->position - deflate->start) %
+                                DEFLATE_WINDOW);
+    uint32_t first = (head + DEFLATE_WINDOW - length) % DEFLATE_WINDOW;
+    uint32_t tail_length = MIN(length, DEFLATE_WINDOW - first);
+
+    memcpy(buffer, deflate->ring + first, tail_length);
+    memcpy(buffer + tail_length, deflate->ring, length - tail_length);
+}
+
+
+static bool add_checkpoint(DcmError **error, DcmIODeflate *deflate)
+{
+    struct DeflateCheckpoint *checkpoints =
+        dcm_realloc(error,
+                    deflate->checkpoints,
+                    (deflate->n_checkpoints + 1) *
+                        sizeof(struct DeflateCheckpoint));
+    if (checkpoints == NULL) {
+        return false;
+    }
+    deflate->checkpoints = checkpoints;
+
+    struct DeflateCheckpoint *checkpoint =
+        &checkpoints[deflate->n_checkpoints];
+    checkpoint->dictionary = DCM_MALLOC(error, deflate->ring_fill);
+    if (checkpoint->dictionary == NULL) {
+        return false;
+    }
+    ring_copy_out(deflate, checkpoint->dictionary, deflate->ring_fill);
+    checkpoint->dictionary_length = deflate->ring_fill;
+    checkpoint->position = deflate->position;
+    checkpoint->input_offset = deflate->input_offset -
+        deflate->stream.avail_in;
+    checkpoint->bits = deflate->stream.data_type & 7;
+    deflate->n_checkpoints += 1;
+
+    return true;
+}
+
+
+/* Restart inflate from a checkpoint.
+ */
+static bool restore_checkpoint(DcmError **error,
+                               DcmIODeflate *deflate,
+                               const struct DeflateCheckpoint *checkpoint)
+{
+    int64_t offset = checkpoint->input_offset - (checkpoint->bits ? 1 : 0);
+    if (dcm_io_seek(error, deflate->io, offset, SEEK_SET) < 0) {
+        return false;
+    }
+    deflate->input_offset = offset;
+    deflate->io_moved = false;
+
+    (void) inflateReset(&deflate->stream);
+    deflate->stream.avail_in = 0;
+    deflate->stream_end = false;
+
+    if (checkpoint->bits) {
+        unsigned char byte;
+        if (dcm_io_read(error, deflate->io, (char *) &byte, 1) != 1) {
+            dcm_error_set(error, DCM_ERROR_CODE_IO,
+                          "Unable to read deflate stream",
+                          "Checkpoint is past the end of the file");
+            return false;
+        }
+        deflate->input_offset += 1;
+        (void) inflatePrime(&deflate->stream,
+                            checkpoint->bits,
+                            byte >> (8 - checkpoint->bits));
+    }
+
+    if (checkpoint->dictionary_length > 0) {
+        (void) inflateSetDictionary(&deflate->stream,
+                                    checkpoint->dictionary,
+                                    checkpoint->dictionary_length);
+    }
+
+    // the dictionary is the output just before the checkpoint, so it goes
+    // in the ring too
+    deflate->position = checkpoint->position;
+    deflate->ring_fill = checkpoint->dictionary_length;
+    uint32_t head = (uint32_t) ((deflate->position - deflate->start) %
+                                DEFLATE_WINDOW);
+    for (uint32_t i = 0; i < checkpoint->dictionary_length; i++) {
+        uint32_t index = (head + DEFLATE_WINDOW -
+                          checkpoint->dictionary_length + i) % DEFLATE_WINDOW;
+        deflate->ring[index] = checkpoint->dictionary[i];
+    }
+
+    return true;
+}
+
+
+/* Inflate some more output into the ring.
+ * -1 on error, 0 at the end of the stream, otherwise bytes produced.
+ */
+static int64_t inflate_more(DcmError **error, DcmIODeflate *deflate)
+{
+    if (deflate->stream_end) {
+        return 0;
+    }
+
+    if (deflate->stream.avail_in == 0) {
+        if (deflate->io_moved) {
+            if (dcm_io_seek(error,
+                            deflate->io,
+                            deflate->input_offset,
+                            SEEK_SET) < 0) {
+                return -1;
+            }
+            deflate->io_moved = false;
+        }
+
+        int64_t bytes_read = dcm_io_read(error,
+                                         deflate->io,
+                                         (char *) deflate->input_buffer,
+                                         BUFFER_SIZE);
+        if (bytes_read < 0) {
+            return -1;
+        }
+        if (bytes_read == 0) {
+            // a truncated stream ... treat as end of file
+            deflate->stream_end = true;
+            return 0;
+        }
+        deflate->stream.next_in = deflate->input_buffer;
+        deflate->stream.avail_in = (uInt) bytes_read;
+        deflate->input_offset += bytes_read;
+    }
+
+    uint32_t head = (uint32_t) ((deflate->position - deflate->start) %
+                                DEFLATE_WINDOW);
+    deflate->stream.next_out = deflate->ring + head;
+    deflate->stream.avail_out = DEFLATE_WINDOW - head;
+
+    // stop at block boundaries, so we can add checkpoints
+    int result = inflate(&deflate->stream, Z_BLOCK);
+    if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Unable to read deflate stream",
+                      "inflate() failed - %s",
+                      deflate->stream.msg ? deflate->stream.msg : "unknown");
+        return -1;
+    }
+
+    uint32_t produced = DEFLATE_WINDOW - head - deflate->stream.avail_out;
+    deflate->position += produced;
+    deflate->ring_fill = MIN(DEFLATE_WINDOW, deflate->ring_fill + produced);
+
+    if (result == Z_STREAM_END) {
+        deflate->stream_end = true;
+    } else {
+        // at the end of a block which is not the last block
+        const struct DeflateCheckpoint *last =
+            &deflate->checkpoints[deflate->n_checkpoints - 1];
+        if ((deflate->stream.data_type & 128) &&
+            !(deflate->stream.data_type & 64) &&
+            deflate->position - last->position >= DEFLATE_CHECKPOINT_SPAN &&
+            !add_checkpoint(error, deflate)) {
+            return -1;
+        }
+    }
+
+    // inflate can stop at a block boundary with no output, so we must not
+    // report end of stream here
+    return produced == 0 && deflate->stream_end ? 0 : MAX(1, produced);
+}
+
+
+static int64_t dcm_io_read_deflate(DcmError **error, DcmIO *io,
+    char *buffer, int64_t length)
+{
+    DcmIODeflate *deflate = (DcmIODeflate *) io;
+    int64_t bytes_read = 0;
+
+    // the file meta is before the stream, and is read directly
+    if (deflate->read_point < deflate->start) {
+        int64_t bytes_to_read = MIN(length,
+                                    deflate->start - deflate->read_point);
+        if (dcm_io_seek(error,
+                        deflate->io,
+                        deflate->read_point,
+                        SEEK_SET) < 0) {
+            return -1;
+        }
+        deflate->io_moved = true;
+
+        bytes_read = dcm_io_read(error, deflate->io, buffer, bytes_to_read);
+        if (bytes_read <= 0) {
+            return bytes_read;
+        }
+        deflate->read_point += bytes_read;
+        buffer += bytes_read;
+        length -= bytes_read;
+    }
+
+    while (length > 0) {
+        int64_t window_start = deflate->position - deflate->ring_fill;
+
+        if (deflate->read_point < window_start ||
+            deflate->read_point >= deflate->position) {
+            // restart from a checkpoint if that's closer than the current
+            // position
+            uint32_t i = deflate->n_checkpoints - 1;
+            while (i > 0 &&
+                   deflate->checkpoints[i].position > deflate->read_point) {
+                i -= 1;
+            }
+            const struct DeflateCheckpoint *checkpoint =
+                &deflate->checkpoints[i];
+            if (deflate->read_point < window_start ||
+                checkpoint->position > deflate->position) {
+                if (!restore_checkpoint(error, deflate, checkpoint)) {
+                    return -1;
+                }
+            }
+        }
+
+        if (deflate->read_point >= deflate->position) {
+            int64_t produced = inflate_more(error, deflate);
+            if (produced < 0) {
+                return -1;
+            } else if (produced == 0) {
+                // end of stream, we maybe read some bytes in a previous loop
+                break;
+            }
+            continue;
+        }
+
+        // copy from the ring
+        uint32_t index = (uint32_t) ((deflate->read_point - deflate->start) %
+                                     DEFLATE_WINDOW);
+        int64_t bytes_to_copy = MIN(length,
+                                    deflate->position - deflate->read_point);
+        bytes_to_copy = MIN(bytes_to_copy, DEFLATE_WINDOW - index);
+        memcpy(buffer, deflate->ring + index, bytes_to_copy);
+
+        buffer += bytes_to_copy;
+        length -= bytes_to_copy;
+        deflate->read_point += bytes_to_copy;
+        bytes_read += bytes_to_copy;
+    }
+
+    return bytes_read;
+}
+
+
+static int64_t dcm_io_seek_deflate(DcmError **error, DcmIO *io,
+    int64_t offset, int whence)
+{
+    DcmIODeflate *deflate = (DcmIODeflate *) io;
+
+    int64_t new_offset;
+
+    switch (whence)
+    {
+        case SEEK_SET:
+            new_offset = offset;
+            break;
+
+        case SEEK_CUR:
+            new_offset = deflate->read_point + offset;
+            break;
+
+        default:
+            // we'd need to inflate the whole stream to find the end
+            dcm_error_set(error, DCM_ERROR_CODE_IO,
+                "Unsupported whence",
+                "Whence %d not implemented for deflate streams", whence);
+            return -1;
+    }
+
+    if (new_offset < 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_IO,
+            "Unable to seek deflate stream",
+            "Offset %"PRId64" is before the start", new_offset);
+        return -1;
+    }
+
+    // we inflate lazily, on the next read
+    deflate->read_point = new_offset;
+
+    return new_offset;
+}
+
+
+static DcmIOMethods deflate_methods = {
+    dcm_io_open_deflate,
+    dcm_io_close_deflate,
+    dcm_io_read_deflate,
+    dcm_io_seek_deflate,
+};
+#endif /*HAVE_ZLIB*/
+
+
+/* Wrap an IO object whose content from start onwards is a raw deflate
+ * stream. Offsets are unchanged before start, and after start are offsets
+ * into the inflated stream. The new IO object owns io and closes it. On
+ * failure, io is left open and the caller still owns it.
+ */
+DcmIO *dcm_io_create_deflate(DcmError **error, DcmIO *io, int64_t start)
+{
+#ifdef HAVE_ZLIB
+    struct DeflateParams params = {
+        io,
+        start,
+    };
+
+    return dcm_io_create(error, &deflate_methods, &params);
+#else
+    USED(io);
+    USED(start);
+
+    dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                  "Unable to read deflate stream",
+                  "libdicom was built without zlib");
+
+    return NULL;
+#endif /*HAVE_ZLIB*/
+}
@@ -14,7 +14,9 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -41,6 +43,14 @@ typedef struct _DcmParseState {
     DcmDataSet *meta;
     int64_t offset;
     int64_t pixel_data_offset;
+
+    // the raw bytes of lazy sequence items, reused for each sequence
+    char *capture;
+    uint32_t capture_length;
+    size_t capture_capacity;
+    uint32_t *item_offsets;
+    uint32_t n_item_offsets;
+    uint32_t item_offsets_capacity;
 } DcmParseState;
 
 
@@ -58,6 +68,15 @@ static int64_t dcm_read(DcmParseState *state,
 }
 
 
+/* Ask the client before allocating memory for a value.
+ */
+static bool dcm_reserve(DcmParseState *state, uint64_t size)
+{
+    return state->parse->reserve == NULL ||
+        state->parse->reserve(state->error, state->client, size);
+}
+
+
 static bool dcm_require(DcmParseState *state,
     char *buffer, int64_t length, int64_t *position)
 {
@@ -110,6 +129,15 @@ static bool dcm_is_eof(DcmParseState *state)
 }
 
 
+static void capture_free(DcmParseState *state)
+{
+    free(state->capture);
+    free(state->item_offsets);
+    state->capture = NULL;
+    state->item_offsets = NULL;
+}
+
+
 /* TRUE for big-endian machines, like PPC. We need to byteswap DICOM
  * numeric types in this case. Run time tests for this are much
  * simpler to manage when cross-compiling.
@@ -251,6 +279,15 @@ static bool parse_element(DcmParseState *state,
                           int64_t *position);
 
 
+/* Defined below, with the scanner.
+ */
+static bool parse_element_sequence_lazy(DcmParseState *state,
+                                        uint32_t seq_tag,
+                                        DcmVR seq_vr,
+                                        uint32_t seq_length,
+                                        int64_t *position);
+
+
 static bool parse_element_header(DcmParseState *state,
                                  uint32_t *tag,
                                  DcmVR *vr,
@@ -443,6 +480,9 @@ static bool parse_pixeldata_item(DcmParseState *state,
 
     // read to our stack buffer, if possible
     if (item_length > INPUT_BUFFER_SIZE) {
+        if (!dcm_reserve(state, item_length)) {
+            return false;
+        }
         value = value_free = DCM_MALLOC(state->error, item_length);
         if (value_free == NULL) {
             return false;
@@ -555,6 +595,35 @@ static bool parse_pixeldata(DcmParseState *state,
 }
 
 
+/* Big binary and numeric values can be used in place, if the IO is mapped.
+ * Strings are changed during parse, so they are always read, and numeric
+ * values must be aligned and need no byteswap.
+ */
+static const char *peek_value(DcmParseState *state,
+                              DcmVRClass vr_class,
+                              size_t size,
+                              uint32_t length,
+                              DcmMapping **mapping)
+{
+    if (state->parse->element_borrow == NULL ||
+        length < INPUT_BUFFER_SIZE ||
+        (vr_class != DCM_VR_CLASS_BINARY &&
+         vr_class != DCM_VR_CLASS_NUMERIC_DECIMAL &&
+         vr_class != DCM_VR_CLASS_NUMERIC_INTEGER) ||
+        (size > 0 && state->big_endian)) {
+        return NULL;
+    }
+
+    const char *value = dcm_io_peek(state->io, length, mapping);
+    if (value == NULL ||
+        (vr_class != DCM_VR_CLASS_BINARY && (uintptr_t) value % size != 0)) {
+        return NULL;
+    }
+
+    return value;
+}
+
+
 static bool parse_element_body(DcmParseState *state,
                                uint32_t tag,
                                DcmVR vr,
@@ -597,8 +666,28 @@ static bool parse_element_body(DcmParseState *state,
                 }
             }
 
+            DcmMapping *mapping;
+            const char *mapped = peek_value(state,
+                                            vr_class,
+                                            size,
+                                            length,
+                                            &mapping);
+            if (mapped) {
+                return state->parse->element_borrow(state->error,
+                                                    state->client,
+                                                    tag,
+                                                    vr,
+                                                    mapped,
+                                                    length,
+                                                    mapping) &&
+                    dcm_seekcur(state, length, position);
+            }
+
             // read to a static char buffer, if possible
             if ((int64_t) length + 1 >= INPUT_BUFFER_SIZE) {
+                if (!dcm_reserve(state, (uint64_t) length + 1)) {
+                    return false;
+                }
                 value = value_free = DCM_MALLOC(state->error,
                                                 (size_t) length + 1);
                 if (value == NULL) {
@@ -616,7 +705,10 @@ static bool parse_element_body(DcmParseState *state,
             }
             value[length] = '\0';
 
-            if (length > 0) {
+            // only strings are padded
+            if (length > 0 &&
+                (vr_class == DCM_VR_CLASS_STRING_SINGLE ||
+                 vr_class == DCM_VR_CLASS_STRING_MULTI)) {
                 if (vr != DCM_VR_UI) {
                     if (isspace(value[length - 1])) {
                         value[length - 1] = '\0';
@@ -659,11 +751,19 @@ static bool parse_element_body(DcmParseState *state,
             }
 
             int64_t seq_position = 0;
-            if (!parse_element_sequence(state,
-                                        tag,
-                                        vr,
-                                        length,
-                                        &seq_position)) {
+            if (state->parse->sequence_raw) {
+                if (!parse_element_sequence_lazy(state,
+                                                 tag,
+                                                 vr,
+                                                 length,
+                                                 &seq_position)) {
+                    return false;
+                }
+            } else if (!parse_element_sequence(state,
+                                               tag,
+                                               vr,
+                                               length,
+                                               &seq_position)) {
                 return false;
             }
             *position += seq_position;
@@ -770,31 +870,15 @@ bool dcm_parse_dataset(DcmError **error,
     };
 
     int64_t position = 0;
-    if (!parse_toplevel_dataset(&state, &position)) {
-        return false;
-    }
+    bool result = parse_toplevel_dataset(&state, &position);
+    capture_free(&state);
 
-    return true;
+    return result;
 }
 
 
-/* Parse a group. A length element, followed by a list of elements.
- */
-bool dcm_parse_group(DcmError **error,
-                     DcmIO *io,
-                     bool implicit,
-                     const DcmParse *parse,
-                     void *client)
+static bool parse_group(DcmParseState *state)
 {
-    DcmParseState state = {
-        .error = error,
-        .io = io,
-        .implicit = implicit,
-        .big_endian = is_big_endian(),
-        .parse = parse,
-        .client = client
-    };
-
     int64_t position = 0;
 
     /* Groups start with (xxxx0000, UL, 4), meaning a 32-bit length value.
@@ -802,41 +886,41 @@ bool dcm_parse_group(DcmError **error,
     uint32_t tag;
     DcmVR vr;
     uint32_t length;
-    if (!parse_element_header(&state, &tag, &vr, &length, &position)) {
+    if (!parse_element_header(state, &tag, &vr, &length, &position)) {
         return false;
     }
     uint16_t element_number = tag & 0xffff;
     uint16_t group_number = tag >> 16;
     if (element_number != 0x0000 || vr != DCM_VR_UL || length != 4) {
-        dcm_error_set(state.error, DCM_ERROR_CODE_PARSE,
+        dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
                       "Reading of Group failed",
                       "Bad Group length element");
         return false;
     }
     uint32_t group_length;
-    if (!read_uint32(&state, &group_length, &position)) {
+    if (!read_uint32(state, &group_length, &position)) {
         return false;
     }
 
     // parse the elements in the group to a dataset
-    if (state.parse->dataset_begin &&
-        !state.parse->dataset_begin(state.error, state.client)) {
+    if (state->parse->dataset_begin &&
+        !state->parse->dataset_begin(state->error, state->client)) {
         return false;
     }
 
     while (position < group_length) {
         int64_t element_start = 0;
-        if (!parse_element_header(&state, &tag, &vr, &length, &element_start)) {
+        if (!parse_element_header(state, &tag, &vr, &length, &element_start)) {
             return false;
         }
 
         // stop if we read the first tag of the group beyond,
         // or if the stop function triggers
         if ((tag >> 16) != group_number ||
-            (state.parse->stop &&
-             state.parse->stop(state.client, tag, vr, length))) {
+            (state->parse->stop &&
+             state->parse->stop(state->client, tag, vr, length))) {
             // seek back to the start of this element
-            if (!dcm_seekcur(&state, -element_start, &element_start)) {
+            if (!dcm_seekcur(state, -element_start, &element_start)) {
                 return false;
             }
 
@@ -845,13 +929,13 @@ bool dcm_parse_group(DcmError **error,
 
         position += element_start;
 
-        if (!parse_element_body(&state, tag, vr, length, &position)) {
+        if (!parse_element_body(state, tag, vr, length, &position)) {
             return false;
         }
     }
 
-    if (state.parse->dataset_end &&
-        !state.parse->dataset_end(state.error, state.client)) {
+    if (state->parse->dataset_end &&
+        !state->parse->dataset_end(state->error, state->client)) {
         return false;
     }
 
@@ -859,6 +943,30 @@ bool dcm_parse_group(DcmError **error,
 }
 
 
+/* Parse a group. A length element, followed by a list of elements.
+ */
+bool dcm_parse_group(DcmError **error,
+                     DcmIO *io,
+                     bool implicit,
+                     const DcmParse *parse,
+                     void *client)
+{
+    DcmParseState state = {
+        .error = error,
+        .io = io,
+        .implicit = implicit,
+        .big_endian = is_big_endian(),
+        .parse = parse,
+        .client = client
+    };
+
+    bool result = parse_group(&state);
+    capture_free(&state);
+
+    return result;
+}
+
+
 /* Walk pixeldata and set up offsets. We use the BOT, if present, otherwise we
  * have to scan the whole thing.
  *
@@ -1006,46 +1114,695 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
     return true;
 }
 
-char *dcm_parse_frame(DcmError **error,
-                      DcmIO *io,
-                      bool implicit,
-                      struct PixelDescription *desc,
-                      uint32_t *length)
+/* The size of the buffer we scan PerFrameFunctionalGroupsSequence with. Most
+ * elements we skip are small, so we want to step over them in memory rather
+ * than with a seek.
+ */
+#define SCAN_BUFFER_SIZE (64 * 1024)
+
+/* How deeply sequences can nest before we reject the file.
+ */
+#define SCAN_MAX_DEPTH (32)
+
+
+typedef struct _DcmScanState {
+    DcmError **error;
+    DcmIO *io;
+    bool implicit;
+
+    // file offset of buffer[0]
+    int64_t buffer_offset;
+    int64_t bytes_in_buffer;
+    int64_t read_point;
+    char buffer[SCAN_BUFFER_SIZE];
+} DcmScanState;
+
+
+static int64_t scan_offset(DcmScanState *state)
 {
-    DcmParseState state = {
-        .error = error,
-        .io = io,
-        .implicit = implicit,
-        .big_endian = is_big_endian(),
-    };
+    return state->buffer_offset + state->read_point;
+}
 
-    int64_t position = 0;
 
-    if (dcm_is_encapsulated_transfer_syntax(desc->transfer_syntax_uid)) {
+static bool scan_require(DcmScanState *state, char *value, int64_t length)
+{
+    while (length > 0) {
+        if (state->read_point == state->bytes_in_buffer) {
+            state->buffer_offset += state->bytes_in_buffer;
+            state->bytes_in_buffer = 0;
+            state->read_point = 0;
+
+            int64_t bytes_read = dcm_io_read(state->error,
+                                             state->io,
+                                             state->buffer,
+                                             SCAN_BUFFER_SIZE);
+            if (bytes_read < 0) {
+                return false;
+            } else if (bytes_read == 0) {
+                dcm_error_set(state->error, DCM_ERROR_CODE_IO,
+                    "End of filehandle",
+                    "Needed %"PRId64" bytes beyond end of filehandle",
+                    length);
+                return false;
+            }
+
+            state->bytes_in_buffer = bytes_read;
+        }
+
+        int64_t n = MIN(length, state->bytes_in_buffer - state->read_point);
+        memcpy(value, state->buffer + state->read_point, n);
+        state->read_point += n;
+        value += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+
+static bool scan_skip(DcmScanState *state, int64_t length)
+{
+    if (length <= state->bytes_in_buffer - state->read_point) {
+        state->read_point += length;
+        return true;
+    }
+
+    // beyond the end of the buffer, so we must seek
+    int64_t offset = scan_offset(state) + length;
+    if (dcm_io_seek(state->error, state->io, offset, SEEK_SET) < 0) {
+        return false;
+    }
+    state->buffer_offset = offset;
+    state->bytes_in_buffer = 0;
+    state->read_point = 0;
+
+    return true;
+}
+
+
+static uint16_t scan_uint16(const char *value)
+{
+    const unsigned char *p = (const unsigned char *) value;
+
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+
+static uint32_t scan_uint32(const char *value)
+{
+    const unsigned char *p = (const unsigned char *) value;
+
+    return (uint32_t) p[0] |
+        ((uint32_t) p[1] << 8) |
+        ((uint32_t) p[2] << 16) |
+        ((uint32_t) p[3] << 24);
+}
+
+
+/* True for VRs with a 4 byte length field in explicit mode.
+ */
+static bool scan_is_long_vr(const char *vr)
+{
+    char vr_str[3] = { vr[0], vr[1], '\0' };
+
+    return dcm_dict_vr_header_length(dcm_dict_vr_from_str(vr_str)) == 4;
+}
+
+
+static bool scan_element_header(DcmScanState *state,
+                                uint32_t *tag,
+                                uint32_t *length)
+{
+    char header[8];
+    if (!scan_require(state, header, 8)) {
+        return false;
+    }
+    *tag = ((uint32_t) scan_uint16(header) << 16) | scan_uint16(header + 2);
+
+    // item and delimiter tags have no VR, even in explicit mode
+    if (state->implicit || (*tag >> 16) == 0xfffe) {
+        *length = scan_uint32(header + 4);
+    } else if (scan_is_long_vr(header + 4)) {
+        char long_length[4];
+        if (!scan_require(state, long_length, 4)) {
+            return false;
+        }
+        *length = scan_uint32(long_length);
+    } else {
+        *length = scan_uint16(header + 6);
+    }
+
+    return true;
+}
+
+
+static bool scan_value(DcmScanState *state,
+                       uint32_t length,
+                       char *value,
+                       uint32_t capacity)
+{
+    if (length > capacity) {
+        return scan_skip(state, length);
+    }
+
+    if (!scan_require(state, value, length)) {
+        return false;
+    }
+    value[length] = '\0';
+
+    // string values are padded with space or NUL to an even length
+    while (length > 0 && (value[length - 1] == ' ' ||
+                          value[length - 1] == '\0')) {
+        value[--length] = '\0';
+    }
+
+    return true;
+}
+
+
+/* This is used recursively.
+ */
+static bool scan_sequence(DcmScanState *state,
+                          uint32_t seq_length,
+                          int depth,
+                          struct FramePosition *position);
+
+
+/* Scan the elements of an item. If position is non-NULL, we record any
+ * frame position values we find.
+ */
+static bool scan_item(DcmScanState *state,
+                      uint32_t item_length,
+                      int depth,
+                      struct FramePosition *position)
+{
+    int64_t start = scan_offset(state);
+
+    if (depth > SCAN_MAX_DEPTH) {
+        dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                      "Reading PerFrameFunctionalGroupsSequence failed",
+                      "Sequences nested too deeply");
+        return false;
+    }
+
+    while (item_length == 0xffffffff ||
+           scan_offset(state) - start < item_length) {
         uint32_t tag;
-        if (!read_tag(&state, &tag, &position) ||
-            !read_uint32(&state, length, &position)) {
-            return NULL;
+        uint32_t length;
+        if (!scan_element_header(state, &tag, &length)) {
+            return false;
+        }
+
+        if (tag == TAG_ITEM_DELIM) {
+            break;
+        }
+
+        char value[DCM_CAPACITY_DS + 1];
+        switch (tag) {
+        case TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX:
+        case TAG_ROW_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX:
+            if (position == NULL || length != 4) {
+                if (!scan_skip(state, length)) {
+                    return false;
+                }
+                break;
+            }
+
+            if (!scan_require(state, value, 4)) {
+                return false;
+            }
+            if (tag == TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX) {
+                position->column = (int32_t) scan_uint32(value);
+                position->have_column = true;
+            } else {
+                position->row = (int32_t) scan_uint32(value);
+                position->have_row = true;
+            }
+            break;
+
+        case TAG_Z_OFFSET_IN_SLIDE_COORDINATE_SYSTEM:
+            if (position == NULL) {
+                if (!scan_skip(state, length)) {
+                    return false;
+                }
+                break;
+            }
+
+            value[0] = '\0';
+            if (!scan_value(state, length, value, DCM_CAPACITY_DS)) {
+                return false;
+            }
+            if (value[0] != '\0') {
+                position->z = strtod(value, NULL);
+                position->have_z = true;
+            }
+            break;
+
+        case TAG_OPTICAL_PATH_IDENTIFIER:
+            if (position == NULL) {
+                if (!scan_skip(state, length)) {
+                    return false;
+                }
+                break;
+            }
+
+            if (!scan_value(state,
+                            length,
+                            position->optical_path_identifier,
+                            DCM_CAPACITY_SH)) {
+                return false;
+            }
+            break;
+
+        case TAG_PLANE_POSITION_SLIDE_SEQUENCE:
+        case TAG_OPTICAL_PATH_IDENTIFICATION_SEQUENCE:
+            if (!scan_sequence(state, length, depth + 1, position)) {
+                return false;
+            }
+            break;
+
+        default:
+            // only sequences can have undefined length here, and we must walk
+            // them to find the end
+            if (length == 0xffffffff) {
+                if (!scan_sequence(state, length, depth + 1, NULL)) {
+                    return false;
+                }
+            } else if (!scan_skip(state, length)) {
+                return false;
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+
+static bool scan_sequence(DcmScanState *state,
+                          uint32_t seq_length,
+                          int depth,
+                          struct FramePosition *position)
+{
+    int64_t start = scan_offset(state);
+
+    while (seq_length == 0xffffffff ||
+           scan_offset(state) - start < seq_length) {
+        uint32_t tag;
+        uint32_t length;
+        if (!scan_element_header(state, &tag, &length)) {
+            return false;
+        }
+
+        if (tag == TAG_SQ_DELIM) {
+            break;
         }
 
         if (tag != TAG_ITEM) {
-            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
-                          "Reading Frame Item failed",
-                          "No Item Tag found for Frame Item");
-            return NULL;
+            dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                          "Reading PerFrameFunctionalGroupsSequence failed",
+                          "Expected tag '%08x' instead of '%08x'",
+                          TAG_ITEM,
+                          tag);
+            return false;
+        }
+
+        // we can jump over defined length items we are not interested in
+        if (position == NULL && length != 0xffffffff) {
+            if (!scan_skip(state, length)) {
+                return false;
+            }
+        } else if (!scan_item(state, length, depth, position)) {
+            return false;
         }
-    } else {
-        *length = desc->rows * desc->columns * desc->samples_per_pixel;
     }
 
-    char *value = DCM_MALLOC(error, *length);
-    if (value == NULL) {
+    return true;
+}
+
+
+/* Lazy sequences. Rather than parsing the items of a sequence, we copy the
+ * bytes of each item to the capture buffer and record where each item
+ * starts. The client can parse items from these bytes later, if it needs
+ * them.
+ *
+ * Item headers and delimiters are not copied, so item i runs from
+ * item_offsets[i] to item_offsets[i + 1].
+ */
+static char *capture_require(DcmParseState *state,
+                             uint32_t length,
+                             int64_t *position)
+{
+    uint64_t needed = (uint64_t) state->capture_length + length;
+    if (needed > UINT32_MAX) {
+        dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                      "Reading of Data Element failed",
+                      "Sequence too large");
         return NULL;
     }
-    if (!dcm_require(&state, value, *length, &position)) {
-        free(value);
+
+    if (needed > state->capture_capacity) {
+        size_t capacity = MAX(4096, state->capture_capacity * 2);
+        capacity = MAX(capacity, (size_t) needed);
+        if (!dcm_reserve(state, capacity)) {
+            return NULL;
+        }
+        char *capture = dcm_realloc(state->error, state->capture, capacity);
+        if (capture == NULL) {
+            return NULL;
+        }
+        state->capture = capture;
+        state->capture_capacity = capacity;
+    }
+
+    char *value = state->capture + state->capture_length;
+    if (!dcm_require(state, value, length, position)) {
         return NULL;
     }
+    state->capture_length += length;
 
     return value;
 }
+
+
+static bool capture_item_start(DcmParseState *state)
+{
+    if (state->n_item_offsets == state->item_offsets_capacity) {
+        uint32_t capacity = MAX(16, state->item_offsets_capacity * 2);
+        uint32_t *item_offsets = dcm_realloc(state->error,
+                                             state->item_offsets,
+                                             capacity * sizeof(uint32_t));
+        if (item_offsets == NULL) {
+            return false;
+        }
+        state->item_offsets = item_offsets;
+        state->item_offsets_capacity = capacity;
+    }
+
+    state->item_offsets[state->n_item_offsets++] = state->capture_length;
+
+    return true;
+}
+
+
+/* This is used recursively.
+ */
+static bool capture_sequence(DcmParseState *state,
+                             uint32_t seq_length,
+                             int depth,
+                             int64_t *position);
+
+
+/* Copy the elements of an item. Undefined length items end with a
+ * delimiter, which we only keep for items of nested sequences.
+ */
+static bool capture_item(DcmParseState *state,
+                         uint32_t item_length,
+                         int depth,
+                         bool keep_delimiter,
+                         int64_t *position)
+{
+    if (item_length != 0xffffffff) {
+        return capture_require(state, item_length, position) != NULL;
+    }
+
+    if (depth > SCAN_MAX_DEPTH) {
+        dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                      "Reading of Data Element failed",
+                      "Sequences nested too deeply");
+        return false;
+    }
+
+    // we must walk the elements to find the end
+    for (;;) {
+        const char *header = capture_require(state, 8, position);
+        if (header == NULL) {
+            return false;
+        }
+        uint32_t tag = ((uint32_t) scan_uint16(header) << 16) |
+            scan_uint16(header + 2);
+
+        if (tag == TAG_ITEM_DELIM) {
+            if (!keep_delimiter) {
+                state->capture_length -= 8;
+            }
+            return true;
+        }
+
+        uint32_t length;
+        if (state->implicit) {
+            length = scan_uint32(header + 4);
+        } else if (scan_is_long_vr(header + 4)) {
+            const char *long_length = capture_require(state, 4, position);
+            if (long_length == NULL) {
+                return false;
+            }
+            length = scan_uint32(long_length);
+        } else {
+            length = scan_uint16(header + 6);
+        }
+
+        // only sequences can have undefined length here
+        if (length == 0xffffffff) {
+            if (!capture_sequence(state, length, depth + 1, position)) {
+                return false;
+            }
+        } else if (!capture_require(state, length, position)) {
+            return false;
+        }
+    }
+}
+
+
+/* Copy a nested sequence, item headers and all.
+ */
+static bool capture_sequence(DcmParseState *state,
+                             uint32_t seq_length,
+                             int depth,
+                             int64_t *position)
+{
+    if (seq_length != 0xffffffff) {
+        return capture_require(state, seq_length, position) != NULL;
+    }
+
+    for (;;) {
+        const char *header = capture_require(state, 8, position);
+        if (header == NULL) {
+            return false;
+        }
+        uint32_t tag = ((uint32_t) scan_uint16(header) << 16) |
+            scan_uint16(header + 2);
+        uint32_t length = scan_uint32(header + 4);
+
+        if (tag == TAG_SQ_DELIM) {
+            return true;
+        }
+
+        if (tag != TAG_ITEM) {
+            dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                          "Reading of Data Element failed",
+                          "Expected tag '%08x' instead of '%08x'",
+                          TAG_ITEM,
+                          tag);
+            return false;
+        }
+
+        if (!capture_item(state, length, depth, true, position)) {
+            return false;
+        }
+    }
+}
+
+
+static bool parse_element_sequence_lazy(DcmParseState *state,
+                                        uint32_t seq_tag,
+                                        DcmVR seq_vr,
+                                        uint32_t seq_length,
+                                        int64_t *position)
+{
+    state->capture_length = 0;
+    state->n_item_offsets = 0;
+
+    int index = 0;
+    while (*position < seq_length) {
+        uint32_t item_tag;
+        uint32_t item_length;
+        if (!read_tag(state, &item_tag, position) ||
+            !read_uint32(state, &item_length, position)) {
+            return false;
+        }
+
+        if (item_tag == TAG_SQ_DELIM) {
+            break;
+        }
+
+        if (item_tag != TAG_ITEM) {
+            dcm_error_set(state->error, DCM_ERROR_CODE_PARSE,
+                          "Reading of Data Element failed",
+                          "Expected tag '%08x' instead of '%08x' "
+                          "for Item #%d",
+                          TAG_ITEM,
+                          item_tag,
+                          index);
+            return false;
+        }
+
+        if (!capture_item_start(state) ||
+            !capture_item(state, item_length, 1, false, position)) {
+            return false;
+        }
+
+        index += 1;
+    }
+
+    // the end of the final item
+    if (!capture_item_start(state)) {
+        return false;
+    }
+
+    return state->parse->sequence_raw(state->error,
+                                      state->client,
+                                      seq_tag,
+                                      seq_vr,
+                                      state->capture,
+                                      state->capture_length,
+                                      state->item_offsets,
+                                      state->n_item_offsets - 1);
+}
+
+
+/* Scan PerFrameFunctionalGroupsSequence for frame positions. This is much
+ * quicker than the generic parser, since we step over everything except the
+ * handful of elements we need without allocating or decoding.
+ *
+ * The io must be positioned at the start of the sequence element, and is left
+ * just after it.
+ */
+bool dcm_parse_frame_positions(DcmError **error,
+                               DcmIO *io,
+                               bool implicit,
+                               struct FramePosition *positions,
+                               uint32_t num_frames)
+{
+    DcmScanState *state = DCM_NEW(error, DcmScanState);
+    if (state == NULL) {
+        return false;
+    }
+    state->error = error;
+    state->io = io;
+    state->implicit = implicit;
+
+    dcm_log_debug("Scanning PerFrameFunctionalGroupsSequence.");
+
+    int64_t offset = dcm_io_seek(error, io, 0, SEEK_CUR);
+    if (offset < 0) {
+        free(state);
+        return false;
+    }
+    state->buffer_offset = offset;
+
+    for (uint32_t i = 0; i < num_frames; i++) {
+        positions[i] = (struct FramePosition) { 0 };
+    }
+
+    uint32_t tag;
+    uint32_t seq_length;
+    if (!scan_element_header(state, &tag, &seq_length)) {
+        free(state);
+        return false;
+    }
+    if (tag != TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Reading PerFrameFunctionalGroupsSequence failed",
+                      "File pointer not positioned at "
+                      "PerFrameFunctionalGroupsSequence");
+        free(state);
+        return false;
+    }
+
+    int64_t start = scan_offset(state);
+    uint32_t frame_number = 0;
+    while (seq_length == 0xffffffff ||
+           scan_offset(state) - start < seq_length) {
+        uint32_t length;
+        if (!scan_element_header(state, &tag, &length)) {
+            free(state);
+            return false;
+        }
+
+        if (tag == TAG_SQ_DELIM) {
+            break;
+        }
+
+        if (tag != TAG_ITEM) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Reading PerFrameFunctionalGroupsSequence failed",
+                          "Expected tag '%08x' instead of '%08x' "
+                          "for Item #%u",
+                          TAG_ITEM,
+                          tag,
+                          frame_number);
+            free(state);
+            return false;
+        }
+
+        // one item per frame
+        if (frame_number >= num_frames) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Reading PerFrameFunctionalGroupsSequence failed",
+                          "Too many items for %u frames",
+                          num_frames);
+            free(state);
+            return false;
+        }
+
+        if (!scan_item(state, length, 1, &positions[frame_number])) {
+            free(state);
+            return false;
+        }
+
+        frame_number += 1;
+    }
+
+    // leave the io just after the sequence
+    if (dcm_io_seek(error, io, scan_offset(state), SEEK_SET) < 0) {
+        free(state);
+        return false;
+    }
+
+    free(state);
+
+    return true;
+}
+
+
+/* Native frames are packed, with no padding between them.
+ */
+int64_t dcm_native_frame_length(const struct PixelDescription *desc)
+{
+    int64_t bits = (int64_t) desc->rows *
+                   desc->columns *
+                   desc->samples_per_pixel *
+                   desc->bits_allocated;
+
+    return (bits + 7) / 8;
+}
+
+
+bool dcm_parse_frame_item(DcmError **error,
+                          const char *header,
+                          uint32_t *length)
+{
+    uint32_t tag = ((uint32_t) scan_uint16(header) << 16) |
+        scan_uint16(header + 2);
+    if (tag != TAG_ITEM) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Reading Frame Item failed",
+                      "No Item Tag found for Frame Item");
+        return false;
+    }
+
+    *length = scan_uint32(header + 4);
+
+    return true;
+}
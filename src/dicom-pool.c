@@ -0,0 +1,353 @@
+/*
+ * A pool of filehandles, keyed by path.
+ *
+ * Servers with many slides can't keep an fd open for every one. The pool
+ * keeps at most max_open files open, and closes the least recently used
+ * idle ones beyond that. A closed filehandle keeps its parsed state (the
+ * offset table, frame index and pixel description), so reopening it is just
+ * an open() call. If the state for all the filehandles goes over the memory
+ * budget, the least recently used idle filehandles are destroyed completely.
+ *
+ * Locking: the pool lock protects the hash tables, the LRU list, the pin
+ * counts and the totals. Each entry has a lock which is held while that
+ * entry's file is opened, so slow opens don't block the rest of the pool.
+ * Only pinned entries are opened, and only unpinned entries are closed, so
+ * these two never touch the same filehandle.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "uthash.h"
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+struct PoolEntry {
+    char *path;
+    DcmMutex *lock;
+
+    // NULL until the first successful open
+    DcmFilehandle *filehandle;
+    bool is_open;
+    uint64_t footprint;
+
+    // number of callers using this filehandle
+    uint32_t pins;
+
+    // most recently acquired at the head
+    struct PoolEntry *prev;
+    struct PoolEntry *next;
+
+    // by path, and by filehandle for release
+    UT_hash_handle hh;
+    UT_hash_handle hh_filehandle;
+};
+
+struct _DcmFilehandlePool {
+    DcmMutex *lock;
+
+    uint32_t max_open;
+    uint64_t budget;
+
+    struct PoolEntry *by_path;
+    struct PoolEntry *by_filehandle;
+    struct PoolEntry *head;
+    struct PoolEntry *tail;
+
+    DcmFilehandlePoolStats stats;
+};
+
+
+static void lru_remove(DcmFilehandlePool *pool, struct PoolEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        pool->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        pool->tail = entry->prev;
+    }
+
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+
+static void lru_push(DcmFilehandlePool *pool, struct PoolEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = pool->head;
+    if (pool->head) {
+        pool->head->prev = entry;
+    } else {
+        pool->tail = entry;
+    }
+
+    pool->head = entry;
+}
+
+
+static void entry_destroy(struct PoolEntry *entry)
+{
+    if (entry) {
+        dcm_filehandle_destroy(entry->filehandle);
+        dcm_mutex_destroy(entry->lock);
+        free(entry->path);
+        free(entry);
+    }
+}
+
+
+static struct PoolEntry *entry_create(DcmError **error, const char *path)
+{
+    struct PoolEntry *entry = DCM_NEW(error, struct PoolEntry);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    entry->path = dcm_strdup(error, path);
+    entry->lock = dcm_mutex_create(error);
+    if (entry->path == NULL || entry->lock == NULL) {
+        entry_destroy(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+
+/* Remove an entry from the pool. Call with the pool lock held.
+ */
+static void pool_remove(DcmFilehandlePool *pool, struct PoolEntry *entry)
+{
+    HASH_DEL(pool->by_path, entry);
+    if (entry->filehandle) {
+        HASH_DELETE(hh_filehandle, pool->by_filehandle, entry);
+    }
+    lru_remove(pool, entry);
+
+    if (entry->is_open) {
+        pool->stats.open_handles -= 1;
+    }
+    pool->stats.bytes -= entry->footprint;
+    pool->stats.handles -= 1;
+
+    entry_destroy(entry);
+}
+
+
+/* Close or destroy idle filehandles until we are inside the limits. Call
+ * with the pool lock held.
+ */
+static void pool_trim(DcmFilehandlePool *pool)
+{
+    struct PoolEntry *entry = pool->tail;
+
+    while (entry &&
+           (pool->stats.open_handles > pool->max_open ||
+            pool->stats.bytes > pool->budget)) {
+        struct PoolEntry *prev = entry->prev;
+
+        if (entry->pins == 0) {
+            if (pool->stats.bytes > pool->budget) {
+                pool_remove(pool, entry);
+                pool->stats.evictions += 1;
+            } else if (entry->is_open) {
+                dcm_filehandle_close_io(entry->filehandle);
+                entry->is_open = false;
+                pool->stats.open_handles -= 1;
+                pool->stats.closes += 1;
+            }
+        }
+
+        entry = prev;
+    }
+}
+
+
+DcmFilehandlePool *dcm_filehandle_pool_create(DcmError **error,
+                                              uint32_t max_open,
+                                              uint64_t budget)
+{
+    DcmFilehandlePool *pool = DCM_NEW(error, DcmFilehandlePool);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->lock = dcm_mutex_create(error);
+    if (pool->lock == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->max_open = max_open;
+    pool->budget = budget;
+
+    return pool;
+}
+
+
+void dcm_filehandle_pool_destroy(DcmFilehandlePool *pool)
+{
+    if (pool) {
+        struct PoolEntry *entry;
+        struct PoolEntry *tmp;
+
+        HASH_ITER(hh, pool->by_path, entry, tmp) {
+            if (entry->pins > 0) {
+                dcm_log_warning("Filehandle for '%s' destroyed while "
+                                "still acquired", entry->path);
+            }
+            pool_remove(pool, entry);
+        }
+
+        dcm_mutex_destroy(pool->lock);
+        free(pool);
+    }
+}
+
+
+/* Open and prepare a filehandle for the first time.
+ */
+static DcmFilehandle *pool_open(DcmError **error, const char *path)
+{
+    DcmFilehandle *filehandle = dcm_filehandle_create_from_file(error, path);
+    if (filehandle == NULL) {
+        return NULL;
+    }
+
+    if (!dcm_filehandle_prepare_read_frame(error, filehandle)) {
+        dcm_filehandle_destroy(filehandle);
+        return NULL;
+    }
+
+    return filehandle;
+}
+
+
+DcmFilehandle *dcm_filehandle_pool_acquire(DcmError **error,
+                                           DcmFilehandlePool *pool,
+                                           const char *path)
+{
+    struct PoolEntry *entry;
+
+    dcm_mutex_lock(pool->lock);
+
+    HASH_FIND(hh, pool->by_path, path, strlen(path), entry);
+    if (entry == NULL) {
+        entry = entry_create(error, path);
+        if (entry == NULL) {
+            dcm_mutex_unlock(pool->lock);
+            return NULL;
+        }
+        HASH_ADD_KEYPTR(hh, pool->by_path,
+                        entry->path, strlen(entry->path), entry);
+        pool->stats.handles += 1;
+    } else {
+        lru_remove(pool, entry);
+    }
+    lru_push(pool, entry);
+    entry->pins += 1;
+
+    dcm_mutex_unlock(pool->lock);
+
+    // the pin stops the entry being closed or removed, and the entry lock
+    // stops two threads opening the same file
+    dcm_mutex_lock(entry->lock);
+
+    bool opened = false;
+    bool reopened = false;
+    bool ok = true;
+    if (entry->filehandle == NULL) {
+        entry->filehandle = pool_open(error, path);
+        ok = entry->filehandle != NULL;
+        opened = ok;
+    } else if (!entry->is_open) {
+        DcmIO *io = dcm_io_create_from_file(error, path);
+        ok = io != NULL &&
+            dcm_filehandle_reopen_io(error, entry->filehandle, io);
+        reopened = ok;
+    }
+    if (opened || reopened) {
+        entry->is_open = true;
+    }
+
+    // everything the filehandle keeps, metadata included
+    DcmMemoryUsage usage = { 0 };
+    if (opened) {
+        dcm_filehandle_get_memory_usage(entry->filehandle, &usage);
+    }
+
+    dcm_mutex_unlock(entry->lock);
+
+    dcm_mutex_lock(pool->lock);
+
+    DcmFilehandle *filehandle = NULL;
+    if (ok) {
+        filehandle = entry->filehandle;
+
+        if (opened) {
+            entry->footprint = usage.total;
+            HASH_ADD(hh_filehandle, pool->by_filehandle,
+                     filehandle, sizeof(filehandle), entry);
+            pool->stats.bytes += entry->footprint;
+            pool->stats.opens += 1;
+        } else if (reopened) {
+            pool->stats.reopens += 1;
+        } else {
+            pool->stats.hits += 1;
+        }
+        if (opened || reopened) {
+            pool->stats.open_handles += 1;
+        }
+
+        pool_trim(pool);
+    } else {
+        entry->pins -= 1;
+        if (entry->pins == 0 && entry->filehandle == NULL) {
+            pool_remove(pool, entry);
+        }
+    }
+
+    dcm_mutex_unlock(pool->lock);
+
+    return filehandle;
+}
+
+
+void dcm_filehandle_pool_release(DcmFilehandlePool *pool,
+                                 DcmFilehandle *filehandle)
+{
+    struct PoolEntry *entry;
+
+    dcm_mutex_lock(pool->lock);
+
+    HASH_FIND(hh_filehandle, pool->by_filehandle,
+              &filehandle, sizeof(filehandle), entry);
+    if (entry == NULL || entry->pins == 0) {
+        dcm_log_warning("Filehandle released to a pool which did not "
+                        "acquire it");
+    } else {
+        entry->pins -= 1;
+        pool_trim(pool);
+    }
+
+    dcm_mutex_unlock(pool->lock);
+}
+
+
+void dcm_filehandle_pool_get_stats(DcmFilehandlePool *pool,
+                                   DcmFilehandlePoolStats *stats)
+{
+    dcm_mutex_lock(pool->lock);
+    *stats = pool->stats;
+    dcm_mutex_unlock(pool->lock);
+}
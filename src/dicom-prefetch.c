@@ -0,0 +1,256 @@
+/*
+ * Background prefetch of the tiles around the most recent read.
+ *
+ * We watch the positions clients read, guess the direction they are panning
+ * in, and queue the tiles just beyond the one they have read for a small pool
+ * of worker threads. Each new read replaces any queued work, since older
+ * guesses are no longer useful.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+/* The most tiles we queue after each read.
+ */
+#define PREFETCH_QUEUE_SIZE (16)
+
+/* How many tiles ahead we fetch when we know the pan direction.
+ */
+#define PREFETCH_DEPTH (2)
+
+struct PrefetchTile {
+    uint32_t column;
+    uint32_t row;
+};
+
+struct _DcmPrefetch {
+    DcmMutex *lock;
+    DcmCond *work;
+
+    DcmPrefetchFn fn;
+    void *client;
+
+    uint32_t tiles_across;
+    uint32_t tiles_down;
+
+    // the last position we saw, and which way we think we're moving
+    bool have_last;
+    uint32_t last_column;
+    uint32_t last_row;
+    uint32_t focal_plane;
+    uint32_t optical_path;
+    int dx;
+    int dy;
+
+    // tiles waiting for a worker, in priority order
+    struct PrefetchTile queue[PREFETCH_QUEUE_SIZE];
+    uint32_t queue_start;
+    uint32_t queue_length;
+
+    bool stopping;
+    uint32_t n_threads;
+    DcmThread **threads;
+};
+
+
+static int sign(int64_t value)
+{
+    return value > 0 ? 1 : value < 0 ? -1 : 0;
+}
+
+
+static void queue_tile(DcmPrefetch *prefetch, int64_t column, int64_t row)
+{
+    if (column < 0 ||
+        row < 0 ||
+        column >= prefetch->tiles_across ||
+        row >= prefetch->tiles_down ||
+        prefetch->queue_length == PREFETCH_QUEUE_SIZE) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < prefetch->queue_length; i++) {
+        const struct PrefetchTile *tile = &prefetch->queue[i];
+        if (tile->column == column && tile->row == row) {
+            return;
+        }
+    }
+
+    prefetch->queue[prefetch->queue_length].column = (uint32_t) column;
+    prefetch->queue[prefetch->queue_length].row = (uint32_t) row;
+    prefetch->queue_length += 1;
+}
+
+
+static void worker_main(void *client)
+{
+    DcmPrefetch *prefetch = (DcmPrefetch *) client;
+
+    dcm_mutex_lock(prefetch->lock);
+
+    for (;;) {
+        while (!prefetch->stopping &&
+               prefetch->queue_start == prefetch->queue_length) {
+            dcm_cond_wait(prefetch->work, prefetch->lock);
+        }
+        if (prefetch->stopping) {
+            break;
+        }
+
+        struct PrefetchTile tile = prefetch->queue[prefetch->queue_start];
+        uint32_t focal_plane = prefetch->focal_plane;
+        uint32_t optical_path = prefetch->optical_path;
+        prefetch->queue_start += 1;
+
+        // fetch without the lock, so the other workers and new reads can
+        // carry on
+        dcm_mutex_unlock(prefetch->lock);
+        prefetch->fn(prefetch->client,
+                     tile.column, tile.row,
+                     focal_plane, optical_path);
+        dcm_mutex_lock(prefetch->lock);
+    }
+
+    dcm_mutex_unlock(prefetch->lock);
+}
+
+
+DcmPrefetch *dcm_prefetch_create(DcmError **error,
+                                 uint32_t n_threads,
+                                 uint32_t tiles_across,
+                                 uint32_t tiles_down,
+                                 DcmPrefetchFn fn,
+                                 void *client)
+{
+    DcmPrefetch *prefetch = DCM_NEW(error, DcmPrefetch);
+    if (prefetch == NULL) {
+        return NULL;
+    }
+
+    prefetch->fn = fn;
+    prefetch->client = client;
+    prefetch->tiles_across = tiles_across;
+    prefetch->tiles_down = tiles_down;
+
+    prefetch->lock = dcm_mutex_create(error);
+    prefetch->work = dcm_cond_create(error);
+    prefetch->threads = DCM_NEW_ARRAY(error, n_threads, DcmThread *);
+    if (prefetch->lock == NULL ||
+        prefetch->work == NULL ||
+        prefetch->threads == NULL) {
+        dcm_prefetch_destroy(prefetch);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < n_threads; i++) {
+        prefetch->threads[i] = dcm_thread_create(error, worker_main, prefetch);
+        if (prefetch->threads[i] == NULL) {
+            dcm_prefetch_destroy(prefetch);
+            return NULL;
+        }
+        prefetch->n_threads += 1;
+    }
+
+    return prefetch;
+}
+
+
+/* Stop and join the workers. Any queued tiles are dropped.
+ */
+void dcm_prefetch_destroy(DcmPrefetch *prefetch)
+{
+    if (prefetch) {
+        if (prefetch->lock && prefetch->work) {
+            dcm_mutex_lock(prefetch->lock);
+            prefetch->stopping = true;
+            dcm_cond_broadcast(prefetch->work);
+            dcm_mutex_unlock(prefetch->lock);
+        }
+
+        for (uint32_t i = 0; i < prefetch->n_threads; i++) {
+            dcm_thread_join(prefetch->threads[i]);
+        }
+
+        free(prefetch->threads);
+        dcm_cond_destroy(prefetch->work);
+        dcm_mutex_destroy(prefetch->lock);
+        free(prefetch);
+    }
+}
+
+
+/* Note a read at a position, and queue the tiles we think will be read next.
+ */
+void dcm_prefetch_position(DcmPrefetch *prefetch,
+                           uint32_t column,
+                           uint32_t row,
+                           uint32_t focal_plane,
+                           uint32_t optical_path)
+{
+    dcm_mutex_lock(prefetch->lock);
+
+    if (prefetch->have_last &&
+        prefetch->focal_plane == focal_plane &&
+        prefetch->optical_path == optical_path) {
+        int dx = sign((int64_t) column - prefetch->last_column);
+        int dy = sign((int64_t) row - prefetch->last_row);
+
+        // a reread of the same tile keeps the old direction
+        if (dx != 0 || dy != 0) {
+            prefetch->dx = dx;
+            prefetch->dy = dy;
+        }
+    } else {
+        prefetch->dx = 0;
+        prefetch->dy = 0;
+    }
+
+    prefetch->have_last = true;
+    prefetch->last_column = column;
+    prefetch->last_row = row;
+    prefetch->focal_plane = focal_plane;
+    prefetch->optical_path = optical_path;
+
+    // any work still queued was for an older position
+    prefetch->queue_start = 0;
+    prefetch->queue_length = 0;
+
+    int64_t c = column;
+    int64_t r = row;
+    int dx = prefetch->dx;
+    int dy = prefetch->dy;
+    if (dx == 0 && dy == 0) {
+        // no idea which way we're going, so fetch the ring around this tile
+        for (int y = -1; y <= 1; y++) {
+            for (int x = -1; x <= 1; x++) {
+                if (x != 0 || y != 0) {
+                    queue_tile(prefetch, c + x, r + y);
+                }
+            }
+        }
+    } else {
+        // the leading edge, nearest first
+        for (int step = 1; step <= PREFETCH_DEPTH; step++) {
+            queue_tile(prefetch, c + dx * step, r + dy * step);
+
+            if (dx != 0 && dy != 0) {
+                queue_tile(prefetch, c + dx * step, r + dy * (step - 1));
+                queue_tile(prefetch, c + dx * (step - 1), r + dy * step);
+            } else {
+                // perpendicular to the direction of travel
+                queue_tile(prefetch, c + dx * step + dy, r + dy * step + dx);
+                queue_tile(prefetch, c + dx * step - dy, r + dy * step - dx);
+            }
+        }
+    }
+
+    dcm_cond_broadcast(prefetch->work);
+
+    dcm_mutex_unlock(prefetch->lock);
+}
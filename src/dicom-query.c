@@ -0,0 +1,389 @@
+/*
+ * Path queries over nested data sets.
+ *
+ * A path like "SharedFunctionalGroupsSequence[0].PixelMeasuresSequence[0].
+ * PixelSpacing" is compiled once into an array of steps, each a tag (or any
+ * tag) and, for every step but the last, an item index (or any item). We
+ * evaluate a query by walking the steps, so a compiled query does no string
+ * handling and no dictionary lookups.
+ *
+ * A compiled query is never changed, so threads can share one.
+ */
+
+#include "config.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+// longer than any keyword in the dictionary
+#define QUERY_MAX_KEYWORD (128)
+
+// deeper than any real data set
+#define QUERY_MAX_STEPS (64)
+
+struct QueryStep {
+    // any_tag is "*", any_item is "[*]"
+    uint32_t tag;
+    bool any_tag;
+    uint32_t item;
+    bool any_item;
+};
+
+struct _DcmQuery {
+    char *path;
+    uint32_t n_steps;
+    struct QueryStep *steps;
+};
+
+struct QueryState {
+    const DcmQuery *query;
+    DcmError **error;
+    DcmQueryFn fn;
+    void *client;
+
+    // set if the walk stopped on an error
+    bool failed;
+};
+
+// for the dcm_dataset_foreach() callback
+struct QueryStepState {
+    struct QueryState *state;
+    uint32_t step;
+};
+
+
+static bool query_bad_path(DcmError **error,
+                           const char *path,
+                           const char *reason)
+{
+    dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                  "Bad query path",
+                  "Path '%s' %s", path, reason);
+    return false;
+}
+
+
+static bool is_hex(const char *str, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        if (!isxdigit((unsigned char) str[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* A tag is "*", a keyword, "(gggg,eeee)" or "ggggeeee".
+ */
+static bool parse_tag(DcmError **error,
+                      const char *path,
+                      const char *str,
+                      size_t length,
+                      struct QueryStep *step)
+{
+    if (length == 1 && str[0] == '*') {
+        step->any_tag = true;
+        return true;
+    }
+
+    if (length == 11 &&
+        str[0] == '(' &&
+        str[5] == ',' &&
+        str[10] == ')' &&
+        is_hex(str + 1, 4) &&
+        is_hex(str + 6, 4)) {
+        step->tag = (uint32_t) (strtoul(str + 1, NULL, 16) << 16) |
+            (uint32_t) strtoul(str + 6, NULL, 16);
+        return true;
+    }
+
+    char keyword[QUERY_MAX_KEYWORD];
+    if (length == 0 || length >= sizeof(keyword)) {
+        return query_bad_path(error, path, "has a bad attribute");
+    }
+    memcpy(keyword, str, length);
+    keyword[length] = '\0';
+
+    if (length == 8 && is_hex(str, 8)) {
+        step->tag = (uint32_t) strtoul(keyword, NULL, 16);
+        return true;
+    }
+
+    step->tag = dcm_dict_tag_from_keyword(keyword);
+    if (step->tag == 0xffffffff) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Bad query path",
+                      "Path '%s' has unknown keyword '%s'", path, keyword);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* An item index is "[*]" or "[n]".
+ */
+static bool parse_item(DcmError **error,
+                       const char *path,
+                       const char *str,
+                       size_t length,
+                       struct QueryStep *step)
+{
+    if (length == 3 && str[1] == '*') {
+        step->any_item = true;
+        return true;
+    }
+
+    if (length < 3) {
+        return query_bad_path(error, path, "has a bad item index");
+    }
+
+    uint64_t item = 0;
+    for (size_t i = 1; i < length - 1; i++) {
+        if (!isdigit((unsigned char) str[i])) {
+            return query_bad_path(error, path, "has a bad item index");
+        }
+        item = item * 10 + (uint64_t) (str[i] - '0');
+        if (item > UINT32_MAX) {
+            return query_bad_path(error, path, "has a bad item index");
+        }
+    }
+    step->item = (uint32_t) item;
+
+    return true;
+}
+
+
+static bool parse_step(DcmError **error,
+                       const char *path,
+                       const char *str,
+                       size_t length,
+                       bool last,
+                       struct QueryStep *step)
+{
+    const char *bracket = memchr(str, '[', length);
+    size_t tag_length = bracket ? (size_t) (bracket - str) : length;
+
+    if (!parse_tag(error, path, str, tag_length, step)) {
+        return false;
+    }
+
+    // every step but the last picks items from a sequence
+    if (bracket == NULL) {
+        if (!last) {
+            return query_bad_path(error, path, "needs an item index");
+        }
+        return true;
+    }
+    if (last) {
+        return query_bad_path(error, path, "ends with an item index");
+    }
+    if (str[length - 1] != ']') {
+        return query_bad_path(error, path, "has a bad item index");
+    }
+
+    return parse_item(error, path, bracket, length - tag_length, step);
+}
+
+
+DcmQuery *dcm_query_create(DcmError **error, const char *path)
+{
+    uint32_t n_steps = 1;
+    for (const char *p = path; *p; p++) {
+        if (*p == '.') {
+            n_steps += 1;
+        }
+    }
+    if (n_steps > QUERY_MAX_STEPS) {
+        query_bad_path(error, path, "is too deep");
+        return NULL;
+    }
+
+    DcmQuery *query = DCM_NEW(error, DcmQuery);
+    if (query == NULL) {
+        return NULL;
+    }
+
+    query->path = dcm_strdup(error, path);
+    query->steps = DCM_NEW_ARRAY(error, n_steps, struct QueryStep);
+    if (query->path == NULL || query->steps == NULL) {
+        dcm_query_destroy(query);
+        return NULL;
+    }
+    query->n_steps = n_steps;
+
+    const char *str = path;
+    for (uint32_t i = 0; i < n_steps; i++) {
+        const char *dot = strchr(str, '.');
+        size_t length = dot ? (size_t) (dot - str) : strlen(str);
+
+        if (!parse_step(error,
+                        path,
+                        str,
+                        length,
+                        i == n_steps - 1,
+                        &query->steps[i])) {
+            dcm_query_destroy(query);
+            return NULL;
+        }
+
+        str += length + 1;
+    }
+
+    return query;
+}
+
+
+const char *dcm_query_get_path(const DcmQuery *query)
+{
+    return query->path;
+}
+
+
+void dcm_query_destroy(DcmQuery *query)
+{
+    if (query) {
+        free(query->path);
+        free(query->steps);
+        free(query);
+    }
+}
+
+
+static bool query_match_dataset(struct QueryState *state,
+                                uint32_t step,
+                                const DcmDataSet *dataset);
+
+
+static bool query_match_element(struct QueryState *state,
+                                uint32_t step,
+                                const DcmElement *element)
+{
+    const struct QueryStep *query_step = &state->query->steps[step];
+
+    if (step == state->query->n_steps - 1) {
+        return state->fn(element, state->client);
+    }
+
+    // a wildcard tag can match elements we can't step into
+    if (dcm_element_get_vr(element) != DCM_VR_SQ) {
+        return true;
+    }
+
+    DcmSequence *seq;
+    if (!dcm_element_get_value_sequence(state->error, element, &seq)) {
+        state->failed = true;
+        return false;
+    }
+
+    uint32_t first = 0;
+    uint32_t last = dcm_sequence_count(seq);
+    if (!query_step->any_item) {
+        if (query_step->item >= last) {
+            return true;
+        }
+        first = query_step->item;
+        last = first + 1;
+    }
+
+    for (uint32_t i = first; i < last; i++) {
+        // lazy sequences parse items here, so this can fail
+        DcmDataSet *item = dcm_sequence_get(state->error, seq, i);
+        if (item == NULL) {
+            state->failed = true;
+            return false;
+        }
+
+        if (!query_match_dataset(state, step + 1, item)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static bool query_match_any(const DcmElement *element, void *client)
+{
+    struct QueryStepState *step_state = (struct QueryStepState *) client;
+
+    return query_match_element(step_state->state, step_state->step, element);
+}
+
+
+static bool query_match_dataset(struct QueryState *state,
+                                uint32_t step,
+                                const DcmDataSet *dataset)
+{
+    const struct QueryStep *query_step = &state->query->steps[step];
+
+    if (query_step->any_tag) {
+        struct QueryStepState step_state = { state, step };
+
+        return dcm_dataset_foreach(dataset, query_match_any, &step_state);
+    }
+
+    const DcmElement *element = dcm_dataset_contains(dataset, query_step->tag);
+    if (element == NULL) {
+        return true;
+    }
+
+    return query_match_element(state, step, element);
+}
+
+
+bool dcm_query_foreach(DcmError **error,
+                       const DcmQuery *query,
+                       const DcmDataSet *dataset,
+                       DcmQueryFn fn,
+                       void *client)
+{
+    struct QueryState state = {
+        .query = query,
+        .error = error,
+        .fn = fn,
+        .client = client,
+    };
+
+    (void) query_match_dataset(&state, 0, dataset);
+
+    return !state.failed;
+}
+
+
+static bool query_first(const DcmElement *element, void *client)
+{
+    const DcmElement **first = (const DcmElement **) client;
+
+    *first = element;
+
+    return false;
+}
+
+
+const DcmElement *dcm_query_get(DcmError **error,
+                                const DcmQuery *query,
+                                const DcmDataSet *dataset)
+{
+    const DcmElement *first = NULL;
+
+    if (!dcm_query_foreach(error, query, dataset, query_first, &first)) {
+        return NULL;
+    }
+
+    if (first == NULL) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Could not find Data Element",
+                      "Nothing matches path '%s'", query->path);
+    }
+
+    return first;
+}
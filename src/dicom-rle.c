@@ -0,0 +1,202 @@
+/*
+ * Decoder for RLE Lossless, see PS3.5 Annex G.
+ *
+ * An RLE frame is a 64 byte header giving the offsets of up to 15 segments,
+ * followed by the segments. Each segment is one byte plane of one sample,
+ * most significant byte first, compressed with PackBits. We decode each
+ * segment directly into its place in the interleaved little-endian output,
+ * so there is no intermediate planar buffer.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+#define RLE_HEADER_LENGTH (64)
+#define RLE_MAX_SEGMENTS (15)
+
+struct RLESegment {
+    const uint8_t *data;
+    uint32_t length;
+
+    // start of this byte plane in the output, and the distance between
+    // pixels
+    uint8_t *pixels;
+    uint32_t stride;
+    uint32_t n_pixels;
+
+    bool ok;
+};
+
+
+static uint32_t read_uint32(const uint8_t *data)
+{
+    return (uint32_t) data[0] |
+        (uint32_t) data[1] << 8 |
+        (uint32_t) data[2] << 16 |
+        (uint32_t) data[3] << 24;
+}
+
+
+/* Decode one PackBits segment. Runs that go past the end of the byte plane
+ * are clipped, since some encoders pad, but a segment which ends early is
+ * an error.
+ */
+static bool decode_segment(const struct RLESegment *segment)
+{
+    const uint8_t *in = segment->data;
+    const uint8_t *in_end = in + segment->length;
+    uint8_t *out = segment->pixels;
+    uint32_t stride = segment->stride;
+    uint32_t n = 0;
+
+    while (n < segment->n_pixels && in < in_end) {
+        int8_t header = (int8_t) *in++;
+
+        if (header >= 0) {
+            // a literal run of header + 1 bytes
+            uint32_t count = (uint32_t) header + 1;
+            if (count > (uint32_t) (in_end - in)) {
+                return false;
+            }
+            uint32_t write = MIN(count, segment->n_pixels - n);
+
+            if (stride == 1) {
+                memcpy(out, in, write);
+                out += write;
+            } else {
+                for (uint32_t i = 0; i < write; i++) {
+                    *out = in[i];
+                    out += stride;
+                }
+            }
+
+            in += count;
+            n += write;
+        } else if (header != -128) {
+            // a replicate run of 1 - header copies of the next byte
+            uint32_t count = 1 - (int32_t) header;
+            if (in == in_end) {
+                return false;
+            }
+            uint8_t value = *in++;
+            uint32_t write = MIN(count, segment->n_pixels - n);
+
+            if (stride == 1) {
+                memset(out, value, write);
+                out += write;
+            } else {
+                for (uint32_t i = 0; i < write; i++) {
+                    *out = value;
+                    out += stride;
+                }
+            }
+
+            n += write;
+        }
+    }
+
+    return n == segment->n_pixels;
+}
+
+
+static void segment_main(void *client)
+{
+    struct RLESegment *segment = (struct RLESegment *) client;
+
+    segment->ok = decode_segment(segment);
+}
+
+
+/* Decode an RLE frame of n_pixels pixels to interleaved, little-endian
+ * native pixels. The segments are shared between n_threads threads from the
+ * task pool, including the calling thread.
+ */
+bool dcm_rle_decode(DcmError **error,
+                    const char *data,
+                    uint32_t length,
+                    char *pixels,
+                    uint32_t n_pixels,
+                    uint16_t samples_per_pixel,
+                    uint16_t bytes_per_sample,
+                    uint32_t n_threads)
+{
+    const uint8_t *header = (const uint8_t *) data;
+    uint32_t stride = (uint32_t) samples_per_pixel * bytes_per_sample;
+    struct RLESegment segments[RLE_MAX_SEGMENTS];
+
+    if (length < RLE_HEADER_LENGTH) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Decoding RLE frame failed",
+                      "Frame is too short for an RLE header");
+        return false;
+    }
+
+    uint32_t n_segments = read_uint32(header);
+    if (n_segments != stride || n_segments > RLE_MAX_SEGMENTS) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Decoding RLE frame failed",
+                      "Frame has %u segments, but %u were expected",
+                      n_segments, stride);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_segments; i++) {
+        uint32_t start = read_uint32(header + 4 + 4 * i);
+        uint32_t end = i == n_segments - 1 ?
+            length : read_uint32(header + 8 + 4 * i);
+        if (start < RLE_HEADER_LENGTH || start > end || end > length) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Decoding RLE frame failed",
+                          "Bad offset for segment %u", i);
+            return false;
+        }
+
+        // segments are most significant byte first, but we write little
+        // endian
+        uint32_t sample = i / bytes_per_sample;
+        uint32_t byte = bytes_per_sample - 1 - i % bytes_per_sample;
+
+        segments[i].data = header + start;
+        segments[i].length = end - start;
+        segments[i].pixels = (uint8_t *) pixels +
+            sample * bytes_per_sample + byte;
+        segments[i].stride = stride;
+        segments[i].n_pixels = n_pixels;
+        segments[i].ok = false;
+    }
+
+    // if we can't make a task group, the calling thread does it all
+    DcmTaskGroup *group = NULL;
+    if (n_threads > 1 && n_segments > 1) {
+        group = dcm_task_group_create(NULL, MIN(n_threads, n_segments));
+    }
+    for (uint32_t i = 0; i < n_segments; i++) {
+        if (group) {
+            dcm_task_group_add(group, segment_main, &segments[i]);
+        } else {
+            segment_main(&segments[i]);
+        }
+    }
+    if (group) {
+        dcm_task_group_wait(group);
+        dcm_task_group_destroy(group);
+    }
+
+    for (uint32_t i = 0; i < n_segments; i++) {
+        if (!segments[i].ok) {
+            dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                          "Decoding RLE frame failed",
+                          "Segment %u is damaged", i);
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,835 @@
+/*
+ * Snapshots of parsed metadata.
+ *
+ * A snapshot is a flat image of a locked data set tree, and loads far more
+ * quickly than the file it came from can be parsed. It is a header, then
+ * an array of data sets, an array of elements, an array of sequence items,
+ * and a heap of values. Everything refers to everything else by index or
+ * offset, so a snapshot can be loaded from anywhere in memory, for example
+ * straight from a memory mapped file.
+ *
+ * Data sets are written in preorder, so every item of a sequence is the
+ * next data set after the one before it. We check this on load, so each
+ * data set is read exactly once and a damaged snapshot can't make a loop,
+ * or share an item to make us do exponential work.
+ *
+ * On load, the tree is built in an arena and values point into the heap,
+ * so there are only a few large allocations. Snapshots use the byte order
+ * of the machine which wrote them.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+#define SNAPSHOT_MAGIC "DCMSNAP"
+#define SNAPSHOT_VERSION (1)
+
+// written in the byte order of the machine, so we can detect a mismatch
+#define SNAPSHOT_BYTE_ORDER (0x01020304)
+
+// the tables and every value in the heap start on this boundary
+#define SNAPSHOT_ALIGN (8)
+
+// deeper than any real data set, and shallow enough to not blow the stack
+#define SNAPSHOT_MAX_DEPTH (64)
+
+#define SNAPSHOT_ROUND(SIZE) \
+    (((SIZE) + SNAPSHOT_ALIGN - 1) & ~((uint64_t) SNAPSHOT_ALIGN - 1))
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t n_datasets;
+    uint32_t n_elements;
+    uint32_t n_items;
+    uint32_t reserved;
+    uint64_t heap_length;
+};
+
+struct SnapshotDataSet {
+    uint32_t first_element;
+    uint32_t n_elements;
+};
+
+/* value is the offset in the heap, or for sequences, the index of the first
+ * item, with vm items. Strings are stored as vm NUL-terminated values one
+ * after the other.
+ */
+struct SnapshotElement {
+    uint32_t tag;
+    int32_t vr;
+    uint32_t vm;
+    uint32_t length;
+    uint64_t value;
+};
+
+/* Offsets of the parts of a snapshot.
+ */
+struct SnapshotLayout {
+    uint64_t datasets;
+    uint64_t elements;
+    uint64_t items;
+    uint64_t heap;
+    uint64_t length;
+};
+
+struct SnapshotWriter {
+    DcmError **error;
+
+    struct SnapshotDataSet *datasets;
+    uint32_t n_datasets;
+    uint32_t datasets_capacity;
+
+    struct SnapshotElement *elements;
+    uint32_t n_elements;
+    uint32_t elements_capacity;
+
+    uint32_t *items;
+    uint32_t n_items;
+    uint32_t items_capacity;
+
+    char *heap;
+    uint64_t heap_length;
+    uint64_t heap_capacity;
+};
+
+struct SnapshotReader {
+    DcmError **error;
+    DcmArena *arena;
+
+    const struct SnapshotDataSet *datasets;
+    const struct SnapshotElement *elements;
+    const uint32_t *items;
+    uint32_t n_datasets;
+    uint32_t n_elements;
+    uint32_t n_items;
+
+    // data sets are read in preorder, so this is the only valid next index
+    uint32_t next_dataset;
+
+    // in the snapshot, or a copy in the arena
+    const char *heap;
+    uint64_t heap_length;
+};
+
+
+static void snapshot_layout(struct SnapshotLayout *layout,
+                            uint32_t n_datasets,
+                            uint32_t n_elements,
+                            uint32_t n_items,
+                            uint64_t heap_length)
+{
+    layout->datasets = SNAPSHOT_ROUND(sizeof(struct SnapshotHeader));
+    layout->elements = SNAPSHOT_ROUND(layout->datasets +
+        (uint64_t) n_datasets * sizeof(struct SnapshotDataSet));
+    layout->items = SNAPSHOT_ROUND(layout->elements +
+        (uint64_t) n_elements * sizeof(struct SnapshotElement));
+    layout->heap = SNAPSHOT_ROUND(layout->items +
+        (uint64_t) n_items * sizeof(uint32_t));
+    layout->length = layout->heap + heap_length;
+}
+
+
+/* Make room for count more entries of size bytes in an array, and return
+ * the index of the first.
+ */
+static bool writer_reserve(DcmError **error,
+                           void **array,
+                           uint32_t *n,
+                           uint32_t *capacity,
+                           size_t size,
+                           uint32_t count,
+                           uint32_t *first)
+{
+    if ((uint64_t) *n + count > UINT32_MAX) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Serializing Data Set failed",
+                      "Data Set is too large for a snapshot");
+        return false;
+    }
+
+    if (*n + count > *capacity) {
+        uint32_t new_capacity = MAX(16, MAX(*capacity * 2, *n + count));
+        void *new_array = dcm_realloc(error,
+                                      *array,
+                                      (uint64_t) new_capacity * size);
+        if (new_array == NULL) {
+            return false;
+        }
+        *array = new_array;
+        *capacity = new_capacity;
+    }
+
+    *first = *n;
+    *n += count;
+
+    return true;
+}
+
+
+/* Make room for a value in the heap, and return its offset.
+ */
+static char *writer_heap_alloc(struct SnapshotWriter *writer,
+                               uint64_t length,
+                               uint64_t *offset)
+{
+    uint64_t start = SNAPSHOT_ROUND(writer->heap_length);
+
+    if (writer->heap == NULL || start + length > writer->heap_capacity) {
+        uint64_t new_capacity = MAX(4096,
+                                    MAX(writer->heap_capacity * 2,
+                                        start + length));
+        char *heap = dcm_realloc(writer->error, writer->heap, new_capacity);
+        if (heap == NULL) {
+            return NULL;
+        }
+        writer->heap = heap;
+        writer->heap_capacity = new_capacity;
+    }
+
+    // zero the padding, so snapshots of the same data set are identical
+    memset(writer->heap + writer->heap_length,
+           0,
+           start - writer->heap_length);
+    writer->heap_length = start + length;
+    *offset = start;
+
+    return writer->heap + start;
+}
+
+
+static bool write_dataset(struct SnapshotWriter *writer,
+                          const DcmDataSet *dataset,
+                          uint32_t *index);
+
+
+static bool write_strings(struct SnapshotWriter *writer,
+                          const DcmElement *element,
+                          struct SnapshotElement *result)
+{
+    uint32_t vm = dcm_element_get_vm(element);
+    uint64_t length = 0;
+
+    for (uint32_t i = 0; i < vm; i++) {
+        const char *value;
+        if (!dcm_element_get_value_string(writer->error, element, i, &value)) {
+            return false;
+        }
+        length += strlen(value) + 1;
+    }
+    if (length > UINT32_MAX) {
+        dcm_error_set(writer->error, DCM_ERROR_CODE_INVALID,
+                      "Serializing Data Set failed",
+                      "Value of Data Element '%08x' is too long",
+                      dcm_element_get_tag(element));
+        return false;
+    }
+
+    char *p = writer_heap_alloc(writer, length, &result->value);
+    if (p == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < vm; i++) {
+        const char *value;
+        (void) dcm_element_get_value_string(NULL, element, i, &value);
+        size_t value_length = strlen(value) + 1;
+        memcpy(p, value, value_length);
+        p += value_length;
+    }
+
+    result->vm = vm;
+    result->length = (uint32_t) length;
+
+    return true;
+}
+
+
+static bool write_bytes(struct SnapshotWriter *writer,
+                        const void *value,
+                        uint32_t length,
+                        struct SnapshotElement *result)
+{
+    char *p = writer_heap_alloc(writer, length, &result->value);
+    if (p == NULL) {
+        return false;
+    }
+    if (length > 0) {
+        memcpy(p, value, length);
+    }
+    result->length = length;
+
+    return true;
+}
+
+
+static bool write_sequence(struct SnapshotWriter *writer,
+                           const DcmElement *element,
+                           struct SnapshotElement *result)
+{
+    DcmSequence *seq;
+    if (!dcm_element_get_value_sequence(writer->error, element, &seq)) {
+        return false;
+    }
+
+    uint32_t n_items = dcm_sequence_count(seq);
+    uint32_t first;
+    if (!writer_reserve(writer->error,
+                        (void **) &writer->items,
+                        &writer->n_items,
+                        &writer->items_capacity,
+                        sizeof(uint32_t),
+                        n_items,
+                        &first)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < n_items; i++) {
+        DcmDataSet *item = dcm_sequence_get(writer->error, seq, i);
+        uint32_t item_index;
+        if (item == NULL ||
+            !write_dataset(writer, item, &item_index)) {
+            return false;
+        }
+        writer->items[first + i] = item_index;
+    }
+
+    result->vm = n_items;
+    result->value = first;
+
+    return true;
+}
+
+
+static bool write_element(struct SnapshotWriter *writer,
+                          const DcmElement *element,
+                          uint32_t index)
+{
+    DcmVR vr = dcm_element_get_vr(element);
+    struct SnapshotElement result = {
+        .tag = dcm_element_get_tag(element),
+        .vr = vr,
+        .vm = dcm_element_get_vm(element),
+    };
+    const void *value;
+
+    switch (dcm_dict_vr_class(vr)) {
+        case DCM_VR_CLASS_STRING_SINGLE:
+        case DCM_VR_CLASS_STRING_MULTI:
+            if (!write_strings(writer, element, &result)) {
+                return false;
+            }
+            break;
+
+        case DCM_VR_CLASS_NUMERIC_DECIMAL:
+        case DCM_VR_CLASS_NUMERIC_INTEGER:
+            if (!write_bytes(writer,
+                             dcm_element_get_value_numeric(element),
+                             result.vm * (uint32_t) dcm_dict_vr_size(vr),
+                             &result)) {
+                return false;
+            }
+            break;
+
+        case DCM_VR_CLASS_BINARY:
+            if (!dcm_element_get_value_binary(writer->error,
+                                              element,
+                                              &value) ||
+                !write_bytes(writer,
+                             value,
+                             dcm_element_get_binary_length(element),
+                             &result)) {
+                return false;
+            }
+            break;
+
+        case DCM_VR_CLASS_SEQUENCE:
+            if (!write_sequence(writer, element, &result)) {
+                return false;
+            }
+            break;
+
+        default:
+            dcm_error_set(writer->error, DCM_ERROR_CODE_INVALID,
+                          "Serializing Data Set failed",
+                          "Data Element '%08x' has unexpected "
+                          "Value Representation", result.tag);
+            return false;
+    }
+
+    // write_sequence() can move the element array
+    writer->elements[index] = result;
+
+    return true;
+}
+
+
+struct WriteDataSet {
+    struct SnapshotWriter *writer;
+    uint32_t next_element;
+};
+
+
+static bool write_element_fn(const DcmElement *element, void *client)
+{
+    struct WriteDataSet *state = (struct WriteDataSet *) client;
+
+    return write_element(state->writer, element, state->next_element++);
+}
+
+
+static bool write_dataset(struct SnapshotWriter *writer,
+                          const DcmDataSet *dataset,
+                          uint32_t *index)
+{
+    uint32_t n_elements = dcm_dataset_count(dataset);
+    uint32_t first_element;
+
+    if (!writer_reserve(writer->error,
+                        (void **) &writer->datasets,
+                        &writer->n_datasets,
+                        &writer->datasets_capacity,
+                        sizeof(struct SnapshotDataSet),
+                        1,
+                        index) ||
+        !writer_reserve(writer->error,
+                        (void **) &writer->elements,
+                        &writer->n_elements,
+                        &writer->elements_capacity,
+                        sizeof(struct SnapshotElement),
+                        n_elements,
+                        &first_element)) {
+        return false;
+    }
+    writer->datasets[*index].first_element = first_element;
+    writer->datasets[*index].n_elements = n_elements;
+
+    struct WriteDataSet state = { writer, first_element };
+
+    return dcm_dataset_foreach(dataset, write_element_fn, &state);
+}
+
+
+static void writer_clear(struct SnapshotWriter *writer)
+{
+    free(writer->datasets);
+    free(writer->elements);
+    free(writer->items);
+    free(writer->heap);
+}
+
+
+bool dcm_dataset_serialize(DcmError **error,
+                           const DcmDataSet *dataset,
+                           char **snapshot,
+                           uint64_t *length)
+{
+    if (!dcm_dataset_is_locked(dataset)) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Serializing Data Set failed",
+                      "Only locked Data Sets can be serialized");
+        return false;
+    }
+
+    struct SnapshotWriter writer = { .error = error };
+    uint32_t root;
+    if (!write_dataset(&writer, dataset, &root)) {
+        writer_clear(&writer);
+        return false;
+    }
+
+    struct SnapshotLayout layout;
+    snapshot_layout(&layout,
+                    writer.n_datasets,
+                    writer.n_elements,
+                    writer.n_items,
+                    writer.heap_length);
+
+    char *result = DCM_MALLOC(error, layout.length);
+    if (result == NULL) {
+        writer_clear(&writer);
+        return false;
+    }
+
+    struct SnapshotHeader header = {
+        .magic = SNAPSHOT_MAGIC,
+        .version = SNAPSHOT_VERSION,
+        .byte_order = SNAPSHOT_BYTE_ORDER,
+        .n_datasets = writer.n_datasets,
+        .n_elements = writer.n_elements,
+        .n_items = writer.n_items,
+        .heap_length = writer.heap_length,
+    };
+    memcpy(result, &header, sizeof(header));
+    memcpy(result + layout.datasets,
+           writer.datasets,
+           writer.n_datasets * sizeof(struct SnapshotDataSet));
+    if (writer.n_elements > 0) {
+        memcpy(result + layout.elements,
+               writer.elements,
+               writer.n_elements * sizeof(struct SnapshotElement));
+    }
+    if (writer.n_items > 0) {
+        memcpy(result + layout.items,
+               writer.items,
+               writer.n_items * sizeof(uint32_t));
+    }
+    if (writer.heap_length > 0) {
+        memcpy(result + layout.heap, writer.heap, writer.heap_length);
+    }
+
+    writer_clear(&writer);
+
+    *snapshot = result;
+    *length = layout.length;
+
+    return true;
+}
+
+
+static bool reader_damaged(struct SnapshotReader *reader, const char *reason)
+{
+    dcm_error_set(reader->error, DCM_ERROR_CODE_PARSE,
+                  "Loading snapshot failed",
+                  "Snapshot is damaged - %s", reason);
+
+    return false;
+}
+
+
+static const char *reader_value(struct SnapshotReader *reader,
+                                const struct SnapshotElement *element)
+{
+    if (element->value % SNAPSHOT_ALIGN != 0 ||
+        element->value > reader->heap_length ||
+        element->length > reader->heap_length - element->value) {
+        (void) reader_damaged(reader, "bad value offset");
+        return NULL;
+    }
+
+    return reader->heap + element->value;
+}
+
+
+static bool read_strings(struct SnapshotReader *reader,
+                         DcmElement *element,
+                         const struct SnapshotElement *from)
+{
+    const char *p = reader_value(reader, from);
+    if (p == NULL) {
+        return false;
+    }
+    const char *end = p + from->length;
+
+    if (from->vm == 0) {
+        return reader_damaged(reader, "string with no values");
+    }
+
+    char **values = dcm_arena_alloc(reader->error,
+                                    reader->arena,
+                                    DCM_ARENA_USE_VALUES,
+                                    from->vm * sizeof(char *));
+    if (values == NULL) {
+        return false;
+    }
+    for (uint32_t i = 0; i < from->vm; i++) {
+        const char *nul = p < end ? memchr(p, '\0', end - p) : NULL;
+        if (nul == NULL) {
+            return reader_damaged(reader, "unterminated string");
+        }
+        values[i] = (char *) p;
+        p = nul + 1;
+    }
+    if (p != end) {
+        return reader_damaged(reader, "bad string length");
+    }
+
+    // arena elements never free their value, so steal just sets the pointer
+    return dcm_element_set_value_string_multi(reader->error,
+                                              element,
+                                              values,
+                                              from->vm,
+                                              true);
+}
+
+
+static DcmDataSet *read_dataset(struct SnapshotReader *reader,
+                                uint32_t index,
+                                int depth);
+
+
+static bool read_sequence(struct SnapshotReader *reader,
+                          DcmElement *element,
+                          const struct SnapshotElement *from,
+                          int depth)
+{
+    if (from->value > reader->n_items ||
+        from->vm > reader->n_items - from->value) {
+        return reader_damaged(reader, "bad item index");
+    }
+
+    DcmSequence *seq = dcm_sequence_create_in_arena(reader->error,
+                                                    reader->arena);
+    if (seq == NULL) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < from->vm; i++) {
+        uint32_t index = reader->items[from->value + i];
+        DcmDataSet *item = read_dataset(reader, index, depth + 1);
+        if (item == NULL ||
+            !dcm_sequence_append(reader->error, seq, item)) {
+            return false;
+        }
+    }
+    dcm_sequence_lock(seq);
+
+    return dcm_element_set_value_sequence(reader->error, element, seq);
+}
+
+
+static DcmElement *read_element(struct SnapshotReader *reader,
+                                const struct SnapshotElement *from,
+                                int depth)
+{
+    DcmElement *element = dcm_element_create_in_arena(reader->error,
+                                                      reader->arena,
+                                                      from->tag,
+                                                      from->vr);
+    if (element == NULL) {
+        return NULL;
+    }
+
+    const char *value;
+    bool ok;
+    switch (dcm_dict_vr_class(from->vr)) {
+        case DCM_VR_CLASS_STRING_SINGLE:
+        case DCM_VR_CLASS_STRING_MULTI:
+            ok = read_strings(reader, element, from);
+            break;
+
+        case DCM_VR_CLASS_NUMERIC_DECIMAL:
+        case DCM_VR_CLASS_NUMERIC_INTEGER:
+        case DCM_VR_CLASS_BINARY:
+            value = reader_value(reader, from);
+            ok = value &&
+                dcm_element_set_value(reader->error,
+                                      element,
+                                      (char *) value,
+                                      from->length,
+                                      true);
+            break;
+
+        case DCM_VR_CLASS_SEQUENCE:
+            ok = read_sequence(reader, element, from, depth);
+            break;
+
+        default:
+            ok = reader_damaged(reader, "bad Value Representation");
+            break;
+    }
+
+    return ok ? element : NULL;
+}
+
+
+static DcmDataSet *read_dataset(struct SnapshotReader *reader,
+                                uint32_t index,
+                                int depth)
+{
+    if (index >= reader->n_datasets) {
+        (void) reader_damaged(reader, "bad Data Set index");
+        return NULL;
+    }
+    if (index != reader->next_dataset) {
+        (void) reader_damaged(reader, "bad item order");
+        return NULL;
+    }
+    reader->next_dataset += 1;
+    if (depth > SNAPSHOT_MAX_DEPTH) {
+        (void) reader_damaged(reader, "Sequences nested too deeply");
+        return NULL;
+    }
+
+    const struct SnapshotDataSet *from = &reader->datasets[index];
+    if ((uint64_t) from->first_element + from->n_elements >
+        reader->n_elements) {
+        (void) reader_damaged(reader, "bad Data Element index");
+        return NULL;
+    }
+
+    DcmDataSet *dataset = dcm_dataset_create_in_arena(reader->error,
+                                                      reader->arena);
+    if (dataset == NULL) {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < from->n_elements; i++) {
+        const struct SnapshotElement *element_from =
+            &reader->elements[from->first_element + i];
+        DcmElement *element = read_element(reader, element_from, depth);
+        if (element == NULL ||
+            !dcm_dataset_insert(reader->error, dataset, element)) {
+            return NULL;
+        }
+    }
+    dcm_dataset_lock(dataset);
+
+    return dataset;
+}
+
+
+static DcmDataSet *deserialize(DcmError **error,
+                               const char *snapshot,
+                               uint64_t length,
+                               DcmMapping *mapping)
+{
+    struct SnapshotHeader header;
+
+    if ((uintptr_t) snapshot % SNAPSHOT_ALIGN != 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_INVALID,
+                      "Loading snapshot failed",
+                      "Snapshot must be aligned to %d bytes",
+                      SNAPSHOT_ALIGN);
+        return NULL;
+    }
+
+    if (length < sizeof(header)) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Loading snapshot failed",
+                      "Snapshot is too short");
+        return NULL;
+    }
+    memcpy(&header, snapshot, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Loading snapshot failed",
+                      "Not a snapshot");
+        return NULL;
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Loading snapshot failed",
+                      "Snapshot is version %u, but only version %d "
+                      "is supported",
+                      header.version, SNAPSHOT_VERSION);
+        return NULL;
+    }
+    if (header.byte_order != SNAPSHOT_BYTE_ORDER) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Loading snapshot failed",
+                      "Snapshot was written with a different byte order");
+        return NULL;
+    }
+
+    struct SnapshotLayout layout;
+    snapshot_layout(&layout,
+                    header.n_datasets,
+                    header.n_elements,
+                    header.n_items,
+                    header.heap_length);
+    if (header.n_datasets == 0 ||
+        header.heap_length > length ||
+        layout.length > length) {
+        dcm_error_set(error, DCM_ERROR_CODE_PARSE,
+                      "Loading snapshot failed",
+                      "Snapshot is truncated");
+        return NULL;
+    }
+
+    struct SnapshotReader reader = {
+        .error = error,
+        .datasets = (const struct SnapshotDataSet *)
+            (snapshot + layout.datasets),
+        .elements = (const struct SnapshotElement *)
+            (snapshot + layout.elements),
+        .items = (const uint32_t *) (snapshot + layout.items),
+        .n_datasets = header.n_datasets,
+        .n_elements = header.n_elements,
+        .n_items = header.n_items,
+        .heap = snapshot + layout.heap,
+        .heap_length = header.heap_length,
+    };
+
+    reader.arena = dcm_arena_create(error);
+    if (reader.arena == NULL) {
+        return NULL;
+    }
+
+    // values point into the heap, so either the arena holds the mapping, or
+    // it holds a copy of the heap
+    if (mapping) {
+        (void) dcm_arena_hold_mapping(reader.arena, mapping);
+    } else {
+        char *heap = dcm_arena_alloc(error,
+                                     reader.arena,
+                                     DCM_ARENA_USE_VALUES,
+                                     header.heap_length);
+        if (heap == NULL) {
+            dcm_arena_unref(reader.arena);
+            return NULL;
+        }
+        memcpy(heap, reader.heap, header.heap_length);
+        reader.heap = heap;
+    }
+
+    DcmDataSet *root = read_dataset(&reader, 0, 0);
+    if (root && reader.next_dataset != reader.n_datasets) {
+        root = NULL;
+        (void) reader_damaged(&reader, "unused Data Sets");
+    }
+    DcmSequence *holder = NULL;
+    if (root) {
+        holder = dcm_sequence_create_in_arena(error, reader.arena);
+    }
+    if (holder == NULL ||
+        !dcm_sequence_append(error, holder, root)) {
+        dcm_arena_unref(reader.arena);
+        return NULL;
+    }
+
+    // steal the root to give it the ref to the arena
+    (void) dcm_sequence_steal(NULL, holder, 0);
+    dcm_arena_unref(reader.arena);
+
+    return root;
+}
+
+
+DcmDataSet *dcm_dataset_deserialize(DcmError **error,
+                                    const char *snapshot,
+                                    uint64_t length)
+{
+    return deserialize(error, snapshot, length, NULL);
+}
+
+
+DcmDataSet *dcm_dataset_deserialize_external(DcmError **error,
+                                             const char *snapshot,
+                                             uint64_t length,
+                                             DcmDataSetReleaseFn release,
+                                             void *client)
+{
+    DcmMapping *mapping = dcm_mapping_create(error, release, client);
+    if (mapping == NULL) {
+        return NULL;
+    }
+
+    DcmDataSet *dataset = deserialize(error, snapshot, length, mapping);
+    if (dataset == NULL) {
+        dcm_mapping_cancel(mapping);
+        return NULL;
+    }
+
+    // the arena now holds the mapping
+    dcm_mapping_unref(mapping);
+
+    return dataset;
+}
@@ -0,0 +1,470 @@
+/*
+ * Small portability layer over the platform threading primitives, and a
+ * shared pool of worker threads.
+ */
+
+#include "config.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <dicom/dicom.h>
+#include "pdicom.h"
+
+#ifdef _WIN32
+#define MUTEX_INIT { SRWLOCK_INIT }
+#define COND_INIT { CONDITION_VARIABLE_INIT }
+#else
+#define MUTEX_INIT { PTHREAD_MUTEX_INITIALIZER }
+#define COND_INIT { PTHREAD_COND_INITIALIZER }
+#endif
+
+/* The most threads the shared pool will ever start.
+ */
+#define TASK_MAX_THREADS (64)
+
+struct _DcmMutex {
+#ifdef _WIN32
+    SRWLOCK lock;
+#else
+    pthread_mutex_t lock;
+#endif
+};
+
+struct _DcmCond {
+#ifdef _WIN32
+    CONDITION_VARIABLE cond;
+#else
+    pthread_cond_t cond;
+#endif
+};
+
+struct _DcmThread {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t thread;
+#endif
+    void (*fn)(void *client);
+    void *client;
+};
+
+
+DcmMutex *dcm_mutex_create(DcmError **error)
+{
+    DcmMutex *mutex = DCM_NEW(error, DcmMutex);
+    if (mutex == NULL) {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    InitializeSRWLock(&mutex->lock);
+#else
+    if (pthread_mutex_init(&mutex->lock, NULL) != 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_NOMEM,
+                      "Unable to create mutex",
+                      "pthread_mutex_init() failed");
+        free(mutex);
+        return NULL;
+    }
+#endif
+
+    return mutex;
+}
+
+
+void dcm_mutex_destroy(DcmMutex *mutex)
+{
+    if (mutex) {
+#ifndef _WIN32
+        pthread_mutex_destroy(&mutex->lock);
+#endif
+        free(mutex);
+    }
+}
+
+
+void dcm_mutex_lock(DcmMutex *mutex)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(&mutex->lock);
+#else
+    pthread_mutex_lock(&mutex->lock);
+#endif
+}
+
+
+void dcm_mutex_unlock(DcmMutex *mutex)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(&mutex->lock);
+#else
+    pthread_mutex_unlock(&mutex->lock);
+#endif
+}
+
+
+DcmCond *dcm_cond_create(DcmError **error)
+{
+    DcmCond *cond = DCM_NEW(error, DcmCond);
+    if (cond == NULL) {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    InitializeConditionVariable(&cond->cond);
+#else
+    if (pthread_cond_init(&cond->cond, NULL) != 0) {
+        dcm_error_set(error, DCM_ERROR_CODE_NOMEM,
+                      "Unable to create condition variable",
+                      "pthread_cond_init() failed");
+        free(cond);
+        return NULL;
+    }
+#endif
+
+    return cond;
+}
+
+
+void dcm_cond_destroy(DcmCond *cond)
+{
+    if (cond) {
+#ifndef _WIN32
+        pthread_cond_destroy(&cond->cond);
+#endif
+        free(cond);
+    }
+}
+
+
+void dcm_cond_wait(DcmCond *cond, DcmMutex *mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableSRW(&cond->cond, &mutex->lock, INFINITE, 0);
+#else
+    pthread_cond_wait(&cond->cond, &mutex->lock);
+#endif
+}
+
+
+void dcm_cond_signal(DcmCond *cond)
+{
+#ifdef _WIN32
+    WakeConditionVariable(&cond->cond);
+#else
+    pthread_cond_signal(&cond->cond);
+#endif
+}
+
+
+void dcm_cond_broadcast(DcmCond *cond)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(&cond->cond);
+#else
+    pthread_cond_broadcast(&cond->cond);
+#endif
+}
+
+
+#ifdef _WIN32
+static unsigned __stdcall thread_main(void *client)
+{
+    DcmThread *thread = (DcmThread *) client;
+
+    thread->fn(thread->client);
+
+    return 0;
+}
+#else
+static void *thread_main(void *client)
+{
+    DcmThread *thread = (DcmThread *) client;
+
+    thread->fn(thread->client);
+
+    return NULL;
+}
+#endif
+
+
+DcmThread *dcm_thread_create(DcmError **error,
+                             void (*fn)(void *client),
+                             void *client)
+{
+    DcmThread *thread = DCM_NEW(error, DcmThread);
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->fn = fn;
+    thread->client = client;
+
+#ifdef _WIN32
+    thread->handle = (HANDLE) _beginthreadex(NULL, 0,
+                                             thread_main, thread,
+                                             0, NULL);
+    if (thread->handle == 0) {
+#else
+    if (pthread_create(&thread->thread, NULL, thread_main, thread) != 0) {
+#endif
+        dcm_error_set(error, DCM_ERROR_CODE_NOMEM,
+                      "Unable to create thread",
+                      "Thread create failed");
+        free(thread);
+        return NULL;
+    }
+
+    return thread;
+}
+
+
+/* Wait for a thread to finish, then free it.
+ */
+void dcm_thread_join(DcmThread *thread)
+{
+    if (thread) {
+#ifdef _WIN32
+        WaitForSingleObject(thread->handle, INFINITE);
+        CloseHandle(thread->handle);
+#else
+        pthread_join(thread->thread, NULL);
+#endif
+        free(thread);
+    }
+}
+
+
+int32_t dcm_atomic_get(int32_t *value)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange((volatile LONG *) value, 0, 0);
+#else
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#endif
+}
+
+
+void dcm_atomic_set(int32_t *value, int32_t new_value)
+{
+#ifdef _MSC_VER
+    InterlockedExchange((volatile LONG *) value, new_value);
+#else
+    __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+#endif
+}
+
+
+int32_t dcm_atomic_add(int32_t *value, int32_t delta)
+{
+#ifdef _MSC_VER
+    return InterlockedExchangeAdd((volatile LONG *) value, delta) + delta;
+#else
+    return __atomic_add_fetch(value, delta, __ATOMIC_ACQ_REL);
+#endif
+}
+
+
+/* The task pool. Threads are started as callers ask for them and live for
+ * the rest of the process, so there is no thread creation per call. Tasks
+ * are queued in groups, and a thread waiting for a group runs that group's
+ * queued tasks itself, so a task can start and wait for a group of its own
+ * without deadlock, even when every pool thread is busy.
+ */
+
+struct Task {
+    DcmTaskGroup *group;
+    void (*fn)(void *client);
+    void *client;
+    struct Task *next;
+};
+
+struct _DcmTaskGroup {
+    // the most tasks from this group that may run at once on pool threads
+    uint32_t limit;
+    uint32_t running;
+
+    // queued plus running
+    uint32_t pending;
+};
+
+static struct {
+    DcmMutex lock;
+
+    // signalled when a task is queued, or a group has a free slot
+    DcmCond work;
+
+    // signalled when a task finishes
+    DcmCond done;
+
+    struct Task *head;
+    struct Task *tail;
+
+    uint32_t n_threads;
+    DcmThread *threads[TASK_MAX_THREADS];
+} task_pool = { MUTEX_INIT, COND_INIT, COND_INIT, NULL, NULL, 0, { NULL } };
+
+
+/* Take the first queued task we may run, either from one group, or from any
+ * group below its limit. Called with the pool lock held.
+ */
+static struct Task *task_pool_take(const DcmTaskGroup *group)
+{
+    struct Task *prev = NULL;
+
+    for (struct Task *task = task_pool.head; task; task = task->next) {
+        if (group ?
+            task->group == group :
+            task->group->running < task->group->limit) {
+            if (prev) {
+                prev->next = task->next;
+            } else {
+                task_pool.head = task->next;
+            }
+            if (task_pool.tail == task) {
+                task_pool.tail = prev;
+            }
+
+            return task;
+        }
+
+        prev = task;
+    }
+
+    return NULL;
+}
+
+
+/* Run a task without the pool lock. Called with the pool lock held.
+ */
+static void task_pool_run(struct Task *task)
+{
+    DcmTaskGroup *group = task->group;
+
+    group->running += 1;
+    dcm_mutex_unlock(&task_pool.lock);
+
+    task->fn(task->client);
+    free(task);
+
+    dcm_mutex_lock(&task_pool.lock);
+    group->running -= 1;
+    group->pending -= 1;
+
+    dcm_cond_broadcast(&task_pool.done);
+    dcm_cond_broadcast(&task_pool.work);
+}
+
+
+static void task_pool_main(void *client)
+{
+    USED(client);
+
+    dcm_mutex_lock(&task_pool.lock);
+
+    for (;;) {
+        struct Task *task = task_pool_take(NULL);
+        if (task) {
+            task_pool_run(task);
+        } else {
+            dcm_cond_wait(&task_pool.work, &task_pool.lock);
+        }
+    }
+}
+
+
+/* Make a group of tasks which will run on at most n_threads threads at
+ * once: n_threads - 1 pool threads, plus the caller once it waits for the
+ * group. The pool is grown to n_threads - 1 threads if it is smaller.
+ */
+DcmTaskGroup *dcm_task_group_create(DcmError **error, uint32_t n_threads)
+{
+    DcmTaskGroup *group = DCM_NEW(error, DcmTaskGroup);
+    if (group == NULL) {
+        return NULL;
+    }
+    group->limit = MAX(1, n_threads) - 1;
+
+    dcm_mutex_lock(&task_pool.lock);
+
+    // if we can't start a thread, the pool just stays smaller
+    uint32_t wanted = MIN(TASK_MAX_THREADS, group->limit);
+    while (task_pool.n_threads < wanted) {
+        DcmThread *thread = dcm_thread_create(NULL, task_pool_main, NULL);
+        if (thread == NULL) {
+            break;
+        }
+        task_pool.threads[task_pool.n_threads++] = thread;
+    }
+
+    dcm_mutex_unlock(&task_pool.lock);
+
+    return group;
+}
+
+
+/* Queue a task. If we can't, the task runs now on the calling thread.
+ */
+void dcm_task_group_add(DcmTaskGroup *group,
+                        void (*fn)(void *client),
+                        void *client)
+{
+    struct Task *task = DCM_NEW(NULL, struct Task);
+    if (task == NULL) {
+        fn(client);
+        return;
+    }
+    task->group = group;
+    task->fn = fn;
+    task->client = client;
+
+    dcm_mutex_lock(&task_pool.lock);
+
+    group->pending += 1;
+    if (task_pool.tail) {
+        task_pool.tail->next = task;
+    } else {
+        task_pool.head = task;
+    }
+    task_pool.tail = task;
+
+    dcm_cond_signal(&task_pool.work);
+
+    dcm_mutex_unlock(&task_pool.lock);
+}
+
+
+/* Wait for every task in a group to finish, running any that are still
+ * queued on the calling thread.
+ */
+void dcm_task_group_wait(DcmTaskGroup *group)
+{
+    dcm_mutex_lock(&task_pool.lock);
+
+    while (group->pending > 0) {
+        struct Task *task = task_pool_take(group);
+        if (task) {
+            task_pool_run(task);
+        } else {
+            dcm_cond_wait(&task_pool.done, &task_pool.lock);
+        }
+    }
+
+    dcm_mutex_unlock(&task_pool.lock);
+}
+
+
+/* Free a group. Any tasks must have finished.
+ */
+void dcm_task_group_destroy(DcmTaskGroup *group)
+{
+    free(group);
+}
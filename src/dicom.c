@@ -128,6 +128,18 @@ void dcm_free_string_array(char **array, int n)
 }
 
 
+void dcm_memory_usage_set_total(DcmMemoryUsage *usage)
+{
+    usage->total = usage->elements +
+        usage->values +
+        usage->hash +
+        usage->sequences +
+        usage->offset_table +
+        usage->frame_index +
+        usage->unused;
+}
+
+
 const char *dcm_get_version(void)
 {
     return DCM_SUFFIXED_VERSION;
@@ -152,6 +164,9 @@ const char *dcm_error_code_str(DcmErrorCode code)
         case DCM_ERROR_CODE_MISSING_FRAME:
             return "Missing frame";
 
+        case DCM_ERROR_CODE_MEMORY_LIMIT:
+            return "Memory limit exceeded";
+
         default:
             return "Unknown error code";
     }
@@ -176,6 +191,9 @@ const char *dcm_error_code_name(DcmErrorCode code)
         case DCM_ERROR_CODE_MISSING_FRAME:
             return "MISSING_FRAME";
 
+        case DCM_ERROR_CODE_MEMORY_LIMIT:
+            return "MEMORY_LIMIT";
+
         default:
             return "UNKNOWN";
     }
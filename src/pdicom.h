@@ -44,10 +44,15 @@ typedef SSIZE_T ssize_t;
 #define USED(x) (void)(x)
 
 #define TAG_DIMENSION_INDEX_VALUES                  0x00209157
+#define TAG_Z_OFFSET_IN_SLIDE_COORDINATE_SYSTEM     0x0040074a
+#define TAG_OPTICAL_PATH_SEQUENCE                   0x00480105
+#define TAG_OPTICAL_PATH_IDENTIFIER                 0x00480106
 #define TAG_REFERENCED_IMAGE_NAVIGATION_SEQUENCE    0x00480200
+#define TAG_OPTICAL_PATH_IDENTIFICATION_SEQUENCE    0x00480207
 #define TAG_PLANE_POSITION_SLIDE_SEQUENCE           0x0048021a
 #define TAG_COLUMN_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX 0x0048021e
 #define TAG_ROW_POSITION_IN_TOTAL_IMAGE_PIXEL_MATRIX 0x0048021f
+#define TAG_SHARED_FUNCTIONAL_GROUP_SEQUENCE        0x52009229
 #define TAG_PER_FRAME_FUNCTIONAL_GROUP_SEQUENCE     0x52009230
 #define TAG_EXTENDED_OFFSET_TABLE                   0x7FE00001
 #define TAG_FLOAT_PIXEL_DATA                        0x7FE00008
@@ -64,6 +69,109 @@ char *dcm_printf_append(char *str, const char *format, ...);
 
 void dcm_free_string_array(char **strings, int n);
 
+void dcm_memory_usage_set_total(DcmMemoryUsage *usage);
+
+typedef struct _DcmMutex DcmMutex;
+
+DcmMutex *dcm_mutex_create(DcmError **error);
+void dcm_mutex_destroy(DcmMutex *mutex);
+void dcm_mutex_lock(DcmMutex *mutex);
+void dcm_mutex_unlock(DcmMutex *mutex);
+
+typedef struct _DcmCond DcmCond;
+
+DcmCond *dcm_cond_create(DcmError **error);
+void dcm_cond_destroy(DcmCond *cond);
+void dcm_cond_wait(DcmCond *cond, DcmMutex *mutex);
+void dcm_cond_signal(DcmCond *cond);
+void dcm_cond_broadcast(DcmCond *cond);
+
+typedef struct _DcmThread DcmThread;
+
+DcmThread *dcm_thread_create(DcmError **error,
+                             void (*fn)(void *client),
+                             void *client);
+void dcm_thread_join(DcmThread *thread);
+
+typedef struct _DcmTaskGroup DcmTaskGroup;
+
+DcmTaskGroup *dcm_task_group_create(DcmError **error, uint32_t n_threads);
+void dcm_task_group_add(DcmTaskGroup *group,
+                        void (*fn)(void *client),
+                        void *client);
+void dcm_task_group_wait(DcmTaskGroup *group);
+void dcm_task_group_destroy(DcmTaskGroup *group);
+
+int32_t dcm_atomic_get(int32_t *value);
+void dcm_atomic_set(int32_t *value, int32_t new_value);
+int32_t dcm_atomic_add(int32_t *value, int32_t delta);
+
+DcmFrameCache *dcm_frame_cache_ref(DcmFrameCache *cache);
+DcmFrame *dcm_frame_cache_get(DcmFrameCache *cache,
+                              const DcmFilehandle *filehandle,
+                              uint32_t frame_number);
+void dcm_frame_cache_put(DcmFrameCache *cache,
+                         const DcmFilehandle *filehandle,
+                         DcmFrame *frame);
+bool dcm_frame_cache_contains(DcmFrameCache *cache,
+                              const DcmFilehandle *filehandle,
+                              uint32_t frame_number);
+void dcm_frame_cache_remove_filehandle(DcmFrameCache *cache,
+                                       const DcmFilehandle *filehandle);
+
+typedef struct _DcmPrefetch DcmPrefetch;
+
+typedef void (*DcmPrefetchFn)(void *client,
+                              uint32_t column,
+                              uint32_t row,
+                              uint32_t focal_plane,
+                              uint32_t optical_path);
+
+DcmPrefetch *dcm_prefetch_create(DcmError **error,
+                                 uint32_t n_threads,
+                                 uint32_t tiles_across,
+                                 uint32_t tiles_down,
+                                 DcmPrefetchFn fn,
+                                 void *client);
+void dcm_prefetch_destroy(DcmPrefetch *prefetch);
+void dcm_prefetch_position(DcmPrefetch *prefetch,
+                           uint32_t column,
+                           uint32_t row,
+                           uint32_t focal_plane,
+                           uint32_t optical_path);
+
+void dcm_filehandle_close_io(DcmFilehandle *filehandle);
+bool dcm_filehandle_reopen_io(DcmError **error,
+                              DcmFilehandle *filehandle,
+                              DcmIO *io);
+
+bool dcm_rle_decode(DcmError **error,
+                    const char *data,
+                    uint32_t length,
+                    char *pixels,
+                    uint32_t n_pixels,
+                    uint16_t samples_per_pixel,
+                    uint16_t bytes_per_sample,
+                    uint32_t n_threads);
+
+DcmIO *dcm_io_create_deflate(DcmError **error, DcmIO *io, int64_t start);
+
+typedef struct _DcmMapping DcmMapping;
+
+DcmMapping *dcm_mapping_create(DcmError **error,
+                               DcmIOReleaseFn release,
+                               void *client);
+void dcm_mapping_cancel(DcmMapping *mapping);
+DcmMapping *dcm_mapping_ref(DcmMapping *mapping);
+void dcm_mapping_unref(DcmMapping *mapping);
+const char *dcm_io_peek(DcmIO *io, int64_t length, DcmMapping **mapping);
+bool dcm_io_can_read_at(const DcmIO *io);
+int64_t dcm_io_read_at(DcmError **error,
+                       DcmIO *io,
+                       int64_t offset,
+                       char *buffer,
+                       int64_t length);
+
 size_t dcm_dict_vr_size(DcmVR vr);
 uint32_t dcm_dict_vr_capacity(DcmVR vr);
 int dcm_dict_vr_header_length(DcmVR vr);
@@ -85,6 +193,75 @@ int dcm_dict_vr_header_length(DcmVR vr);
 DcmDataSet *dcm_sequence_steal(DcmError **error,
                                const DcmSequence *seq, uint32_t index);
 
+typedef struct _DcmArena DcmArena;
+
+// what an arena allocation is for, so we can report memory use
+typedef enum _DcmArenaUse {
+    DCM_ARENA_USE_ELEMENTS,
+    DCM_ARENA_USE_VALUES,
+    DCM_ARENA_USE_SEQUENCES,
+
+    DCM_ARENA_N_USES,
+} DcmArenaUse;
+
+DcmArena *dcm_arena_create(DcmError **error);
+DcmArena *dcm_arena_ref(DcmArena *arena);
+void dcm_arena_unref(DcmArena *arena);
+void *dcm_arena_alloc(DcmError **error,
+                      DcmArena *arena,
+                      DcmArenaUse use,
+                      size_t size);
+void *dcm_arena_realloc(DcmError **error,
+                        DcmArena *arena,
+                        DcmArenaUse use,
+                        void *pointer,
+                        size_t old_size,
+                        size_t size);
+char *dcm_arena_strdup(DcmError **error, DcmArena *arena, const char *str);
+void dcm_arena_lock(DcmArena *arena);
+void dcm_arena_unlock(DcmArena *arena);
+void dcm_arena_set_intern(DcmArena *arena, bool intern);
+bool dcm_arena_get_intern(const DcmArena *arena);
+void *dcm_arena_intern_lookup(const DcmArena *arena,
+                              int kind,
+                              const char *key);
+bool dcm_arena_intern_add(DcmError **error,
+                          DcmArena *arena,
+                          int kind,
+                          const char *key,
+                          void *value);
+bool dcm_arena_hold_mapping(DcmArena *arena, DcmMapping *mapping);
+void dcm_arena_set_limit(DcmArena *arena, uint64_t limit);
+bool dcm_arena_reserve(DcmError **error,
+                       const DcmArena *arena,
+                       uint64_t size);
+void dcm_arena_add_memory_usage(DcmArena *arena, DcmMemoryUsage *usage);
+
+DcmElement *dcm_element_create_in_arena(DcmError **error,
+                                        DcmArena *arena,
+                                        uint32_t tag,
+                                        DcmVR vr);
+DcmDataSet *dcm_dataset_create_in_arena(DcmError **error, DcmArena *arena);
+DcmSequence *dcm_sequence_create_in_arena(DcmError **error, DcmArena *arena);
+const void *dcm_element_get_value_numeric(const DcmElement *element);
+uint32_t dcm_element_get_binary_length(const DcmElement *element);
+void dcm_dataset_add_memory_usage(const DcmDataSet *dataset,
+                                  DcmMemoryUsage *usage);
+bool dcm_element_set_value_borrowed(DcmError **error,
+                                    DcmElement *element,
+                                    const char *value,
+                                    uint32_t length,
+                                    DcmMapping *mapping);
+bool dcm_dataset_insert_lazy_sequence(DcmError **error,
+                                      DcmDataSet *dataset,
+                                      uint32_t tag,
+                                      DcmVR vr,
+                                      bool implicit,
+                                      const char *value,
+                                      uint32_t length,
+                                      const uint32_t *item_offsets,
+                                      uint32_t n_items);
+
 typedef struct _DcmParse {
     bool (*dataset_begin)(DcmError **, void *client);
     bool (*dataset_end)(DcmError **, void *client);
@@ -125,6 +302,33 @@ typedef struct _DcmParse {
                  uint32_t tag,
                  DcmVR vr,
                  uint32_t length);
+
+    // if set, sequences are not parsed ... instead, the raw bytes of the
+    // items are passed here, with item i from item_offsets[i] to
+    // item_offsets[i + 1]
+    bool (*sequence_raw)(DcmError **,
+                         void *client,
+                         uint32_t tag,
+                         DcmVR vr,
+                         const char *value,
+                         uint32_t length,
+                         const uint32_t *item_offsets,
+                         uint32_t n_items);
+
+    // if set, large binary and numeric values which can be used in place
+    // in the mapped memory of the IO object are passed here, rather than to
+    // element_create ... value must not be changed
+    bool (*element_borrow)(DcmError **,
+                           void *client,
+                           uint32_t tag,
+                           DcmVR vr,
+                           const char *value,
+                           uint32_t length,
+                           DcmMapping *mapping);
+
+    // if set, called before size bytes are allocated to read a value, so the
+    // client can refuse ... return false and set error to stop the parse
+    bool (*reserve)(DcmError **, void *client, uint64_t size);
 } DcmParse;
 
 DCM_EXTERN
@@ -148,6 +352,24 @@ bool dcm_parse_pixeldata_offsets(DcmError **error,
                                  int64_t *offsets,
                                  int num_frames);
 
+/* The position of a frame, as found in PerFrameFunctionalGroupsSequence.
+ */
+struct FramePosition {
+    int32_t column;
+    int32_t row;
+    double z;
+    char optical_path_identifier[DCM_CAPACITY_SH + 1];
+    bool have_column;
+    bool have_row;
+    bool have_z;
+};
+
+bool dcm_parse_frame_positions(DcmError **error,
+                               DcmIO *io,
+                               bool implicit,
+                               struct FramePosition *positions,
+                               uint32_t num_frames);
+
 struct PixelDescription {
     uint16_t rows;
     uint16_t columns;
@@ -161,8 +383,8 @@ struct PixelDescription {
     const char *transfer_syntax_uid;
 };
 
-char *dcm_parse_frame(DcmError **error,
-                      DcmIO *io,
-                      bool implicit,
-                      struct PixelDescription *desc,
-                      uint32_t *length);
+int64_t dcm_native_frame_length(const struct PixelDescription *desc);
+
+bool dcm_parse_frame_item(DcmError **error,
+                          const char *header,
+                          uint32_t *length);
@@ -7,6 +7,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
 #include <check.h>
 
 #include <dicom/dicom.h>
@@ -113,6 +118,290 @@ static char *load_file_to_memory(const char *name, int64_t *length_out)
 }
 
 
+/* Append an explicit VR little endian element, padded to an even length.
+ */
+static char *append_element(char *p,
+                            uint32_t tag,
+                            const char *vr,
+                            const void *value,
+                            uint32_t length)
+{
+    uint32_t padded = length + (length & 1);
+    bool long_vr = strcmp(vr, "OB") == 0;
+
+    p[0] = (char) ((tag >> 16) & 0xff);
+    p[1] = (char) (tag >> 24);
+    p[2] = (char) (tag & 0xff);
+    p[3] = (char) ((tag >> 8) & 0xff);
+    p[4] = vr[0];
+    p[5] = vr[1];
+    if (long_vr) {
+        p[6] = 0;
+        p[7] = 0;
+        memcpy(p + 8, &padded, 4);
+        p += 12;
+    } else {
+        uint16_t short_length = (uint16_t) padded;
+        memcpy(p + 6, &short_length, 2);
+        p += 8;
+    }
+    memcpy(p, value, length);
+    if (padded > length) {
+        p[length] = vr[0] == 'U' && vr[1] == 'I' ? '\0' : ' ';
+    }
+
+    return p + padded;
+}
+
+
+static char *append_us(char *p, uint32_t tag, uint16_t value)
+{
+    return append_element(p, tag, "US", &value, 2);
+}
+
+
+static char *append_string(char *p,
+                           uint32_t tag,
+                           const char *vr,
+                           const char *value)
+{
+    return append_element(p, tag, vr, value, (uint32_t) strlen(value));
+}
+
+
+/* Append the preamble, file meta and image description for an 8-bit
+ * image.
+ */
+static char *append_image_header(char *p,
+                                 const char *transfer_syntax_uid,
+                                 uint16_t rows,
+                                 uint16_t columns,
+                                 uint16_t samples_per_pixel,
+                                 const char *photometric_interpretation,
+                                 uint32_t n_frames)
+{
+    p += 128;
+    memcpy(p, "DICM", 4);
+    p += 4;
+
+    char meta[256];
+    char *q = meta;
+    const char version[] = {0, 1};
+    q = append_element(q, 0x00020001, "OB", version, 2);
+    q = append_string(q, 0x00020002, "UI", "1.2.840.10008.5.1.4.1.1.77.1.6");
+    q = append_string(q, 0x00020003, "UI", "1.2.3.4");
+    q = append_string(q, 0x00020010, "UI", transfer_syntax_uid);
+    uint32_t meta_length = (uint32_t) (q - meta);
+    p = append_element(p, 0x00020000, "UL", &meta_length, 4);
+    memcpy(p, meta, meta_length);
+    p += meta_length;
+
+    char n_frames_str[16];
+    snprintf(n_frames_str, sizeof(n_frames_str), "%u", n_frames);
+    p = append_string(p, 0x00080016, "UI", "1.2.840.10008.5.1.4.1.1.77.1.6");
+    p = append_string(p, 0x00080018, "UI", "1.2.3.4");
+    p = append_us(p, 0x00280002, samples_per_pixel);
+    p = append_string(p, 0x00280004, "CS", photometric_interpretation);
+    p = append_us(p, 0x00280006, 0);
+    p = append_string(p, 0x00280008, "IS", n_frames_str);
+    p = append_us(p, 0x00280010, rows);
+    p = append_us(p, 0x00280011, columns);
+    p = append_us(p, 0x00280100, 8);
+    p = append_us(p, 0x00280101, 8);
+    p = append_us(p, 0x00280102, 7);
+    p = append_us(p, 0x00280103, 0);
+
+    return p;
+}
+
+
+/* Make a native RGB image with every byte of each frame set to the frame
+ * number.
+ */
+static char *create_native_rgb(uint16_t rows,
+                               uint16_t columns,
+                               uint32_t n_frames,
+                               int64_t *length)
+{
+    uint32_t frame_length = (uint32_t) rows * columns * 3;
+    char *memory = calloc(1, 1024 + (size_t) frame_length * n_frames);
+    ck_assert_ptr_nonnull(memory);
+
+    char *p = append_image_header(memory,
+                                  "1.2.840.10008.1.2.1",
+                                  rows,
+                                  columns,
+                                  3,
+                                  "RGB",
+                                  n_frames);
+    p = append_element(p, 0x7fe00010, "OB", "", 0);
+    memcpy(p - 4, &(uint32_t) { frame_length * n_frames }, 4);
+    for (uint32_t i = 0; i < n_frames; i++) {
+        memset(p, (int) (i + 1), frame_length);
+        p += frame_length;
+    }
+
+    *length = p - memory;
+
+    return memory;
+}
+
+
+/* Append an item or delimiter header.
+ */
+static char *append_item(char *p, uint16_t element, uint32_t length)
+{
+    const uint16_t tag[] = { 0xfffe, element };
+    memcpy(p, tag, 4);
+    memcpy(p + 4, &length, 4);
+
+    return p + 8;
+}
+
+
+/* Make an RLE image of 2 x 4 greyscale frames, with a Basic Offset Table.
+ * Each frame is an 8 byte item set to the frame number, and items is set to
+ * where the first one starts.
+ */
+static char *create_encapsulated(uint32_t n_frames,
+                                 int64_t *items,
+                                 int64_t *length)
+{
+    char *memory = calloc(1, 1024 + (size_t) n_frames * 20);
+    ck_assert_ptr_nonnull(memory);
+
+    char *p = append_image_header(memory,
+                                  "1.2.840.10008.1.2.5",
+                                  2,
+                                  4,
+                                  1,
+                                  "MONOCHROME2",
+                                  n_frames);
+    p = append_element(p, 0x7fe00010, "OB", "", 0);
+    memcpy(p - 4, &(uint32_t) { 0xffffffff }, 4);
+
+    p = append_item(p, 0xe000, n_frames * 4);
+    for (uint32_t i = 0; i < n_frames; i++) {
+        memcpy(p, &(uint32_t) { i * 16 }, 4);
+        p += 4;
+    }
+
+    *items = p - memory;
+    for (uint32_t i = 0; i < n_frames; i++) {
+        p = append_item(p, 0xe000, 8);
+        memset(p, (int) (i + 1), 8);
+        p += 8;
+    }
+    p = append_item(p, 0xe0dd, 0);
+
+    *length = p - memory;
+
+    return memory;
+}
+
+
+/* Memory IO which counts seeks, so we can see how reads are batched.
+ */
+struct CountingIO {
+    DcmIO io;
+    const char *memory;
+    int64_t length;
+    int64_t position;
+    int n_seeks;
+};
+
+
+static DcmIO *counting_open(DcmError **error, void *client)
+{
+    (void) error;
+
+    return (DcmIO *) client;
+}
+
+
+static void counting_close(DcmIO *io)
+{
+    (void) io;
+}
+
+
+static int64_t counting_read(DcmError **error,
+                             DcmIO *io,
+                             char *buffer,
+                             int64_t length)
+{
+    struct CountingIO *counting = (struct CountingIO *) io;
+    int64_t n = counting->length - counting->position;
+
+    (void) error;
+    n = n < length ? n : length;
+    memcpy(buffer, counting->memory + counting->position, n);
+    counting->position += n;
+
+    return n;
+}
+
+
+static int64_t counting_seek(DcmError **error,
+                             DcmIO *io,
+                             int64_t offset,
+                             int whence)
+{
+    struct CountingIO *counting = (struct CountingIO *) io;
+
+    (void) error;
+    counting->n_seeks += 1;
+    if (whence == SEEK_SET) {
+        counting->position = offset;
+    } else if (whence == SEEK_CUR) {
+        counting->position += offset;
+    } else {
+        counting->position = counting->length + offset;
+    }
+
+    return counting->position;
+}
+
+
+static const DcmIOMethods counting_methods = {
+    counting_open,
+    counting_close,
+    counting_read,
+    counting_seek,
+};
+
+
+/* Splice bytes into a file loaded with load_file_to_memory().
+ */
+static char *insert_bytes(char *memory,
+                          int64_t *length,
+                          int64_t offset,
+                          const void *bytes,
+                          size_t n)
+{
+    char *result = realloc(memory, *length + n);
+    ck_assert_ptr_nonnull(result);
+    memmove(result + offset + n, result + offset, *length - offset);
+    memcpy(result + offset, bytes, n);
+    *length += n;
+
+    return result;
+}
+
+
+/* Selector SV Value and Selector UV Value, both with a 4 byte length in
+ * explicit VR.
+ */
+static const unsigned char long_vr_elements[] = {
+    0x72, 0x00, 0x82, 0x00, 'S', 'V', 0x00, 0x00,
+    0x08, 0x00, 0x00, 0x00, 0xfe, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff,
+    0x72, 0x00, 0x83, 0x00, 'U', 'V', 0x00, 0x00,
+    0x08, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00,
+};
+
+
 START_TEST(test_error)
 {
     DcmError *error = NULL;
@@ -547,6 +836,71 @@ START_TEST(test_element_US_multivalue_empty)
 END_TEST
 
 
+START_TEST(test_dataset_clone_shared)
+{
+    DcmDataSet *dataset = dcm_dataset_create(NULL);
+
+    DcmElement *element = dcm_element_create(NULL, 0x00280010, DCM_VR_US);
+    (void) dcm_element_set_value_integer(NULL, element, 256);
+    dcm_dataset_insert(NULL, dataset, element);
+
+    DcmDataSet *item = dcm_dataset_create(NULL);
+    element = dcm_element_create(NULL, 0x00280011, DCM_VR_US);
+    (void) dcm_element_set_value_integer(NULL, element, 512);
+    dcm_dataset_insert(NULL, item, element);
+    DcmSequence *seq = dcm_sequence_create(NULL);
+    dcm_sequence_append(NULL, seq, item);
+    element = dcm_element_create(NULL, 0x00209111, DCM_VR_SQ);
+    (void) dcm_element_set_value_sequence(NULL, element, seq);
+    dcm_dataset_insert(NULL, dataset, element);
+
+    dcm_dataset_lock(dataset);
+
+    // clones of a locked data set share its elements
+    DcmDataSet *clone = dcm_dataset_clone(NULL, dataset);
+    ck_assert_ptr_nonnull(clone);
+    ck_assert_int_eq(dcm_dataset_count(clone), 2);
+    ck_assert_ptr_eq(dcm_dataset_get(NULL, clone, 0x00280010),
+                     dcm_dataset_get(NULL, dataset, 0x00280010));
+
+    DcmDataSet *clone2 = dcm_dataset_clone(NULL, clone);
+    ck_assert_ptr_nonnull(clone2);
+    ck_assert_int_eq(dcm_dataset_count(clone2), 2);
+
+    // and stay valid after the original is gone
+    dcm_dataset_destroy(dataset);
+
+    DcmSequence *clone_seq;
+    element = dcm_dataset_get(NULL, clone, 0x00209111);
+    ck_assert(dcm_element_get_value_sequence(NULL, element, &clone_seq));
+    ck_assert_int_eq(dcm_sequence_count(clone_seq), 1);
+    int64_t value;
+    element = dcm_dataset_get(NULL,
+                              dcm_sequence_get(NULL, clone_seq, 0),
+                              0x00280011);
+    ck_assert(dcm_element_get_value_integer(NULL, element, 0, &value));
+    ck_assert_int_eq(value, 512);
+
+    // changing a clone copies the element list, and leaves other clones alone
+    element = dcm_element_create(NULL, 0x00280100, DCM_VR_US);
+    (void) dcm_element_set_value_integer(NULL, element, 8);
+    ck_assert(dcm_dataset_insert(NULL, clone, element));
+    ck_assert(dcm_dataset_remove(NULL, clone, 0x00280010));
+    ck_assert_int_eq(dcm_dataset_count(clone), 2);
+    ck_assert_ptr_null(dcm_dataset_contains(clone, 0x00280010));
+
+    ck_assert_int_eq(dcm_dataset_count(clone2), 2);
+    ck_assert_ptr_null(dcm_dataset_contains(clone2, 0x00280100));
+    element = dcm_dataset_get(NULL, clone2, 0x00280010);
+    ck_assert(dcm_element_get_value_integer(NULL, element, 0, &value));
+    ck_assert_int_eq(value, 256);
+
+    dcm_dataset_destroy(clone);
+    dcm_dataset_destroy(clone2);
+}
+END_TEST
+
+
 START_TEST(test_sequence)
 {
     DcmElement *element;
@@ -640,6 +994,503 @@ START_TEST(test_dataset)
 END_TEST
 
 
+static bool check_ascending(const DcmElement *element, void *client)
+{
+    uint32_t *last_tag = (uint32_t *) client;
+    uint32_t tag = dcm_element_get_tag(element);
+
+    if (tag <= *last_tag) {
+        return false;
+    }
+    *last_tag = tag;
+
+    return true;
+}
+
+
+START_TEST(test_dataset_order)
+{
+    const uint32_t tags[] = {
+        0x00280100, 0x00280002, 0x00280103, 0x00280010,
+        0x00280006, 0x00280102, 0x00280011, 0x00280101,
+    };
+    uint32_t n_tags = sizeof(tags) / sizeof(tags[0]);
+
+    DcmDataSet *dataset = dcm_dataset_create(NULL);
+    ck_assert_ptr_nonnull(dataset);
+
+    for (uint32_t i = 0; i < n_tags; i++) {
+        DcmElement *element = dcm_element_create(NULL, tags[i], DCM_VR_US);
+        ck_assert_int_ne(dcm_element_set_value_integer(NULL, element, i), 0);
+        ck_assert_int_ne(dcm_dataset_insert(NULL, dataset, element), 0);
+    }
+    ck_assert_uint_eq(dcm_dataset_count(dataset), n_tags);
+
+    // duplicates are rejected
+    DcmElement *duplicate = dcm_element_create(NULL, tags[3], DCM_VR_US);
+    (void) dcm_element_set_value_integer(NULL, duplicate, 1);
+    ck_assert_int_eq(dcm_dataset_insert(NULL, dataset, duplicate), 0);
+    dcm_element_destroy(duplicate);
+
+    for (uint32_t i = 0; i < n_tags; i++) {
+        DcmElement *element = dcm_dataset_contains(dataset, tags[i]);
+        ck_assert_ptr_nonnull(element);
+        int64_t value;
+        (void) dcm_element_get_value_integer(NULL, element, 0, &value);
+        ck_assert_int_eq(value, i);
+    }
+    ck_assert_ptr_null(dcm_dataset_contains(dataset, 0x00280001));
+    ck_assert_ptr_null(dcm_dataset_contains(dataset, 0x00280200));
+
+    ck_assert_int_ne(dcm_dataset_remove(NULL, dataset, 0x00280010), 0);
+    ck_assert_ptr_null(dcm_dataset_contains(dataset, 0x00280010));
+    ck_assert_ptr_nonnull(dcm_dataset_contains(dataset, 0x00280011));
+
+    // iteration and tag copies are in tag order
+    uint32_t last_tag = 0;
+    ck_assert_int_ne(dcm_dataset_foreach(dataset, check_ascending, &last_tag),
+                     0);
+    ck_assert_uint_eq(last_tag, 0x00280103);
+
+    uint32_t copied_tags[7];
+    dcm_dataset_copy_tags(dataset, copied_tags, 7);
+    ck_assert_uint_eq(copied_tags[0], 0x00280002);
+    ck_assert_uint_eq(copied_tags[2], 0x00280011);
+    ck_assert_uint_eq(copied_tags[6], 0x00280103);
+
+    dcm_dataset_lock(dataset);
+    ck_assert_int_eq(dcm_dataset_remove(NULL, dataset, 0x00280011), 0);
+    ck_assert_uint_eq(dcm_dataset_count(dataset), 7);
+
+    dcm_dataset_destroy(dataset);
+}
+END_TEST
+
+
+START_TEST(test_dataset_get_many)
+{
+    DcmDataSet *dataset = dcm_dataset_create(NULL);
+
+    DcmElement *element = dcm_element_create(NULL, 0x00280010, DCM_VR_US);
+    (void) dcm_element_set_value_integer(NULL, element, 256);
+    (void) dcm_dataset_insert(NULL, dataset, element);
+
+    element = dcm_element_create(NULL, 0x00480001, DCM_VR_FL);
+    (void) dcm_element_set_value_decimal(NULL, element, 0.25);
+    (void) dcm_dataset_insert(NULL, dataset, element);
+
+    element = dcm_element_create(NULL, 0x00280004, DCM_VR_CS);
+    (void) dcm_element_set_value_string(NULL, element, "RGB", false);
+    (void) dcm_dataset_insert(NULL, dataset, element);
+
+    int64_t rows = 0;
+    int64_t columns = 17;
+    double width = 0.0;
+    const char *photometric_interpretation = NULL;
+
+    // out of order, with a missing optional value
+    DcmValueSpec specs[] = {
+        {0x00480001, DCM_VALUE_TYPE_DECIMAL, false, &width},
+        {0x00280004, DCM_VALUE_TYPE_STRING, false,
+            &photometric_interpretation},
+        {0x00280010, DCM_VALUE_TYPE_INTEGER, false, &rows},
+        {0x00280011, DCM_VALUE_TYPE_INTEGER, true, &columns},
+    };
+    ck_assert_int_ne(dcm_dataset_get_many(NULL, dataset, specs, 4), 0);
+    ck_assert_int_eq(rows, 256);
+    ck_assert_int_eq(columns, 17);
+    ck_assert_double_eq_tol(width, 0.25, 1e-6);
+    ck_assert_str_eq(photometric_interpretation, "RGB");
+
+    // missing values which are not optional are errors
+    DcmError *error = NULL;
+    specs[3].optional = false;
+    ck_assert_int_eq(dcm_dataset_get_many(&error, dataset, specs, 4), 0);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+
+    // and so are values of the wrong type
+    specs[0].type = DCM_VALUE_TYPE_INTEGER;
+    ck_assert_int_eq(dcm_dataset_get_many(&error, dataset, specs, 1), 0);
+    ck_assert_ptr_nonnull(error);
+    dcm_error_clear(&error);
+
+    dcm_dataset_destroy(dataset);
+}
+END_TEST
+
+
+static void count_release(void *client)
+{
+    int *n_releases = (int *) client;
+
+    *n_releases += 1;
+}
+
+
+START_TEST(test_frame_external)
+{
+    static const char pixels[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    int n_releases = 0;
+
+    DcmFrame *frame = dcm_frame_create_external(NULL,
+                                                1,
+                                                pixels,
+                                                sizeof(pixels),
+                                                2,
+                                                2,
+                                                3,
+                                                8,
+                                                8,
+                                                0,
+                                                0,
+                                                "RGB",
+                                                "1.2.840.10008.1.2.1",
+                                                count_release,
+                                                &n_releases);
+    ck_assert_ptr_nonnull(frame);
+    ck_assert_ptr_eq(dcm_frame_get_value(frame), pixels);
+    ck_assert_uint_eq(dcm_frame_get_length(frame), sizeof(pixels));
+
+    ck_assert_ptr_eq(dcm_frame_ref(frame), frame);
+    ck_assert_ptr_eq(dcm_frame_ref(frame), frame);
+
+    dcm_frame_unref(frame);
+    dcm_frame_destroy(frame);
+    ck_assert_int_eq(n_releases, 0);
+    ck_assert_str_eq(dcm_frame_get_photometric_interpretation(frame), "RGB");
+
+    dcm_frame_unref(frame);
+    ck_assert_int_eq(n_releases, 1);
+}
+END_TEST
+
+
+START_TEST(test_frame_decode_rle)
+{
+    // 4 x 2 pixels of 16 bit monochrome, so two segments, high byte first
+    static char rle[80] = {
+        2, 0, 0, 0,
+        64, 0, 0, 0,
+        72, 0, 0, 0,
+    };
+    static const char high[] = {
+        (char) 0xfe, 1, 1, 3, 5, (char) 0xfe, 7, (char) 0x80
+    };
+    static const char low[] = {
+        (char) 0xfe, 2, 1, 4, 6, (char) 0xfe, 8, (char) 0x80
+    };
+    static const char expected[] = {
+        2, 1, 2, 1, 2, 1, 4, 3, 6, 5, 8, 7, 8, 7, 8, 7
+    };
+    memcpy(rle + 64, high, sizeof(high));
+    memcpy(rle + 72, low, sizeof(low));
+
+    DcmFrame *frame = dcm_frame_create_external(NULL,
+                                                1,
+                                                rle,
+                                                sizeof(rle),
+                                                2,
+                                                4,
+                                                1,
+                                                16,
+                                                16,
+                                                0,
+                                                0,
+                                                "MONOCHROME2",
+                                                "1.2.840.10008.1.2.5",
+                                                NULL,
+                                                NULL);
+    ck_assert_ptr_nonnull(frame);
+
+    for (uint32_t n_threads = 1; n_threads <= 2; n_threads++) {
+        DcmFrame *decoded = dcm_frame_decode_ex(NULL, frame, n_threads);
+        ck_assert_ptr_nonnull(decoded);
+        ck_assert_str_eq(dcm_frame_get_transfer_syntax_uid(decoded),
+                         "1.2.840.10008.1.2.1");
+        ck_assert_uint_eq(dcm_frame_get_length(decoded), sizeof(expected));
+        ck_assert_mem_eq(dcm_frame_get_value(decoded),
+                         expected,
+                         sizeof(expected));
+
+        // decoding a native frame just adds a reference
+        DcmFrame *native = dcm_frame_decode(NULL, decoded);
+        ck_assert_ptr_eq(native, decoded);
+        dcm_frame_unref(native);
+        dcm_frame_unref(decoded);
+    }
+    dcm_frame_unref(frame);
+
+    // a segment which ends early is an error
+    frame = dcm_frame_create_external(NULL,
+                                      1,
+                                      rle,
+                                      77,
+                                      2,
+                                      4,
+                                      1,
+                                      16,
+                                      16,
+                                      0,
+                                      0,
+                                      "MONOCHROME2",
+                                      "1.2.840.10008.1.2.5",
+                                      NULL,
+                                      NULL);
+    ck_assert_ptr_nonnull(frame);
+    DcmError *error = NULL;
+    ck_assert_ptr_null(dcm_frame_decode(&error, frame));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_PARSE);
+    dcm_error_clear(&error);
+    dcm_frame_unref(frame);
+}
+END_TEST
+
+
+static bool fake_decode(DcmError **error,
+                        void *client,
+                        const DcmFrame *frame,
+                        char *buffer,
+                        uint32_t length,
+                        DcmFrameInfo *info)
+{
+    (void) error;
+    (void) frame;
+
+    *((int *) client) += 1;
+    memset(buffer, 0x42, length);
+    info->photometric_interpretation = "RGB";
+
+    return true;
+}
+
+
+START_TEST(test_frame_decode_codec)
+{
+    static char jpeg[16] = { 0 };
+    static int calls = 0;
+    DcmCodec codec = {
+        "1.2.840.10008.1.2.4.50",
+        fake_decode,
+        &calls
+    };
+
+    ck_assert_int_eq(dcm_codec_is_supported("1.2.840.10008.1.2.4.50"), 0);
+    ck_assert_int_ne(dcm_codec_register(NULL, &codec), 0);
+    ck_assert_int_ne(dcm_codec_is_supported("1.2.840.10008.1.2.4.50"), 0);
+
+    DcmFrame *frame = dcm_frame_create_external(NULL,
+                                                1,
+                                                jpeg,
+                                                sizeof(jpeg),
+                                                2,
+                                                2,
+                                                3,
+                                                8,
+                                                8,
+                                                0,
+                                                0,
+                                                "YBR_FULL_422",
+                                                "1.2.840.10008.1.2.4.50",
+                                                NULL,
+                                                NULL);
+    ck_assert_ptr_nonnull(frame);
+
+    DcmFrame *decoded = dcm_frame_decode(NULL, frame);
+    ck_assert_ptr_nonnull(decoded);
+    ck_assert_int_eq(calls, 1);
+    ck_assert_uint_eq(dcm_frame_get_length(decoded), 12);
+    ck_assert_str_eq(dcm_frame_get_photometric_interpretation(decoded),
+                     "RGB");
+    ck_assert_str_eq(dcm_frame_get_transfer_syntax_uid(decoded),
+                     "1.2.840.10008.1.2.1");
+    ck_assert_int_eq(dcm_frame_get_value(decoded)[11], 0x42);
+    dcm_frame_unref(decoded);
+
+    // a buffer which is too small is an error
+    char buffer[12];
+    DcmFrameInfo info;
+    DcmError *error = NULL;
+    ck_assert_int_eq(dcm_frame_decode_into(&error, frame, buffer, 8, &info),
+                     0);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+    ck_assert_int_eq(calls, 1);
+    dcm_frame_unref(frame);
+
+    // big-endian native frames are byteswapped
+    static const char big[] = { 1, 2, 3, 4 };
+    static const char little[] = { 2, 1, 4, 3 };
+    frame = dcm_frame_create_external(NULL,
+                                      1,
+                                      big,
+                                      sizeof(big),
+                                      1,
+                                      2,
+                                      1,
+                                      16,
+                                      16,
+                                      0,
+                                      0,
+                                      "MONOCHROME2",
+                                      "1.2.840.10008.1.2.2",
+                                      NULL,
+                                      NULL);
+    ck_assert_ptr_nonnull(frame);
+    ck_assert_int_ne(dcm_frame_decode_into(NULL,
+                                           frame,
+                                           buffer,
+                                           sizeof(buffer),
+                                           &info),
+                     0);
+    ck_assert_uint_eq(info.length, sizeof(little));
+    ck_assert_mem_eq(buffer, little, sizeof(little));
+    dcm_frame_unref(frame);
+}
+END_TEST
+
+
+START_TEST(test_frame_convert)
+{
+    // 16-bit MONOCHROME1, so inverted, and large enough for the SIMD path
+    uint16_t mono[16];
+    for (uint32_t i = 0; i < 16; i++) {
+        static const uint16_t values[] = { 0, 0x8000, 0xffff, 0x4000 };
+        mono[i] = values[i % 4];
+    }
+    DcmFrame *frame = dcm_frame_create_external(NULL,
+                                                1,
+                                                (const char *) mono,
+                                                sizeof(mono),
+                                                4,
+                                                4,
+                                                1,
+                                                16,
+                                                16,
+                                                0,
+                                                0,
+                                                "MONOCHROME1",
+                                                "1.2.840.10008.1.2.1",
+                                                NULL,
+                                                NULL);
+    ck_assert_ptr_nonnull(frame);
+
+    DcmFrame *grey = dcm_frame_convert(NULL, frame, DCM_PIXEL_FORMAT_GREY8);
+    ck_assert_ptr_nonnull(grey);
+    ck_assert_uint_eq(dcm_frame_get_length(grey), 16);
+    ck_assert_uint_eq(dcm_frame_get_bits_allocated(grey), 8);
+    ck_assert_str_eq(dcm_frame_get_photometric_interpretation(grey),
+                     "MONOCHROME2");
+    const uint8_t *pixels = (const uint8_t *) dcm_frame_get_value(grey);
+    ck_assert_uint_eq(pixels[0], 255);
+    ck_assert_uint_eq(pixels[1], 127);
+    ck_assert_uint_eq(pixels[2], 0);
+    ck_assert_uint_eq(pixels[3], 191);
+    ck_assert_mem_eq(pixels, pixels + 12, 4);
+
+    // greyscale is already in the right format
+    DcmFrame *same = dcm_frame_convert(NULL, grey, DCM_PIXEL_FORMAT_GREY8);
+    ck_assert_ptr_eq(same, grey);
+    dcm_frame_unref(same);
+
+    DcmFrame *rgb = dcm_frame_convert(NULL, grey, DCM_PIXEL_FORMAT_RGB8);
+    ck_assert_ptr_nonnull(rgb);
+    ck_assert_uint_eq(dcm_frame_get_length(rgb), 48);
+    ck_assert_uint_eq(((const uint8_t *) dcm_frame_get_value(rgb))[4], 127);
+    dcm_frame_unref(rgb);
+    dcm_frame_unref(grey);
+
+    // a narrow window saturates
+    grey = dcm_frame_convert_ex(NULL,
+                                frame,
+                                DCM_PIXEL_FORMAT_GREY8,
+                                0x4000,
+                                2);
+    ck_assert_ptr_nonnull(grey);
+    pixels = (const uint8_t *) dcm_frame_get_value(grey);
+    ck_assert_uint_eq(pixels[0], 255);
+    ck_assert_uint_eq(pixels[1], 0);
+    dcm_frame_unref(grey);
+    dcm_frame_unref(frame);
+
+    // YBR_FULL white, black and red, repeated
+    char ybr[18 * 3];
+    for (uint32_t i = 0; i < 6; i++) {
+        static const char values[] = {
+            (char) 255, (char) 128, (char) 128,
+            0, (char) 128, (char) 128,
+            76, 85, (char) 255,
+        };
+        memcpy(ybr + i * sizeof(values), values, sizeof(values));
+    }
+    frame = dcm_frame_create_external(NULL,
+                                      1,
+                                      ybr,
+                                      sizeof(ybr),
+                                      1,
+                                      18,
+                                      3,
+                                      8,
+                                      8,
+                                      0,
+                                      0,
+                                      "YBR_FULL",
+                                      "1.2.840.10008.1.2.1",
+                                      NULL,
+                                      NULL);
+    ck_assert_ptr_nonnull(frame);
+
+    rgb = dcm_frame_convert(NULL, frame, DCM_PIXEL_FORMAT_RGB8);
+    ck_assert_ptr_nonnull(rgb);
+    ck_assert_str_eq(dcm_frame_get_photometric_interpretation(rgb), "RGB");
+    pixels = (const uint8_t *) dcm_frame_get_value(rgb);
+    ck_assert_uint_eq(pixels[0], 255);
+    ck_assert_uint_eq(pixels[4], 0);
+    ck_assert_uint_ge(pixels[6], 253);
+    ck_assert_uint_le(pixels[7], 1);
+    ck_assert_uint_le(pixels[8], 1);
+    for (uint32_t i = 1; i < 6; i++) {
+        ck_assert_mem_eq(pixels, pixels + i * 9, 9);
+    }
+
+    grey = dcm_frame_convert(NULL, rgb, DCM_PIXEL_FORMAT_GREY8);
+    ck_assert_ptr_nonnull(grey);
+    pixels = (const uint8_t *) dcm_frame_get_value(grey);
+    ck_assert_uint_eq(pixels[0], 255);
+    ck_assert_uint_eq(pixels[1], 0);
+    ck_assert_uint_eq(pixels[2], 76);
+    dcm_frame_unref(grey);
+    dcm_frame_unref(rgb);
+    dcm_frame_unref(frame);
+
+    // 33025 x 65026 16-bit pixels is 4 bytes once the size wraps at 32 bits
+    frame = dcm_frame_create_external(NULL,
+                                      1,
+                                      (const char *) mono,
+                                      4,
+                                      33025,
+                                      65026,
+                                      1,
+                                      16,
+                                      16,
+                                      0,
+                                      0,
+                                      "MONOCHROME2",
+                                      "1.2.840.10008.1.2.1",
+                                      NULL,
+                                      NULL);
+    ck_assert_ptr_nonnull(frame);
+    DcmError *error = NULL;
+    ck_assert_ptr_null(dcm_frame_convert(&error,
+                                         frame,
+                                         DCM_PIXEL_FORMAT_GREY8));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+    dcm_frame_unref(frame);
+}
+END_TEST
+
+
 START_TEST(test_file_sm_image_file_meta)
 {
     const char *value;
@@ -735,65 +1586,1726 @@ START_TEST(test_file_sm_image_frame)
 END_TEST
 
 
-START_TEST(test_file_sm_image_file_meta_memory)
+START_TEST(test_file_sm_image_read_frames_decoded)
 {
-    DcmElement *element;
-    const char *value;
-
-    int64_t length;
-    char *memory = load_file_to_memory("data/test_files/sm_image.dcm", &length);
-    ck_assert_ptr_nonnull(memory);
+    static const uint32_t frame_numbers[] = { 5, 1, 3, 2, 4 };
+    const uint32_t n_frames = 5;
 
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
     DcmFilehandle *filehandle =
-        dcm_filehandle_create_from_memory(NULL, memory, length);
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
     ck_assert_ptr_nonnull(filehandle);
 
-    const DcmDataSet *meta = dcm_filehandle_get_file_meta(NULL, filehandle);
+    DcmFrame *frames[5];
+    ck_assert_int_ne(dcm_filehandle_read_frames_decoded(NULL,
+                                                        filehandle,
+                                                        frame_numbers,
+                                                        n_frames,
+                                                        4,
+                                                        frames),
+                     0);
+
+    for (uint32_t i = 0; i < n_frames; i++) {
+        DcmFrame *frame = dcm_filehandle_read_frame(NULL,
+                                                    filehandle,
+                                                    frame_numbers[i]);
+        ck_assert_ptr_nonnull(frame);
+        ck_assert_ptr_nonnull(frames[i]);
+        ck_assert_uint_eq(dcm_frame_get_number(frames[i]), frame_numbers[i]);
+        ck_assert_uint_eq(dcm_frame_get_length(frames[i]),
+                          dcm_frame_get_length(frame));
+        ck_assert_mem_eq(dcm_frame_get_value(frames[i]),
+                         dcm_frame_get_value(frame),
+                         dcm_frame_get_length(frame));
+        dcm_frame_unref(frame);
+        dcm_frame_unref(frames[i]);
+    }
 
-    // Transfer Syntax UID
-    element = dcm_dataset_get(NULL, meta, 0x00020010);
-    (void) dcm_element_get_value_string(NULL, element, 0, &value);
-    ck_assert_str_eq(value, "1.2.840.10008.1.2.1");
+    // a bad frame number fails the whole read
+    static const uint32_t bad_numbers[] = { 1, 2, 9999 };
+    DcmError *error = NULL;
+    ck_assert_int_eq(dcm_filehandle_read_frames_decoded(&error,
+                                                        filehandle,
+                                                        bad_numbers,
+                                                        3,
+                                                        2,
+                                                        frames),
+                     0);
+    ck_assert_ptr_nonnull(error);
+    dcm_error_clear(&error);
+    for (uint32_t i = 0; i < 3; i++) {
+        ck_assert_ptr_null(frames[i]);
+    }
 
-    // Media Storage SOP Class UID
-    element = dcm_dataset_get(NULL, meta, 0x00020002);
-    (void) dcm_element_get_value_string(NULL, element, 0, &value);
-    ck_assert_str_eq(value, "1.2.840.10008.5.1.4.1.1.77.1.6");
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
 
-    dcm_dataset_print(meta, 0);
+
+START_TEST(test_file_sm_image_sparse_frame_position)
+{
+    char *file_path = fixture_path("data/test_files/sm_image_sparse.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    ck_assert_int_ne(dcm_filehandle_prepare_read_frame(NULL, filehandle), 0);
+
+    DcmFrame *frame = dcm_filehandle_read_frame_position(NULL,
+                                                         filehandle,
+                                                         2, 1);
+    ck_assert_ptr_nonnull(frame);
+    ck_assert_uint_eq(dcm_frame_get_rows(frame), 4);
+    ck_assert_uint_eq(dcm_frame_get_columns(frame), 4);
+    const char *value = dcm_frame_get_value(frame);
+    ck_assert_uint_eq(value[0], dcm_frame_get_number(frame));
+    dcm_frame_destroy(frame);
+
+    // there's a hole in the tile grid at (1, 1)
+    DcmError *error = NULL;
+    frame = dcm_filehandle_read_frame_position(&error, filehandle, 1, 1);
+    ck_assert_ptr_null(frame);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_MISSING_FRAME);
+    dcm_error_clear(&error);
 
     dcm_filehandle_destroy(filehandle);
-    free(memory);
 }
 END_TEST
 
 
-static Suite *create_main_suite(void)
+START_TEST(test_file_sm_image_sparse_frame_position_ex)
 {
-    Suite *suite = suite_create("main");
-
-    TCase *error_case = tcase_create("error");
-    tcase_add_test(error_case, test_error);
-    suite_add_tcase(suite, error_case);
+    char *file_path = fixture_path("data/test_files/sm_image_sparse.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
 
-    TCase *log_case = tcase_create("log");
-    tcase_add_test(log_case, test_log_level);
-    suite_add_tcase(suite, log_case);
+    ck_assert_uint_eq(dcm_filehandle_get_num_focal_planes(NULL, filehandle), 2);
+    ck_assert_uint_eq(dcm_filehandle_get_num_optical_paths(NULL, filehandle),
+                      2);
+
+    // focal planes are in increasing Z order
+    double z;
+    ck_assert_int_ne(dcm_filehandle_get_focal_plane_z(NULL,
+                                                      filehandle, 0, &z), 0);
+    ck_assert_double_eq(z, -1.25);
+    ck_assert_int_ne(dcm_filehandle_get_focal_plane_z(NULL,
+                                                      filehandle, 1, &z), 0);
+    ck_assert_double_eq(z, 0.5);
+
+    // optical paths are in OpticalPathSequence order
+    ck_assert_str_eq(dcm_filehandle_get_optical_path_identifier(NULL,
+                                                                filehandle,
+                                                                0),
+                     "DAPI");
+    ck_assert_str_eq(dcm_filehandle_get_optical_path_identifier(NULL,
+                                                                filehandle,
+                                                                1),
+                     "FITC");
+
+    struct {
+        uint32_t column;
+        uint32_t row;
+        uint32_t focal_plane;
+        uint32_t optical_path;
+        uint32_t frame_number;
+    } tests[] = {
+        {2, 1, 0, 0, 20},
+        {0, 0, 1, 0, 11},
+        {2, 1, 1, 1, 5},
+        {1, 0, 0, 1, 7},
+    };
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        DcmFrame *frame =
+            dcm_filehandle_read_frame_position_ex(NULL,
+                                                  filehandle,
+                                                  tests[i].column,
+                                                  tests[i].row,
+                                                  tests[i].focal_plane,
+                                                  tests[i].optical_path);
+        ck_assert_ptr_nonnull(frame);
+        ck_assert_uint_eq(dcm_frame_get_number(frame), tests[i].frame_number);
+        dcm_frame_destroy(frame);
+    }
 
-    TCase *dict_case = tcase_create("dict");
-    tcase_add_test(dict_case, test_tag_validity_checks);
-    tcase_add_test(dict_case, test_vr_validity_checks);
-    tcase_add_test(dict_case, test_dict_tag_lookups);
-    tcase_add_test(dict_case, test_dict_vr_lookups);
-    suite_add_tcase(suite, dict_case);
+    DcmError *error = NULL;
+    DcmFrame *frame = dcm_filehandle_read_frame_position_ex(&error,
+                                                            filehandle,
+                                                            1, 1, 1, 1);
+    ck_assert_ptr_null(frame);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_MISSING_FRAME);
+    dcm_error_clear(&error);
 
-    return suite;
+    dcm_filehandle_destroy(filehandle);
 }
+END_TEST
 
 
-static Suite *create_data_suite(void)
+START_TEST(test_file_sm_image_sparse_long_vr)
 {
-    Suite *suite = suite_create("data");
+    int64_t length;
+    char *memory = load_file_to_memory("data/test_files/sm_image_sparse.dcm",
+                                       &length);
+    ck_assert_ptr_nonnull(memory);
+
+    // append to the first undefined length per-frame item
+    memory = insert_bytes(memory,
+                          &length,
+                          946,
+                          long_vr_elements,
+                          sizeof(long_vr_elements));
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+
+    ck_assert_int_ne(dcm_filehandle_prepare_read_frame(NULL, filehandle), 0);
+
+    DcmFrame *frame = dcm_filehandle_read_frame_position(NULL,
+                                                         filehandle,
+                                                         2, 1);
+    ck_assert_ptr_nonnull(frame);
+    const char *value = dcm_frame_get_value(frame);
+    ck_assert_uint_eq(value[0], dcm_frame_get_number(frame));
+    dcm_frame_destroy(frame);
+
+    dcm_filehandle_destroy(filehandle);
+    free(memory);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_planes_frame_position)
+{
+    char *file_path = fixture_path("data/test_files/sm_image_planes.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // TILED_FULL, 3 x 2 tiles, 2 focal planes and 2 optical paths
+    ck_assert_uint_eq(dcm_filehandle_get_num_focal_planes(NULL, filehandle), 2);
+    ck_assert_uint_eq(dcm_filehandle_get_num_optical_paths(NULL, filehandle),
+                      2);
+    ck_assert_str_eq(dcm_filehandle_get_optical_path_identifier(NULL,
+                                                                filehandle,
+                                                                1),
+                     "FITC");
+
+    struct {
+        uint32_t column;
+        uint32_t row;
+        uint32_t focal_plane;
+        uint32_t optical_path;
+        uint32_t frame_number;
+    } tests[] = {
+        {2, 1, 0, 0, 6},
+        {0, 0, 1, 0, 7},
+        {1, 0, 0, 1, 14},
+        {2, 1, 1, 1, 24},
+    };
+
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        DcmFrame *frame =
+            dcm_filehandle_read_frame_position_ex(NULL,
+                                                  filehandle,
+                                                  tests[i].column,
+                                                  tests[i].row,
+                                                  tests[i].focal_plane,
+                                                  tests[i].optical_path);
+        ck_assert_ptr_nonnull(frame);
+        ck_assert_uint_eq(dcm_frame_get_number(frame), tests[i].frame_number);
+        // each frame is filled with its number
+        ck_assert_uint_eq((uint8_t) dcm_frame_get_value(frame)[0],
+                          tests[i].frame_number);
+        dcm_frame_destroy(frame);
+    }
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+#ifndef _WIN32
+struct ThreadedRead {
+    DcmFilehandle *filehandle;
+    uint32_t start;
+    int errors;
+};
+
+
+static void *threaded_read(void *client)
+{
+    struct ThreadedRead *read = (struct ThreadedRead *) client;
+
+    for (uint32_t i = 0; i < 25; i++) {
+        uint32_t frame_number = 1 + (read->start + i) % 25;
+        DcmFrame *frame = dcm_filehandle_read_frame(NULL,
+                                                    read->filehandle,
+                                                    frame_number);
+        if (frame == NULL ||
+            dcm_frame_get_number(frame) != frame_number) {
+            read->errors += 1;
+        }
+        dcm_frame_destroy(frame);
+    }
+
+    return NULL;
+}
+
+
+START_TEST(test_file_sm_image_threaded_read)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // all threads start on an unprepared filehandle, so they race to
+    // initialise it
+    pthread_t threads[8];
+    struct ThreadedRead reads[8];
+    for (uint32_t i = 0; i < 8; i++) {
+        reads[i].filehandle = filehandle;
+        reads[i].start = i * 3;
+        reads[i].errors = 0;
+        ck_assert_int_eq(pthread_create(&threads[i],
+                                        NULL,
+                                        threaded_read,
+                                        &reads[i]), 0);
+    }
+    for (uint32_t i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        ck_assert_int_eq(reads[i].errors, 0);
+    }
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+#endif
+
+
+START_TEST(test_file_sm_image_frame_cache)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // room for ten of the 300 byte frames
+    DcmFrameCache *cache = dcm_frame_cache_create(NULL, 3000);
+    ck_assert_ptr_nonnull(cache);
+    ck_assert_int_ne(dcm_filehandle_set_frame_cache(NULL, filehandle, cache),
+                     0);
+
+    // a hit returns the cached frame
+    DcmFrame *frame1 = dcm_filehandle_read_frame(NULL, filehandle, 1);
+    DcmFrame *frame2 = dcm_filehandle_read_frame(NULL, filehandle, 1);
+    ck_assert_ptr_nonnull(frame1);
+    ck_assert_ptr_eq(frame1, frame2);
+    dcm_frame_destroy(frame1);
+    dcm_frame_destroy(frame2);
+
+    DcmFrameCacheStats stats;
+    dcm_frame_cache_get_stats(cache, &stats);
+    ck_assert_uint_eq(stats.hits, 1);
+    ck_assert_uint_eq(stats.misses, 1);
+    ck_assert_uint_eq(stats.frames, 1);
+    ck_assert_uint_eq(stats.bytes, 300);
+
+    // push frames 1 and 2 out, then read them again to make them part of the
+    // working set
+    for (uint32_t i = 2; i <= 12; i++) {
+        dcm_frame_destroy(dcm_filehandle_read_frame(NULL, filehandle, i));
+    }
+    for (uint32_t i = 1; i <= 2; i++) {
+        dcm_frame_destroy(dcm_filehandle_read_frame(NULL, filehandle, i));
+    }
+
+    // a scan over all other frames must not evict the working set
+    for (uint32_t i = 13; i <= 25; i++) {
+        dcm_frame_destroy(dcm_filehandle_read_frame(NULL, filehandle, i));
+    }
+    dcm_frame_cache_get_stats(cache, &stats);
+    uint64_t hits = stats.hits;
+    ck_assert_uint_gt(stats.evictions, 0);
+    ck_assert_uint_le(stats.bytes, 3000);
+
+    const uint32_t frame_numbers[] = {2, 1};
+    DcmFrame *frames[2];
+    ck_assert_int_ne(dcm_filehandle_read_frames(NULL,
+                                                filehandle,
+                                                frame_numbers,
+                                                2,
+                                                frames), 0);
+    dcm_frame_cache_get_stats(cache, &stats);
+    ck_assert_uint_eq(stats.hits, hits + 2);
+    ck_assert_uint_eq(dcm_frame_get_number(frames[0]), 2);
+    ck_assert_uint_eq(dcm_frame_get_number(frames[1]), 1);
+
+    // read_frame_into copies from the cache
+    char buffer[300];
+    DcmFrameInfo info;
+    ck_assert_int_ne(dcm_filehandle_read_frame_into(NULL,
+                                                    filehandle,
+                                                    1,
+                                                    buffer, sizeof(buffer),
+                                                    &info), 0);
+    dcm_frame_cache_get_stats(cache, &stats);
+    ck_assert_uint_eq(stats.hits, hits + 3);
+    ck_assert_mem_eq(buffer, dcm_frame_get_value(frames[1]), 300);
+    dcm_frame_destroy(frames[0]);
+    dcm_frame_destroy(frames[1]);
+
+    // destroying a filehandle drops just its own frames
+    DcmFilehandle *other = dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(other);
+    ck_assert_int_ne(dcm_filehandle_set_frame_cache(NULL, other, cache), 0);
+    dcm_frame_destroy(dcm_filehandle_read_frame(NULL, other, 1));
+    dcm_frame_destroy(dcm_filehandle_read_frame(NULL, other, 2));
+    dcm_frame_cache_get_stats(cache, &stats);
+    uint64_t frames_before = stats.frames;
+    dcm_filehandle_destroy(other);
+    dcm_frame_cache_get_stats(cache, &stats);
+    ck_assert_uint_eq(stats.frames, frames_before - 2);
+    ck_assert_uint_eq(stats.bytes, stats.frames * 300);
+    hits = stats.hits;
+    dcm_frame_destroy(dcm_filehandle_read_frame(NULL, filehandle, 2));
+    dcm_frame_cache_get_stats(cache, &stats);
+    ck_assert_uint_eq(stats.hits, hits + 1);
+    free(file_path);
+
+    // the filehandle keeps the cache alive
+    dcm_frame_cache_destroy(cache);
+    dcm_frame_destroy(dcm_filehandle_read_frame(NULL, filehandle, 1));
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_pool)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    char *sparse_path = fixture_path("data/test_files/sm_image_sparse.dcm");
+    DcmFilehandlePoolStats stats;
+
+    // only one idle file may stay open
+    DcmFilehandlePool *pool = dcm_filehandle_pool_create(NULL, 1, 1000000);
+    ck_assert_ptr_nonnull(pool);
+
+    DcmFilehandle *filehandle1 =
+        dcm_filehandle_pool_acquire(NULL, pool, file_path);
+    DcmFilehandle *filehandle2 =
+        dcm_filehandle_pool_acquire(NULL, pool, file_path);
+    ck_assert_ptr_nonnull(filehandle1);
+    ck_assert_ptr_eq(filehandle1, filehandle2);
+    dcm_filehandle_pool_release(pool, filehandle1);
+    dcm_filehandle_pool_release(pool, filehandle2);
+
+    dcm_filehandle_pool_get_stats(pool, &stats);
+    ck_assert_uint_eq(stats.opens, 1);
+    ck_assert_uint_eq(stats.hits, 1);
+    ck_assert_uint_eq(stats.open_handles, 1);
+
+    // the pool counts the metadata too
+    DcmMemoryUsage usage;
+    dcm_filehandle_get_memory_usage(filehandle1, &usage);
+    ck_assert_uint_gt(usage.elements, 0);
+    ck_assert_uint_eq(stats.bytes, usage.total);
+
+    // opening a second file closes the first, but keeps its state
+    DcmFilehandle *sparse =
+        dcm_filehandle_pool_acquire(NULL, pool, sparse_path);
+    ck_assert_ptr_nonnull(sparse);
+    dcm_filehandle_pool_get_stats(pool, &stats);
+    ck_assert_uint_eq(stats.closes, 1);
+    ck_assert_uint_eq(stats.open_handles, 1);
+    ck_assert_uint_eq(stats.handles, 2);
+    dcm_filehandle_pool_release(pool, sparse);
+
+    filehandle1 = dcm_filehandle_pool_acquire(NULL, pool, file_path);
+    ck_assert_ptr_eq(filehandle1, filehandle2);
+    dcm_filehandle_pool_get_stats(pool, &stats);
+    ck_assert_uint_eq(stats.opens, 2);
+    ck_assert_uint_eq(stats.reopens, 1);
+
+    DcmFrame *frame = dcm_filehandle_read_frame(NULL, filehandle1, 1);
+    ck_assert_ptr_nonnull(frame);
+    ck_assert_uint_eq(dcm_frame_get_length(frame), 300);
+    dcm_frame_destroy(frame);
+    dcm_filehandle_pool_release(pool, filehandle1);
+
+    ck_assert_ptr_null(dcm_filehandle_pool_acquire(NULL, pool, "bad.dcm"));
+    dcm_filehandle_pool_get_stats(pool, &stats);
+    ck_assert_uint_eq(stats.handles, 2);
+
+    dcm_filehandle_pool_destroy(pool);
+
+    // with no budget, idle filehandles are destroyed
+    pool = dcm_filehandle_pool_create(NULL, 1, 0);
+    ck_assert_ptr_nonnull(pool);
+    filehandle1 = dcm_filehandle_pool_acquire(NULL, pool, file_path);
+    ck_assert_ptr_nonnull(filehandle1);
+    dcm_filehandle_pool_release(pool, filehandle1);
+    dcm_filehandle_pool_get_stats(pool, &stats);
+    ck_assert_uint_eq(stats.evictions, 1);
+    ck_assert_uint_eq(stats.handles, 0);
+    ck_assert_uint_eq(stats.bytes, 0);
+    dcm_filehandle_pool_destroy(pool);
+
+    free(file_path);
+    free(sparse_path);
+}
+END_TEST
+
+
+#ifndef _WIN32
+/* Wait for prefetch to fill the cache to n frames.
+ */
+static uint32_t wait_for_frames(DcmFrameCache *cache, uint32_t n)
+{
+    DcmFrameCacheStats stats;
+
+    for (int i = 0; i < 1000; i++) {
+        dcm_frame_cache_get_stats(cache, &stats);
+        if (stats.frames >= n) {
+            break;
+        }
+        usleep(10000);
+    }
+
+    return stats.frames;
+}
+
+
+START_TEST(test_file_sm_image_prefetch)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    DcmFrameCache *cache = dcm_frame_cache_create(NULL, 100000);
+    ck_assert_ptr_nonnull(cache);
+    ck_assert_int_ne(dcm_filehandle_set_frame_cache(NULL, filehandle, cache),
+                     0);
+    ck_assert_int_ne(dcm_filehandle_set_prefetch(NULL, filehandle, 2), 0);
+
+    // no direction yet, so we get this tile plus the ring around the corner
+    dcm_frame_destroy(dcm_filehandle_read_frame_position(NULL,
+                                                         filehandle,
+                                                         0, 0));
+    ck_assert_uint_eq(wait_for_frames(cache, 4), 4);
+
+    // (1, 0) was prefetched, and moving right fetches two columns ahead
+    dcm_frame_destroy(dcm_filehandle_read_frame_position(NULL,
+                                                         filehandle,
+                                                         1, 0));
+    ck_assert_uint_eq(wait_for_frames(cache, 8), 8);
+
+    DcmFrameCacheStats stats;
+    dcm_frame_cache_get_stats(cache, &stats);
+    uint64_t hits = stats.hits;
+    const uint32_t ahead[][2] = {{2, 0}, {2, 1}, {3, 0}, {3, 1}};
+    for (int i = 0; i < 4; i++) {
+        dcm_frame_destroy(dcm_filehandle_read_frame(NULL,
+                                                    filehandle,
+                                                    1 +
+                                                    ahead[i][0] +
+                                                    ahead[i][1] * 5));
+    }
+    dcm_frame_cache_get_stats(cache, &stats);
+    ck_assert_uint_eq(stats.hits, hits + 4);
+
+    dcm_frame_cache_destroy(cache);
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_pool_prefetch)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    char *sparse_path = fixture_path("data/test_files/sm_image_sparse.dcm");
+
+    // only one idle file may stay open
+    DcmFilehandlePool *pool = dcm_filehandle_pool_create(NULL, 1, 1000000);
+    ck_assert_ptr_nonnull(pool);
+    DcmFrameCache *cache = dcm_frame_cache_create(NULL, 100000);
+    ck_assert_ptr_nonnull(cache);
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_pool_acquire(NULL, pool, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    ck_assert_int_ne(dcm_filehandle_set_frame_cache(NULL, filehandle, cache),
+                     0);
+    ck_assert_int_ne(dcm_filehandle_set_prefetch(NULL, filehandle, 2), 0);
+    dcm_filehandle_pool_release(pool, filehandle);
+
+    // opening a second file closes the first
+    DcmFilehandle *sparse =
+        dcm_filehandle_pool_acquire(NULL, pool, sparse_path);
+    ck_assert_ptr_nonnull(sparse);
+    dcm_filehandle_pool_release(pool, sparse);
+
+    DcmFilehandlePoolStats stats;
+    filehandle = dcm_filehandle_pool_acquire(NULL, pool, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    dcm_filehandle_pool_get_stats(pool, &stats);
+    ck_assert_uint_eq(stats.reopens, 1);
+
+    // prefetch came back with the reopen, so the neighbours still load
+    dcm_frame_destroy(dcm_filehandle_read_frame_position(NULL,
+                                                         filehandle,
+                                                         0, 0));
+    ck_assert_uint_eq(wait_for_frames(cache, 4), 4);
+    dcm_filehandle_pool_release(pool, filehandle);
+
+    dcm_filehandle_pool_destroy(pool);
+    dcm_frame_cache_destroy(cache);
+    free(file_path);
+    free(sparse_path);
+}
+END_TEST
+#endif
+
+
+START_TEST(test_file_sm_image_frame_into)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    DcmFrame *frame = dcm_filehandle_read_frame(NULL, filehandle, 7);
+    ck_assert_ptr_nonnull(frame);
+
+    // ask for the size first
+    DcmFrameInfo info;
+    ck_assert_int_ne(dcm_filehandle_read_frame_into(NULL,
+                                                    filehandle,
+                                                    7,
+                                                    NULL, 0,
+                                                    &info), 0);
+    ck_assert_uint_eq(info.number, 7);
+    ck_assert_uint_eq(info.length, dcm_frame_get_length(frame));
+    ck_assert_uint_eq(info.rows, dcm_frame_get_rows(frame));
+    ck_assert_uint_eq(info.columns, dcm_frame_get_columns(frame));
+    ck_assert_uint_eq(info.samples_per_pixel,
+                      dcm_frame_get_samples_per_pixel(frame));
+    ck_assert_str_eq(info.photometric_interpretation,
+                     dcm_frame_get_photometric_interpretation(frame));
+    ck_assert_str_eq(info.transfer_syntax_uid,
+                     dcm_frame_get_transfer_syntax_uid(frame));
+
+    // too small
+    char buffer[300];
+    DcmError *error = NULL;
+    ck_assert_int_eq(dcm_filehandle_read_frame_into(&error,
+                                                    filehandle,
+                                                    7,
+                                                    buffer, info.length - 1,
+                                                    &info), 0);
+    ck_assert_ptr_nonnull(error);
+    dcm_error_clear(&error);
+
+    ck_assert_uint_le(info.length, sizeof(buffer));
+    ck_assert_int_ne(dcm_filehandle_read_frame_into(NULL,
+                                                    filehandle,
+                                                    7,
+                                                    buffer, sizeof(buffer),
+                                                    &info), 0);
+    ck_assert_mem_eq(buffer, dcm_frame_get_value(frame), info.length);
+
+    dcm_frame_destroy(frame);
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_frames)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // out of order, and with a repeat
+    const uint32_t frame_numbers[] = {25, 1, 13, 1, 2};
+    const uint32_t n_frames = sizeof(frame_numbers) / sizeof(uint32_t);
+    DcmFrame *frames[sizeof(frame_numbers) / sizeof(uint32_t)];
+    ck_assert_int_ne(dcm_filehandle_read_frames(NULL,
+                                                filehandle,
+                                                frame_numbers,
+                                                n_frames,
+                                                frames), 0);
+
+    for (uint32_t i = 0; i < n_frames; i++) {
+        DcmFrame *frame = dcm_filehandle_read_frame(NULL,
+                                                    filehandle,
+                                                    frame_numbers[i]);
+        ck_assert_ptr_nonnull(frame);
+        ck_assert_ptr_nonnull(frames[i]);
+        ck_assert_uint_eq(dcm_frame_get_number(frames[i]), frame_numbers[i]);
+        ck_assert_uint_eq(dcm_frame_get_length(frames[i]),
+                          dcm_frame_get_length(frame));
+        ck_assert_mem_eq(dcm_frame_get_value(frames[i]),
+                         dcm_frame_get_value(frame),
+                         dcm_frame_get_length(frame));
+        dcm_frame_destroy(frame);
+        dcm_frame_destroy(frames[i]);
+    }
+
+    // a bad frame number fails the whole read
+    const uint32_t bad_numbers[] = {1, 26};
+    DcmError *error = NULL;
+    ck_assert_int_eq(dcm_filehandle_read_frames(&error,
+                                                filehandle,
+                                                bad_numbers,
+                                                2,
+                                                frames), 0);
+    ck_assert_ptr_nonnull(error);
+    ck_assert_ptr_null(frames[0]);
+    dcm_error_clear(&error);
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_native_frames_coalesced)
+{
+    int64_t length;
+    char *memory = create_native_rgb(1024, 1024, 3, &length);
+    struct CountingIO counting = { { NULL }, memory, length, 0, 0 };
+    DcmIO *io = dcm_io_create(NULL, &counting_methods, &counting);
+    ck_assert_ptr_nonnull(io);
+    DcmFilehandle *filehandle = dcm_filehandle_create(NULL, io);
+    ck_assert_ptr_nonnull(filehandle);
+    ck_assert_int_ne(dcm_filehandle_prepare_read_frame(NULL, filehandle), 0);
+
+    // the frames are larger than the coalesce distance, but they touch, so
+    // they are fetched with a single read
+    const uint32_t frame_numbers[] = {3, 1, 2};
+    DcmFrame *frames[3];
+    counting.n_seeks = 0;
+    ck_assert_int_ne(dcm_filehandle_read_frames(NULL,
+                                                filehandle,
+                                                frame_numbers,
+                                                3,
+                                                frames), 0);
+    ck_assert_int_eq(counting.n_seeks, 1);
+
+    for (uint32_t i = 0; i < 3; i++) {
+        ck_assert_ptr_nonnull(frames[i]);
+        ck_assert_uint_eq(dcm_frame_get_number(frames[i]), frame_numbers[i]);
+        ck_assert_uint_eq(dcm_frame_get_length(frames[i]), 1024 * 1024 * 3);
+        const char *value = dcm_frame_get_value(frames[i]);
+        ck_assert_uint_eq(value[0], frame_numbers[i]);
+        ck_assert_uint_eq(value[1024 * 1024 * 3 - 1], frame_numbers[i]);
+        dcm_frame_destroy(frames[i]);
+    }
+
+    // decoded reads fetch the same way
+    counting.n_seeks = 0;
+    ck_assert_int_ne(dcm_filehandle_read_frames_decoded(NULL,
+                                                        filehandle,
+                                                        frame_numbers,
+                                                        3,
+                                                        2,
+                                                        frames), 0);
+    ck_assert_int_eq(counting.n_seeks, 1);
+    for (uint32_t i = 0; i < 3; i++) {
+        ck_assert_ptr_nonnull(frames[i]);
+        ck_assert_uint_eq(dcm_frame_get_number(frames[i]), frame_numbers[i]);
+        dcm_frame_unref(frames[i]);
+    }
+
+    dcm_filehandle_destroy(filehandle);
+    free(memory);
+}
+END_TEST
+
+
+START_TEST(test_file_encapsulated_frames_coalesced)
+{
+    int64_t items;
+    int64_t length;
+    char *memory = create_encapsulated(3, &items, &length);
+    struct CountingIO counting = { { NULL }, memory, length, 0, 0 };
+    DcmIO *io = dcm_io_create(NULL, &counting_methods, &counting);
+    ck_assert_ptr_nonnull(io);
+    DcmFilehandle *filehandle = dcm_filehandle_create(NULL, io);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // a tight limit, which is plenty for the metadata and these frames
+    dcm_filehandle_set_memory_limit(filehandle, 64 * 1024);
+    ck_assert_int_ne(dcm_filehandle_prepare_read_frame(NULL, filehandle), 0);
+
+    const uint32_t frame_numbers[] = {3, 1, 2};
+    DcmFrame *frames[3];
+    ck_assert_int_ne(dcm_filehandle_read_frames(NULL,
+                                                filehandle,
+                                                frame_numbers,
+                                                3,
+                                                frames), 0);
+    for (uint32_t i = 0; i < 3; i++) {
+        ck_assert_ptr_nonnull(frames[i]);
+        ck_assert_uint_eq(dcm_frame_get_length(frames[i]), 8);
+        const char *value = dcm_frame_get_value(frames[i]);
+        ck_assert_uint_eq(value[0], frame_numbers[i]);
+        ck_assert_uint_eq(value[7], frame_numbers[i]);
+        dcm_frame_destroy(frames[i]);
+    }
+
+    // a huge item length is caught before we allocate for it ... frame 2
+    // must end where frame 3 starts
+    uint32_t *item_length = (uint32_t *) (memory + items + 16 + 4);
+    *item_length = 0xfffffff0;
+    DcmError *error = NULL;
+    ck_assert_int_eq(dcm_filehandle_read_frames(&error,
+                                                filehandle,
+                                                frame_numbers + 1,
+                                                2,
+                                                frames), 0);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_PARSE);
+    dcm_error_clear(&error);
+    *item_length = 8;
+
+    // nothing follows frame 3, so only the memory limit bounds it
+    item_length = (uint32_t *) (memory + items + 32 + 4);
+    *item_length = 0xfffffff0;
+    ck_assert_int_eq(dcm_filehandle_read_frames(&error,
+                                                filehandle,
+                                                frame_numbers,
+                                                2,
+                                                frames), 0);
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_MEMORY_LIMIT);
+    dcm_error_clear(&error);
+
+    dcm_filehandle_destroy(filehandle);
+    free(memory);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_region)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // a 23 x 12 RGB region which overlaps nine 10 x 10 tiles
+    const uint32_t left = 5;
+    const uint32_t top = 7;
+    const uint32_t width = 23;
+    const uint32_t height = 12;
+    const uint32_t stride = 100;
+    char *buffer = malloc(stride * height);
+    ck_assert_int_ne(dcm_filehandle_read_region(NULL,
+                                                filehandle,
+                                                left, top,
+                                                width, height,
+                                                0, 0,
+                                                buffer, stride,
+                                                0), 0);
+
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t image_x = left + x;
+            uint32_t image_y = top + y;
+            DcmFrame *frame =
+                dcm_filehandle_read_frame_position(NULL,
+                                                   filehandle,
+                                                   image_x / 10,
+                                                   image_y / 10);
+            ck_assert_ptr_nonnull(frame);
+            const char *value = dcm_frame_get_value(frame);
+            const char *pixel = value + 3 * (image_x % 10 + 10 * (image_y % 10));
+            ck_assert_mem_eq(buffer + y * stride + x * 3, pixel, 3);
+            dcm_frame_destroy(frame);
+        }
+    }
+
+    free(buffer);
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_sparse_region)
+{
+    char *file_path = fixture_path("data/test_files/sm_image_sparse.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // 4 x 4 tiles, with the tile at (1, 1) missing, and every pixel in each
+    // frame set to the frame number
+    char buffer[8 * 6];
+    ck_assert_int_ne(dcm_filehandle_read_region(NULL,
+                                                filehandle,
+                                                2, 2, 8, 6,
+                                                0, 0,
+                                                buffer, 8,
+                                                0xff), 0);
+
+    const char expected[6][8] = {
+        {16, 16, 17, 17, 17, 17, 18, 18},
+        {16, 16, 17, 17, 17, 17, 18, 18},
+        {19, 19, -1, -1, -1, -1, 20, 20},
+        {19, 19, -1, -1, -1, -1, 20, 20},
+        {19, 19, -1, -1, -1, -1, 20, 20},
+        {19, 19, -1, -1, -1, -1, 20, 20},
+    };
+    ck_assert_mem_eq(buffer, expected, sizeof(buffer));
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_read_metadata)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+
+    // Image Type
+    DcmElement *element = dcm_dataset_get(NULL, metadata, 0x00080008);
+    ck_assert_ptr_nonnull(element);
+    ck_assert_uint_eq(dcm_element_get_vm(element), 4);
+    const char *value;
+    ck_assert_int_ne(dcm_element_get_value_string(NULL, element, 2, &value),
+                     0);
+    ck_assert_str_eq(value, "VOLUME");
+
+    // Dimension Index Sequence
+    element = dcm_dataset_get(NULL, metadata, 0x00209222);
+    ck_assert_ptr_nonnull(element);
+    DcmSequence *sequence;
+    ck_assert_int_ne(dcm_element_get_value_sequence(NULL, element, &sequence),
+                     0);
+    ck_assert_uint_eq(dcm_sequence_count(sequence), 2);
+
+    // the parsed tree outlives the filehandle
+    dcm_filehandle_destroy(filehandle);
+
+    DcmDataSet *item = dcm_sequence_get(NULL, sequence, 1);
+    ck_assert_ptr_nonnull(item);
+
+    // Dimension Description Label
+    element = dcm_dataset_get(NULL, item, 0x00209421);
+    ck_assert_ptr_nonnull(element);
+    ck_assert_int_ne(dcm_element_get_value_string(NULL, element, 0, &value),
+                     0);
+    ck_assert_str_eq(value, "Column tile index");
+
+    DcmElement *clone = dcm_element_clone(NULL, element);
+    dcm_dataset_destroy(metadata);
+    ck_assert_ptr_nonnull(clone);
+    ck_assert_int_ne(dcm_element_get_value_string(NULL, clone, 0, &value),
+                     0);
+    ck_assert_str_eq(value, "Column tile index");
+    dcm_element_destroy(clone);
+}
+END_TEST
+
+
+static void check_same_dataset(const DcmDataSet *a, const DcmDataSet *b)
+{
+    uint32_t n_tags = dcm_dataset_count(a);
+    ck_assert_uint_eq(dcm_dataset_count(b), n_tags);
+
+    uint32_t *tags = malloc(n_tags * sizeof(uint32_t));
+    dcm_dataset_copy_tags(a, tags, n_tags);
+
+    for (uint32_t i = 0; i < n_tags; i++) {
+        DcmElement *element_a = dcm_dataset_get(NULL, a, tags[i]);
+        DcmElement *element_b = dcm_dataset_get(NULL, b, tags[i]);
+        ck_assert_ptr_nonnull(element_a);
+        ck_assert_ptr_nonnull(element_b);
+
+        DcmVR vr = dcm_element_get_vr(element_a);
+        ck_assert_int_eq(dcm_element_get_vr(element_b), vr);
+
+        if (dcm_dict_vr_class(vr) == DCM_VR_CLASS_SEQUENCE) {
+            DcmSequence *seq_a;
+            DcmSequence *seq_b;
+            ck_assert_int_ne(dcm_element_get_value_sequence(NULL,
+                                                            element_a,
+                                                            &seq_a), 0);
+            ck_assert_int_ne(dcm_element_get_value_sequence(NULL,
+                                                            element_b,
+                                                            &seq_b), 0);
+            uint32_t n_items = dcm_sequence_count(seq_a);
+            ck_assert_uint_eq(dcm_sequence_count(seq_b), n_items);
+
+            for (uint32_t j = 0; j < n_items; j++) {
+                check_same_dataset(dcm_sequence_get(NULL, seq_a, j),
+                                   dcm_sequence_get(NULL, seq_b, j));
+            }
+        } else {
+            char *value_a = dcm_element_value_to_string(element_a);
+            char *value_b = dcm_element_value_to_string(element_b);
+            ck_assert_str_eq(value_a, value_b);
+            free(value_a);
+            free(value_b);
+        }
+    }
+
+    free(tags);
+}
+
+
+START_TEST(test_file_sm_image_lazy_sequences)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    filehandle = dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    dcm_filehandle_set_lazy_sequences(filehandle, true);
+    DcmDataSet *lazy_metadata = dcm_filehandle_read_metadata(NULL,
+                                                             filehandle,
+                                                             NULL);
+    ck_assert_ptr_nonnull(lazy_metadata);
+
+    // items are parsed from a copy, so they outlive the filehandle
+    dcm_filehandle_destroy(filehandle);
+
+    // Dimension Index Sequence, item 1 first
+    DcmElement *element = dcm_dataset_get(NULL, lazy_metadata, 0x00209222);
+    ck_assert_ptr_nonnull(element);
+    DcmSequence *sequence;
+    ck_assert_int_ne(dcm_element_get_value_sequence(NULL, element, &sequence),
+                     0);
+    ck_assert_uint_eq(dcm_sequence_count(sequence), 2);
+    DcmDataSet *item = dcm_sequence_get(NULL, sequence, 1);
+    ck_assert_ptr_nonnull(item);
+    ck_assert_ptr_eq(dcm_sequence_get(NULL, sequence, 1), item);
+
+    // Dimension Description Label
+    element = dcm_dataset_get(NULL, item, 0x00209421);
+    ck_assert_ptr_nonnull(element);
+    const char *value;
+    ck_assert_int_ne(dcm_element_get_value_string(NULL, element, 0, &value),
+                     0);
+    ck_assert_str_eq(value, "Column tile index");
+
+    // and the whole tree matches an eager parse
+    check_same_dataset(metadata, lazy_metadata);
+
+    dcm_dataset_destroy(lazy_metadata);
+    dcm_dataset_destroy(metadata);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_lazy_sequences_long_vr)
+{
+    int64_t length;
+    char *memory = load_file_to_memory("data/test_files/sm_image_sparse.dcm",
+                                       &length);
+    ck_assert_ptr_nonnull(memory);
+
+    // append to the first undefined length Optical Path Sequence item
+    memory = insert_bytes(memory,
+                          &length,
+                          550,
+                          long_vr_elements,
+                          sizeof(long_vr_elements));
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    filehandle = dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+    dcm_filehandle_set_lazy_sequences(filehandle, true);
+    DcmDataSet *lazy_metadata = dcm_filehandle_read_metadata(NULL,
+                                                             filehandle,
+                                                             NULL);
+    ck_assert_ptr_nonnull(lazy_metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    // Optical Path Sequence
+    DcmElement *element = dcm_dataset_get(NULL, lazy_metadata, 0x00480105);
+    ck_assert_ptr_nonnull(element);
+    DcmSequence *sequence;
+    ck_assert_int_ne(dcm_element_get_value_sequence(NULL, element, &sequence),
+                     0);
+    ck_assert_uint_eq(dcm_sequence_count(sequence), 2);
+    DcmDataSet *item = dcm_sequence_get(NULL, sequence, 0);
+    ck_assert_ptr_nonnull(item);
+
+    // Selector SV Value
+    element = dcm_dataset_get(NULL, item, 0x00720082);
+    ck_assert_ptr_nonnull(element);
+    int64_t value;
+    ck_assert_int_ne(dcm_element_get_value_integer(NULL, element, 0, &value),
+                     0);
+    ck_assert_int_eq(value, -2);
+
+    check_same_dataset(metadata, lazy_metadata);
+
+    dcm_dataset_destroy(lazy_metadata);
+    dcm_dataset_destroy(metadata);
+    free(memory);
+}
+END_TEST
+
+
+static void release_memory(void *client)
+{
+    char **memory = (char **) client;
+
+    free(*memory);
+    *memory = NULL;
+}
+
+
+static const char *get_icc_profile(DcmDataSet *metadata)
+{
+    DcmElement *element = dcm_dataset_get(NULL, metadata, 0x00480105);
+    ck_assert_ptr_nonnull(element);
+    DcmSequence *sequence;
+    ck_assert_int_ne(dcm_element_get_value_sequence(NULL, element, &sequence),
+                     0);
+    DcmDataSet *item = dcm_sequence_get(NULL, sequence, 0);
+    ck_assert_ptr_nonnull(item);
+    element = dcm_dataset_get(NULL, item, 0x00282000);
+    ck_assert_ptr_nonnull(element);
+    const void *value;
+    ck_assert_int_ne(dcm_element_get_value_binary(NULL, element, &value), 0);
+
+    return value;
+}
+
+
+START_TEST(test_file_sm_image_borrowed_values)
+{
+    int64_t length;
+    char *memory = load_file_to_memory("data/test_files/sm_image.dcm",
+                                       &length);
+    ck_assert_ptr_nonnull(memory);
+    char *copy = malloc(length);
+    memcpy(copy, memory, length);
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_memory(NULL, copy, length);
+    ck_assert_ptr_nonnull(filehandle);
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    DcmIO *io = dcm_io_create_from_memory_external(NULL,
+                                                   memory,
+                                                   length,
+                                                   release_memory,
+                                                   &memory);
+    ck_assert_ptr_nonnull(io);
+    filehandle = dcm_filehandle_create(NULL, io);
+    ck_assert_ptr_nonnull(filehandle);
+    DcmDataSet *borrowed_metadata = dcm_filehandle_read_metadata(NULL,
+                                                                 filehandle,
+                                                                 NULL);
+    ck_assert_ptr_nonnull(borrowed_metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    // the ICC profile points into the file, which is kept alive by the
+    // metadata
+    ck_assert_ptr_nonnull(memory);
+    const char *icc_profile = get_icc_profile(borrowed_metadata);
+    ck_assert(icc_profile >= memory && icc_profile < memory + length);
+    check_same_dataset(metadata, borrowed_metadata);
+
+    dcm_dataset_destroy(borrowed_metadata);
+    ck_assert_ptr_null(memory);
+
+    dcm_dataset_destroy(metadata);
+    free(copy);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_snapshot)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    char *snapshot;
+    uint64_t length;
+    ck_assert_int_ne(dcm_dataset_serialize(NULL,
+                                           metadata,
+                                           &snapshot,
+                                           &length), 0);
+
+    DcmDataSet *loaded = dcm_dataset_deserialize(NULL, snapshot, length);
+    ck_assert_ptr_nonnull(loaded);
+    ck_assert_int_ne(dcm_dataset_is_locked(loaded), 0);
+    check_same_dataset(metadata, loaded);
+    ck_assert_mem_eq(get_icc_profile(metadata), get_icc_profile(loaded), 3144);
+
+    // a snapshot of the loaded data set is the same
+    char *snapshot2;
+    uint64_t length2;
+    ck_assert_int_ne(dcm_dataset_serialize(NULL,
+                                           loaded,
+                                           &snapshot2,
+                                           &length2), 0);
+    ck_assert_uint_eq(length2, length);
+    ck_assert_mem_eq(snapshot2, snapshot, length);
+    dcm_free(snapshot2);
+    dcm_dataset_destroy(loaded);
+
+    // external snapshots are used in place
+    DcmDataSet *borrowed = dcm_dataset_deserialize_external(NULL,
+                                                            snapshot,
+                                                            length,
+                                                            release_memory,
+                                                            &snapshot);
+    ck_assert_ptr_nonnull(borrowed);
+    check_same_dataset(metadata, borrowed);
+    const char *icc_profile = get_icc_profile(borrowed);
+    ck_assert(icc_profile >= snapshot && icc_profile < snapshot + length);
+    dcm_dataset_destroy(borrowed);
+    ck_assert_ptr_null(snapshot);
+
+    // damaged snapshots are rejected
+    ck_assert_int_ne(dcm_dataset_serialize(NULL,
+                                           metadata,
+                                           &snapshot,
+                                           &length), 0);
+    DcmError *error = NULL;
+    ck_assert_ptr_null(dcm_dataset_deserialize(&error, snapshot, length - 8));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_PARSE);
+    dcm_error_clear(&error);
+
+    // an item used twice ... the header is 40 bytes, data sets are 8 bytes
+    // and elements are 24 bytes
+    uint32_t counts[2];
+    memcpy(counts, snapshot + 16, sizeof(counts));
+    uint32_t *items = (uint32_t *) (snapshot + 40 +
+                                    counts[0] * 8 + counts[1] * 24);
+    uint32_t item = items[1];
+    items[1] = items[0];
+    ck_assert_ptr_null(dcm_dataset_deserialize(&error, snapshot, length));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_PARSE);
+    dcm_error_clear(&error);
+    items[1] = item;
+
+    snapshot[0] = 'X';
+    ck_assert_ptr_null(dcm_dataset_deserialize(&error, snapshot, length));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_PARSE);
+    dcm_error_clear(&error);
+    dcm_free(snapshot);
+
+    dcm_dataset_destroy(metadata);
+}
+END_TEST
+
+
+START_TEST(test_snapshot_odd_binary)
+{
+    // an odd-length value, padded to even in the element length
+    static const char bytes[] = { 1, 2, 3 };
+    DcmElement *element = dcm_element_create(NULL, 0x00282000, DCM_VR_OB);
+    ck_assert_ptr_nonnull(element);
+    ck_assert_int_ne(dcm_element_set_value_binary(NULL,
+                                                  element,
+                                                  (void *) bytes,
+                                                  3,
+                                                  false), 0);
+    ck_assert_uint_eq(dcm_element_get_length(element), 4);
+
+    // clones copy just the value
+    DcmElement *clone = dcm_element_clone(NULL, element);
+    ck_assert_ptr_nonnull(clone);
+    const void *value;
+    ck_assert_int_ne(dcm_element_get_value_binary(NULL, clone, &value), 0);
+    ck_assert_mem_eq(value, bytes, 3);
+    dcm_element_destroy(clone);
+
+    DcmDataSet *dataset = dcm_dataset_create(NULL);
+    ck_assert_ptr_nonnull(dataset);
+    ck_assert_int_ne(dcm_dataset_insert(NULL, dataset, element), 0);
+    dcm_dataset_lock(dataset);
+
+    char *snapshot;
+    uint64_t length;
+    ck_assert_int_ne(dcm_dataset_serialize(NULL,
+                                           dataset,
+                                           &snapshot,
+                                           &length), 0);
+    DcmDataSet *loaded = dcm_dataset_deserialize(NULL, snapshot, length);
+    ck_assert_ptr_nonnull(loaded);
+
+    element = dcm_dataset_get(NULL, loaded, 0x00282000);
+    ck_assert_ptr_nonnull(element);
+    ck_assert_uint_eq(dcm_element_get_length(element), 4);
+    ck_assert_int_ne(dcm_element_get_value_binary(NULL, element, &value), 0);
+    ck_assert_mem_eq(value, bytes, 3);
+
+    dcm_dataset_destroy(loaded);
+    dcm_free(snapshot);
+    dcm_dataset_destroy(dataset);
+}
+END_TEST
+
+
+static void check_memory_usage_total(const DcmMemoryUsage *usage)
+{
+    ck_assert_uint_eq(usage->total,
+                      usage->elements +
+                      usage->values +
+                      usage->hash +
+                      usage->sequences +
+                      usage->offset_table +
+                      usage->frame_index +
+                      usage->unused);
+}
+
+
+START_TEST(test_file_sm_image_memory_usage)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    dcm_filehandle_set_intern_strings(filehandle, true);
+
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+    DcmMemoryUsage usage;
+    dcm_dataset_get_memory_usage(metadata, &usage);
+    ck_assert_uint_gt(usage.elements, 0);
+    ck_assert_uint_gt(usage.values, 0);
+    ck_assert_uint_gt(usage.hash, 0);
+    ck_assert_uint_gt(usage.sequences, 0);
+    ck_assert_uint_eq(usage.offset_table, 0);
+    check_memory_usage_total(&usage);
+    uint64_t metadata_total = usage.total;
+    dcm_dataset_destroy(metadata);
+
+    // the filehandle only counts what it keeps
+    ck_assert_int_ne(dcm_filehandle_prepare_read_frame(NULL, filehandle), 0);
+    dcm_filehandle_get_memory_usage(filehandle, &usage);
+    ck_assert_uint_gt(usage.elements, 0);
+    ck_assert_uint_gt(usage.offset_table, 0);
+    check_memory_usage_total(&usage);
+    dcm_filehandle_destroy(filehandle);
+
+    // and data sets we build count what they own
+    DcmDataSet *dataset = dcm_dataset_create(NULL);
+    DcmElement *element = dcm_element_create(NULL, 0x00100010, DCM_VR_PN);
+    (void) dcm_element_set_value_string(NULL, element, "Doe^John", false);
+    (void) dcm_dataset_insert(NULL, dataset, element);
+    dcm_dataset_get_memory_usage(dataset, &usage);
+    ck_assert_uint_gt(usage.elements, 0);
+    ck_assert_uint_eq(usage.values, strlen("Doe^John") + 1);
+    ck_assert_uint_eq(usage.total, usage.elements + usage.values);
+    dcm_dataset_destroy(dataset);
+
+    // multiple values count the array of pointers once, whether we steal
+    // the caller's array or pack a copy
+    for (int steal = 0; steal < 2; steal++) {
+        char **values = malloc(2 * sizeof(char *));
+        values[0] = my_strdup("ORIGINAL");
+        values[1] = my_strdup("PRIMARY");
+        dataset = dcm_dataset_create(NULL);
+        element = dcm_element_create(NULL, 0x00080008, DCM_VR_CS);
+        ck_assert_int_ne(dcm_element_set_value_string_multi(NULL,
+                                                            element,
+                                                            values,
+                                                            2,
+                                                            steal), 0);
+        (void) dcm_dataset_insert(NULL, dataset, element);
+        dcm_dataset_get_memory_usage(dataset, &usage);
+        ck_assert_uint_eq(usage.values,
+                          2 * sizeof(char *) +
+                          strlen("ORIGINAL") + 1 +
+                          strlen("PRIMARY") + 1);
+        dcm_dataset_destroy(dataset);
+        if (!steal) {
+            free(values[0]);
+            free(values[1]);
+            free(values);
+        }
+    }
+
+    // a read which needs more than the limit fails cleanly
+    DcmError *error = NULL;
+    filehandle = dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    dcm_filehandle_set_intern_strings(filehandle, true);
+    dcm_filehandle_set_memory_limit(filehandle, metadata_total / 2);
+    ck_assert_ptr_null(dcm_filehandle_read_metadata(&error,
+                                                    filehandle,
+                                                    NULL));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_MEMORY_LIMIT);
+    dcm_error_clear(&error);
+
+    dcm_filehandle_set_memory_limit(filehandle, 0);
+    metadata = dcm_filehandle_read_metadata(NULL, filehandle, NULL);
+    ck_assert_ptr_nonnull(metadata);
+    dcm_dataset_destroy(metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    free(file_path);
+}
+END_TEST
+
+static bool collect_integers(const DcmElement *element, void *client)
+{
+    int64_t *values = (int64_t *) client;
+    int64_t value;
+
+    ck_assert_int_ne(dcm_element_get_value_integer(NULL, element, 0, &value),
+                     0);
+    values[0] += 1;
+    values[values[0]] = value;
+
+    // stop after four values
+    return values[0] < 4;
+}
+
+
+static bool count_matches(const DcmElement *element, void *client)
+{
+    int *n_matches = (int *) client;
+
+    ck_assert_uint_eq(dcm_element_get_tag(element), 0x0048021e);
+    *n_matches += 1;
+
+    return true;
+}
+
+
+START_TEST(test_file_sm_image_query)
+{
+    char *file_path = fixture_path("data/test_files/sm_image_sparse.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    DcmQuery *query = dcm_query_create(NULL,
+        "SharedFunctionalGroupsSequence[0]."
+        "PixelMeasuresSequence[0].PixelSpacing");
+    ck_assert_ptr_nonnull(query);
+    const DcmElement *element = dcm_query_get(NULL, query, metadata);
+    ck_assert_ptr_nonnull(element);
+    ck_assert_uint_eq(dcm_element_get_tag(element), 0x00280030);
+    dcm_query_destroy(query);
+
+    // fan out across the per-frame items, stopping early
+    query = dcm_query_create(NULL,
+        "PerFrameFunctionalGroupsSequence[*]."
+        "PlanePositionSlideSequence[0].ColumnPositionInTotalImagePixelMatrix");
+    ck_assert_ptr_nonnull(query);
+    int64_t values[5] = { 0 };
+    ck_assert_int_ne(dcm_query_foreach(NULL,
+                                       query,
+                                       metadata,
+                                       collect_integers,
+                                       values), 0);
+    ck_assert_int_eq(values[0], 4);
+    ck_assert_int_eq(values[1], 1);
+    ck_assert_int_eq(values[2], 5);
+    ck_assert_int_eq(values[3], 9);
+    dcm_query_destroy(query);
+
+    // tags and wildcards
+    query = dcm_query_create(NULL,
+        "(5200,9230)[*].*[*].0048021e");
+    ck_assert_ptr_nonnull(query);
+    int n_matches = 0;
+    ck_assert_int_ne(dcm_query_foreach(NULL,
+                                       query,
+                                       metadata,
+                                       count_matches,
+                                       &n_matches), 0);
+    ck_assert_int_eq(n_matches, 20);
+    dcm_query_destroy(query);
+
+    // no match
+    DcmError *error = NULL;
+    query = dcm_query_create(NULL,
+        "PerFrameFunctionalGroupsSequence[100]."
+        "PlanePositionSlideSequence[0].ColumnPositionInTotalImagePixelMatrix");
+    ck_assert_ptr_nonnull(query);
+    ck_assert_ptr_null(dcm_query_get(&error, query, metadata));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+    dcm_query_destroy(query);
+
+    // bad paths
+    ck_assert_ptr_null(dcm_query_create(NULL, ""));
+    ck_assert_ptr_null(dcm_query_create(NULL, "NoSuchKeyword"));
+    ck_assert_ptr_null(dcm_query_create(NULL, "PixelSpacing[0]"));
+    ck_assert_ptr_null(dcm_query_create(NULL,
+        "SharedFunctionalGroupsSequence.PixelSpacing"));
+    ck_assert_ptr_null(dcm_query_create(NULL,
+        "SharedFunctionalGroupsSequence[x].PixelSpacing"));
+
+    dcm_dataset_destroy(metadata);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_intern_strings)
+{
+    char *file_path = fixture_path("data/test_files/sm_image.dcm");
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    DcmDataSet *metadata = dcm_filehandle_read_metadata(NULL,
+                                                        filehandle,
+                                                        NULL);
+    ck_assert_ptr_nonnull(metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    filehandle = dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+    dcm_filehandle_set_intern_strings(filehandle, true);
+    DcmDataSet *interned_metadata = dcm_filehandle_read_metadata(NULL,
+                                                                 filehandle,
+                                                                 NULL);
+    ck_assert_ptr_nonnull(interned_metadata);
+    dcm_filehandle_destroy(filehandle);
+
+    check_same_dataset(metadata, interned_metadata);
+
+    // both items of Dimension Index Sequence share a
+    // Dimension Organization UID
+    DcmElement *element = dcm_dataset_get(NULL,
+                                          interned_metadata,
+                                          0x00209222);
+    ck_assert_ptr_nonnull(element);
+    DcmSequence *sequence;
+    ck_assert_int_ne(dcm_element_get_value_sequence(NULL, element, &sequence),
+                     0);
+    const char *values[2];
+    for (uint32_t i = 0; i < 2; i++) {
+        DcmDataSet *item = dcm_sequence_get(NULL, sequence, i);
+        ck_assert_ptr_nonnull(item);
+        element = dcm_dataset_get(NULL, item, 0x00209164);
+        ck_assert_ptr_nonnull(element);
+        ck_assert_int_ne(dcm_element_get_value_string(NULL,
+                                                      element,
+                                                      0,
+                                                      &values[i]), 0);
+    }
+    ck_assert_str_eq(values[0], values[1]);
+    ck_assert_ptr_eq(values[0], values[1]);
+
+    dcm_dataset_destroy(interned_metadata);
+    dcm_dataset_destroy(metadata);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_deflated)
+{
+    char *file_path = fixture_path("data/test_files/sm_image_deflated.dcm");
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_file(NULL, file_path);
+    free(file_path);
+    ck_assert_ptr_nonnull(filehandle);
+
+#ifdef HAVE_ZLIB
+    const DcmDataSet *metadata =
+        dcm_filehandle_get_metadata_subset(NULL, filehandle);
+    ck_assert_ptr_nonnull(metadata);
+    DcmElement *element = dcm_dataset_get(NULL, metadata, 0x00280010);
+    int64_t rows;
+    ck_assert_int_ne(dcm_element_get_value_integer(NULL, element, 0, &rows),
+                     0);
+    ck_assert_int_eq(rows, 32);
+
+    // out of order, so we must seek back in the inflated stream
+    const uint32_t frame_numbers[] = {8, 1, 5, 5, 2};
+    for (size_t i = 0; i < sizeof(frame_numbers) / sizeof(uint32_t); i++) {
+        uint32_t number = frame_numbers[i];
+        DcmFrame *frame = dcm_filehandle_read_frame(NULL, filehandle, number);
+        ck_assert_ptr_nonnull(frame);
+        ck_assert_uint_eq(dcm_frame_get_length(frame), 32 * 32);
+
+        // pixel j of frame n is (n - 1) * 7 + j
+        const uint8_t *value = (const uint8_t *) dcm_frame_get_value(frame);
+        ck_assert_uint_eq(value[0], ((number - 1) * 7) & 0xff);
+        ck_assert_uint_eq(value[1000], ((number - 1) * 7 + 1000) & 0xff);
+        dcm_frame_destroy(frame);
+    }
+#else
+    // the filehandle is still usable after the failure, so every call
+    // fails the same way
+    DcmError *error = NULL;
+    for (int i = 0; i < 2; i++) {
+        ck_assert_ptr_null(dcm_filehandle_get_file_meta(&error, filehandle));
+        ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+        dcm_error_clear(&error);
+    }
+    ck_assert_ptr_null(dcm_filehandle_read_metadata(&error, filehandle, NULL));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+    ck_assert_ptr_null(dcm_filehandle_read_frame(&error, filehandle, 1));
+    ck_assert_int_eq(dcm_error_get_code(error), DCM_ERROR_CODE_INVALID);
+    dcm_error_clear(&error);
+#endif
+
+    dcm_filehandle_destroy(filehandle);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_deflated_damaged)
+{
+    int64_t length;
+    char *memory = load_file_to_memory("data/test_files/sm_image_deflated.dcm",
+                                       &length);
+    ck_assert_ptr_nonnull(memory);
+
+    // the deflate stream starts after the file meta group, and a block
+    // with type 3 is invalid
+    uint32_t group_length;
+    memcpy(&group_length, memory + 140, 4);
+    memset(memory + 144 + group_length, 0xff, length - 144 - group_length);
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+
+    // every call fails cleanly, not just the first
+    DcmError *error = NULL;
+    for (int i = 0; i < 2; i++) {
+        ck_assert_ptr_null(dcm_filehandle_get_metadata_subset(&error,
+                                                              filehandle));
+        ck_assert_ptr_nonnull(error);
+        dcm_error_clear(&error);
+        ck_assert_ptr_null(dcm_filehandle_read_frame(&error, filehandle, 1));
+        ck_assert_ptr_nonnull(error);
+        dcm_error_clear(&error);
+    }
+
+    dcm_filehandle_destroy(filehandle);
+    free(memory);
+}
+END_TEST
+
+
+START_TEST(test_file_sm_image_file_meta_memory)
+{
+    DcmElement *element;
+    const char *value;
+
+    int64_t length;
+    char *memory = load_file_to_memory("data/test_files/sm_image.dcm", &length);
+    ck_assert_ptr_nonnull(memory);
+
+    DcmFilehandle *filehandle =
+        dcm_filehandle_create_from_memory(NULL, memory, length);
+    ck_assert_ptr_nonnull(filehandle);
+
+    const DcmDataSet *meta = dcm_filehandle_get_file_meta(NULL, filehandle);
+
+    // Transfer Syntax UID
+    element = dcm_dataset_get(NULL, meta, 0x00020010);
+    (void) dcm_element_get_value_string(NULL, element, 0, &value);
+    ck_assert_str_eq(value, "1.2.840.10008.1.2.1");
+
+    // Media Storage SOP Class UID
+    element = dcm_dataset_get(NULL, meta, 0x00020002);
+    (void) dcm_element_get_value_string(NULL, element, 0, &value);
+    ck_assert_str_eq(value, "1.2.840.10008.5.1.4.1.1.77.1.6");
+
+    dcm_dataset_print(meta, 0);
+
+    dcm_filehandle_destroy(filehandle);
+    free(memory);
+}
+END_TEST
+
+
+static Suite *create_main_suite(void)
+{
+    Suite *suite = suite_create("main");
+
+    TCase *error_case = tcase_create("error");
+    tcase_add_test(error_case, test_error);
+    suite_add_tcase(suite, error_case);
+
+    TCase *log_case = tcase_create("log");
+    tcase_add_test(log_case, test_log_level);
+    suite_add_tcase(suite, log_case);
+
+    TCase *dict_case = tcase_create("dict");
+    tcase_add_test(dict_case, test_tag_validity_checks);
+    tcase_add_test(dict_case, test_vr_validity_checks);
+    tcase_add_test(dict_case, test_dict_tag_lookups);
+    tcase_add_test(dict_case, test_dict_vr_lookups);
+    suite_add_tcase(suite, dict_case);
+
+    return suite;
+}
+
+
+static Suite *create_data_suite(void)
+{
+    Suite *suite = suite_create("data");
 
     TCase *element_case = tcase_create("element");
     tcase_add_test(element_case, test_element_AE);
@@ -813,12 +3325,22 @@ static Suite *create_data_suite(void)
 
     TCase *dataset_case = tcase_create("dataset");
     tcase_add_test(dataset_case, test_dataset);
+    tcase_add_test(dataset_case, test_dataset_clone_shared);
+    tcase_add_test(dataset_case, test_dataset_order);
+    tcase_add_test(dataset_case, test_dataset_get_many);
     suite_add_tcase(suite, dataset_case);
 
     TCase *sequence_case = tcase_create("sequence");
     tcase_add_test(sequence_case, test_sequence);
     suite_add_tcase(suite, sequence_case);
 
+    TCase *frame_case = tcase_create("frame");
+    tcase_add_test(frame_case, test_frame_external);
+    tcase_add_test(frame_case, test_frame_decode_rle);
+    tcase_add_test(frame_case, test_frame_decode_codec);
+    tcase_add_test(frame_case, test_frame_convert);
+    suite_add_tcase(suite, frame_case);
+
     return suite;
 }
 
@@ -833,10 +3355,39 @@ static Suite *create_file_suite(void)
 
     TCase *metadata_case = tcase_create("metadata");
     tcase_add_test(metadata_case, test_file_sm_image_metadata);
+    tcase_add_test(metadata_case, test_file_sm_image_read_metadata);
+    tcase_add_test(metadata_case, test_file_sm_image_lazy_sequences);
+    tcase_add_test(metadata_case, test_file_sm_image_lazy_sequences_long_vr);
+    tcase_add_test(metadata_case, test_file_sm_image_intern_strings);
+    tcase_add_test(metadata_case, test_file_sm_image_borrowed_values);
+    tcase_add_test(metadata_case, test_file_sm_image_snapshot);
+    tcase_add_test(metadata_case, test_snapshot_odd_binary);
+    tcase_add_test(metadata_case, test_file_sm_image_query);
+    tcase_add_test(metadata_case, test_file_sm_image_memory_usage);
+    tcase_add_test(metadata_case, test_file_sm_image_deflated);
+    tcase_add_test(metadata_case, test_file_sm_image_deflated_damaged);
     suite_add_tcase(suite, metadata_case);
 
     TCase *frame_case = tcase_create("frame");
     tcase_add_test(frame_case, test_file_sm_image_frame);
+    tcase_add_test(frame_case, test_file_sm_image_sparse_frame_position);
+    tcase_add_test(frame_case, test_file_sm_image_sparse_frame_position_ex);
+    tcase_add_test(frame_case, test_file_sm_image_sparse_long_vr);
+    tcase_add_test(frame_case, test_file_sm_image_planes_frame_position);
+    tcase_add_test(frame_case, test_file_sm_image_read_frames_decoded);
+#ifndef _WIN32
+    tcase_add_test(frame_case, test_file_sm_image_threaded_read);
+    tcase_add_test(frame_case, test_file_sm_image_prefetch);
+    tcase_add_test(frame_case, test_file_sm_image_pool_prefetch);
+#endif
+    tcase_add_test(frame_case, test_file_sm_image_frame_into);
+    tcase_add_test(frame_case, test_file_sm_image_frame_cache);
+    tcase_add_test(frame_case, test_file_sm_image_pool);
+    tcase_add_test(frame_case, test_file_sm_image_frames);
+    tcase_add_test(frame_case, test_file_native_frames_coalesced);
+    tcase_add_test(frame_case, test_file_encapsulated_frames_coalesced);
+    tcase_add_test(frame_case, test_file_sm_image_region);
+    tcase_add_test(frame_case, test_file_sm_image_sparse_region);
     suite_add_tcase(suite, frame_case);
 
     TCase *memory_case = tcase_create("memory");